@@ -0,0 +1,14 @@
+#define APISUPPORT_NONPOSIX_IO_URING 1
+#ifdef apisupport_dummy
+export CFLAGS_NONPOSIX_IO_URING="-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_DEFAULT_SOURCE"
+#endif
+#define APISUPPORT_NONPOSIX_EVENTFD 1
+#define APISUPPORT_NONPOSIX_O_DIRECT 1
+#ifdef apisupport_dummy
+export CFLAGS_NONPOSIX_O_DIRECT="-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_GNU_SOURCE"
+#endif
+#define APISUPPORT_NONPOSIX_FALLOCATE 1
+#ifdef apisupport_dummy
+export CFLAGS_NONPOSIX_FALLOCATE="-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_GNU_SOURCE"
+#endif
+#define APISUPPORT_LIBSSL_HOST_NAME 1
@@ -7,6 +7,7 @@
 #include "events.h"
 #include "pool.h"
 #include "proto_lbs.h"
+#include "slab.h"
 #include "warnp.h"
 #include "wire.h"
 
@@ -116,9 +117,9 @@ callback_gc(void * cookie)
 
 	/*
 	 * Instruct the backing store to free everything older than the
-	 * oldest leaf node accessible via the B+Tree root.
+	 * oldest leaf node accessible via the most recently written root.
 	 */
-	if (proto_lbs_request_free(T->LBS, T->root_shadow->oldestleaf,
+	if (proto_lbs_request_free(T->LBS, T->oldestdurable,
 	    callback_free_done, NULL))
 		goto err0;
 
@@ -177,6 +178,16 @@ btree_init(struct wire_requestqueue * Q_lbs, uint64_t npages,
 	/* Attach LBS request queue to the tree. */
 	T->LBS = Q_lbs;
 
+	/* We haven't done anything yet. */
+	for (i = 0; i < BTREE_STATS_LEVELS; i++)
+		T->hits[i] = T->misses[i] = 0;
+	T->bytesread = T->bytesappended = 0;
+	T->leafruns = T->leafruns_contiguous = 0;
+	T->trace = NULL;
+	T->sworkers = NULL;
+	T->appendmax = 0;
+	T->cluster = 0;
+
 	/* Issue a PARAMS2 request. */
 	PC.T = T;
 	PC.failed = PC.done = 0;
@@ -216,6 +227,10 @@ btree_init(struct wire_requestqueue * Q_lbs, uint64_t npages,
 		}
 	}
 	T->poolsz = (size_t)npages;
+	if (npagebytes != (uint64_t)(-1))
+		T->poolbytes = (size_t)npagebytes;
+	else
+		T->poolbytes = SIZE_MAX;
 
 	/* Set default key/value lengths if necessary. */
 	if (*keylen == (uint64_t)(-1)) {
@@ -246,13 +261,30 @@ btree_init(struct wire_requestqueue * Q_lbs, uint64_t npages,
 		goto err1;
 	}
 
-	/* Create a page pool. */
-	if ((T->P = pool_init(T->poolsz,
-	    offsetof(struct node, pool_cookie))) == NULL)
+	/* Create a page buffer allocator. */
+	if ((T->pagebufs = slab_init(T->pagelen, SLAB_HUGEPAGE)) == NULL)
 		goto err1;
 
-	/* No root nodes yet. */
+	/*
+	 * Create a page pool.  If we were given a memory budget, enforce it
+	 * in bytes (via sizes reported by btree_node_setsize); otherwise,
+	 * limit the number of pages.
+	 */
+	if (T->poolbytes != SIZE_MAX)
+		T->P = pool_init(SIZE_MAX, T->poolbytes,
+		    offsetof(struct node, pool_cookie));
+	else
+		T->P = pool_init(T->poolsz, SIZE_MAX,
+		    offsetof(struct node, pool_cookie));
+	if (T->P == NULL)
+		goto err2;
+
+	/* No root nodes yet, and nothing is being written. */
 	T->root_shadow = T->root_dirty = NULL;
+	T->syncs = NULL;
+
+	/* The cleaner is started once we have a root. */
+	T->cstate = NULL;
 
 	/*
 	 * Try to find a root node by scanning backwards from the last block
@@ -266,7 +298,7 @@ btree_init(struct wire_requestqueue * Q_lbs, uint64_t npages,
 		if ((T->root_dirty = node_alloc(rootblk, (uint64_t)(-1),
 		    (uint32_t)(-1))) == NULL) {
 			warnp("Failed to allocate node");
-			goto err2;
+			goto err3;
 		}
 		T->root_shadow = T->root_dirty;
 
@@ -275,7 +307,7 @@ btree_init(struct wire_requestqueue * Q_lbs, uint64_t npages,
 		if (btree_node_fetch_try(T, T->root_dirty,
 		    callback_getroot, &GC)) {
 			warnp("Failed to GET root page");
-			goto err3;
+			goto err4;
 		}
 
 		/* Wait until we've finished fetching. */
@@ -334,12 +366,12 @@ btree_init(struct wire_requestqueue * Q_lbs, uint64_t npages,
 	/* If we had any pages, one of them should have been a root. */
 	if (T->nextblk > 0) {
 		warn0("Could not find root B+Tree node");
-		goto err2;
+		goto err3;
 	}
 
 	/* Create a dirty leaf node. */
 	if ((T->root_dirty = btree_node_mkleaf(T, 0, NULL)) == NULL)
-		goto err2;
+		goto err3;
 
 	/* Mark the node as a root. */
 	T->root_dirty->root = 1;
@@ -350,9 +382,9 @@ btree_init(struct wire_requestqueue * Q_lbs, uint64_t npages,
 
 	/* Sync the (trivial) dirty tree out. */
 	SC.done = 0;
-	if (btree_sync(T, callback_sync, &SC)) {
+	if (btree_sync(T, NULL, callback_sync, &SC)) {
 		warnp("Failed to APPEND root page");
-		goto err4;
+		goto err5;
 	}
 
 	/* Wait until we've finished writing. */
@@ -374,6 +406,9 @@ btree_init(struct wire_requestqueue * Q_lbs, uint64_t npages,
 		Scost = 0.0;
 
 gotroot:
+	/* The shadow tree has been written. */
+	T->oldestdurable = T->root_shadow->oldestleaf;
+
 	/* Schedule a callback to invoke FREE. */
 	if ((T->gc_timer =
 	    events_timer_register(callback_gc, T, &free_time)) == NULL) {
@@ -391,18 +426,20 @@ gotroot:
 	return (T);
 
 	/* Root-creation path. */
-err4:
+err5:
 	btree_node_unlock(T, T->root_dirty);
 	btree_node_destroy(T, T->root_dirty);
-	goto err2;
+	goto err3;
 
 	/* Root-fetching path. */
-err3:
+err4:
 	node_free(T->root_dirty);
 
 	/* Merged exit path. */
-err2:
+err3:
 	pool_free(T->P);
+err2:
+	slab_free(T->pagebufs);
 err1:
 	free(T);
 err0:
@@ -410,6 +447,39 @@ err0:
 	return (NULL);
 }
 
+/**
+ * btree_poolsz(T):
+ * Return the number of pages the page pool of the B+Tree ${T} can hold.  If
+ * the pool has a size in bytes, this is estimated from the average memory
+ * used by each page currently in the pool (including its node and the
+ * arrays of keys and children or values), but is never less than 1024.
+ */
+size_t
+btree_poolsz(struct btree * T)
+{
+	size_t nrec, nbytes;
+	size_t pagemem;
+	size_t npages;
+
+	/* If the pool size is a number of pages, we're done. */
+	if (T->poolbytes == SIZE_MAX)
+		return (T->poolsz);
+
+	/* How much memory does each page use, on average? */
+	pool_usage(T->P, &nrec, &nbytes);
+	pagemem = (nrec > 0) ? nbytes / nrec : 0;
+	if (pagemem < T->pagelen)
+		pagemem = T->pagelen;
+
+	/* How many such pages fit into the pool? */
+	npages = T->poolbytes / pagemem;
+	if (npages < 1024)
+		npages = 1024;
+
+	/* Return the estimate. */
+	return (npages);
+}
+
 /**
  * btree_free(T):
  * Free the B-Tree ${T}, which must have root_shadow == root_dirty and must
@@ -442,6 +512,9 @@ btree_free(struct btree * T)
 	/* Free the page pool. */
 	pool_free(T->P);
 
+	/* Free the page buffer allocator. */
+	slab_free(T->pagebufs);
+
 	/* Free the tree structure. */
 	free(T);
 }
@@ -7,12 +7,20 @@
 /* Opaque types. */
 struct cleaner;
 struct node;
+struct serialize_workers;
+struct slab;
+struct trace;
 struct wire_requestqueue;
+struct write_cookie;
+
+/* Number of tree levels for which page cache statistics are kept. */
+#define BTREE_STATS_LEVELS	8
 
 /* B+Tree structure. */
 struct btree {
 	size_t pagelen;			/* Page length (in bytes). */
-	size_t poolsz;			/* Size of page pool. */
+	size_t poolsz;			/* Size of page pool (pages). */
+	size_t poolbytes;		/* Size of page pool (bytes). */
 	uint64_t nextblk;		/* Next available block #. */
 	struct wire_requestqueue * LBS;	/* LBS request queue. */
 
@@ -28,14 +36,37 @@ struct btree {
 	struct node * root_shadow;	/* Root node in shadow tree. */
 	struct node * root_dirty;	/* Root node in dirty tree. */
 	struct pool * P;		/* Page pool. */
+	struct slab * pagebufs;		/* Page buffer allocator. */
 
 	/* Used to periodically call FREE(). */
 	void * gc_timer;		/* Cookie from events_timer. */
+	uint64_t oldestdurable;		/* Oldest leaf in written tree. */
+
+	/* Syncs in progress, oldest first. */
+	struct write_cookie * syncs;
 
 	/* Required for cleaning. */
 	struct cleaner * cstate;	/* Cleaner state. */
 	uint64_t nnodes;		/* Size of the dirty tree. */
 	uint64_t npages;		/* # pages of storage used. */
+
+	/* Statistics; the last level also counts any higher levels. */
+	uint64_t hits[BTREE_STATS_LEVELS];	/* Lookups finding a page. */
+	uint64_t misses[BTREE_STATS_LEVELS];	/* Lookups reading a page. */
+	uint64_t bytesread;		/* Bytes read from LBS. */
+	uint64_t bytesappended;		/* Bytes appended to LBS. */
+	uint64_t leafruns;		/* Runs of leaves rewritten. */
+	uint64_t leafruns_contiguous;	/* ... into consecutive pages. */
+	struct trace * trace;		/* Commit pipeline trace, or NULL. */
+
+	/* Serialization threads, or NULL to serialize in this thread. */
+	struct serialize_workers * sworkers;
+
+	/* Maximum number of pages per APPEND, or 0 for no limit. */
+	size_t appendmax;
+
+	/* Rewrite runs of sibling leaves together in key order? */
+	int cluster;
 };
 
 /**
@@ -53,6 +84,15 @@ struct btree {
 struct btree * btree_init(struct wire_requestqueue *, uint64_t, uint64_t,
     uint64_t *, uint64_t *, double);
 
+/**
+ * btree_poolsz(T):
+ * Return the number of pages the page pool of the B+Tree ${T} can hold.  If
+ * the pool has a size in bytes, this is estimated from the average memory
+ * used by each page currently in the pool (including its node and the
+ * arrays of keys and children or values), but is never less than 1024.
+ */
+size_t btree_poolsz(struct btree *);
+
 /**
  * btree_balance(T, callback, cookie):
  * Rebalance the B+Tree ${T}, and invoke the provided callback.
@@ -66,11 +106,30 @@ int btree_balance(struct btree *, int (*)(void *), void *);
 void btree_mlen(struct btree *);
 
 /**
- * btree_sync(T, callback, cookie):
+ * btree_sync(T, callback_published, callback, cookie):
  * Serialize and write dirty nodes from the B+Tree ${T}; mark said nodes as
- * clean; free the shadow tree; and invoke the provided callback.
+ * clean; free the shadow tree; and invoke ${callback}(${cookie}) once the
+ * pages have been written.  If ${callback_published} is NULL, the nodes are
+ * marked as clean once their pages have been written; otherwise, as soon as
+ * they have been serialized and any earlier sync has completed, after which
+ * ${callback_published}(${cookie}) is invoked and the tree may be modified
+ * and synced again while the pages are being written.
+ */
+int btree_sync(struct btree *, int (*)(void *), int (*)(void *), void *);
+
+/**
+ * btree_durable(T):
+ * Return non-zero iff every change in the shadow tree of the B+Tree ${T} has
+ * been written to the block store.
+ */
+int btree_durable(struct btree *);
+
+/**
+ * btree_whendurable(T, callback, cookie):
+ * Invoke ${callback}(${cookie}) once every change in the shadow tree of the
+ * B+Tree ${T} has been written to the block store.
  */
-int btree_sync(struct btree *, int (*)(void *), void *);
+int btree_whendurable(struct btree *, int (*)(void *), void *);
 
 /**
  * btree_sanity(T):
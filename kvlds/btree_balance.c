@@ -9,6 +9,7 @@
 #include "btree_node.h"
 #include "node.h"
 #include "serialize.h"
+#include "trace.h"
 
 #include "btree.h"
 
@@ -18,11 +19,31 @@ struct balance_cookie {
 	void * cookie;
 	struct btree * T;
 	size_t nmergefetch;
+	size_t npasses;
 };
 
 static int merge_fetch(void *);
 static int domerge(void *);
 
+/* Is ${N} the rightmost node at its level of the dirty tree? */
+static int
+rightedge(struct node * N)
+{
+	struct node * P;
+
+	/* Walk up the tree until we reach the root. */
+	for (; N->root == 0; N = P) {
+		P = N->p_dirty;
+
+		/* If we're not our parent's last child, we're not the edge. */
+		if (P->v.children[P->nkeys] != N)
+			return (0);
+	}
+
+	/* We're on the right edge. */
+	return (1);
+}
+
 /* Split the descendents of the specified node. */
 static int
 splitchildren(struct btree * T, struct node * N)
@@ -31,6 +52,7 @@ splitchildren(struct btree * T, struct node * N)
 	size_t new_nkeys;
 	const struct kvldskey ** new_keys;
 	struct node ** new_children;
+	int edge;
 	int failed = 0;		/* We haven't failed yet. */
 
 	/* If this node has no children, do nothing. */
@@ -47,12 +69,18 @@ splitchildren(struct btree * T, struct node * N)
 			goto err0;
 	}
 
+	/*
+	 * Our last child is on the right edge of the tree iff we are; nodes
+	 * there get split in a way which suits keys arriving in order.
+	 */
+	edge = rightedge(N);
+
 	/* Figure out how many children we'll have after splitting them. */
 	for (new_nkeys = i = 0; i <= N->nkeys; i++) {
 		if (node_present(N->v.children[i]) &&
 		    (serialize_size(N->v.children[i]) > T->pagelen))
-			new_nkeys +=
-			    btree_node_split_nparts(T, N->v.children[i]);
+			new_nkeys += btree_node_split_nparts(T,
+			    N->v.children[i], edge && (i == N->nkeys));
 		else
 			new_nkeys += 1;
 	}
@@ -86,6 +114,7 @@ splitchildren(struct btree * T, struct node * N)
 		if (node_present(N->v.children[i]) &&
 		    (serialize_size(N->v.children[i]) > T->pagelen)) {
 			if (btree_node_split(T, N->v.children[i],
+			    edge && (i == N->nkeys),
 			    &new_keys[j], &new_children[j], &nparts)) {
 				/*
 				 * Splitting failed.  Just grab the unsplit
@@ -172,8 +201,11 @@ splitroot(struct btree * T, struct node * N)
 	size_t nparts;
 	size_t i;
 
-	/* Figure out how many separator keys we will have. */
-	nkeys = btree_node_split_nparts(T, N) - 1;
+	/*
+	 * Figure out how many separator keys we will have.  The root is the
+	 * only node at its level, so it is on the right edge of the tree.
+	 */
+	nkeys = btree_node_split_nparts(T, N, 1) - 1;
 
 	/* Allocate vectors for keys and children. */
 	if (IMALLOC(keys, nkeys, const struct kvldskey *))
@@ -208,7 +240,7 @@ splitroot(struct btree * T, struct node * N)
 	btree_node_lock(T, R);
 
 	/* Split the node, writing keys and new nodes into the new root. */
-	if (btree_node_split(T, N, R->u.keys, R->v.children, &nparts))
+	if (btree_node_split(T, N, 1, R->u.keys, R->v.children, &nparts))
 		goto err3;
 
 	/* Sanity check the number of children. */
@@ -640,6 +672,7 @@ domerge(void * cookie)
 	/* Do the merging. */
 	if (domergenode(B, T->root_dirty))
 		goto err0;
+	B->npasses += 1;
 
 #ifdef SANITY_CHECKS
 	/* Sanity check the B+Tree. */
@@ -654,6 +687,9 @@ domerge(void * cookie)
 		/* Remove extraneous root nodes. */
 		deroot(B);
 
+		/* Record how many Merge passes we needed. */
+		trace_merges(T->trace, B->npasses);
+
 		/* We're done!  Schedule the callback and free the cookie. */
 		if (!events_immediate_register(B->callback, B->cookie, 0))
 			goto err0;
@@ -683,6 +719,7 @@ btree_balance(struct btree * T, int (* callback)(void *), void * cookie)
 	B->callback = callback;
 	B->cookie = cookie;
 	B->T = T;
+	B->npasses = 0;
 
 	/* Split nodes as necessary. */
 	if (splittree(T))
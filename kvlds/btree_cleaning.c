@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "elasticqueue.h"
 #include "events.h"
 #include "warnp.h"
 
@@ -30,6 +31,14 @@ struct cleaning_group {
 	size_t pending_fetches;	/* Number of nodes not fetched yet. */
 };
 
+/* Recent and baseline values of a latency. */
+struct load {
+	double recent;		/* Moving average of recent samples. */
+	double base;		/* Latency when the system is quiet. */
+	int valid;		/* Have we seen any samples? */
+	int sampled;		/* Any samples since the last tick? */
+};
+
 /* Cleaner state. */
 struct cleaner {
 	struct btree * T;	/* The tree. */
@@ -39,13 +48,293 @@ struct cleaner {
 	int group_pending;	/* Are we trying to find a group to clean? */
 	struct cleaning_group * head;	/* Head of the list of groups. */
 	size_t pending_cleans;	/* Number of nodes fetching + waiting. */
+	uint64_t ncleaned;	/* Number of nodes dirtied by cleaning. */
+	uint64_t nclustered;	/* Number of nodes dirtied by clustering. */
+
+	/* Liveness map. */
+	struct elasticqueue * live;	/* Live pages in each region. */
+	uint64_t live_start;	/* Block # at which region 0 starts. */
+	uint64_t regionlen;	/* Number of blocks per region. */
+	uint64_t cutoff;	/* Clean leaves older than this block #. */
+
+	/* Foreground load. */
+	struct load mr;		/* MR batch latency. */
+	struct load get;	/* LBS GET latency. */
+	size_t nmr_qlen;	/* Current NMR queue length. */
+	double nmr_qavg;	/* Average NMR queue length. */
+	int deferring;		/* Foreground is busy; defer cleaning. */
+	double debtlimit;	/* Maximum debt to defer. */
 };
 
+/* Initial number of blocks per liveness map region. */
+#define REGION_LEN	1024
+
+/* Coarsen the liveness map if it has more regions than this. */
+#define MAXREGIONS	65536
+
+/* Weight given to each new latency sample. */
+#define LOAD_ALPHA	0.2
+
+/* Weight given to recent latency when raising the baseline each tick. */
+#define LOAD_BASE_ALPHA	(1.0 / 600.0)
+
+/* Latency is elevated if more than this multiple of the baseline... */
+#define LOAD_FACTOR	2.0
+
+/* ... and exceeds the baseline by more than this many seconds. */
+#define LOAD_SLACK	0.001
+
+/* Maximum number of seconds of cleaning debt accrual to defer. */
+#define MAXDEFER	300.0
+
 /* Time between ticks of the cleaning debt clock. */
 static const struct timeval onesec = {.tv_sec = 1, .tv_usec = 0};
 
 static int poke(struct cleaner *);
 
+/* Halve the number of liveness map regions by merging adjacent pairs. */
+static int
+live_coarsen(struct cleaner * C)
+{
+	struct elasticqueue * live;
+	double * x;
+	double sum;
+	size_t i, len;
+
+	/* Create a new map. */
+	if ((live = elasticqueue_init(sizeof(double))) == NULL)
+		goto err0;
+
+	/* Merge pairs of regions. */
+	len = elasticqueue_getlen(C->live);
+	for (i = 0; i < len; i += 2) {
+		x = elasticqueue_get(C->live, i);
+		sum = *x;
+		if (i + 1 < len) {
+			x = elasticqueue_get(C->live, i + 1);
+			sum += *x;
+		}
+		if (elasticqueue_add(live, &sum))
+			goto err1;
+	}
+
+	/* Replace the old map. */
+	elasticqueue_free(C->live);
+	C->live = live;
+	C->regionlen *= 2;
+
+	/* Success! */
+	return (0);
+
+err1:
+	elasticqueue_free(live);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Return a pointer to the live-page count for the region containing block
+ * ${blkno}, which must not precede the start of the map, extending the map
+ * as necessary.  Return NULL on error.
+ */
+static double *
+live_get(struct cleaner * C, uint64_t blkno)
+{
+	double zero = 0.0;
+
+	/* Sanity check. */
+	assert(blkno >= C->live_start);
+
+	/* Add regions until the map covers this block. */
+	while ((blkno - C->live_start) / C->regionlen >=
+	    elasticqueue_getlen(C->live)) {
+		if (elasticqueue_add(C->live, &zero))
+			goto err0;
+		if (elasticqueue_getlen(C->live) > MAXREGIONS) {
+			if (live_coarsen(C))
+				goto err0;
+		}
+	}
+
+	/* Return a pointer to the count. */
+	return (elasticqueue_get(C->live,
+	    (size_t)((blkno - C->live_start) / C->regionlen)));
+
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Add ${density} live pages per block for blocks ${start} to ${end} - 1. */
+static int
+live_add(struct cleaner * C, uint64_t start, uint64_t end, double density)
+{
+	uint64_t blkno;
+	uint64_t n;
+	double * x;
+
+	/* Add pages to the map, one region at a time. */
+	for (blkno = start; blkno < end; blkno += n) {
+		/* How many of the pages fall into this region? */
+		n = C->regionlen - (blkno - C->live_start) % C->regionlen;
+		if (n > end - blkno)
+			n = end - blkno;
+
+		/* Record them as live. */
+		if ((x = live_get(C, blkno)) == NULL)
+			goto err0;
+		*x += density * (double)n;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Drop regions from the liveness map which are entirely below ${horizon}. */
+static void
+live_trim(struct cleaner * C, uint64_t horizon)
+{
+
+	while ((elasticqueue_getlen(C->live) > 0) &&
+	    (C->live_start + C->regionlen <= horizon)) {
+		elasticqueue_delete(C->live);
+		C->live_start += C->regionlen;
+	}
+}
+
+/*
+ * Pick a new cleaning cutoff.  The backing store can only free blocks
+ * below the oldest leaf, so cleaning a region is only useful once all the
+ * regions before it have been cleaned; accordingly, the candidates are the
+ * prefixes of the liveness map.  Score each by the segment-cleaning
+ * cost-benefit formula
+ *     (1 - u) * age / (1 + u)
+ * where u is the fraction of the blocks in the prefix which are live and
+ * age is the number of blocks written since the end of the prefix, and
+ * select the best one.  Return the number of garbage blocks which cleaning
+ * that prefix would allow us to free.
+ */
+static double
+live_choose(struct cleaner * C)
+{
+	struct btree * T = C->T;
+	uint64_t horizon = T->root_shadow->oldestleaf;
+	uint64_t start, end;
+	double live, cap, u, age, score;
+	double l = 0.0, g = 0.0;
+	double bestscore = 0.0, bestg = 0.0;
+	size_t i;
+
+	/* Forget about blocks which have already been freed. */
+	live_trim(C, horizon);
+
+	/* Nothing is worth cleaning until we find otherwise. */
+	C->cutoff = 0;
+
+	/* Scan through the regions. */
+	for (i = 0; i < elasticqueue_getlen(C->live); i++) {
+		/* Figure out which blocks in this region are in use. */
+		start = C->live_start + i * C->regionlen;
+		end = start + C->regionlen;
+		if (start < horizon)
+			start = horizon;
+		if (end > T->nextblk)
+			end = T->nextblk;
+		if (end <= start)
+			continue;
+		cap = (double)(end - start);
+
+		/* Accumulate live and garbage blocks. */
+		live = *(double *)elasticqueue_get(C->live, i);
+		if (live > cap)
+			live = cap;
+		l += live;
+		g += cap - live;
+
+		/* Score this prefix. */
+		u = l / (l + g);
+		age = (double)(T->nextblk - end);
+		score = (1.0 - u) * age / (1.0 + u);
+		if (score > bestscore) {
+			bestscore = score;
+			bestg = g;
+			C->cutoff = end;
+		}
+	}
+
+	/* Return the amount of garbage we could free. */
+	return (bestg);
+}
+
+/* Record a latency sample ${t}. */
+static void
+load_sample(struct load * L, double t)
+{
+
+	if (L->valid) {
+		L->recent += (t - L->recent) * LOAD_ALPHA;
+	} else {
+		L->recent = L->base = t;
+		L->valid = 1;
+	}
+	L->sampled = 1;
+}
+
+/*
+ * Update the baseline latency.  This drops immediately to the recent
+ * latency if that is lower, but rises only slowly, so that it tracks the
+ * latency seen when the system is not busy.  If no samples have arrived
+ * since the last tick, the system is idle, so forget the recent latency.
+ */
+static void
+load_tick(struct load * L)
+{
+
+	if (!L->sampled)
+		L->recent = L->base;
+	L->sampled = 0;
+	if (L->recent < L->base)
+		L->base = L->recent;
+	else
+		L->base += (L->recent - L->base) * LOAD_BASE_ALPHA;
+}
+
+/* Is the recent latency elevated compared to the baseline? */
+static int
+load_elevated(struct load * L)
+{
+
+	return (L->valid && (L->recent > L->base * LOAD_FACTOR) &&
+	    (L->recent > L->base + LOAD_SLACK));
+}
+
+/*
+ * Decide whether the foreground workload is busy enough that cleaning
+ * should be deferred: Either non-modifying requests are queuing up, or
+ * modifying-request batches or page reads are taking noticeably longer than
+ * they do when the system is quiet.
+ */
+static int
+busy(struct cleaner * C)
+{
+
+	/* Update the average NMR queue length. */
+	C->nmr_qavg += ((double)C->nmr_qlen - C->nmr_qavg) * 0.5;
+
+	/* Update baseline latencies. */
+	load_tick(&C->mr);
+	load_tick(&C->get);
+
+	/* Are we busy? */
+	return ((C->nmr_qavg >= 1.0) || load_elevated(&C->mr) ||
+	    load_elevated(&C->get));
+}
+
 /* Compute oldestncleaf upwards in the shadow tree. */
 static void
 recompute_oncl(struct node * N)
@@ -167,12 +456,34 @@ err1:
 	return (-1);
 }
 
+/*
+ * Are the children of the height-1 node ${N} scattered around the log,
+ * rather than being stored in key order in (roughly) consecutive pages?
+ */
+static int
+scattered(struct node * N)
+{
+	size_t i;
+
+	/* Pages must be in key order... */
+	for (i = 0; i < N->nkeys; i++) {
+		if (N->v.children[i + 1]->pagenum <=
+		    N->v.children[i]->pagenum)
+			return (1);
+	}
+
+	/* ... and not spread out too much. */
+	return (N->v.children[N->nkeys]->pagenum -
+	    N->v.children[0]->pagenum >= 2 * ((uint64_t)N->nkeys + 1));
+}
+
 /* Find a group of nodes to clean. */
 static int
 callback_find(void * cookie, struct node * N)
 {
 	struct cleaning_group * CG = cookie;
 	struct cleaner * C = CG->C;
+	uint64_t cutoff;
 	size_t i;
 	int repoke = 1;
 
@@ -191,7 +502,7 @@ callback_find(void * cookie, struct node * N)
 	 * cleaner group.  This can happen if we have a small tree and are
 	 * cleaning it very aggressively.
 	 */
-	if (N->oldestncleaf >= C->T->nextblk - C->T->nnodes / 2) {
+	if (N->oldestncleaf >= C->cutoff) {
 		/* Release the cleaner group. */
 		free_cg(CG);
 
@@ -234,10 +545,19 @@ callback_find(void * cookie, struct node * N)
 
 	/* If we have a node of height 1, figure out which leaves to clean. */
 	if (N->height == 1) {
+		/*
+		 * If we're clustering leaves and these ones are scattered
+		 * around the log, clean all of them (except those which are
+		 * already being cleaned) so that they are written out
+		 * together in key order; otherwise clean the old ones.
+		 */
+		cutoff = C->cutoff;
+		if (C->T->cluster && scattered(N))
+			cutoff = (uint64_t)(-1);
+
 		/* Look for nodes with low oldestncleaf values. */
 		for (i = 0; i <= N->nkeys; i++) {
-			if (N->v.children[i]->oldestncleaf <
-			    C->T->nextblk - C->T->nnodes / 2) {
+			if (N->v.children[i]->oldestncleaf < cutoff) {
 				/* This child needs to be cleaned. */
 				CG->pending_fetches++;
 				C->pending_cleans++;
@@ -292,6 +612,7 @@ static int
 poke(struct cleaner * C)
 {
 	struct cleaning_group * CG;
+	double target;
 
 	/*
 	 * If we're trying to find a group to clean, we need to wait until
@@ -304,15 +625,31 @@ poke(struct cleaner * C)
 	 * If we're using more than 1/16 of our memory to hold pages which
 	 * are being cleaned, stop there; that's plenty.
 	 */
-	if (C->pending_cleans > C->T->poolsz / 16)
+	if (C->pending_cleans > btree_poolsz(C->T) / 16)
 		goto done;
 
+	/*
+	 * If the foreground workload is busy, let the cleaning debt build up
+	 * to debtlimit and only pay off the excess; we'll catch up once the
+	 * system is quiet again.
+	 */
+	target = C->cleandebt;
+	if (C->deferring)
+		target -= C->debtlimit;
+
 	/*
 	 * If the number of nodes we have waiting to be fetched or dirtied
-	 * is more than the cleaning debt, we don't need to look for any more
-	 * pages to clean yet.
+	 * is more than the (non-deferred) cleaning debt, we don't need to
+	 * look for any more pages to clean yet.
+	 */
+	if ((double)C->pending_cleans >= target)
+		goto done;
+
+	/*
+	 * If there are no old leaves which are worth cleaning, don't go
+	 * looking for them.
 	 */
-	if ((double)C->pending_cleans >= C->cleandebt)
+	if (C->T->root_shadow->oldestncleaf >= C->cutoff)
 		goto done;
 
 	/* We're going to launch a group of node cleans. */
@@ -353,20 +690,21 @@ tick(void * cookie)
 {
 	struct cleaner * C = cookie;
 	struct btree * T = C->T;
+	double garbage;
 
 	/* The timer is not running. */
 	C->cleantimer = NULL;
 
+	/* Decide which leaves are worth cleaning. */
+	garbage = live_choose(C);
+
 	/*
-	 * Adjust our "cleaning debt" based on current amount of garbage.
-	 * This is an underestimate of the amount of garbage if page have
-	 * been split and not yet synced, since nnodes reflects the current
-	 * size of the dirty tree while npages reflects the on-disk storage
-	 * used.  The if() eliminates potential arithmetic underflow in such
-	 * circumstances.
+	 * Adjust our "cleaning debt" based on the amount of garbage which we
+	 * could free by cleaning the leaves we have selected.  Garbage in
+	 * newer regions, or in old regions which are mostly live, does not
+	 * count until cleaning it becomes worthwhile.
 	 */
-	if (T->npages >= T->nnodes)
-		C->cleandebt += (double)(T->npages - T->nnodes) * C->cleanrate;
+	C->cleandebt += garbage * C->cleanrate;
 
 	/**
 	 * Limit our "cleaning balance" based on the size of the tree.  We
@@ -388,6 +726,14 @@ tick(void * cookie)
 	if (C->cleandebt > (double)T->nnodes)
 		C->cleandebt = (double)T->nnodes;
 
+	/*
+	 * Decide whether to defer cleaning.  Deferring shifts cleaning I/O
+	 * out of busy periods without changing how much cleaning we do, so
+	 * we allow up to MAXDEFER seconds worth of debt to be deferred.
+	 */
+	C->deferring = busy(C);
+	C->debtlimit = garbage * C->cleanrate * MAXDEFER;
+
 	/* Launch cleaning if possible and appropriate. */
 	if (poke(C))
 		goto err0;
@@ -418,8 +764,7 @@ struct cleaner *
 btree_cleaning_start(struct btree * T, double Scost)
 {
 	struct cleaner * C;
-
-	(void)Scost;
+	double density;
 
 	/* Create a cleaner state structure. */
 	if ((C = malloc(sizeof(struct cleaner))) == NULL)
@@ -429,6 +774,30 @@ btree_cleaning_start(struct btree * T, double Scost)
 	C->head = NULL;
 	C->pending_cleans = 0;
 
+	/* We haven't seen any foreground load yet. */
+	C->mr.valid = C->mr.sampled = 0;
+	C->get.valid = C->get.sampled = 0;
+	C->nmr_qlen = 0;
+	C->nmr_qavg = 0.0;
+	C->deferring = 0;
+	C->debtlimit = 0.0;
+
+	/*
+	 * We don't know which of the pages currently in storage are live,
+	 * so start with a liveness map in which the nnodes live pages are
+	 * spread evenly over the npages pages in use.
+	 */
+	if ((C->live = elasticqueue_init(sizeof(double))) == NULL)
+		goto err1;
+	C->live_start = T->nextblk - T->npages;
+	C->regionlen = REGION_LEN;
+	density = (T->npages > 0) ? (double)T->nnodes / (double)T->npages : 0;
+	if (density > 1.0)
+		density = 1.0;
+	if (live_add(C, C->live_start, T->nextblk, density))
+		goto err2;
+	C->cutoff = 0;
+
 	/**
 	 * The optimal rate of cleaning is when the cost accrued to store
 	 * garbage (inaccessible pages) is equal to the cost accrued to
@@ -451,15 +820,19 @@ btree_cleaning_start(struct btree * T, double Scost)
 	 * "payment" on the debt by performing some cleaning.
 	 */
 	C->cleandebt = 0;
+	C->ncleaned = 0;
+	C->nclustered = 0;
 	if ((C->cleantimer =
 	    events_timer_register(tick, C, &onesec)) == NULL) {
 		warnp("events_timer_register");
-		goto err1;
+		goto err2;
 	}
 
 	/* Success! */
 	return (C);
 
+err2:
+	elasticqueue_free(C->live);
 err1:
 	free(C);
 err0:
@@ -496,6 +869,105 @@ btree_cleaning_notify_dirtying(struct cleaner * C, struct node * N)
 	}
 }
 
+/**
+ * btree_cleaning_notify_append(C, start, end):
+ * Notify the cleaner that pages ${start} through ${end} - 1 have been
+ * written, and are therefore live.
+ */
+int
+btree_cleaning_notify_append(struct cleaner * C, uint64_t start,
+    uint64_t end)
+{
+
+	/* All of these pages are live. */
+	return (live_add(C, start, end, 1.0));
+}
+
+/**
+ * btree_cleaning_notify_garbage(C, N):
+ * Notify the cleaner that the page holding the shadow node ${N} is no
+ * longer reachable.
+ */
+void
+btree_cleaning_notify_garbage(struct cleaner * C, struct node * N)
+{
+	double * x;
+
+	/* If the page precedes the map, it has already been freed. */
+	if (N->pagenum < C->live_start)
+		return;
+
+	/*
+	 * If the page is beyond the end of the map, we never saw it being
+	 * written; we can't do anything useful with it.
+	 */
+	if ((N->pagenum - C->live_start) / C->regionlen >=
+	    elasticqueue_getlen(C->live))
+		return;
+
+	/* One fewer live page in this region. */
+	x = elasticqueue_get(C->live,
+	    (size_t)((N->pagenum - C->live_start) / C->regionlen));
+	if (*x >= 1.0)
+		*x -= 1.0;
+	else
+		*x = 0.0;
+}
+
+/**
+ * btree_cleaning_notify_nmrq(C, qlen):
+ * Notify the cleaner that ${qlen} non-modifying requests are queued waiting
+ * to be launched.
+ */
+void
+btree_cleaning_notify_nmrq(struct cleaner * C, size_t qlen)
+{
+
+	C->nmr_qlen = qlen;
+}
+
+/**
+ * btree_cleaning_notify_mrlat(C, t):
+ * Notify the cleaner that a batch of modifying requests took ${t} seconds.
+ */
+void
+btree_cleaning_notify_mrlat(struct cleaner * C, double t)
+{
+
+	load_sample(&C->mr, t);
+}
+
+/**
+ * btree_cleaning_notify_getlat(C, t):
+ * Notify the cleaner that reading a page from the block store took ${t}
+ * seconds.
+ */
+void
+btree_cleaning_notify_getlat(struct cleaner * C, double t)
+{
+
+	load_sample(&C->get, t);
+}
+
+/**
+ * btree_cleaning_stats(C, cleandebt, ncleaned, nclustered, deferring):
+ * Return via ${cleandebt} the cleaner's current cleaning debt (in pages),
+ * via ${ncleaned} the number of pages it has cleaned, via ${nclustered} the
+ * number of clean leaves it has dirtied so that they are written out along
+ * with their siblings, and via ${deferring} whether it is deferring
+ * cleaning because the foreground workload is busy.
+ */
+void
+btree_cleaning_stats(struct cleaner * C, double * cleandebt,
+    uint64_t * ncleaned, uint64_t * nclustered, int * deferring)
+{
+
+	*cleandebt = C->cleandebt;
+	*ncleaned = C->ncleaned;
+	*nclustered = C->nclustered;
+	*deferring = C->deferring;
+}
+
 /**
  * btree_cleaning_possible(C):
  * Return non-zero if the cleaner has any groups of pages fetched which it
@@ -517,6 +989,69 @@ btree_cleaning_possible(struct cleaner * C)
 	return (0);
 }
 
+/**
+ * btree_cleaning_cluster(C, leaves, nleaves):
+ * Notify the cleaner that the ${nleaves} leaves ${leaves} have been dirtied
+ * by a batch of modifying requests.  If leaves are being clustered, dirty
+ * any clean siblings which are in memory of leaves whose parents have had
+ * at least half of their children dirtied, so that each such run of sibling
+ * leaves is written out together in key order.
+ */
+int
+btree_cleaning_cluster(struct cleaner * C, struct node ** leaves,
+    size_t nleaves)
+{
+	struct btree * T = C->T;
+	struct node * P;
+	struct node * N;
+	size_t ndirty;
+	size_t i, j;
+
+	/* Do nothing if we're not clustering leaves. */
+	if (T->cluster == 0)
+		goto done;
+
+	/* Look at the parent of each dirty leaf. */
+	for (i = 0; i < nleaves; i++) {
+		/* If this leaf is the root, it has no siblings. */
+		if (leaves[i]->root)
+			continue;
+		P = leaves[i]->p_dirty;
+
+		/* Count dirty children. */
+		for (ndirty = j = 0; j <= P->nkeys; j++) {
+			if (P->v.children[j]->state == NODE_STATE_DIRTY)
+				ndirty++;
+		}
+
+		/* Did this batch dirty at least half of the run? */
+		if (ndirty * 2 < P->nkeys + 1)
+			continue;
+
+		/* Dirty the rest of the run, if it is in memory. */
+		for (j = 0; j <= P->nkeys; j++) {
+			N = P->v.children[j];
+			if ((N->state != NODE_STATE_CLEAN) || !node_present(N))
+				continue;
+			btree_node_lock(T, N);
+			if (btree_node_dirty(T, N) == NULL)
+				goto err1;
+			btree_node_unlock(T, N);
+			C->nclustered += 1;
+		}
+	}
+
+done:
+	/* Success! */
+	return (0);
+
+err1:
+	btree_node_unlock(T, N);
+
+	/* Failure! */
+	return (-1);
+}
+
 /**
  * btree_cleaning_clean(C):
  * Dirty whatever pages the cleaner wants to dirty.
@@ -546,6 +1081,7 @@ btree_cleaning_clean(struct cleaner * C)
 			/* Dirty the node. */
 			if (btree_node_dirty(C->T, CC->N) == 0)
 				goto err0;
+			C->ncleaned += 1;
 		}
 	}
 
@@ -594,6 +1130,9 @@ btree_cleaning_stop(struct cleaner * C)
 	/* We should have no cleaning groups. */
 	assert(C->head == NULL);
 
+	/* Free the liveness map. */
+	elasticqueue_free(C->live);
+
 	/* Free the cleaner state structure. */
 	free(C);
 }
@@ -1,6 +1,9 @@
 #ifndef BTREE_CLEANING_H_
 #define BTREE_CLEANING_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* Opaque types. */
 struct btree;
 struct cleaner;
@@ -21,6 +24,51 @@ struct cleaner * btree_cleaning_start(struct btree *, double);
  */
 void btree_cleaning_notify_dirtying(struct cleaner *, struct node *);
 
+/**
+ * btree_cleaning_notify_append(C, start, end):
+ * Notify the cleaner that pages ${start} through ${end} - 1 have been
+ * written, and are therefore live.
+ */
+int btree_cleaning_notify_append(struct cleaner *, uint64_t, uint64_t);
+
+/**
+ * btree_cleaning_notify_garbage(C, N):
+ * Notify the cleaner that the page holding the shadow node ${N} is no
+ * longer reachable.
+ */
+void btree_cleaning_notify_garbage(struct cleaner *, struct node *);
+
+/**
+ * btree_cleaning_notify_nmrq(C, qlen):
+ * Notify the cleaner that ${qlen} non-modifying requests are queued waiting
+ * to be launched.
+ */
+void btree_cleaning_notify_nmrq(struct cleaner *, size_t);
+
+/**
+ * btree_cleaning_notify_mrlat(C, t):
+ * Notify the cleaner that a batch of modifying requests took ${t} seconds.
+ */
+void btree_cleaning_notify_mrlat(struct cleaner *, double);
+
+/**
+ * btree_cleaning_notify_getlat(C, t):
+ * Notify the cleaner that reading a page from the block store took ${t}
+ * seconds.
+ */
+void btree_cleaning_notify_getlat(struct cleaner *, double);
+
+/**
+ * btree_cleaning_stats(C, cleandebt, ncleaned, nclustered, deferring):
+ * Return via ${cleandebt} the cleaner's current cleaning debt (in pages),
+ * via ${ncleaned} the number of pages it has cleaned, via ${nclustered} the
+ * number of clean leaves it has dirtied so that they are written out along
+ * with their siblings, and via ${deferring} whether it is deferring
+ * cleaning because the foreground workload is busy.
+ */
+void btree_cleaning_stats(struct cleaner *, double *, uint64_t *,
+    uint64_t *, int *);
+
 /**
  * btree_cleaning_possible(C):
  * Return non-zero if the cleaner has any groups of pages fetched which it
@@ -28,6 +76,16 @@ void btree_cleaning_notify_dirtying(struct cleaner *, struct node *);
  */
 int btree_cleaning_possible(struct cleaner *);
 
+/**
+ * btree_cleaning_cluster(C, leaves, nleaves):
+ * Notify the cleaner that the ${nleaves} leaves ${leaves} have been dirtied
+ * by a batch of modifying requests.  If leaves are being clustered, dirty
+ * any clean siblings which are in memory of leaves whose parents have had
+ * at least half of their children dirtied, so that each such run of sibling
+ * leaves is written out together in key order.
+ */
+int btree_cleaning_cluster(struct cleaner *, struct node **, size_t);
+
 /**
  * btree_cleaning_clean(C):
  * Dirty whatever pages the cleaner wants to dirty.
@@ -111,6 +111,24 @@ btree_find_child(struct node * N, const struct kvldskey * k)
 	return (min);
 }
 
+/* Record a lookup which found a child of ${NP} present or not present. */
+static void
+countlookup(struct btree * T, struct node * NP, int present)
+{
+	size_t level;
+
+	/* The child is one level below its parent. */
+	level = (size_t)(NP->height - 1);
+	if (level >= BTREE_STATS_LEVELS)
+		level = BTREE_STATS_LEVELS - 1;
+
+	/* Record the lookup. */
+	if (present)
+		T->hits[level] += 1;
+	else
+		T->misses[level] += 1;
+}
+
 /*
  * Keep looking for a leaf.  This function is responsible for ensuring that
  * C and C->e are freed.
@@ -146,6 +164,9 @@ findleaf(void * cookie)
 		}
 		NP = C->N;
 		C->N = C->N->v.children[i];
+
+		/* Record whether the child was present. */
+		countlookup(C->T, NP, node_present(C->N));
 	}
 
 	/* If the node is not present, fetch it; else, do the callback. */
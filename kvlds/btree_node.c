@@ -1,3 +1,5 @@
+#include <sys/time.h>
+
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -8,8 +10,11 @@
 #include "imalloc.h"
 #include "kvldskey.h"
 #include "kvpair.h"
+#include "monoclock.h"
+#include "mpool.h"
 #include "pool.h"
 #include "proto_lbs.h"
+#include "slab.h"
 #include "warnp.h"
 
 #include "btree.h"
@@ -33,6 +38,7 @@ struct reading {
 	struct btree * T;	/* B+tree to which this page belongs. */
 	size_t pagelen;		/* Size of page. */
 	int canfail;		/* Non-zero if failure is an option. */
+	struct timeval t_start;	/* Time when the read was issued. */
 };
 
 /* Descend-into-node state. */
@@ -42,6 +48,8 @@ struct descend {
 	struct node * N;
 };
 
+MPOOL(descend, struct descend, 4096);
+
 static int callback_fetch(void *, int, int, const uint8_t *);
 static int callback_descend(void *);
 
@@ -80,7 +88,7 @@ freedata(struct btree * T, struct node * N)
 
 	/* If the node has a serialized buffer, free it. */
 	if (N->pagebuf) {
-		free(N->pagebuf);
+		slab_rec_free(T->pagebufs, N->pagebuf);
 		N->pagebuf = NULL;
 	}
 
@@ -95,26 +103,73 @@ freedata(struct btree * T, struct node * N)
 	N->type = NODE_TYPE_NP;
 }
 
+/**
+ * Return the number of bytes of memory used by the present node ${N}.  The
+ * node structures of children are owned by (and counted against) their
+ * parent; keys and values are counted via the page buffer into which they
+ * point once the node has been serialized or deserialized.
+ */
+static size_t
+memsize(struct btree * T, struct node * N)
+{
+	size_t len = 0;
+
+	/* The page buffer, if we have one. */
+	if (N->pagebuf != NULL)
+		len += T->pagelen;
+
+	/* Nodes which are being read have no data yet. */
+	if ((N->type == NODE_TYPE_READ) || (N->nkeys == (size_t)(-1)))
+		return (len);
+
+	/* Arrays of key-value pairs, or keys and children. */
+	if (N->type == NODE_TYPE_LEAF) {
+		len += N->nkeys * sizeof(struct kvpair_const);
+	} else {
+		len += N->nkeys * sizeof(struct kvldskey *);
+		len += (N->nkeys + 1) *
+		    (sizeof(struct node *) + sizeof(struct node));
+	}
+
+	/* Return the total. */
+	return (len);
+}
+
+/*
+ * Make nodes evicted from the page pool non-present, starting with ${evict}
+ * (if non-NULL).  Since the pool limit may be in bytes and nodes vary in
+ * size, we may need to evict several nodes to get back down to the target
+ * size.
+ */
+static void
+evictnodes(struct btree * T, void * evict)
+{
+	struct node * N_evict;
+
+	while ((N_evict = evict) != NULL) {
+		/* Sanity-check: We can only evict clean nodes. */
+		assert(N_evict->state == NODE_STATE_CLEAN);
+
+		/* Delete the node's data and mark it as non-present. */
+		freedata(T, N_evict);
+
+		/* Do we need to evict more? */
+		evict = pool_evict(T->P);
+	}
+}
+
 /* Add a node to the page pool and handle any resulting eviction. */
 static int
 makepresent(struct btree * T, struct node * N)
 {
 	void * evict;
-	struct node * N_evict;
 
 	/* Add the node to the pool. */
 	if (pool_rec_add(T->P, N, &evict))
 		goto err0;
-	N_evict = evict;
 
-	/* If a node was evicted, make it non-present. */
-	if (N_evict != NULL) {
-		/* Sanity-check: We can only evict clean nodes. */
-		assert(N_evict->state == NODE_STATE_CLEAN);
-
-		/* Delete the node's data and mark it as non-present. */
-		freedata(T, N_evict);
-	}
+	/* Make evicted nodes non-present. */
+	evictnodes(T, evict);
 
 	/* Success! */
 	return (0);
@@ -173,6 +228,9 @@ btree_node_mknode(struct btree * T, unsigned int type, int height, size_t nkeys,
 	/* We don't know how far keys in this subtree match. */
 	N->mlen_t = 0;
 
+	/* Record the amount of memory this node uses. */
+	btree_node_setsize(T, N);
+
 	/* Success! */
 	return (N);
 
@@ -183,6 +241,27 @@ err0:
 	return (NULL);
 }
 
+/**
+ * btree_node_setsize(T, N):
+ * Recompute the number of bytes of memory used by the present node ${N} in
+ * the B+Tree ${T} and record it in the page pool, evicting other nodes if
+ * the pool is now above its target size.  This should be called whenever a
+ * node's data or page buffer is created or replaced.
+ */
+void
+btree_node_setsize(struct btree * T, struct node * N)
+{
+
+	/* Sanity check: The node must be in the pool. */
+	assert(node_present(N) || (N->type == NODE_TYPE_READ));
+
+	/* Update the pool's accounting. */
+	pool_rec_setsize(T->P, N, memsize(T, N));
+
+	/* If the node grew, we may need to evict something. */
+	evictnodes(T, pool_evict(T->P));
+}
+
 /**
  * btree_node_fetch_canfail(T, N, callback, cookie, canfail):
  * Fetch the node ${N} which is currently of type either NODE_TYPE_NP or
@@ -219,6 +298,10 @@ btree_node_fetch_canfail(struct btree * T, struct node * N,
 			goto err2;
 
 		/* Read the page. */
+		if (monoclock_get(&N->u.reading->t_start)) {
+			warnp("monoclock_get");
+			goto err3;
+		}
 		if (proto_lbs_request_get(T->LBS, N->pagenum, T->pagelen,
 		    callback_fetch, N))
 			goto err3;
@@ -305,6 +388,7 @@ callback_fetch(void * cookie, int failed, int status, const uint8_t * buf)
 	struct node * N = cookie;
 	struct reading * R = N->u.reading;
 	struct reader * r;
+	struct timeval t_end;
 	size_t i;
 
 	/* Throw a fit if the read request failed. */
@@ -313,6 +397,16 @@ callback_fetch(void * cookie, int failed, int status, const uint8_t * buf)
 		goto err2;
 	}
 
+	/* Tell the cleaner how long the read took. */
+	if (R->T->cstate != NULL) {
+		if (monoclock_get(&t_end)) {
+			warnp("monoclock_get");
+			goto err2;
+		}
+		btree_cleaning_notify_getlat(R->T->cstate,
+		    timeval_diff(R->t_start, t_end));
+	}
+
 	/* Throw a fit if the block does not exist and we can't fail. */
 	if ((status != 0) && (R->canfail == 0)) {
 		warn0("Failed to read a mandatory page");
@@ -321,8 +415,11 @@ callback_fetch(void * cookie, int failed, int status, const uint8_t * buf)
 
 	/* If the block exists, parse it. */
 	if (status == 0) {
+		/* We've read another page. */
+		R->T->bytesread += R->pagelen;
+
 		/* Parse the page. */
-		if (deserialize(N, buf, R->pagelen)) {
+		if (deserialize(R->T, N, buf, R->pagelen)) {
 			warn0("Cannot deserialize page");
 			goto err2;
 		}
@@ -335,6 +432,9 @@ callback_fetch(void * cookie, int failed, int status, const uint8_t * buf)
 			}
 		}
 
+		/* Record the amount of memory this node uses. */
+		btree_node_setsize(R->T, N);
+
 		/* Release our lock on the page. */
 		btree_node_unlock(R->T, N);
 	} else {
@@ -554,7 +654,7 @@ btree_node_descend(struct btree * T, struct node * N,
 	struct descend * C;
 
 	/* Bake a cookie. */
-	if ((C = malloc(sizeof(struct descend))) == NULL)
+	if ((C = mpool_descend_malloc()) == NULL)
 		goto err0;
 	C->callback = callback;
 	C->cookie = cookie;
@@ -574,7 +674,7 @@ btree_node_descend(struct btree * T, struct node * N,
 	return (0);
 
 err1:
-	free(C);
+	mpool_descend_free(C);
 err0:
 	/* Failure! */
 	return (-1);
@@ -591,7 +691,7 @@ callback_descend(void * cookie)
 	rc = (C->callback)(C->cookie, C->N);
 
 	/* Free the cookie. */
-	free(C);
+	mpool_descend_free(C);
 
 	/* Return status from callback. */
 	return (rc);
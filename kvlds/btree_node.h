@@ -28,6 +28,15 @@ struct node * btree_node_mknode(struct btree *, unsigned int, int, size_t,
 	btree_node_mknode(T, NODE_TYPE_PARENT,			\
 	    height, nkeys, keys, children, NULL)
 
+/**
+ * btree_node_setsize(T, N):
+ * Recompute the number of bytes of memory used by the present node ${N} in
+ * the B+Tree ${T} and record it in the page pool, evicting other nodes if
+ * the pool is now above its target size.  This should be called whenever a
+ * node's data or page buffer is created or replaced.
+ */
+void btree_node_setsize(struct btree *, struct node *);
+
 /**
  * btree_node_lock(T, N):
  * Lock the node ${N}.
@@ -112,22 +121,25 @@ void btree_node_pageout_recursive(struct btree *, struct node *);
 struct node * btree_node_dirty(struct btree *, struct node *);
 
 /**
- * btree_node_split_nparts(T, N):
+ * btree_node_split_nparts(T, N, rightedge):
  * Return the number of nodes into which the node ${N} belonging to the
- * B+Tree ${T} will be split by ntree_node_split.
+ * B+Tree ${T} will be split by btree_node_split.  The value ${rightedge}
+ * must be non-zero iff ${N} is the rightmost node at its level of the tree.
  */
-size_t btree_node_split_nparts(struct btree *, struct node *);
+size_t btree_node_split_nparts(struct btree *, struct node *, int);
 
 /**
- * btree_node_split(T, N, keys, parents, nparts):
+ * btree_node_split(T, N, rightedge, keys, parents, nparts):
  * Split the node ${N} belonging to the B+Tree ${T} into parts which are
  * small enough to be serialized to a single page.  Write the resulting
  * nodes into ${parents} and the separating keys into ${keys}; write the
  * number of parts into ${nparts} (this value must match the value returned
- * by btree_node_split_nparts).  Free the node ${N}.  On failure, return
+ * by btree_node_split_nparts).  If ${rightedge} is non-zero, ${N} is the
+ * rightmost node at its level of the tree, and all parts except the last
+ * are packed as full as possible.  Free the node ${N}.  On failure, return
  * with ${N} unmodified.
  */
-int btree_node_split(struct btree *, struct node *,
+int btree_node_split(struct btree *, struct node *, int,
     const struct kvldskey **, struct node **, size_t *);
 
 /**
@@ -12,9 +12,54 @@
 
 #include "btree_node.h"
 
+/*
+ * Figure out how to split a node belonging to the B+Tree ${T}; ${rightedge}
+ * is non-zero if the node is the rightmost node at its level of the tree.
+ * A part is finished once its size exceeds the returned value, or if adding
+ * the next key-value pair or child would make its size exceed ${fill}.
+ */
+static size_t
+getbreakat(struct btree * T, int rightedge, size_t * fill)
+{
+
+	/*
+	 * If the node is on the right edge of the tree, keys are probably
+	 * being appended in increasing order; the parts to the left will
+	 * never be modified again, so pack them as full as possible -- but
+	 * leave room for the extra root data, since Deroot might promote
+	 * any of them to roothood.  Such a part is larger than 2/3 of a
+	 * page (less the root data) by "Key/value size bounds" in DESIGN.
+	 */
+	if (rightedge) {
+		*fill = T->pagelen - SERIALIZE_ROOT;
+		return (*fill);
+	}
+
+	/* Otherwise, we split when we exceed 2/3 of a full node. */
+	*fill = T->pagelen;
+	return ((T->pagelen * 2) / 3);
+}
+
+/* Return the size of the leaf key-value pair ${i} in ${N}. */
+static size_t
+pairsize(struct node * N, size_t i)
+{
+
+	return (kvldskey_serial_size(N->u.pairs[i].k) +
+	    kvldskey_serial_size(N->u.pairs[i].v));
+}
+
+/* Return the size of the separator key ${i} in ${N} and the next child. */
+static size_t
+childsize(struct node * N, size_t i)
+{
+
+	return (kvldskey_serial_size(N->u.keys[i]) + SERIALIZE_PERCHILD);
+}
+
 /* Return the number of parts into which a leaf node should be split. */
 static size_t
-nparts_leaf(struct node * N, size_t breakat)
+nparts_leaf(struct node * N, size_t breakat, size_t fill)
 {
 	size_t nparts;
 	size_t i;
@@ -28,16 +73,14 @@ nparts_leaf(struct node * N, size_t breakat)
 	cursize = SERIALIZE_OVERHEAD;
 	for (i = 0; i < N->nkeys; i++) {
 		/* Should we split before this next key-value pair? */
-		if (cursize > breakat) {
+		if ((cursize > breakat) ||
+		    (cursize + pairsize(N, i) > fill)) {
 			nparts += 1;
 			cursize = SERIALIZE_OVERHEAD;
 		}
 
-		/* Add the key size. */
-		cursize += kvldskey_serial_size(N->u.pairs[i].k);
-
-		/* Add the value size. */
-		cursize += kvldskey_serial_size(N->u.pairs[i].v);
+		/* Add the key and value sizes. */
+		cursize += pairsize(N, i);
 	}
 
 	/* Return the number of parts. */
@@ -46,7 +89,7 @@ nparts_leaf(struct node * N, size_t breakat)
 
 /* Return the number of parts into which a parent node should be split. */
 static size_t
-nparts_parent(struct node * N, size_t breakat)
+nparts_parent(struct node * N, size_t breakat, size_t fill)
 {
 	size_t nparts;
 	size_t i;
@@ -60,15 +103,13 @@ nparts_parent(struct node * N, size_t breakat)
 	cursize = SERIALIZE_OVERHEAD + SERIALIZE_PERCHILD;
 	for (i = 1; i <= N->nkeys; i++) {
 		/* Should we split before this next child? */
-		if (cursize > breakat) {
+		if ((cursize > breakat) ||
+		    (cursize + childsize(N, i - 1) > fill)) {
 			nparts += 1;
 			cursize = SERIALIZE_OVERHEAD + SERIALIZE_PERCHILD;
 		} else {
-			/* Add the separator key size. */
-			cursize += kvldskey_serial_size(N->u.keys[i-1]);
-
-			/* Add the next child. */
-			cursize += SERIALIZE_PERCHILD;
+			/* Add the separator key and the next child. */
+			cursize += childsize(N, i - 1);
 		}
 	}
 
@@ -77,23 +118,24 @@ nparts_parent(struct node * N, size_t breakat)
 }
 
 /**
- * btree_node_split_nparts(T, N):
+ * btree_node_split_nparts(T, N, rightedge):
  * Return the number of nodes into which the node ${N} belonging to the
- * B+Tree ${T} will be split by ntree_node_split.
+ * B+Tree ${T} will be split by btree_node_split.  The value ${rightedge}
+ * must be non-zero iff ${N} is the rightmost node at its level of the tree.
  */
 size_t
-btree_node_split_nparts(struct btree * T, struct node * N)
+btree_node_split_nparts(struct btree * T, struct node * N, int rightedge)
 {
-	size_t breakat;
+	size_t breakat, fill;
 
-	/* We will split when we exceed 2/3 of a full node. */
-	breakat = (T->pagelen * 2)/3;
+	/* Figure out when to split. */
+	breakat = getbreakat(T, rightedge, &fill);
 
 	/* Handle leaves and parents separately. */
 	if (N->type == NODE_TYPE_LEAF)
-		return (nparts_leaf(N, breakat));
+		return (nparts_leaf(N, breakat, fill));
 	else
-		return (nparts_parent(N, breakat));
+		return (nparts_parent(N, breakat, fill));
 }
 
 /* Make a leaf.  Copy pointers to keys. */
@@ -125,7 +167,7 @@ err0:
 /* Split a leaf. */
 static int
 split_leaf(struct btree * T, struct node * N, const struct kvldskey ** keys,
-    struct node ** parents, size_t * nparts, size_t breakat)
+    struct node ** parents, size_t * nparts, size_t breakat, size_t fill)
 {
 	size_t i;
 	size_t cursize;
@@ -140,7 +182,8 @@ split_leaf(struct btree * T, struct node * N, const struct kvldskey ** keys,
 	nkeys = 0;
 	for (i = 0; i < N->nkeys; i++) {
 		/* Should we split before this next key-value pair? */
-		if (cursize > breakat) {
+		if ((cursize > breakat) ||
+		    (cursize + pairsize(N, i) > fill)) {
 			/* Create a new leaf node. */
 			if ((parents[*nparts] =
 			    makeleaf(T, nkeys, &N->u.pairs[i - nkeys])) == NULL)
@@ -159,11 +202,8 @@ split_leaf(struct btree * T, struct node * N, const struct kvldskey ** keys,
 			nkeys = 0;
 		}
 
-		/* Add the key size. */
-		cursize += kvldskey_serial_size(N->u.pairs[i].k);
-
-		/* Add the value size. */
-		cursize += kvldskey_serial_size(N->u.pairs[i].v);
+		/* Add the key and value sizes. */
+		cursize += pairsize(N, i);
 
 		/* We have a key in the node we're constructing. */
 		nkeys += 1;
@@ -246,7 +286,7 @@ err0:
 /* Split a parent. */
 static int
 split_parent(struct btree * T, struct node * N, const struct kvldskey ** keys,
-    struct node ** parents, size_t * nparts, size_t breakat)
+    struct node ** parents, size_t * nparts, size_t breakat, size_t fill)
 {
 	size_t i, j;
 	size_t cursize;
@@ -261,7 +301,8 @@ split_parent(struct btree * T, struct node * N, const struct kvldskey ** keys,
 	nkeys = 0;
 	for (i = 1; i <= N->nkeys; i++) {
 		/* Should we split before this next child? */
-		if (cursize > breakat) {
+		if ((cursize > breakat) ||
+		    (cursize + childsize(N, i - 1) > fill)) {
 			/* Create a new parent node. */
 			if ((parents[*nparts] = makeparent(T, N->height,
 			    nkeys, &N->u.keys[i - nkeys - 1],
@@ -276,12 +317,9 @@ split_parent(struct btree * T, struct node * N, const struct kvldskey ** keys,
 			cursize = SERIALIZE_OVERHEAD + SERIALIZE_PERCHILD;
 			nkeys = 0;
 		} else {
-			/* Add the separator key size. */
-			cursize += kvldskey_serial_size(N->u.keys[i-1]);
+			/* Add the separator key and the next child. */
+			cursize += childsize(N, i - 1);
 			nkeys += 1;
-
-			/* Add the next child. */
-			cursize += SERIALIZE_PERCHILD;
 		}
 	}
 
@@ -322,32 +360,36 @@ err1:
 }
 
 /**
- * btree_node_split(T, N, keys, parents, nparts):
+ * btree_node_split(T, N, rightedge, keys, parents, nparts):
  * Split the node ${N} belonging to the B+Tree ${T} into parts which are
  * small enough to be serialized to a single page.  Write the resulting
  * nodes into ${parents} and the separating keys into ${keys}; write the
  * number of parts into ${nparts} (this value must match the value returned
- * by btree_node_split_nparts).  Free the node ${N}.  On failure, return
+ * by btree_node_split_nparts).  If ${rightedge} is non-zero, ${N} is the
+ * rightmost node at its level of the tree, and all parts except the last
+ * are packed as full as possible.  Free the node ${N}.  On failure, return
  * with ${N} unmodified.
  */
 int
-btree_node_split(struct btree * T, struct node * N,
+btree_node_split(struct btree * T, struct node * N, int rightedge,
     const struct kvldskey ** keys, struct node ** parents, size_t * nparts)
 {
-	size_t breakat;
+	size_t breakat, fill;
 	int rc;
 
 	/* Sanity-check: We should never try to split a non-dirty node. */
 	assert(N->state == NODE_STATE_DIRTY);
 
-	/* We will split when we exceed 2/3 of a full node. */
-	breakat = (T->pagelen * 2)/3;
+	/* Figure out when to split. */
+	breakat = getbreakat(T, rightedge, &fill);
 
 	/* Handle leaves and parents separately. */
 	if (N->type == NODE_TYPE_LEAF)
-		rc = split_leaf(T, N, keys, parents, nparts, breakat);
+		rc = split_leaf(T, N, keys, parents, nparts, breakat,
+		    fill);
 	else
-		rc = split_parent(T, N, keys, parents, nparts, breakat);
+		rc = split_parent(T, N, keys, parents, nparts, breakat,
+		    fill);
 
 	/* On success, update recorded size of tree. */
 	if (rc == 0)
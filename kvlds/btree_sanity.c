@@ -103,6 +103,8 @@ sanity(struct btree * T, struct node * N, int state)
 		nlcks += 1;
 	if (N->state != NODE_STATE_CLEAN)
 		nlcks += 1;
+	if (N->unwritten)
+		nlcks += 1;
 	if (N->type == NODE_TYPE_PARENT) {
 		for (i = 0; i <= N->nkeys; i++) {
 			if (node_hasplock(N->v.children[i])) {
@@ -1,31 +1,79 @@
+#include <sys/time.h>
+
 #include <assert.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "elasticarray.h"
 #include "events.h"
 #include "imalloc.h"
 #include "proto_lbs.h"
+#include "slab.h"
 #include "warnp.h"
 
+#include "btree_cleaning.h"
 #include "btree_node.h"
 #include "node.h"
 #include "serialize.h"
+#include "serialize_workers.h"
+#include "trace.h"
 
 #include "btree.h"
 
+/* A callback waiting for published changes to be written. */
+struct waiter {
+	int (* callback)(void *);
+	void * cookie;
+};
+
+/* Page numbers of freed shadow nodes. */
+ELASTICARRAY_DECL(PAGELIST, pagelist, uint64_t);
+
+/* Callbacks waiting for a sync to complete. */
+ELASTICARRAY_DECL(WAITERS, waiters, struct waiter);
+
 struct write_cookie {
-	/* Callback to be performed after sync is done. */
+	/* Callbacks to be performed once published and once synced. */
+	int (* callback_published)(void *);
 	int (* callback)(void *);
 	void * cookie;
 
 	/* The B+Tree. */
 	struct btree * T;
+
+	/* The next (newer) sync in progress, or NULL. */
+	struct write_cookie * next;
+
+	/* Start of the current commit pipeline stage. */
+	struct timeval t_trace;
+
+	/* Dirty nodes in block order, and pointers to their pages. */
+	struct node ** nodes;
+	const uint8_t ** bufv;
+	uint64_t base;			/* Block number of the first page. */
+	uint64_t blkno;			/* Next block after the last page. */
+	uint64_t oldestleaf;		/* Oldest leaf in the new tree. */
+	size_t npages;			/* Number of pages to write. */
+	size_t nsent;			/* Pages sent to the block store. */
+	size_t nwritten;		/* Pages written by the block store. */
+
+	/* Publishing the new tree to non-modifying requests. */
+	int publishing;			/* Nodes have been marked clean. */
+	int published;			/* The old shadow tree is gone. */
+	PAGELIST garbage;		/* Pages which held the old tree. */
+	WAITERS waiters;		/* Callbacks awaiting completion. */
 };
 
+/* Only use worker threads if we have at least this many pages. */
+#define PARALLEL_MIN	64
+
+static int sendchunk(void *);
 static int callback_append(void *, int, int, uint64_t);
 static int callback_unshadow(void *);
+static int publish(struct write_cookie *);
+static int finish(struct write_cookie *);
 
 /* Count the number of dirty nodes under the specified node. */
 static size_t
@@ -47,25 +95,55 @@ ndirty(struct node * N)
 	return (n);
 }
 
-/* Serialize the dirty nodes in a (sub)tree. */
-static int
-serializetree(struct btree * T, struct node * N, size_t pagelen,
-    uint64_t nextblk, const uint8_t ** bufv, uint64_t * pn)
+/*
+ * Record in ${T} whether the children of the height-1 node ${N} are all
+ * being written, and if so, whether they are in consecutive pages.
+ */
+static void
+countrun(struct btree * T, struct node * N)
+{
+	size_t i;
+
+	/* Ignore runs which are only partly being rewritten. */
+	for (i = 0; i <= N->nkeys; i++) {
+		if (N->v.children[i]->state != NODE_STATE_DIRTY)
+			return;
+	}
+	T->leafruns += 1;
+
+	/* Are the leaves in consecutive pages, in key order? */
+	for (i = 0; i < N->nkeys; i++) {
+		if (N->v.children[i + 1]->pagenum !=
+		    N->v.children[i]->pagenum + 1)
+			return;
+	}
+	T->leafruns_contiguous += 1;
+}
+
+/*
+ * Assign page numbers to the dirty nodes in a (sub)tree, compute their page
+ * sizes, and record them in ${nodes} in page number order.
+ */
+static void
+preparetree(struct btree * T, struct node * N, uint64_t nextblk,
+    struct node ** nodes, uint64_t * pn)
 {
 	size_t i;
 
 	/* If this node is not dirty, return immediately. */
 	if (N->state != NODE_STATE_DIRTY)
-		return (0);
+		return;
 
-	/* If this node has children, serialize them first. */
+	/* If this node has children, prepare them first. */
 	if (N->type == NODE_TYPE_PARENT) {
 		for (i = 0; i <= N->nkeys; i++)
-			if (serializetree(T, N->v.children[i], pagelen,
-			    nextblk, bufv, pn))
-				goto err0;
+			preparetree(T, N->v.children[i], nextblk, nodes, pn);
 	}
 
+	/* Check the layout of runs of leaves. */
+	if (N->height == 1)
+		countrun(T, N);
+
 	/* Record this node's page number. */
 	N->pagenum = nextblk + *pn;
 
@@ -81,22 +159,19 @@ serializetree(struct btree * T, struct node * N, size_t pagelen,
 		}
 	}
 
-	/* Serialize the page and record the page pointer. */
-	if (serialize(T, N, pagelen))
-		goto err0;
-	bufv[(*pn)++] = N->pagebuf;
+	/* Compute the page size, which our parent needs to know. */
+	serialize_size(N);
 
-	/* Success! */
-	return (0);
-
-err0:
-	/* Failure! */
-	return (-1);
+	/* Record the node. */
+	nodes[(*pn)++] = N;
 }
 
-/* Mark all dirty nodes in a (sub)tree as clean. */
+/*
+ * Mark all dirty nodes in a (sub)tree as clean.  If ${unwritten} is non-zero,
+ * their pages have not been written yet, so keep them locked in memory.
+ */
 static void
-makeclean(struct btree * T, struct node * N)
+makeclean(struct btree * T, struct node * N, int unwritten)
 {
 	size_t i;
 
@@ -110,7 +185,7 @@ makeclean(struct btree * T, struct node * N)
 	/* If this node has children, recurse down. */
 	if (N->type == NODE_TYPE_PARENT) {
 		for (i = 0; i <= N->nkeys; i++)
-			makeclean(T, N->v.children[i]);
+			makeclean(T, N->v.children[i], unwritten);
 	}
 
 	/*
@@ -130,20 +205,128 @@ makeclean(struct btree * T, struct node * N)
 	/* Mark this node as clean. */
 	N->state = NODE_STATE_CLEAN;
 
-	/* Remove the node-is-dirty lock on the node. */
-	btree_node_unlock(T, N);
+	/*
+	 * Remove the node-is-dirty lock on the node; or if its page has not
+	 * been written yet, keep the lock until it has.
+	 */
+	if (unwritten)
+		N->unwritten = 1;
+	else
+		btree_node_unlock(T, N);
 
 	/* This node's dirty parent is also its shadow parent. */
 	N->p_shadow = N->p_dirty;
 	btree_node_lock(T, N->p_shadow);
 }
 
-/* Free shadow nodes and reparent clean children. */
-static void
-unshadow(struct btree * T, struct node * N)
+/* Compare two page numbers. */
+static int
+pagecmp(const void * _x, const void * _y)
+{
+	uint64_t x = *(const uint64_t *)_x;
+	uint64_t y = *(const uint64_t *)_y;
+
+	if (x < y)
+		return (-1);
+	else if (x > y)
+		return (1);
+	else
+		return (0);
+}
+
+/* Callback for FREERANGE requests. */
+static int
+callback_freerange_done(void * cookie, int failed)
+{
+
+	(void)cookie; /* UNUSED */
+
+	/* Throw a fit if the FREERANGE failed. */
+	if (failed) {
+		warn0("LBS FREERANGE request failed");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Tell the block store that the pages listed in ${L} are garbage, so that it
+ * can release their space without waiting for all older pages to be freed.
+ */
+static int
+freepages(struct btree * T, PAGELIST L)
 {
+	struct proto_lbs_range * ranges;
+	uint64_t * pages = pagelist_get(L, 0);
+	size_t npages = pagelist_getsize(L);
+	size_t nranges;
 	size_t i;
 
+	/* Nothing to do if we have no pages. */
+	if (npages == 0)
+		goto done;
+
+	/* Coalesce the pages into runs of consecutive blocks. */
+	qsort(pages, npages, sizeof(uint64_t), pagecmp);
+	if (IMALLOC(ranges, (npages < PROTO_LBS_FREERANGE_MAX) ? npages :
+	    PROTO_LBS_FREERANGE_MAX, struct proto_lbs_range))
+		goto err0;
+	for (nranges = i = 0; i < npages; i++) {
+		/* Extend the current run if we can. */
+		if ((nranges > 0) && (pages[i] ==
+		    ranges[nranges - 1].blkno + ranges[nranges - 1].nblks)) {
+			ranges[nranges - 1].nblks += 1;
+			continue;
+		}
+
+		/* Send the runs we have if there's no room for another. */
+		if (nranges == PROTO_LBS_FREERANGE_MAX) {
+			if (proto_lbs_request_freerange(T->LBS, nranges,
+			    ranges, callback_freerange_done, NULL))
+				goto err1;
+			nranges = 0;
+		}
+
+		/* Start a new run. */
+		ranges[nranges].blkno = pages[i];
+		ranges[nranges].nblks = 1;
+		nranges++;
+	}
+
+	/* Send the remaining runs. */
+	if (proto_lbs_request_freerange(T->LBS, nranges, ranges,
+	    callback_freerange_done, NULL))
+		goto err1;
+	free(ranges);
+
+done:
+	/* Success! */
+	return (0);
+
+err1:
+	free(ranges);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Free shadow nodes and reparent clean children, adding the page numbers of
+ * the freed nodes to ${L}.  Return -1 if pages could not be added to ${L};
+ * the tree is updated regardless.
+ */
+static int
+unshadow(struct btree * T, struct node * N, PAGELIST L)
+{
+	size_t i;
+	int rc = 0;
+
 #ifdef SANITY_CHECKS
 	/* Sanity check the B+Tree. */
 	btree_sanity(T);
@@ -166,14 +349,15 @@ unshadow(struct btree * T, struct node * N)
 			btree_node_lock(T, N->p_shadow);
 
 		/* We're done. */
-		return;
+		return (0);
 	}
 
 	/* If this node has children, recurse down. */
 	if (N->type == NODE_TYPE_PARENT) {
 		for (i = 0; i <= N->nkeys; i++) {
 			/* Recurse down. */
-			unshadow(T, N->v.children[i]);
+			if (unshadow(T, N->v.children[i], L))
+				rc = -1;
 
 			/* Clear the child pointer. */
 			N->v.children[i] = NULL;
@@ -185,61 +369,189 @@ unshadow(struct btree * T, struct node * N)
 	btree_sanity(T);
 #endif
 
+	/* The page holding this node is now garbage. */
+	if (T->cstate != NULL)
+		btree_cleaning_notify_garbage(T->cstate, N);
+	if (pagelist_append(L, &N->pagenum, 1))
+		rc = -1;
+
 	/* Destroy this node. */
 	btree_node_destroy(T, N);
+
+	/* Return status. */
+	return (rc);
+}
+
+/* Serialize the next chunk of dirty pages and send it to the block store. */
+static int
+sendchunk(void * cookie)
+{
+	struct write_cookie * WC = cookie;
+	struct btree * T = WC->T;
+	struct node ** nodes = &WC->nodes[WC->nsent];
+	size_t n;
+	size_t i;
+
+	/* Figure out how many pages go into this APPEND. */
+	n = WC->npages - WC->nsent;
+	if ((T->appendmax != 0) && (n > T->appendmax))
+		n = T->appendmax;
+
+	/*
+	 * Allocate page buffers for this chunk.  We don't allocate them until
+	 * now, so that a large sync split into several APPENDs doesn't hold
+	 * buffers for pages which won't be serialized for a while.  Once the
+	 * pages are serialized, the nodes' keys and values point into these
+	 * buffers, so they are freed along with the nodes rather than when
+	 * the APPEND completes.
+	 */
+	for (i = 0; i < n; i++) {
+		assert(nodes[i]->pagebuf == NULL);
+		if ((nodes[i]->pagebuf = slab_rec_alloc(T->pagebufs)) == NULL)
+			goto err0;
+	}
+
+	/*
+	 * Serialize pages.  Now that every node knows its page number and
+	 * the sizes of its children's pages, nodes can be serialized in any
+	 * order; so spread the work across our worker threads if we have
+	 * enough pages to make that worthwhile.
+	 */
+	if ((T->sworkers != NULL) && (n >= PARALLEL_MIN)) {
+		if (serialize_workers_run(T->sworkers, T, nodes, n,
+		    T->pagelen))
+			goto err0;
+	} else {
+		for (i = 0; i < n; i++)
+			serialize_write(T, nodes[i], T->pagelen);
+	}
+
+	/* Record page pointers; the nodes now hold page buffers. */
+	for (i = 0; i < n; i++) {
+		WC->bufv[WC->nsent + i] = nodes[i]->pagebuf;
+		btree_node_setsize(T, nodes[i]);
+	}
+
+	/* If this is the last chunk, we've finished serializing. */
+	if ((WC->nsent + n == WC->npages) &&
+	    trace_stage(T->trace, TRACE_SERIALIZE, &WC->t_trace))
+		goto err0;
+
+	/* Write pages out. */
+	if (proto_lbs_request_append_blks(T->LBS, (uint32_t)n,
+	    WC->base + WC->nsent, T->pagelen, &WC->bufv[WC->nsent],
+	    callback_append, WC)) {
+		warnp("Error writing pages");
+		goto err0;
+	}
+	WC->nsent += n;
+
+	/*
+	 * If there are more pages, serialize them once the event loop has
+	 * had a chance to start sending this chunk.  The root node is the
+	 * last page, so if we crash part-way through, the pages we have
+	 * written will be ignored when the tree is next loaded.
+	 */
+	if (WC->nsent < WC->npages) {
+		if (events_timer_register_double(sendchunk, WC, 0.0) == NULL)
+			goto err0;
+		goto done;
+	}
+
+	/* Publish the new tree if we can do so before it is written. */
+	if (publish(WC))
+		goto err0;
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
 }
 
 /**
- * btree_sync(T, callback, cookie):
+ * btree_sync(T, callback_published, callback, cookie):
  * Serialize and write dirty nodes from the B+Tree ${T}; mark said nodes as
- * clean; free the shadow tree; and invoke the provided callback.
+ * clean; free the shadow tree; and invoke ${callback}(${cookie}) once the
+ * pages have been written.  If ${callback_published} is NULL, the nodes are
+ * marked as clean once their pages have been written; otherwise, as soon as
+ * they have been serialized and any earlier sync has completed, after which
+ * ${callback_published}(${cookie}) is invoked and the tree may be modified
+ * and synced again while the pages are being written.
  */
 int
-btree_sync(struct btree * T, int (* callback)(void *), void * cookie)
+btree_sync(struct btree * T, int (* callback_published)(void *),
+    int (* callback)(void *), void * cookie)
 {
 	struct write_cookie * WC;
-	size_t npages;
-	const uint8_t ** bufv;
+	struct write_cookie ** WCp;
 	uint64_t pn = 0;
 
 	/* Bake a cookie. */
 	if ((WC = malloc(sizeof(struct write_cookie))) == NULL)
 		goto err0;
 	WC->T = T;
+	WC->callback_published = callback_published;
 	WC->callback = callback;
 	WC->cookie = cookie;
+	WC->next = NULL;
+	WC->nsent = WC->nwritten = 0;
+	WC->publishing = WC->published = 0;
+
+	/* Start timing serialization. */
+	if (trace_stage(T->trace, TRACE_NONE, &WC->t_trace))
+		goto err1;
 
 	/* Figure out how many pages we need to write. */
-	npages = ndirty(T->root_dirty);
+	WC->npages = ndirty(T->root_dirty);
 
-	/* Allocate a vector to hold pointers to pages. */
-	if (IMALLOC(bufv, npages, const uint8_t *))
+	/* Allocate vectors to hold pointers to nodes and pages. */
+	if (IMALLOC(WC->nodes, WC->npages, struct node *))
 		goto err1;
-
-	/* Serialize pages and record pointers into the vector. */
-	if (serializetree(T, T->root_dirty, T->pagelen, T->nextblk,
-	    bufv, &pn))
+	if (IMALLOC(WC->bufv, WC->npages, const uint8_t *))
 		goto err2;
 
-	/* Sanity check the number of pages serialized. */
-	assert(pn == npages);
-	assert(npages <= UINT32_MAX);
+	/* We will record pages which become garbage and waiting callbacks. */
+	if ((WC->garbage = pagelist_init(0)) == NULL)
+		goto err3;
+	if ((WC->waiters = waiters_init(0)) == NULL)
+		goto err4;
 
-	/* Write pages out. */
-	if (proto_lbs_request_append_blks(T->LBS, (uint32_t)npages, T->nextblk,
-	    T->pagelen, bufv, callback_append, WC)) {
-		warnp("Error writing pages");
-		goto err2;
-	}
+	/* Assign page numbers and compute page sizes. */
+	WC->base = T->nextblk;
+	preparetree(T, T->root_dirty, WC->base, WC->nodes, &pn);
 
-	/* Free the page pointers vector. */
-	free(bufv);
+	/* Sanity check the number of pages prepared. */
+	assert(pn == WC->npages);
+	assert(WC->npages <= UINT32_MAX);
+
+	/* Later syncs will write pages after ours. */
+	T->nextblk = WC->base + WC->npages;
+	WC->oldestleaf = T->root_dirty->oldestleaf;
+
+	/* Add this sync to the end of the list of syncs in progress. */
+	for (WCp = &T->syncs; *WCp != NULL; WCp = &(*WCp)->next)
+		continue;
+	*WCp = WC;
+
+	/*
+	 * Serialize and write out the first (and possibly only) chunk.  We
+	 * can't clean up if this fails, since the page numbers are in use.
+	 */
+	if (sendchunk(WC))
+		goto err0;
 
 	/* Success! */
 	return (0);
 
+err4:
+	pagelist_free(WC->garbage);
+err3:
+	free(WC->bufv);
 err2:
-	free(bufv);
+	free(WC->nodes);
 err1:
 	free(WC);
 err0:
@@ -247,42 +559,104 @@ err0:
 	return (-1);
 }
 
-/* Callback for btree_sync when write is complete. */
+/* Callback for btree_sync when a chunk of pages has been written. */
 static int
 callback_append(void * cookie, int failed, int status, uint64_t blkno)
 {
 	struct write_cookie * WC = cookie;
 	struct btree * T = WC->T;
+	size_t n;
 
 	/* Throw a fit if we didn't manage to write the pages. */
 	if (failed) {
 		warnp("LBS APPEND request failed");
-		goto err1;
+		goto err0;
 	}
 	if (status) {
 		warn0("Failed to write dirty nodes to backing store");
-		goto err1;
+		goto err0;
 	}
 
-	/* Record the next available block number. */
-	T->nextblk = blkno;
+	/* Chunks are written in order; count the pages in this one. */
+	n = WC->npages - WC->nwritten;
+	if ((T->appendmax != 0) && (n > T->appendmax))
+		n = T->appendmax;
+	WC->nwritten += n;
+
+	/* If more chunks are coming, they must follow on from this one. */
+	if (WC->nwritten < WC->npages) {
+		if (blkno != WC->base + WC->nwritten) {
+			warn0("Block store does not support chunked APPENDs");
+			goto err0;
+		}
+		goto done;
+	}
+
+	/* If another sync is writing pages, they must follow on from ours. */
+	if ((WC->next != NULL) && (blkno != WC->base + WC->npages)) {
+		warn0("Block store does not support pipelined APPENDs");
+		goto err0;
+	}
+	WC->blkno = blkno;
+
+	/* The pages have been written. */
+	if (trace_stage(T->trace, TRACE_APPEND, &WC->t_trace))
+		goto err0;
+
+	/*
+	 * If the new tree has been published, we're done; otherwise, publish
+	 * it now if we can.
+	 */
+	if (WC->published) {
+		if (finish(WC))
+			goto err0;
+	} else {
+		if (publish(WC))
+			goto err0;
+	}
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Mark the dirty tree as clean and free the old shadow tree, if all of the
+ * pages have been serialized, any earlier syncs have completed, and either
+ * the pages have been written or we're allowed to publish before then.
+ */
+static int
+publish(struct write_cookie * WC)
+{
+	struct btree * T = WC->T;
+	int written = (WC->nwritten == WC->npages);
+
+	/* Can we publish the new tree yet? */
+	if (WC->publishing || (WC->nsent < WC->npages) || (T->syncs != WC))
+		goto done;
+	if (!written && (WC->callback_published == NULL))
+		goto done;
 
 	/* Mark the nodes in the dirty tree as clean. */
-	makeclean(T, T->root_dirty);
+	makeclean(T, T->root_dirty, !written);
+	WC->publishing = 1;
 
 	/*
 	 * Make sure no callbacks are pending on the shadow tree before we
 	 * garbage collect it.
 	 */
 	if (!events_immediate_register(callback_unshadow, WC, 1))
-		goto err1;
+		goto err0;
 
+done:
 	/* Success! */
 	return (0);
 
-err1:
-	free(WC);
-
+err0:
 	/* Failure! */
 	return (-1);
 }
@@ -312,12 +686,70 @@ callback_unshadow(void * cookie)
 		 * Traverse the tree, re-pointing clean children at their
 		 * dirty parents and freeing shadow nodes.
 		 */
-		unshadow(T, root_shadow);
+		if (unshadow(T, root_shadow, WC->garbage))
+			goto err0;
 	}
 
 	/* Update number-of-pages-used value. */
 	T->npages = T->nextblk - T->root_dirty->oldestleaf;
 
+	/* The old shadow tree is gone. */
+	WC->published = 1;
+	if (trace_stage(T->trace, TRACE_UNSHADOW, &WC->t_trace))
+		goto err0;
+
+	/* If the pages have been written, we're done. */
+	if (WC->nwritten == WC->npages)
+		return (finish(WC));
+
+	/* Otherwise, the tree can be modified while they are written. */
+	if (!events_immediate_register(WC->callback_published, WC->cookie, 0))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* The new tree has been published and written.  Clean up. */
+static int
+finish(struct write_cookie * WC)
+{
+	struct btree * T = WC->T;
+	struct waiter * W;
+	size_t i;
+
+	/* The pages have been written; they can now be evicted. */
+	for (i = 0; i < WC->npages; i++) {
+		if (WC->nodes[i]->unwritten) {
+			WC->nodes[i]->unwritten = 0;
+			btree_node_unlock(T, WC->nodes[i]);
+		}
+	}
+
+	/* We don't need the node and page pointers vectors any more. */
+	free(WC->bufv);
+	free(WC->nodes);
+
+	/* Tell the cleaner that the pages we just wrote are live. */
+	if ((T->cstate != NULL) &&
+	    btree_cleaning_notify_append(T->cstate, WC->base, WC->blkno))
+		goto err0;
+
+	/*
+	 * Record how much we wrote, and unless another sync is writing pages
+	 * after ours, the next available block number.
+	 */
+	T->bytesappended += (WC->blkno - WC->base) * T->pagelen;
+	if (WC->next == NULL)
+		T->nextblk = WC->blkno;
+
+	/* Blocks older than the new tree's oldest leaf can now be freed. */
+	T->oldestdurable = WC->oldestleaf;
+
 	/*
 	 * We could issue a FREE call here, but since FREE is only advisory
 	 * we need to call it elsewhere as well in order to avoid having data
@@ -325,9 +757,38 @@ callback_unshadow(void * cookie)
 	 * calling FREE elsewhere anyway, don't bother calling it here.
 	 */
 
+	/*
+	 * The pages which held the old shadow tree are garbage.  Tell the
+	 * block store, since it can release their space long before a FREE
+	 * reaches them.
+	 */
+	if (freepages(T, WC->garbage))
+		goto err0;
+	pagelist_free(WC->garbage);
+
+	/* This sync is no longer in progress. */
+	T->syncs = WC->next;
+
 	/* Register post-sync callback to be performed. */
 	if (!events_immediate_register(WC->callback, WC->cookie, 0))
-		goto err1;
+		goto err0;
+
+	/*
+	 * Register callbacks which were waiting for this sync, after the
+	 * post-sync callback so that responses to requests which saw this
+	 * sync's changes follow the responses to the requests which made
+	 * them.
+	 */
+	for (i = 0; i < waiters_getsize(WC->waiters); i++) {
+		W = waiters_get(WC->waiters, i);
+		if (!events_immediate_register(W->callback, W->cookie, 0))
+			goto err0;
+	}
+	waiters_free(WC->waiters);
+
+	/* The next sync can publish its tree now if it is ready. */
+	if ((T->syncs != NULL) && publish(T->syncs))
+		goto err0;
 
 	/* Free cookie. */
 	free(WC);
@@ -335,9 +796,49 @@ callback_unshadow(void * cookie)
 	/* Success! */
 	return (0);
 
-err1:
-	free(WC);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * btree_durable(T):
+ * Return non-zero iff every change in the shadow tree of the B+Tree ${T} has
+ * been written to the block store.
+ */
+int
+btree_durable(struct btree * T)
+{
+
+	/* Only the oldest sync in progress can have been published. */
+	return ((T->syncs == NULL) || !T->syncs->published);
+}
 
+/**
+ * btree_whendurable(T, callback, cookie):
+ * Invoke ${callback}(${cookie}) once every change in the shadow tree of the
+ * B+Tree ${T} has been written to the block store.
+ */
+int
+btree_whendurable(struct btree * T, int (* callback)(void *), void * cookie)
+{
+	struct waiter W;
+
+	/* If the shadow tree has not been written yet, wait for it. */
+	if (!btree_durable(T)) {
+		W.callback = callback;
+		W.cookie = cookie;
+		if (waiters_append(T->syncs->waiters, &W, 1))
+			goto err0;
+	} else {
+		if (!events_immediate_register(callback, cookie, 0))
+			goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
 	/* Failure! */
 	return (-1);
 }
@@ -6,15 +6,18 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "events.h"
 #include "imalloc.h"
 #include "kvldskey.h"
+#include "monoclock.h"
 #include "mpool.h"
 #include "netbuf.h"
 #include "network.h"
+#include "pool.h"
 #include "proto_kvlds.h"
 #include "serialize.h"
 #include "warnp.h"
@@ -23,12 +26,44 @@
 #include "btree.h"
 #include "btree_cleaning.h"
 #include "node.h"
+#include "trace.h"
 
 #include "dispatch.h"
 
+/*
+ * Stop reading requests once any class of requests has this many times its
+ * page budget worth of requests queued.
+ */
+#define BACKLOG	4
+
 /* Maximum number of requests to have pending at once. */
 #define MAXREQS	4096
 
+/* Classes of non-modifying requests. */
+#define NMR_GET		0
+#define NMR_RANGE	1
+#define NMR_NCLASSES	2
+
+/* Relative weights of the classes, and how long (s) requests may wait. */
+static const struct nmrclass_params {
+	size_t weight;
+	double deadline;
+} nmrclass_params[NMR_NCLASSES] = {
+	[NMR_GET] = {.weight = 3, .deadline = 0.01},
+	[NMR_RANGE] = {.weight = 1, .deadline = 1.0}
+};
+
+/*
+ * Number of MR batch size histogram buckets: Bucket 0 counts empty batches,
+ * bucket i > 0 counts batches of [2^(i-1), 2^i) requests, and the final
+ * bucket also counts all larger batches.
+ */
+#define MR_NBUCKETS	12
+
+/* Maximum number of counters returned in response to a STATS request. */
+#define NSTATS	(5 + 2 * BTREE_STATS_LEVELS + 5 + 4 + MR_NBUCKETS + 1 + 2 + \
+    1 + 1 + 2 + TRACE_NSTAGES * (TRACE_NBUCKETS + 1) + TRACE_MAXMERGES + 1)
+
 /* Linked list of requests. */
 struct requestq {
 	/* The request. */
@@ -37,9 +72,30 @@ struct requestq {
 	/* Next request in the linked list. */
 	struct requestq * next;
 
-	/* Used for NMRs after dequeueing. */
+	/* Used for NMRs. */
 	struct dispatch_state * D;
 	size_t npages;
+	int class;
+	struct timeval t_queued;
+};
+
+/* Queue of non-modifying requests of a single class. */
+struct nmrclass {
+	struct requestq * head;		/* First request in the queue. */
+	struct requestq ** tail;	/* Pointer to final NULL. */
+	size_t qlen;			/* Number of queued requests. */
+	size_t qpages;			/* Pages touched by queued requests. */
+	size_t ip;			/* Pages touched by ongoing requests. */
+	size_t share;			/* Share of nmr_concurrency. */
+	double vtime;			/* Pages launched / weight. */
+};
+
+/* A batch of modifying requests which is in progress. */
+struct mrbatch {
+	struct dispatch_state * D;	/* Dispatcher. */
+	size_t nreqs;			/* # requests in batch. */
+	struct timeval t_start;		/* Time batch was launched. */
+	int writing;			/* Pages are being written. */
 };
 
 /* Request dispatcher state. */
@@ -51,6 +107,7 @@ struct dispatch_state {
 	struct netbuf_write * writeq;	/* Packet write queue. */
 	void * read_cookie;		/* Request read cookie. */
 	size_t nrequests;		/* Number of responses we owe. */
+	size_t maxrequests;		/* Most responses ever owed at once. */
 
 	/* Operational parameters. */
 	struct btree * T;		/* The B+Tree we're working on. */
@@ -58,25 +115,38 @@ struct dispatch_state {
 	size_t vmax;			/* Maximum permitted value length. */
 
 	/* Non-modifying requests. */
-	struct requestq * nmr_head;	/* First request in the queue. */
-	struct requestq ** nmr_tail;	/* Pointer to final NULL. */
+	struct nmrclass nmr[NMR_NCLASSES];	/* Queues of NMRs. */
+	size_t nmr_qlen;		/* Number of queued NMRs. */
 	size_t nmr_ip;			/* Pages touched by ongoing NMRs. */
 	size_t nmr_concurrency;		/* Max # pages touched by NMRs. */
 
 	/* Modifying requests. */
 	struct requestq * mr_head;	/* First request in the queue. */
 	struct requestq ** mr_tail;	/* Pointer to final NULL. */
-	size_t mr_reqs;			/* # requests in current batch. */
+	struct mrbatch * mr_last;	/* Most recent batch in progress. */
 	size_t mr_concurrency;		/* Max # pages touched by MRs. */
 
 	/* Stop-queuing-MRs-yet-and-start-processing-them controls. */
-	int mr_inprogress;		/* Nonzero if MRs are in progress. */
+	size_t mr_inprogress;		/* # batches in progress. */
+	int mr_pipeline;		/* Overlap consecutive batches. */
 	size_t mr_qlen;			/* Number of queued MRs. */
 	void * mr_timer;		/* Cookie from events_timer. */
 	int mr_timer_expired;		/* Timer has expired. */
 	struct timeval mr_timeout;	/* Maximum time for MR to wait. */
 	size_t mr_min_batch;		/* Minimum MR batch w/o timeout. */
 
+	/* Adaptive tuning of mr_timeout and mr_min_batch. */
+	int mr_adaptive;		/* Nonzero if tuning is enabled. */
+	double mr_target;		/* Target commit latency, or 0. */
+	double mr_synctime;		/* Average time to commit a batch. */
+	double mr_rate;			/* Average MR arrival rate. */
+	size_t mr_arrivals;		/* MRs arrived since mr_ratetime. */
+	struct timeval mr_ratetime;	/* Start of arrival count. */
+
+	/* Statistics. */
+	uint64_t mr_batches[MR_NBUCKETS];	/* MR batch size histogram. */
+	uint64_t mr_overlapped;		/* Batches launched during a write. */
+
 	/* Cleaning-flush timer. */
 	void * mrc_timer;		/* Cookie from events_timer. */
 	int docleans;			/* Cleaning needs a batch of MRs. */
@@ -86,24 +156,117 @@ MPOOL(requestq, struct requestq, 4096);
 
 static int callback_accept(void *, int);
 static int dropconnection(void *);
+static size_t mr_maxqlen(struct dispatch_state *);
+static int backlogged(struct dispatch_state *);
+static void setconcurrency(struct dispatch_state *);
+static int nmr_enqueue(struct dispatch_state *, struct requestq *);
 static int poke_nmr(struct dispatch_state *);
 static int callback_nmr_done(void *);
 static int poke_mr(struct dispatch_state *);
 static int callback_mr_timer(void *);
 static int callback_mrc_timer(void *);
+static int callback_mr_writing(void *);
 static int callback_mr_done(void *);
 static int gotrequest(void *, int);
 static int readreqs(struct dispatch_state *);
+static int sendstats(struct dispatch_state *, uint64_t);
+
+/* Weight given to each new sample when tuning group commits. */
+#define TUNE_ALPHA	0.1
+
+/* Bounds on tuned group commit parameters; as for -w and -g. */
+#define TUNE_MAXWAIT	1.0
+#define TUNE_MAXBATCH	1024
 
 /* Time between ticks of the 'flush cleans if we have had no MRs' clock. */
 static const struct timeval fivesec = {.tv_sec = 5, .tv_usec = 0};
 
+/* Set the maximum time an MR can wait before being committed. */
+static void
+settimeout(struct dispatch_state * D, double w)
+{
+
+	D->mr_timeout.tv_sec = (time_t)w;
+	D->mr_timeout.tv_usec = (suseconds_t)((w - (double)D->mr_timeout.tv_sec)
+	    * 1000000);
+}
+
+/*
+ * A batch of MRs took ${t} seconds from launch until responses were sent.
+ * Update the commit delay and forced commit size based on the time taken
+ * to commit batches and the rate at which MRs are arriving.
+ */
+static int
+tune(struct dispatch_state * D, double t)
+{
+	struct timeval tnow;
+	double elapsed;
+	double w, g;
+
+	/* Update the average time taken to commit a batch. */
+	if (D->mr_synctime < 0.0)
+		D->mr_synctime = t;
+	else
+		D->mr_synctime += (t - D->mr_synctime) * TUNE_ALPHA;
+
+	/* Update the average arrival rate. */
+	if (monoclock_get(&tnow)) {
+		warnp("monoclock_get");
+		goto err0;
+	}
+	elapsed = timeval_diff(D->mr_ratetime, tnow);
+	if (elapsed > 0.0) {
+		D->mr_rate += ((double)D->mr_arrivals / elapsed - D->mr_rate) *
+		    TUNE_ALPHA;
+		D->mr_arrivals = 0;
+		D->mr_ratetime = tnow;
+	}
+
+	/*
+	 * A request waits for up to the commit delay and then for its batch
+	 * to be committed.  If we have a target latency, wait for as much of
+	 * it as is left after committing; otherwise, aim for throughput by
+	 * waiting as long as a commit takes, since that is how long it would
+	 * take to commit a batch we launched right now.
+	 */
+	if (D->mr_target > 0.0)
+		w = D->mr_target - D->mr_synctime;
+	else
+		w = D->mr_synctime;
+	if (w < 0.0)
+		w = 0.0;
+	if (w > TUNE_MAXWAIT)
+		w = TUNE_MAXWAIT;
+
+	/*
+	 * Don't wait for more requests than we would expect to arrive during
+	 * that time; if a burst brings them sooner, commit immediately.
+	 */
+	g = D->mr_rate * w;
+	if (g < 1.0)
+		g = 1.0;
+	if (g > TUNE_MAXBATCH)
+		g = TUNE_MAXBATCH;
+
+	/* Use the new values. */
+	settimeout(D, w);
+	D->mr_min_batch = (size_t)g;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /* The connection is dying.  Help speed up the process. */
 static int
 dropconnection(void * cookie)
 {
 	struct dispatch_state * D = cookie;
 	struct requestq * RQ;
+	size_t i;
 
 	/* This connection is dying. */
 	D->dying = 1;
@@ -115,16 +278,21 @@ dropconnection(void * cookie)
 	}
 
 	/* Free queued requests. */
-	while ((RQ = D->nmr_head) != NULL) {
-		/* Remove from the queue. */
-		D->nmr_head = RQ->next;
-
-		/* Free the request and linked list node. */
-		proto_kvlds_request_free(RQ->R);
-		mpool_requestq_free(RQ);
+	for (i = 0; i < NMR_NCLASSES; i++) {
+		while ((RQ = D->nmr[i].head) != NULL) {
+			/* Remove from the queue. */
+			D->nmr[i].head = RQ->next;
+			D->nmr[i].qlen -= 1;
+			D->nmr[i].qpages -= RQ->npages;
+			D->nmr_qlen -= 1;
+
+			/* Free the request and linked list node. */
+			proto_kvlds_request_free(RQ->R);
+			mpool_requestq_free(RQ);
 
-		/* That's one request we won't be responding to. */
-		D->nrequests -= 1;
+			/* That's one request we won't be responding to. */
+			D->nrequests -= 1;
+		}
 	}
 	while ((RQ = D->mr_head) != NULL) {
 		/* Remove from the queue. */
@@ -139,6 +307,9 @@ dropconnection(void * cookie)
 		D->nrequests -= 1;
 	}
 
+	/* The cleaner doesn't need to wait for these NMRs any more. */
+	btree_cleaning_notify_nmrq(D->T->cstate, D->nmr_qlen);
+
 	/* Cancel any stop-queuing timer; we've freed the queue anyway. */
 	if (D->mr_timer != NULL) {
 		events_timer_cancel(D->mr_timer);
@@ -152,36 +323,102 @@ dropconnection(void * cookie)
 	return (0);
 }
 
+/*
+ * Can the request at the head of the NMR queue ${C} be launched?  A request
+ * can always be launched if no NMRs are in progress; otherwise it must fit
+ * within the overall NMR page budget, and within its class' share of that
+ * budget unless no other requests of its class are in progress or no
+ * requests of other classes are waiting.
+ */
+static int
+nmr_canlaunch(struct dispatch_state * D, struct nmrclass * C)
+{
+	size_t npages = C->head->npages;
+	size_t i;
+
+	/* If nothing is in progress, go ahead. */
+	if (D->nmr_ip == 0)
+		return (1);
+
+	/* We can't exceed the overall budget. */
+	if (D->nmr_ip + npages > D->nmr_concurrency)
+		return (0);
+
+	/* If we're within our share, go ahead. */
+	if ((C->ip == 0) || (C->ip + npages <= C->share))
+		return (1);
+
+	/* We can borrow from other classes if they have nothing waiting. */
+	for (i = 0; i < NMR_NCLASSES; i++) {
+		if ((&D->nmr[i] != C) && (D->nmr[i].head != NULL))
+			return (0);
+	}
+	return (1);
+}
+
 /* Launch non-modifying requests, if possible. */
 static int
 poke_nmr(struct dispatch_state * D)
 {
+	struct nmrclass * C;
 	struct requestq * RQ;
+	struct timeval tnow;
+	size_t i;
 
-	/* If we have any queued requests, try to launch them. */
-	while ((RQ = D->nmr_head) != NULL) {
-		/* How many pages would this request need to touch? */
-		if (RQ->R->type == PROTO_KVLDS_GET)
-			RQ->npages = (size_t)(D->T->root_shadow->height + 1);
-		else
-			RQ->npages = (size_t)D->T->root_shadow->height +
-			    D->T->pagelen / SERIALIZE_PERCHILD;
+	/* We need the current time to check deadlines. */
+	if (monoclock_get(&tnow)) {
+		warnp("monoclock_get");
+		goto err0;
+	}
+
+	/* Launch requests until we run out or can't launch any more. */
+	do {
+		/*
+		 * Pick a class to launch a request from.  A request which
+		 * has passed its deadline goes first; otherwise we share the
+		 * page budget between classes in proportion to their weights
+		 * by picking the class which has used the least so far.
+		 */
+		C = NULL;
+		for (i = 0; i < NMR_NCLASSES; i++) {
+			if ((D->nmr[i].head == NULL) ||
+			    !nmr_canlaunch(D, &D->nmr[i]))
+				continue;
+			if (timeval_diff(D->nmr[i].head->t_queued, tnow) >
+			    nmrclass_params[i].deadline) {
+				C = &D->nmr[i];
+				break;
+			}
+			if ((C == NULL) || (D->nmr[i].vtime < C->vtime))
+				C = &D->nmr[i];
+		}
 
-		/* Can we handle this request? */
-		if ((D->nmr_ip > 0) &&
-		    (D->nmr_ip + RQ->npages > D->nmr_concurrency))
+		/* Nothing to launch? */
+		if (C == NULL)
 			break;
 
-		/* Dequeue this request. */
-		D->nmr_head = RQ->next;
+		/* Dequeue the request. */
+		RQ = C->head;
+		C->head = RQ->next;
+		C->qlen -= 1;
+		C->qpages -= RQ->npages;
+		D->nmr_qlen -= 1;
+
+		/* Account for the pages this class is using. */
+		C->vtime += (double)RQ->npages /
+		    (double)nmrclass_params[RQ->class].weight;
+		C->ip += RQ->npages;
+		D->nmr_ip += RQ->npages;
 
 		/* Launch the request. */
 		RQ->D = D;
 		if (dispatch_nmr_launch(D->T, RQ->R, D->writeq,
 		    callback_nmr_done, RQ))
 			goto err0;
-		D->nmr_ip += RQ->npages;
-	}
+	} while (1);
+
+	/* Let the cleaner know how many requests are waiting. */
+	btree_cleaning_notify_nmrq(D->T->cstate, D->nmr_qlen);
 
 	/* Success! */
 	return (0);
@@ -199,6 +436,7 @@ callback_nmr_done(void * cookie)
 	struct dispatch_state * D = RQ->D;
 
 	/* This NMR is no longer in progress. */
+	D->nmr[RQ->class].ip -= RQ->npages;
 	D->nmr_ip -= RQ->npages;
 
 	/* Free request cookie. */
@@ -231,28 +469,55 @@ poke_mr(struct dispatch_state * D)
 	size_t pagesperop = (size_t)(D->T->root_dirty->height + 1);
 	struct proto_kvlds_request ** reqs;
 	struct requestq * RQ;
+	struct mrbatch * MB;
+	size_t nreqs;
 	size_t i;
+	int canlaunch;
 
-	/* Sanity check. */
-	assert(D->mr_qlen <= MAXREQS);
+	/*
+	 * We can launch a batch if no batches are in progress; or, if we're
+	 * pipelining commits, if the one batch in progress is writing pages.
+	 */
+	if (D->mr_inprogress == 0)
+		canlaunch = 1;
+	else if (D->mr_pipeline && (D->mr_inprogress == 1) &&
+	    (D->mr_last != NULL) && D->mr_last->writing)
+		canlaunch = 1;
+	else
+		canlaunch = 0;
 
-	/* Launch a batch of requests if possible. */
-	if ((D->mr_inprogress == 0) &&
+	/*
+	 * Launch a batch of requests if possible.  If we have stopped reading
+	 * because the queue is full, don't wait for the timer.
+	 */
+	if (canlaunch &&
 	    ((D->mr_timer_expired != 0) ||
 	     (D->docleans != 0) ||
-	     (D->mr_qlen >= D->mr_min_batch))) {
+	     (D->mr_qlen >= D->mr_min_batch) ||
+	     (D->mr_qlen >= mr_maxqlen(D)))) {
 		/* Figure out how many requests will be in this batch. */
 		if (D->mr_qlen * pagesperop > concurrency)
-			D->mr_reqs = concurrency / pagesperop;
+			nreqs = concurrency / pagesperop;
 		else
-			D->mr_reqs = D->mr_qlen;
+			nreqs = D->mr_qlen;
 
-		/* Allocate an array. */
-		if (IMALLOC(reqs, D->mr_reqs, struct proto_kvlds_request *))
+		/* Bake a cookie. */
+		if ((MB = malloc(sizeof(struct mrbatch))) == NULL)
 			goto err0;
+		MB->D = D;
+		MB->nreqs = nreqs;
+		MB->writing = 0;
+		if (monoclock_get(&MB->t_start)) {
+			warnp("monoclock_get");
+			goto err1;
+		}
+
+		/* Allocate an array. */
+		if (IMALLOC(reqs, nreqs, struct proto_kvlds_request *))
+			goto err1;
 
 		/* Fill the array with requests. */
-		for (i = 0; i < D->mr_reqs; i++) {
+		for (i = 0; i < nreqs; i++) {
 			/* We should have a request. */
 			assert(D->mr_head != NULL);
 
@@ -268,13 +533,24 @@ poke_mr(struct dispatch_state * D)
 			mpool_requestq_free(RQ);
 		}
 
-		/* Modifying requests are now in progress. */
-		D->mr_inprogress = 1;
-
 		/* Launch the batch of modifying requests. */
-		if (dispatch_mr_launch(D->T, reqs, D->mr_reqs, D->writeq,
-		    callback_mr_done, D))
-			goto err1;
+		if (dispatch_mr_launch(D->T, reqs, nreqs, D->writeq,
+		    D->mr_pipeline ? callback_mr_writing : NULL,
+		    callback_mr_done, MB))
+			goto err2;
+
+		/* Record the size of this batch. */
+		for (i = 0; (i < MR_NBUCKETS - 1) && (nreqs >> i); i++)
+			continue;
+		D->mr_batches[i] += 1;
+
+		/* Count batches launched while another is being written. */
+		if (D->mr_inprogress > 0)
+			D->mr_overlapped += 1;
+
+		/* Modifying requests are now in progress. */
+		D->mr_inprogress += 1;
+		D->mr_last = MB;
 
 		/* We beat the clock.  Disable it. */
 		if (D->mr_timer != NULL) {
@@ -315,11 +591,13 @@ poke_mr(struct dispatch_state * D)
 	/* Success! */
 	return (0);
 
-err1:
+err2:
 	/* These requests can never be done, but at least we can free them. */
-	for (i = 0; i < D->mr_reqs; i++)
+	for (i = 0; i < nreqs; i++)
 		proto_kvlds_request_free(reqs[i]);
 	free(reqs);
+err1:
+	free(MB);
 err0:
 	/* Failure! */
 	return (-1);
@@ -366,22 +644,58 @@ callback_mrc_timer(void * cookie)
 	return (poke_mr(D));
 }
 
+/* A batch of MRs is writing pages; the next batch can be launched. */
+static int
+callback_mr_writing(void * cookie)
+{
+	struct mrbatch * MB = cookie;
+
+	/* This batch is writing pages. */
+	MB->writing = 1;
+
+	/* Maybe we can launch some more MRs? */
+	return (poke_mr(MB->D));
+}
+
 /* A batch of MRs has been completed. */
 static int
 callback_mr_done(void * cookie)
 {
-	struct dispatch_state * D = cookie;
+	struct mrbatch * MB = cookie;
+	struct dispatch_state * D = MB->D;
+	struct timeval t_end;
 
 #ifdef SANITY_CHECKS
-	/* Sanity check the B+Tree. */
-	btree_sanity(D->T);
+	/* Sanity check the B+Tree, unless another batch is modifying it. */
+	if (D->mr_inprogress == 1)
+		btree_sanity(D->T);
 #endif
 
 	/* We've handled a bunch of requests. */
-	D->nrequests -= D->mr_reqs;
+	D->nrequests -= MB->nreqs;
 
-	/* No MRs are in progress any more. */
-	D->mr_inprogress = 0;
+	/* This batch is no longer in progress. */
+	D->mr_inprogress -= 1;
+	if (D->mr_last == MB)
+		D->mr_last = NULL;
+
+	/* Tell the cleaner how long the batch took. */
+	if (monoclock_get(&t_end)) {
+		warnp("monoclock_get");
+		goto err1;
+	}
+	btree_cleaning_notify_mrlat(D->T->cstate,
+	    timeval_diff(MB->t_start, t_end));
+
+	/* Tune group commit parameters if appropriate. */
+	if (D->mr_adaptive && tune(D, timeval_diff(MB->t_start, t_end)))
+		goto err1;
+
+	/* The tree has changed; recompute our page budgets. */
+	setconcurrency(D);
+
+	/* Free the batch cookie. */
+	free(MB);
 
 	/* Check if we need to read more requests. */
 	if (readreqs(D))
@@ -390,6 +704,111 @@ callback_mr_done(void * cookie)
 	/* Maybe we can launch some more MRs? */
 	return (poke_mr(D));
 
+err1:
+	free(MB);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Return the number of queued modifying requests at which we should stop
+ * reading requests: BACKLOG times the MR page budget, but never less than
+ * one request.
+ */
+static size_t
+mr_maxqlen(struct dispatch_state * D)
+{
+	size_t pagesperop = (size_t)(D->T->root_dirty->height + 1);
+	size_t maxqlen = D->mr_concurrency * BACKLOG / pagesperop;
+
+	return ((maxqlen > 0) ? maxqlen : 1);
+}
+
+/*
+ * Return non-zero if any class of requests has too much work queued, or if
+ * we owe too many responses in total; if so, we should stop reading requests
+ * until some of them have been handled.
+ */
+static int
+backlogged(struct dispatch_state * D)
+{
+	size_t i;
+
+	/* Do we have too many requests in progress? */
+	if (D->nrequests >= MAXREQS)
+		return (1);
+
+	/* Are non-modifying requests backed up? */
+	for (i = 0; i < NMR_NCLASSES; i++) {
+		if (D->nmr[i].qpages >= D->nmr[i].share * BACKLOG)
+			return (1);
+	}
+
+	/*
+	 * Are modifying requests backed up?  This doesn't depend on the
+	 * group commit parameters; poke_mr launches a batch without waiting
+	 * once the queue is this long.
+	 */
+	if (D->mr_qlen >= mr_maxqlen(D))
+		return (1);
+
+	/* Nothing is backed up. */
+	return (0);
+}
+
+/* Add the non-modifying request ${RQ} to the appropriate queue. */
+static int
+nmr_enqueue(struct dispatch_state * D, struct requestq * RQ)
+{
+	struct nmrclass * C;
+	size_t i;
+
+	/* Which class is this, and how many pages might it touch? */
+	if (RQ->R->type == PROTO_KVLDS_GET) {
+		RQ->class = NMR_GET;
+		RQ->npages = (size_t)(D->T->root_shadow->height + 1);
+	} else {
+		RQ->class = NMR_RANGE;
+		RQ->npages = (size_t)D->T->root_shadow->height +
+		    D->T->pagelen / SERIALIZE_PERCHILD;
+	}
+	C = &D->nmr[RQ->class];
+
+	/* Record when the request was queued. */
+	if (monoclock_get(&RQ->t_queued)) {
+		warnp("monoclock_get");
+		goto err0;
+	}
+
+	/*
+	 * If this class was idle, don't let it claim credit for the time it
+	 * spent idle: Bring it up to the least-served class with requests
+	 * waiting.
+	 */
+	if (C->head == NULL) {
+		for (i = 0; i < NMR_NCLASSES; i++) {
+			if ((D->nmr[i].head != NULL) &&
+			    (D->nmr[i].vtime > C->vtime))
+				C->vtime = D->nmr[i].vtime;
+		}
+	}
+
+	/* Add to the queue. */
+	if (C->head == NULL)
+		C->head = RQ;
+	else
+		*(C->tail) = RQ;
+	C->tail = &RQ->next;
+
+	/* The queue has gained an element. */
+	C->qlen += 1;
+	C->qpages += RQ->npages;
+	D->nmr_qlen += 1;
+
+	/* Success! */
+	return (0);
+
 err0:
 	/* Failure! */
 	return (-1);
@@ -412,8 +831,8 @@ readreqs(struct dispatch_state * D)
 	if (D->read_cookie != NULL)
 		goto done;
 
-	/* If we have MAXREQS requests in progress, do nothing. */
-	if (D->nrequests == MAXREQS)
+	/* If we have too many requests queued, do nothing. */
+	if (backlogged(D))
 		goto done;
 
 	/* Wait for a request to arrive. */
@@ -432,6 +851,111 @@ err0:
 	return (-1);
 }
 
+/* Send a STATS response with ID ${ID}. */
+static int
+sendstats(struct dispatch_state * D, uint64_t ID)
+{
+	struct btree * T = D->T;
+	char namebuf[NSTATS][64];
+	const char * names[NSTATS];
+	uint64_t values[NSTATS];
+	size_t n = 0;
+	size_t nrec, nbytes;
+	double cleandebt;
+	uint64_t ncleaned;
+	uint64_t nclustered;
+	int deferring;
+	char base[40];
+	size_t i, j;
+
+/* Add a counter, optionally with a numeric suffix. */
+#define STAT(name, suffix, value) do {					\
+	assert(n < NSTATS);						\
+	if ((suffix) == (size_t)(-1))					\
+		snprintf(namebuf[n], sizeof(namebuf[n]), "%s", name);	\
+	else								\
+		snprintf(namebuf[n], sizeof(namebuf[n]), "%s.%zu",	\
+		    name, (size_t)(suffix));				\
+	names[n] = namebuf[n];						\
+	values[n] = (uint64_t)(value);					\
+	n++;								\
+} while (0)
+
+	/* Page pool. */
+	pool_usage(T->P, &nrec, &nbytes);
+	STAT("pool.size", (size_t)(-1), btree_poolsz(T));
+	STAT("pool.budget", (size_t)(-1),
+	    (T->poolbytes != SIZE_MAX) ? T->poolbytes : 0);
+	STAT("pool.used", (size_t)(-1), nrec);
+	STAT("pool.bytes", (size_t)(-1), nbytes);
+	STAT("pool.peak", (size_t)(-1), pool_peakbytes(T->P));
+
+	/* Page cache hits and misses, by tree level. */
+	for (i = 0; i < BTREE_STATS_LEVELS; i++) {
+		STAT("cache.hits", i, T->hits[i]);
+		STAT("cache.misses", i, T->misses[i]);
+	}
+
+	/* Tree shape. */
+	STAT("tree.height", (size_t)(-1), T->root_dirty->height);
+	STAT("tree.nnodes", (size_t)(-1), T->nnodes);
+	STAT("tree.npages", (size_t)(-1), T->npages);
+	STAT("tree.leafruns", (size_t)(-1), T->leafruns);
+	STAT("tree.leafruns.contiguous", (size_t)(-1), T->leafruns_contiguous);
+
+	/* Cleaner. */
+	btree_cleaning_stats(T->cstate, &cleandebt, &ncleaned, &nclustered,
+	    &deferring);
+	STAT("cleaner.debt", (size_t)(-1), (cleandebt > 0.0) ? cleandebt : 0);
+	STAT("cleaner.cleaned", (size_t)(-1), ncleaned);
+	STAT("cleaner.clustered", (size_t)(-1), nclustered);
+	STAT("cleaner.deferring", (size_t)(-1), deferring);
+
+	/* Modifying request batch sizes, labelled by minimum size. */
+	STAT("mr.batches", 0, D->mr_batches[0]);
+	for (i = 1; i < MR_NBUCKETS; i++)
+		STAT("mr.batches", (size_t)1 << (i - 1), D->mr_batches[i]);
+	STAT("mr.overlapped", (size_t)(-1), D->mr_overlapped);
+
+	/* Current group commit delay (in us) and forced commit size. */
+	STAT("mr.timeout", (size_t)(-1),
+	    (uint64_t)D->mr_timeout.tv_sec * 1000000 +
+	    (uint64_t)D->mr_timeout.tv_usec);
+	STAT("mr.min_batch", (size_t)(-1), D->mr_min_batch);
+
+	/* Non-modifying requests waiting to be launched. */
+	STAT("nmr.queued", (size_t)(-1), D->nmr_qlen);
+
+	/* Most requests ever pending at once on this connection. */
+	STAT("requests.maxpending", (size_t)(-1), D->maxrequests);
+
+	/* Block store traffic. */
+	STAT("lbs.bytesread", (size_t)(-1), T->bytesread);
+	STAT("lbs.bytesappended", (size_t)(-1), T->bytesappended);
+
+	/* Commit pipeline stage durations, labelled by minimum us. */
+	if (T->trace != NULL) {
+		for (i = 0; i < TRACE_NSTAGES; i++) {
+			snprintf(base, sizeof(base), "trace.%s",
+			    trace_stagename((int)i));
+			STAT(base, 0, T->trace->hist[i][0]);
+			for (j = 1; j < TRACE_NBUCKETS; j++)
+				STAT(base, (size_t)1 << (j - 1),
+				    T->trace->hist[i][j]);
+			snprintf(base, sizeof(base), "trace.%s.total",
+			    trace_stagename((int)i));
+			STAT(base, (size_t)(-1), T->trace->total[i]);
+		}
+		for (i = 0; i <= TRACE_MAXMERGES; i++)
+			STAT("trace.merges", i, T->trace->merges[i]);
+	}
+
+#undef STAT
+
+	/* Send the response. */
+	return (proto_kvlds_response_stats(D->writeq, ID, n, names, values));
+}
+
 /* Read and dispatch incoming request(s). */
 static int
 gotrequest(void * cookie, int status)
@@ -448,16 +972,16 @@ gotrequest(void * cookie, int status)
 		goto drop;
 
 	/*
-	 * Read packets until there are no more to read, we hit MAXREQS, or
-	 * an error occurs.
+	 * Read packets until there are no more to read, we have too many
+	 * requests queued, or an error occurs.
 	 */
 	do {
 		/* Allocate space for a request. */
 		if ((R = proto_kvlds_request_alloc()) == NULL)
 			goto err0;
 
-		/* If we have MAXREQS requests, stop looping. */
-		if (D->nrequests == MAXREQS)
+		/* If we have too many requests queued, stop looping. */
+		if (backlogged(D))
 			break;
 
 		/* Attempt to read a request. */
@@ -470,6 +994,8 @@ gotrequest(void * cookie, int status)
 
 		/* We owe a response to the client. */
 		D->nrequests += 1;
+		if (D->nrequests > D->maxrequests)
+			D->maxrequests = D->nrequests;
 
 		/* Construct a linked list node. */
 		if ((RQ = mpool_requestq_malloc()) == NULL)
@@ -491,6 +1017,20 @@ gotrequest(void * cookie, int status)
 			/* Free the request packet. */
 			proto_kvlds_request_free(R);
 
+			/* This request has been handled. */
+			D->nrequests -= 1;
+			break;
+		case PROTO_KVLDS_STATS:
+			/* Send the response immediately. */
+			if (sendstats(D, RQ->R->ID))
+				goto err2;
+
+			/* Free the linked list node. */
+			mpool_requestq_free(RQ);
+
+			/* Free the request packet. */
+			proto_kvlds_request_free(R);
+
 			/* This request has been handled. */
 			D->nrequests -= 1;
 			break;
@@ -519,6 +1059,7 @@ gotrequest(void * cookie, int status)
 
 			/* The MR queue has gained an element. */
 			D->mr_qlen += 1;
+			D->mr_arrivals += 1;
 
 			/* Poke the queue. */
 			if (poke_mr(D))
@@ -527,11 +1068,8 @@ gotrequest(void * cookie, int status)
 		case PROTO_KVLDS_GET:
 		case PROTO_KVLDS_RANGE:
 			/* Add to non-modifying request queue. */
-			if (D->nmr_head == NULL)
-				D->nmr_head = RQ;
-			else
-				*(D->nmr_tail) = RQ;
-			D->nmr_tail = &RQ->next;
+			if (nmr_enqueue(D, RQ))
+				goto err0;
 
 			/* Poke the queue. */
 			if (poke_nmr(D))
@@ -577,19 +1115,80 @@ err0:
 	return (-1);
 }
 
+/*
+ * Set the maximum numbers of pages which non-modifying and modifying
+ * requests may touch at once, based on how many pages fit into the page
+ * pool; since the pool may have a size in bytes, this can change as the
+ * tree does.
+ */
+static void
+setconcurrency(struct dispatch_state * D)
+{
+	size_t poolsz = btree_poolsz(D->T);
+	size_t wsum;
+	size_t i;
+
+	/* Non-modifying requests can use 1/4 of the pool. */
+	D->nmr_concurrency = poolsz / 4;
+
+	/* Divide the NMR page budget according to class weights. */
+	for (wsum = i = 0; i < NMR_NCLASSES; i++)
+		wsum += nmrclass_params[i].weight;
+	for (i = 0; i < NMR_NCLASSES; i++) {
+		D->nmr[i].share = D->nmr_concurrency *
+		    nmrclass_params[i].weight / wsum;
+		if (D->nmr[i].share == 0)
+			D->nmr[i].share = 1;
+	}
+
+	/* Modifying requests can use another 1/4 of the pool. */
+	D->mr_concurrency = poolsz / 4;
+
+	/*
+	 * If we're pipelining group commits, two batches can have pages
+	 * locked at once (one modifying the tree and one waiting for its
+	 * pages to be written), so split the budget between them.
+	 */
+	if (D->mr_pipeline)
+		D->mr_concurrency /= 2;
+
+	/**
+	 * Adjust maximum # of pages touched by MRs (if necessary).  In
+	 * addition to the limit of poolsz / 4 (as calculated above), we
+	 * have 2 more limits which arise from the wire and lbs protocols.
+	 * - The record of a wire packet must fit into 4 bytes.  The
+	 *   packet length is defined as:
+	 *       len = 16 + nblks * blklen
+	 *   and we must have:
+	 *       len <= UINT32_MAX
+	 * - The length of the wire packet (including header and trailer) must
+	 *   fit into size_t.  Using the same definition of len, we must have:
+	 *       len <= SIZE_MAX - 20
+	 */
+	if (D->mr_concurrency > ((UINT32_MAX - 16) / D->T->pagelen))
+		D->mr_concurrency = (UINT32_MAX - 16) / D->T->pagelen;
+	if (D->mr_concurrency > ((SIZE_MAX - 16 - 20) / D->T->pagelen))
+		D->mr_concurrency = (SIZE_MAX - 16 - 20) / D->T->pagelen;
+}
+
 /**
- * dispatch_accept(s, T, kmax, vmax, w, g):
+ * dispatch_accept(s, T, kmax, vmax, w, g, W, pipeline):
  * Accept a connection from the listening socket ${s} and return a dispatch
  * state for the B+Tree ${T}.  Keys will be at most ${kmax} bytes; values
  * will be at most ${vmax} bytes; up to ${w} seconds should be spent waiting
  * for more requests before performing a group commit, unless ${g} requests
- * are pending.
+ * are pending.  If ${W} is non-negative, ${w} and ${g} are initial values
+ * which should be adjusted based on the request arrival rate and the time
+ * taken to commit, aiming for a commit latency of ${W} seconds (if positive)
+ * or maximum throughput (if zero).  If ${pipeline} is non-zero, start
+ * processing each group commit while the previous one is being written.
  */
 struct dispatch_state *
 dispatch_accept(int s, struct btree * T,
-    size_t kmax, size_t vmax, double w, size_t g)
+    size_t kmax, size_t vmax, double w, size_t g, double W, int pipeline)
 {
 	struct dispatch_state * D;
+	size_t i;
 
 	/* Allocate space for dispatcher state. */
 	if ((D = malloc(sizeof(struct dispatch_state))) == NULL)
@@ -603,38 +1202,40 @@ dispatch_accept(int s, struct btree * T,
 	D->kmax = kmax;
 	D->vmax = vmax;
 	D->nrequests = 0;
-	D->nmr_head = NULL;
+	D->maxrequests = 0;
+	D->nmr_qlen = 0;
 	D->nmr_ip = 0;
-	D->nmr_concurrency = T->poolsz / 4;
+	for (i = 0; i < NMR_NCLASSES; i++) {
+		D->nmr[i].head = NULL;
+		D->nmr[i].qlen = 0;
+		D->nmr[i].qpages = 0;
+		D->nmr[i].ip = 0;
+		D->nmr[i].vtime = 0.0;
+	}
 	D->mr_head = NULL;
-	D->mr_reqs = 0;
-	D->mr_concurrency = T->poolsz / 4;
+	D->mr_last = NULL;
 	D->mr_inprogress = 0;
 	D->mr_qlen = 0;
 	D->mr_timer = NULL;
 	D->mr_timer_expired = 0;
-	D->mr_timeout.tv_sec = (time_t)w;
-	D->mr_timeout.tv_usec = (suseconds_t)((w - (double)D->mr_timeout.tv_sec)
-	    * 1000000);
+	settimeout(D, w);
 	D->mr_min_batch = g;
+	D->mr_adaptive = (W >= 0.0);
+	D->mr_target = W;
+	D->mr_synctime = -1.0;
+	D->mr_rate = 0.0;
+	D->mr_arrivals = 0;
+	for (i = 0; i < MR_NBUCKETS; i++)
+		D->mr_batches[i] = 0;
+	D->mr_overlapped = 0;
+	if (monoclock_get(&D->mr_ratetime)) {
+		warnp("monoclock_get");
+		goto err1;
+	}
+	D->mr_pipeline = pipeline;
 
-	/**
-	 * Adjust maximum # of pages touched by MRs (if necessary).  In
-	 * addition to the limit of T->poolsz / 4 (as calculated above), we
-	 * have 2 more limits which arise from the wire and lbs protocols.
-	 * - The record of a wire packet must fit into 4 bytes.  The
-	 *   packet length is defined as:
-	 *       len = 16 + nblks * blklen
-	 *   and we must have:
-	 *       len <= UINT32_MAX
-	 * - The length of the wire packet (including header and trailer) must
-	 *   fit into size_t.  Using the same definition of len, we must have:
-	 *       len <= SIZE_MAX - 20
-	 */
-	if (D->mr_concurrency > ((UINT32_MAX - 16) / D->T->pagelen))
-		D->mr_concurrency = (UINT32_MAX - 16) / D->T->pagelen;
-	if (D->mr_concurrency > ((SIZE_MAX - 16 - 20) / D->T->pagelen))
-		D->mr_concurrency = (SIZE_MAX - 16 - 20) / D->T->pagelen;
+	/* Figure out how many pages requests may touch at once. */
+	setconcurrency(D);
 
 	/* Start the periodic cleaning timer. */
 	D->docleans = 0;
@@ -10,15 +10,19 @@ struct netbuf_write;
 struct proto_kvlds_request;
 
 /**
- * dispatch_accept(s, T, kmax, vmax, w, g):
+ * dispatch_accept(s, T, kmax, vmax, w, g, W, pipeline):
  * Accept a connection from the listening socket ${s} and return a dispatch
  * state for the B+Tree ${T}.  Keys will be at most ${kmax} bytes; values
  * will be at most ${vmax} bytes; up to ${w} seconds should be spent waiting
  * for more requests before performing a group commit, unless ${g} requests
- * are pending.
+ * are pending.  If ${W} is non-negative, ${w} and ${g} are initial values
+ * which should be adjusted based on the request arrival rate and the time
+ * taken to commit, aiming for a commit latency of ${W} seconds (if positive)
+ * or maximum throughput (if zero).  If ${pipeline} is non-zero, start
+ * processing each group commit while the previous one is being written.
  */
 struct dispatch_state * dispatch_accept(int, struct btree *, size_t, size_t,
-    double, size_t);
+    double, size_t, double, int);
 
 /**
  * dispatch_alive(D):
@@ -45,13 +49,19 @@ int dispatch_nmr_launch(struct btree *, struct proto_kvlds_request *,
     struct netbuf_write *, int (*)(void *), void *);
 
 /**
- * dispatch_mr_launch(T, reqs, nreqs, WQ, callback_done, cookie):
+ * dispatch_mr_launch(T, reqs, nreqs, WQ, callback_writing, callback_done,
+ *     cookie):
  * Perform the ${nreqs} modifying requests ${reqs[0]} ... ${reqs[nreqs - 1]}
  * on the B+Tree ${T}; write response packets to the write queue ${WQ}; and
- * free the requests and request array.  Invoke the callback
- * ${callback_done}(${cookie}) after the requests have been serviced.
+ * free the requests and request array.  Invoke ${callback_done}(${cookie})
+ * after the requests have been serviced.  If ${callback_writing} is not
+ * NULL, the modified tree is published as soon as its pages are being
+ * written to the block store, and ${callback_writing}(${cookie}) is then
+ * invoked; another batch may be launched at that point, and will modify the
+ * tree while this batch's pages are being written.  Responses are only sent
+ * once the modified pages have been written.
  */
 int dispatch_mr_launch(struct btree *, struct proto_kvlds_request **, size_t,
-    struct netbuf_write *, int (*)(void *), void *);
+    struct netbuf_write *, int (*)(void *), int (*)(void *), void *);
 
 #endif /* !DISPATCH_H_ */
@@ -1,11 +1,14 @@
+#include <sys/time.h>
+
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "arena.h"
 #include "events.h"
-#include "imalloc.h"
 #include "kvldskey.h"
 #include "kvpair.h"
-#include "mpool.h"
 #include "netbuf.h"
 #include "proto_kvlds.h"
 
@@ -15,6 +18,7 @@
 #include "btree_mutate.h"
 #include "btree_node.h"
 #include "node.h"
+#include "trace.h"
 
 #include "dispatch.h"
 
@@ -28,15 +32,18 @@ struct req_cookie {
 
 /* State for a batch of modifying requests. */
 struct batch {
+	int (* callback_writing)(void *);
 	int (* callback_done)(void *);
 	void * cookie;
 	size_t nreqs;
 	struct btree * T;
 	struct netbuf_write * WQ;
+	struct arena * A;
 	struct req_cookie ** reqs;
 	size_t leavestofind;
 	struct node ** dirties;
 	size_t ndirty;
+	struct timeval t_trace;
 };
 
 /* Shadow/dirty node pointer pair. */
@@ -45,12 +52,12 @@ struct nodepair {
 	struct node * dirty;
 };
 
-MPOOL(reqcookie, struct req_cookie, 4096);
-
 static int callback_gotleaf(void *, struct node *);
 static int callback_gotleaves(void *);
 static int callback_balanced(void *);
+static int callback_published(void *);
 static int callback_synced(void *);
+static int callback_finished(void *);
 
 /* Compare the shadow node pointers. */
 static int
@@ -87,18 +94,28 @@ finddirty(struct nodepair * V, size_t N, struct node * shadow)
 }
 
 /**
- * dispatch_mr_launch(T, reqs, nreqs, WQ, callback_done, cookie):
+ * dispatch_mr_launch(T, reqs, nreqs, WQ, callback_writing, callback_done,
+ *     cookie):
  * Perform the ${nreqs} modifying requests ${reqs[0]} ... ${reqs[nreqs - 1]}
  * on the B+Tree ${T}; write response packets to the write queue ${WQ}; and
- * free the requests and request array.  Invoke the callback
- * ${callback_done}(${cookie}) after the requests have been serviced.
+ * free the requests and request array.  Invoke ${callback_done}(${cookie})
+ * after the requests have been serviced.  If ${callback_writing} is not
+ * NULL, the modified tree is published as soon as its pages are being
+ * written to the block store, and ${callback_writing}(${cookie}) is then
+ * invoked; another batch may be launched at that point, and will modify the
+ * tree while this batch's pages are being written.  Responses are only sent
+ * once the modified pages have been written.
  */
 int
 dispatch_mr_launch(struct btree * T, struct proto_kvlds_request ** reqs,
     size_t nreqs, struct netbuf_write * WQ,
-    int (* callback_done)(void *), void * cookie)
+    int (* callback_writing)(void *), int (* callback_done)(void *),
+    void * cookie)
 {
+	struct arena * A;
 	struct batch * B;
+	struct req_cookie * reqcookies;
+	size_t perreq;
 	size_t i;
 
 #ifdef SANITY_CHECKS
@@ -106,25 +123,46 @@ dispatch_mr_launch(struct btree * T, struct proto_kvlds_request ** reqs,
 	btree_sanity(T);
 #endif
 
-	/* Bake a cookie. */
-	if ((B = malloc(sizeof(struct batch))) == NULL)
+	/*
+	 * Everything we allocate for this batch lives until the batch is
+	 * finished, so carve it all out of a single arena.  Size the first
+	 * chunk to hold the batch, the request cookies, and the arrays which
+	 * batch_dirty will need, so that in the common case this is the only
+	 * large allocation we make.
+	 */
+	perreq = sizeof(struct req_cookie) + sizeof(struct req_cookie *) +
+	    sizeof(struct nodepair) + sizeof(struct node *);
+	if (nreqs > (SIZE_MAX - sizeof(struct batch)) / perreq) {
+		errno = ENOMEM;
+		goto err0;
+	}
+	if ((A = arena_init(sizeof(struct batch) + nreqs * perreq)) == NULL)
 		goto err0;
+
+	/* Bake a cookie. */
+	if (ARENA_MALLOC(A, B, 1, struct batch))
+		goto err1;
+	B->callback_writing = callback_writing;
 	B->callback_done = callback_done;
 	B->cookie = cookie;
 	B->nreqs = nreqs;
 	B->T = T;
 	B->WQ = WQ;
+	B->A = A;
+
+	/* Start timing the leaf-finding stage. */
+	if (trace_stage(T->trace, TRACE_NONE, &B->t_trace))
+		goto err1;
 
 	/* Allocate an array of request cookie pointers. */
-	if (IMALLOC(B->reqs, B->nreqs, struct req_cookie *))
+	if (ARENA_MALLOC(A, B->reqs, B->nreqs, struct req_cookie *))
 		goto err1;
 
 	/* Bake request cookies. */
-	for (i = 0; i < B->nreqs; i++)
-		B->reqs[i] = NULL;
+	if (ARENA_MALLOC(A, reqcookies, B->nreqs, struct req_cookie))
+		goto err1;
 	for (i = 0; i < B->nreqs; i++) {
-		if ((B->reqs[i] = mpool_reqcookie_malloc()) == NULL)
-			goto err2;
+		B->reqs[i] = &reqcookies[i];
 		B->reqs[i]->R = reqs[i];
 		B->reqs[i]->batch = B;
 		B->reqs[i]->opdone = 0;
@@ -133,7 +171,7 @@ dispatch_mr_launch(struct btree * T, struct proto_kvlds_request ** reqs,
 	/* If we don't need to find any leaves, schedule the next step. */
 	if ((B->leavestofind = B->nreqs) == 0) {
 		if (!events_immediate_register(callback_gotleaves, B, 1))
-			goto err2;
+			goto err1;
 	}
 
 	/* Look for the leaves. */
@@ -155,12 +193,8 @@ dispatch_mr_launch(struct btree * T, struct proto_kvlds_request ** reqs,
 	/* Success! */
 	return (0);
 
-err2:
-	for (i = 0; i < B->nreqs; i++)
-		mpool_reqcookie_free(B->reqs[i]);
-	free(B->reqs);
 err1:
-	free(B);
+	arena_free(A);
 err0:
 	/* Failure! */
 	return (-1);
@@ -205,7 +239,7 @@ batch_dirty(struct batch * B)
 	struct kvpair_const * kv;
 
 	/* Allocate array to hold (shadow node, dirty node) pairs. */
-	if (IMALLOC(shadowdirty, B->nreqs, struct nodepair))
+	if (ARENA_MALLOC(B->A, shadowdirty, B->nreqs, struct nodepair))
 		goto err0;
 	Nsd = 0;
 
@@ -258,7 +292,7 @@ batch_dirty(struct batch * B)
 		shadowdirty[Nsd].shadow = req->leaf;
 		if ((shadowdirty[Nsd].dirty =
 		    btree_node_dirty(B->T, req->leaf)) == NULL)
-			goto err1;
+			goto err0;
 		Nsd += 1;
 	}
 
@@ -277,8 +311,8 @@ batch_dirty(struct batch * B)
 
 	/* Create a list of dirty leaves for future reference. */
 	if ((B->ndirty = Nsd) > 0) {
-		if (IMALLOC(B->dirties, B->ndirty, struct node *))
-			goto err1;
+		if (ARENA_MALLOC(B->A, B->dirties, B->ndirty, struct node *))
+			goto err0;
 		for (i = 0; i < B->ndirty; i++)
 			B->dirties[i] = shadowdirty[i].dirty;
 	} else {
@@ -286,8 +320,9 @@ batch_dirty(struct batch * B)
 		B->dirties = NULL;
 	}
 
-	/* Free the shadow/dirty pairs. */
-	free(shadowdirty);
+	/* Dirty the rest of any runs of leaves we're mostly rewriting. */
+	if (btree_cleaning_cluster(B->T->cstate, B->dirties, B->ndirty))
+		goto err0;
 
 	/* Tell the cleaner to dirty nodes now if it wants. */
 	if (btree_cleaning_clean(B->T->cstate))
@@ -296,8 +331,6 @@ batch_dirty(struct batch * B)
 	/* Success! */
 	return (0);
 
-err1:
-	free(shadowdirty);
 err0:
 	/* Failure! */
 	return (-1);
@@ -417,10 +450,11 @@ batch_run(struct batch * B)
 	}
 
 	/* We're not going to mutate leaves any more. */
-	for (i = 0; i < B->ndirty; i++)
+	for (i = 0; i < B->ndirty; i++) {
 		if (btree_mutate_immutable(B->dirties[i]))
 			goto err0;
-	free(B->dirties);
+		btree_node_setsize(B->T, B->dirties[i]);
+	}
 
 	/* Success! */
 	return (0);
@@ -436,6 +470,10 @@ callback_gotleaves(void * cookie)
 {
 	struct batch * B = cookie;
 
+	/* We've found the leaves and can modify the tree. */
+	if (trace_stage(B->T->trace, TRACE_LEAVES, &B->t_trace))
+		goto err0;
+
 	/* Dirty the nodes we will need to modify. */
 	if (batch_dirty(B))
 		goto err0;
@@ -450,6 +488,8 @@ callback_gotleaves(void * cookie)
 	/* Perform the requested operations. */
 	if (batch_run(B))
 		goto err0;
+	if (trace_stage(B->T->trace, TRACE_MUTATE, &B->t_trace))
+		goto err0;
 
 	/* Next we need to rebalance the tree. */
 	if (btree_balance(B->T, callback_balanced, B))
@@ -459,8 +499,11 @@ callback_gotleaves(void * cookie)
 	return (0);
 
 dosync:
-	/* We're skipping balancing and syncing because nothing changed. */
-	if (!events_immediate_register(callback_synced, B, 0))
+	/*
+	 * We're skipping balancing and syncing because nothing changed; but
+	 * our responses reflect any changes which are still being written.
+	 */
+	if (btree_whendurable(B->T, callback_synced, B))
 		goto err0;
 
 	/* Success! */
@@ -477,11 +520,39 @@ callback_balanced(void * cookie)
 {
 	struct batch * B = cookie;
 
+	/* The tree has been rebalanced. */
+	if (trace_stage(B->T->trace, TRACE_BALANCE, &B->t_trace))
+		goto err0;
+
 	/* Fill in matching-prefix values. */
 	btree_mlen(B->T);
+	if (trace_stage(B->T->trace, TRACE_MLEN, &B->t_trace))
+		goto err0;
 
-	/* Sync modified nodes out to durable storage. */
-	return (btree_sync(B->T, callback_synced, B));
+	/*
+	 * Sync modified nodes out to durable storage; if we're pipelining,
+	 * the next batch can start once the modified tree is published.
+	 */
+	if (btree_sync(B->T, (B->callback_writing != NULL) ?
+	    callback_published : NULL, callback_synced, B))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* The modified tree has been published.  The next batch can start. */
+static int
+callback_published(void * cookie)
+{
+	struct batch * B = cookie;
+
+	/* Tell our caller that we're writing pages. */
+	return ((B->callback_writing)(B->cookie));
 }
 
 /* Dirty nodes have been flushed out.  Do callbacks and clean up. */
@@ -530,19 +601,13 @@ callback_synced(void * cookie)
 		}
 	}
 
-	/* Schedule completion callback. */
-	if (!events_immediate_register(B->callback_done, B->cookie, 0))
-		goto err0;
-
-	/* Clean up requests and request cookies. */
-	for (i = 0; i < B->nreqs; i++) {
+	/* Clean up requests. */
+	for (i = 0; i < B->nreqs; i++)
 		proto_kvlds_request_free(B->reqs[i]->R);
-		mpool_reqcookie_free(B->reqs[i]);
-	}
 
-	/* Free batch cookie. */
-	free(B->reqs);
-	free(B);
+	/* Schedule completion callback. */
+	if (!events_immediate_register(callback_finished, B, 0))
+		goto err0;
 
 	/* Success! */
 	return (0);
@@ -551,3 +616,20 @@ err0:
 	/* Failure! */
 	return (-1);
 }
+
+/* Invoke the completion callback and free the batch. */
+static int
+callback_finished(void * cookie)
+{
+	struct batch * B = cookie;
+	int rc;
+
+	/* Invoke the completion callback. */
+	rc = (B->callback_done)(B->cookie);
+
+	/* Free the batch cookie, request cookies, and arrays. */
+	arena_free(B->A);
+
+	/* Return status from callback. */
+	return (rc);
+}
@@ -25,6 +25,9 @@ struct nmr_cookie {
 	struct proto_kvlds_request * R;
 	struct netbuf_write * WQ;
 
+	/* Internal state used for GET requests. */
+	struct kvldskey * value;
+
 	/* Internal state used for RANGE requests. */
 	struct ptrheap * H;
 	struct kvldskey * end;
@@ -32,12 +35,17 @@ struct nmr_cookie {
 	size_t nkeys;
 	size_t rlen;
 	size_t leavesleft;
+	const struct kvldskey * next;
+	struct kvldskey ** keys;
+	struct kvldskey ** values;
 };
 
 static int callback_get_gotleaf(void *, struct node *);
+static int callback_get_durable(void *);
 static int callback_range_gotnode(void *, struct node *, struct kvldskey *);
 static int callback_range_gotleaf(void *, struct node *);
 static int rangedone(struct nmr_cookie *);
+static int rangesend(void *);
 
 /**
  * dispatch_nmr_launch(T, R, WQ, callback_done, cookie_done):
@@ -94,31 +102,66 @@ err0:
 	return (-1);
 }
 
-/* We've got the leaf node.  Now find the key and send a response. */
+/* Send a GET response with the value ${value} (or NULL) and clean up. */
 static int
-callback_get_gotleaf(void * cookie, struct node * N)
+getdone(struct nmr_cookie * C, const struct kvldskey * value)
 {
-	struct nmr_cookie * C = cookie;
-	struct kvpair_const * kv;
-
-	/* Find the key in this node. */
-	kv = btree_find_kvpair(N, C->R->key);
 
 	/* Send the response. */
-	if (kv != NULL) {
+	if (value != NULL) {
 		/* Send the requested value back to the client. */
 		if (proto_kvlds_response_get(C->WQ, C->R->ID, 0,
-		    kv->v))
-			goto err1;
+		    value))
+			goto err0;
 	} else {
 		/* Send a non-present response back to the client. */
 		if (proto_kvlds_response_get(C->WQ, C->R->ID, 1,
 		    NULL))
-			goto err1;
+			goto err0;
 	}
 
 	/* Schedule the request-done callback. */
 	if (!events_immediate_register(C->callback_done, C->cookie_done, 0))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* We've got the leaf node.  Now find the key and send a response. */
+static int
+callback_get_gotleaf(void * cookie, struct node * N)
+{
+	struct nmr_cookie * C = cookie;
+	struct kvpair_const * kv;
+
+	/* Find the key in this node. */
+	kv = btree_find_kvpair(N, C->R->key);
+
+	/*
+	 * If the shadow tree is still being written, hold on to a copy of
+	 * the value and wait until it has been written before responding.
+	 */
+	if (!btree_durable(C->T)) {
+		C->value = NULL;
+		if ((kv != NULL) && ((C->value = kvldskey_dup(kv->v)) == NULL))
+			goto err1;
+		if (btree_whendurable(C->T, callback_get_durable, C))
+			goto err2;
+
+		/* We don't need the node any more. */
+		btree_node_unlock(C->T, N);
+
+		/* Success! */
+		return (0);
+	}
+
+	/* Send the response. */
+	if (getdone(C, (kv != NULL) ? kv->v : NULL))
 		goto err1;
 
 	/* Unlock the node. */
@@ -133,6 +176,8 @@ callback_get_gotleaf(void * cookie, struct node * N)
 	/* Success! */
 	return (0);
 
+err2:
+	kvldskey_free(C->value);
 err1:
 	btree_node_unlock(C->T, N);
 	proto_kvlds_request_free(C->R);
@@ -142,6 +187,25 @@ err1:
 	return (-1);
 }
 
+/* The value we found has been written.  Send the response. */
+static int
+callback_get_durable(void * cookie)
+{
+	struct nmr_cookie * C = cookie;
+	int rc;
+
+	/* Send the response. */
+	rc = getdone(C, C->value);
+
+	/* Free the value, the request, and the cookie. */
+	kvldskey_free(C->value);
+	proto_kvlds_request_free(C->R);
+	free(C);
+
+	/* Return status from sending the response. */
+	return (rc);
+}
+
 /* We've found a node responsible for this range. */
 static int
 callback_range_gotnode(void * cookie, struct node * N,
@@ -298,13 +362,10 @@ err0:
 	return (-1);
 }
 
-/* Send the RANGE response and clean up. */
+/* Collect the key-value pairs for the RANGE response. */
 static int
 rangedone(struct nmr_cookie * C)
 {
-	const struct kvldskey * next;
-	struct kvldskey ** keys;
-	struct kvldskey ** values;
 	struct kvpair * kv;
 	size_t i;
 
@@ -313,19 +374,19 @@ rangedone(struct nmr_cookie * C)
 	 * provided with, we want to return the ending key as the next key.
 	 */
 	if (C->end->len == 0)
-		next = C->R->range_end;
+		C->next = C->R->range_end;
 	else if (C->R->range_end->len == 0)
-		next = C->end;
+		C->next = C->end;
 	else if (kvldskey_cmp(C->end, C->R->range_end) < 0)
-		next = C->end;
+		C->next = C->end;
 	else
-		next = C->R->range_end;
+		C->next = C->R->range_end;
 
 	/* Allocate arrays for holding keys and values. */
-	if (IMALLOC(keys, C->nkeys, struct kvldskey *))
+	if (IMALLOC(C->keys, C->nkeys, struct kvldskey *))
+		goto err1;
+	if (IMALLOC(C->values, C->nkeys, struct kvldskey *))
 		goto err2;
-	if (IMALLOC(values, C->nkeys, struct kvldskey *))
-		goto err3;
 
 	/* Pull key-value pairs out of the heap. */
 	for (i = 0; i < C->nkeys; i++) {
@@ -337,30 +398,61 @@ rangedone(struct nmr_cookie * C)
 		ptrheap_deletemin(C->H);
 
 		/* Stuff the key and value into the respective arrays. */
-		keys[i] = kv->k;
-		values[i] = kv->v;
+		C->keys[i] = kv->k;
+		C->values[i] = kv->v;
 
 		/* Free the key-value pair structure. */
 		free(kv);
 	}
 
+	/* Free the heap. */
+	ptrheap_free(C->H);
+
+	/*
+	 * Send the response, once the shadow tree has been written if it is
+	 * still being written.
+	 */
+	if (btree_durable(C->T))
+		return (rangesend(C));
+	if (btree_whendurable(C->T, rangesend, C))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(C->keys);
+err1:
+	ptrheap_free(C->H);
+	kvldskey_free(C->end);
+	proto_kvlds_request_free(C->R);
+	free(C);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Send the RANGE response and clean up. */
+static int
+rangesend(void * cookie)
+{
+	struct nmr_cookie * C = cookie;
+	size_t i;
+
 	/* Send the RANGE response. */
-	if (proto_kvlds_response_range(C->WQ, C->R->ID, C->nkeys, next,
-	    keys, values))
-		goto err4;
+	if (proto_kvlds_response_range(C->WQ, C->R->ID, C->nkeys, C->next,
+	    C->keys, C->values))
+		goto err2;
 
 	/* Free the values. */
 	for (i = 0; i < C->nkeys; i++)
-		kvldskey_free(values[i]);
-	free(values);
+		kvldskey_free(C->values[i]);
+	free(C->values);
 
 	/* Free the keys. */
 	for (i = 0; i < C->nkeys; i++)
-		kvldskey_free(keys[i]);
-	free(keys);
-
-	/* Free the heap. */
-	ptrheap_free(C->H);
+		kvldskey_free(C->keys[i]);
+	free(C->keys);
 
 	/* Free the end-of-range value provided by btree_find_range. */
 	kvldskey_free(C->end);
@@ -378,16 +470,13 @@ rangedone(struct nmr_cookie * C)
 	/* Success! */
 	return (0);
 
-err4:
+err2:
 	for (i = 0; i < C->nkeys; i++)
-		kvldskey_free(values[i]);
+		kvldskey_free(C->values[i]);
 	for (i = 0; i < C->nkeys; i++)
-		kvldskey_free(keys[i]);
-	free(values);
-err3:
-	free(keys);
-err2:
-	ptrheap_free(C->H);
+		kvldskey_free(C->keys[i]);
+	free(C->values);
+	free(C->keys);
 	kvldskey_free(C->end);
 	proto_kvlds_request_free(C->R);
 err1:
@@ -17,6 +17,8 @@
 
 #include "btree.h"
 #include "dispatch.h"
+#include "serialize_workers.h"
+#include "trace.h"
 
 static void
 usage(void)
@@ -27,7 +29,9 @@ usage(void)
 	    "[-C <npages> | -c <pagemem>] [-1] "
 	    "[-k <max key length>] [-v <max value length>] [-p <pidfile>] "
 	    "[-S <cost of storage per GB-month>] "
-	    "[-w <commit delay time>] [-g <min forced commit size>]\n");
+	    "[-w <commit delay time>] [-g <min forced commit size>] "
+	    "[-W <target commit latency>] [-P] [-T] "
+	    "[-j <serialization threads>] [-A <max APPEND size>] [-L]\n");
 	fprintf(stderr, "       kivaloo-kvlds --version\n");
 	exit(1);
 }
@@ -53,9 +57,11 @@ main(int argc, char * argv[])
 	int s_lbs;
 
 	/* Command-line parameters. */
+	uint64_t opt_A = (uint64_t)(-1);
 	uint64_t opt_C = (uint64_t)(-1);
 	uint64_t opt_c = (uint64_t)(-1);
 	uint64_t opt_g = (uint64_t)(-1);
+	uint64_t opt_j = (uint64_t)(-1);
 	uint64_t opt_k = (uint64_t)(-1);
 	char * opt_l = NULL;
 	char * opt_p = NULL;
@@ -63,6 +69,10 @@ main(int argc, char * argv[])
 	char * opt_s = NULL;
 	uint64_t opt_v = (uint64_t)(-1);
 	double opt_w = 0.0;
+	double opt_W = -1.0;
+	int opt_L = 0;
+	int opt_P = 0;
+	int opt_T = 0;
 	int opt_1 = 0;
 
 	/* Working variables. */
@@ -75,6 +85,12 @@ main(int argc, char * argv[])
 	/* Parse the command line. */
 	while ((ch = GETOPT(argc, argv)) != NULL) {
 		GETOPT_SWITCH(ch) {
+		GETOPT_OPTARG("-A"):
+			if (opt_A != (uint64_t)(-1))
+				usage();
+			if (humansize_parse(optarg, &opt_A))
+				OPT_EINVAL(ch, optarg);
+			break;
 		GETOPT_OPTARG("-C"):
 			if (opt_C != (uint64_t)(-1))
 				usage();
@@ -93,6 +109,12 @@ main(int argc, char * argv[])
 			if (humansize_parse(optarg, &opt_g))
 				OPT_EINVAL(ch, optarg);
 			break;
+		GETOPT_OPTARG("-j"):
+			if (opt_j != (uint64_t)(-1))
+				usage();
+			if (PARSENUM(&opt_j, optarg, 1, 256))
+				OPT_EPARSE(ch, optarg);
+			break;
 		GETOPT_OPTARG("-k"):
 			if (opt_k != (uint64_t)(-1))
 				usage();
@@ -135,9 +157,30 @@ main(int argc, char * argv[])
 			if (PARSENUM(&opt_w, optarg, 0, INFINITY))
 				OPT_EPARSE(ch, optarg);
 			break;
+		GETOPT_OPTARG("-W"):
+			if (opt_W != -1.0)
+				usage();
+			if (PARSENUM(&opt_W, optarg, 0, INFINITY))
+				OPT_EPARSE(ch, optarg);
+			break;
 		GETOPT_OPT("--version"):
 			fprintf(stderr, "kivaloo-kvlds @VERSION@\n");
 			exit(0);
+		GETOPT_OPT("-L"):
+			if (opt_L != 0)
+				usage();
+			opt_L = 1;
+			break;
+		GETOPT_OPT("-P"):
+			if (opt_P != 0)
+				usage();
+			opt_P = 1;
+			break;
+		GETOPT_OPT("-T"):
+			if (opt_T != 0)
+				usage();
+			opt_T = 1;
+			break;
 		GETOPT_OPT("-1"):
 			if (opt_1 != 0)
 				usage();
@@ -180,6 +223,10 @@ main(int argc, char * argv[])
 		warn0("Maximum cache size on this system is %zu", SIZE_MAX);
 		exit(1);
 	}
+	if ((opt_A != (uint64_t)(-1)) && (opt_A > SIZE_MAX)) {
+		warn0("Maximum APPEND size on this system is %zu", SIZE_MAX);
+		exit(1);
+	}
 	if ((opt_k != (uint64_t)(-1)) && (opt_k > 255)) {
 		warn0("Keys longer than 255 bytes are not supported");
 		exit(1);
@@ -192,6 +239,10 @@ main(int argc, char * argv[])
 		warn0("Commit delay time in [0.0, 1.0]: -w %f", opt_w);
 		exit(1);
 	}
+	if ((opt_W != -1.0) && (opt_W > 1.0)) {
+		warn0("Target commit latency in [0.0, 1.0]: -W %f", opt_W);
+		exit(1);
+	}
 	if ((opt_g != (uint64_t)(-1)) &&
 	    ((opt_g < 1) || (opt_g > 1024))) {
 		warn0("Forced commit size must be in [1, 1024]: "
@@ -243,6 +294,21 @@ main(int argc, char * argv[])
 		exit(1);
 	}
 
+	/* Split large commits into multiple APPENDs if requested. */
+	if (opt_A != (uint64_t)(-1)) {
+		if ((T->appendmax = (size_t)opt_A / T->pagelen) == 0)
+			T->appendmax = 1;
+	}
+
+	/* Cluster sibling leaves if requested. */
+	T->cluster = opt_L;
+
+	/* Trace the commit pipeline if requested. */
+	if (opt_T && ((T->trace = trace_init()) == NULL)) {
+		warnp("Cannot initialize commit pipeline trace");
+		exit(1);
+	}
+
 	/* Daemonize and write pid. */
 	if (opt_p == NULL) {
 		if (asprintf(&opt_p, "%s.pid", opt_s) == -1) {
@@ -255,12 +321,24 @@ main(int argc, char * argv[])
 		exit(1);
 	}
 
+	/*
+	 * Serialize pages using multiple threads if requested.  This must
+	 * happen after daemonizing, since threads do not survive fork(2).
+	 */
+	if ((opt_j != (uint64_t)(-1)) && (opt_j > 1)) {
+		if ((T->sworkers =
+		    serialize_workers_init((size_t)opt_j - 1)) == NULL) {
+			warnp("Cannot create serialization threads");
+			exit(1);
+		}
+	}
+
 	/* Handle connections, one at a time. */
 	do {
 		/* Accept a connection. */
 		if ((dstate = dispatch_accept(s, T,
-		    (size_t)opt_k, (size_t)opt_v, opt_w, (size_t)opt_g))
-		    == NULL)
+		    (size_t)opt_k, (size_t)opt_v, opt_w, (size_t)opt_g,
+		    opt_W, opt_P)) == NULL)
 			exit(1);
 
 		/* Loop until the connection is dead. */
@@ -276,7 +354,9 @@ main(int argc, char * argv[])
 			exit(1);
 	} while (opt_1 == 0);
 
-	/* Free the B+Tree. */
+	/* Free the serialization threads, trace, and B+Tree. */
+	serialize_workers_free(T->sworkers);
+	trace_free(T->trace);
 	btree_free(T);
 
 	/* Shut down the LBS request queue. */
@@ -2,8 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "mpool.h"
+
 #include "node.h"
 
+MPOOL(node, struct node, 4096);
+
 /**
  * node_alloc(pagenum, oldestleaf, pagesize):
  * Create and return a node with the specified ${pagenum}, ${oldestleaf}, and
@@ -15,7 +19,7 @@ node_alloc(uint64_t pagenum, uint64_t oldestleaf, uint32_t pagesize)
 	struct node * N;
 
 	/* Allocate node. */
-	if ((N = malloc(sizeof(struct node))) == NULL)
+	if ((N = mpool_node_malloc()) == NULL)
 		goto err0;
 	memset(N, 0, sizeof(struct node));
 
@@ -52,5 +56,5 @@ node_free(struct node * N)
 		return;
 
 	/* Free node. */
-	free(N);
+	mpool_node_free(N);
 }
@@ -65,6 +65,9 @@ struct node {
 	/* 1 if the node needs to be considered for merging; 0 otherwise. */
 	unsigned int needmerge : 1;
 
+	/* 1 if the node is not dirty but its page has not been written. */
+	unsigned int unwritten : 1;
+
 	/* Height of this node (leaf = 0); -1 if !present. */
 	int8_t height;
 
@@ -98,7 +101,7 @@ struct node {
 	/**
 	 * A node is locked:
 	 * (a) once if root != 0,
-	 * (b) once if state != NODE_STATE_CLEAN,
+	 * (b) once if state != NODE_STATE_CLEAN, and once if unwritten != 0,
 	 * (c) once if state == NODE_STATE_CLEAN && type == NODE_TYPE_LEAF &&
 	 *     v.cstate != NULL,
 	 * (d) once per present child node if type == NODE_TYPE_PARENT, and
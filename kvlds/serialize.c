@@ -8,6 +8,7 @@
 #include "imalloc.h"
 #include "kvldskey.h"
 #include "kvpair.h"
+#include "slab.h"
 #include "sysendian.h"
 #include "warnp.h"
 
@@ -70,14 +71,48 @@
  */
 int
 serialize(struct btree * T, struct node * N, size_t buflen)
+{
+
+	/* Sanity check: This node should be dirty and have no page buffer. */
+	assert(N->state == NODE_STATE_DIRTY);
+	assert(N->pagebuf == NULL);
+
+	/* Get the page length.  This also sets N->pagesize. */
+	serialize_size(N);
+
+	/* Allocate a page buffer. */
+	if ((N->pagebuf = slab_rec_alloc(T->pagebufs)) == NULL)
+		goto err0;
+
+	/* Serialize the node into the buffer. */
+	serialize_write(T, N, buflen);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * serialize_write(T, N, buflen):
+ * Serialize the dirty node ${N} into its page buffer, which must have been
+ * allocated by the caller, after serialize_size(${N}) has been called on it
+ * and each of its children.  Adjust key and value pointers to point into the
+ * page buffer.  This function may be called for different nodes of the same
+ * tree concurrently from multiple threads.
+ */
+void
+serialize_write(struct btree * T, struct node * N, size_t buflen)
 {
 	size_t pagelen;
 	uint8_t * p;
 	size_t i;
 
-	/* Sanity check: This node should be dirty and have no page buffer. */
+	/* Sanity check: This node should be dirty and have a page buffer. */
 	assert(N->state == NODE_STATE_DIRTY);
-	assert(N->pagebuf == NULL);
+	assert(N->pagebuf != NULL);
 
 	/* Sanity check: The node must have a height (incl. 0). */
 	assert(N->height != -1);
@@ -85,15 +120,17 @@ serialize(struct btree * T, struct node * N, size_t buflen)
 	/* Sanity check: We can only store 2 bytes of nkeys. */
 	assert(N->nkeys <= UINT16_MAX);
 
-	/* Get the page length.  This also sets N->pagelen. */
-	pagelen = serialize_size(N);
+	/* Get the page length, which must already have been computed. */
+	assert(N->pagesize != (uint32_t)(-1));
+	pagelen = N->pagesize;
 
 	/* Sanity check: The page should fit into the buffer. */
 	assert(pagelen <= buflen);
 
-	/* Allocate a page buffer. */
-	if ((N->pagebuf = malloc(buflen)) == NULL)
-		goto err0;
+	/* Sanity check: The buffer must fit into a page buffer. */
+	assert(buflen <= T->pagelen);
+
+	/* Start at the beginning of the page buffer. */
 	p = N->pagebuf;
 
 	/* Copy magic. */
@@ -168,22 +205,17 @@ serialize(struct btree * T, struct node * N, size_t buflen)
 
 	/* Zero the remaining space. */
 	memset(p, 0, buflen - pagelen);
-
-	/* Success! */
-	return (0);
-
-err0:
-	/* Failure! */
-	return (-1);
 }
 
 /**
- * deserialize(N, buf, buflen):
- * Deserialize the node ${N} out of the ${buflen}-byte page buffer ${buf}.
- * Extra data held in the serialized root node is not processed.
+ * deserialize(T, N, buf, buflen):
+ * Deserialize the node ${N} of the B+Tree ${T} out of the ${buflen}-byte
+ * page buffer ${buf}.  Extra data held in the serialized root node is not
+ * processed.
  */
 int
-deserialize(struct node * N, const uint8_t * buf, size_t buflen)
+deserialize(struct btree * T, struct node * N, const uint8_t * buf,
+    size_t buflen)
 {
 	uint8_t * p;
 	size_t i;
@@ -201,8 +233,11 @@ deserialize(struct node * N, const uint8_t * buf, size_t buflen)
 	assert(N->type == NODE_TYPE_READ);
 	assert(N->state == NODE_STATE_CLEAN);
 
+	/* Sanity check: The page must fit into a page buffer. */
+	assert(buflen <= T->pagelen);
+
 	/* Copy the serialized page. */
-	if ((N->pagebuf = malloc(buflen)) == NULL)
+	if ((N->pagebuf = slab_rec_alloc(T->pagebufs)) == NULL)
 		goto err0;
 	memcpy(N->pagebuf, buf, buflen);
 	p = N->pagebuf;
@@ -360,7 +395,7 @@ err2:
 	 * LEAF+PARENT merged error handling path.
 	 */
 err1:
-	free(N->pagebuf);
+	slab_rec_free(T->pagebufs, N->pagebuf);
 	N->pagebuf = NULL;
 	if (errno != 0)
 		warnp("Error parsing page");
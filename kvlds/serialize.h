@@ -35,11 +35,22 @@ struct node;
 int serialize(struct btree *, struct node *, size_t);
 
 /**
- * deserialize(N, buf, buflen):
- * Deserialize the node ${N} out of the ${buflen}-byte page buffer ${buf}.
- * Extra data held in the serialized root node is not processed.
+ * serialize_write(T, N, buflen):
+ * Serialize the dirty node ${N} into its page buffer, which must have been
+ * allocated by the caller, after serialize_size(${N}) has been called on it
+ * and each of its children.  Adjust key and value pointers to point into the
+ * page buffer.  This function may be called for different nodes of the same
+ * tree concurrently from multiple threads.
  */
-int deserialize(struct node *, const uint8_t *, size_t);
+void serialize_write(struct btree *, struct node *, size_t);
+
+/**
+ * deserialize(T, N, buf, buflen):
+ * Deserialize the node ${N} of the B+Tree ${T} out of the ${buflen}-byte
+ * page buffer ${buf}.  Extra data held in the serialized root node is not
+ * processed.
+ */
+int deserialize(struct btree *, struct node *, const uint8_t *, size_t);
 
 /**
  * deserialize_root(T, buf):
@@ -0,0 +1,317 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imalloc.h"
+#include "warnp.h"
+
+#include "serialize.h"
+
+#include "serialize_workers.h"
+
+/* Number of nodes handed to a thread at once. */
+#define CHUNK	16
+
+/* Worker pool state. */
+struct serialize_workers {
+	/* Thread management. */
+	pthread_mutex_t mtx;	/* Controls access to this structure. */
+	pthread_cond_t cv_work;	/* Work has been posted, or we must die. */
+	pthread_cond_t cv_done;	/* A thread has finished its work. */
+	pthread_t * thr;	/* Thread IDs. */
+	size_t nthreads;	/* Number of threads. */
+	uint64_t generation;	/* Incremented when work is posted. */
+	int suicide;		/* Need-to-kill-ourselves condition. */
+
+	/* Work to be done. */
+	struct btree * T;	/* Tree to which the nodes belong. */
+	struct node ** nodes;	/* Nodes to serialize. */
+	size_t nnodes;		/* Number of nodes. */
+	size_t buflen;		/* Length of page buffers. */
+	size_t next;		/* Next node to be handed out. */
+	size_t nbusy;		/* Threads which have not finished. */
+};
+
+/*
+ * Serialize nodes until there are none left.  Must be called with the mutex
+ * held; the mutex is released while nodes are being serialized.
+ */
+static int
+dowork(struct serialize_workers * W)
+{
+	size_t start, end;
+	size_t i;
+	int rc;
+
+	/* Keep grabbing chunks of nodes. */
+	while (W->next < W->nnodes) {
+		/* Grab a chunk. */
+		start = W->next;
+		end = (W->nnodes - start > CHUNK) ? start + CHUNK : W->nnodes;
+		W->next = end;
+
+		/* Serialize the nodes without holding the mutex. */
+		if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+			warn0("pthread_mutex_unlock: %s", strerror(rc));
+			goto err0;
+		}
+		for (i = start; i < end; i++)
+			serialize_write(W->T, W->nodes[i], W->buflen);
+		if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+			warn0("pthread_mutex_lock: %s", strerror(rc));
+			goto err0;
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Worker thread. */
+static void *
+workthread(void * cookie)
+{
+	struct serialize_workers * W = cookie;
+	uint64_t seen = 0;
+	int rc;
+
+	/* Grab the mutex. */
+	if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* Infinite loop doing work until told to suicide. */
+	do {
+		/* Sleep until we have new work or need to kill ourself. */
+		while ((W->generation == seen) && (W->suicide == 0)) {
+			if ((rc = pthread_cond_wait(&W->cv_work,
+			    &W->mtx)) != 0) {
+				warn0("pthread_cond_wait: %s", strerror(rc));
+				exit(1);
+			}
+		}
+
+		/* If we need to kill ourself, stop looping. */
+		if (W->suicide)
+			break;
+
+		/* Do the work. */
+		seen = W->generation;
+		if (dowork(W))
+			exit(1);
+
+		/* We're done; wake the master thread if it's waiting. */
+		if (--W->nbusy == 0) {
+			if ((rc = pthread_cond_signal(&W->cv_done)) != 0) {
+				warn0("pthread_cond_signal: %s",
+				    strerror(rc));
+				exit(1);
+			}
+		}
+	} while (1);
+
+	/* Release the mutex and die. */
+	if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+	return (NULL);
+}
+
+/* Tell the first ${n} threads to die, and wait for them to do so. */
+static int
+killthreads(struct serialize_workers * W, size_t n)
+{
+	size_t i;
+	int rc;
+
+	/* Tell the threads to die. */
+	if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+	W->suicide = 1;
+	if ((rc = pthread_cond_broadcast(&W->cv_work)) != 0) {
+		warn0("pthread_cond_broadcast: %s", strerror(rc));
+		goto err1;
+	}
+	if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Wait for them to die. */
+	for (i = 0; i < n; i++) {
+		if ((rc = pthread_join(W->thr[i], NULL)) != 0) {
+			warn0("pthread_join: %s", strerror(rc));
+			goto err0;
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&W->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * serialize_workers_init(nthreads):
+ * Create a pool of ${nthreads} threads which serialize B+Tree nodes.
+ */
+struct serialize_workers *
+serialize_workers_init(size_t nthreads)
+{
+	struct serialize_workers * W;
+	size_t i;
+	int rc;
+
+	/* Allocate the pool structure. */
+	if ((W = malloc(sizeof(struct serialize_workers))) == NULL)
+		goto err0;
+	W->nthreads = nthreads;
+	W->generation = 0;
+	W->suicide = 0;
+	W->nnodes = W->next = W->nbusy = 0;
+
+	/* Allocate an array of thread IDs. */
+	if (IMALLOC(W->thr, nthreads, pthread_t))
+		goto err1;
+
+	/* Create the mutex and condition variables. */
+	if ((rc = pthread_mutex_init(&W->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+	if ((rc = pthread_cond_init(&W->cv_work, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err3;
+	}
+	if ((rc = pthread_cond_init(&W->cv_done, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err4;
+	}
+
+	/* Create the threads. */
+	for (i = 0; i < nthreads; i++) {
+		if ((rc = pthread_create(&W->thr[i], NULL,
+		    workthread, W)) != 0) {
+			warn0("pthread_create: %s", strerror(rc));
+			goto err6;
+		}
+	}
+
+	/* Success! */
+	return (W);
+
+err6:
+	if (killthreads(W, i))
+		exit(1);
+	pthread_cond_destroy(&W->cv_done);
+err4:
+	pthread_cond_destroy(&W->cv_work);
+err3:
+	pthread_mutex_destroy(&W->mtx);
+err2:
+	free(W->thr);
+err1:
+	free(W);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * serialize_workers_run(W, T, nodes, nnodes, buflen):
+ * Use the worker pool ${W} (and the calling thread) to serialize the
+ * ${nnodes} dirty nodes ${nodes}[0 .. ${nnodes} - 1] of the B+Tree ${T} via
+ * serialize_write(${T}, node, ${buflen}).  Return once all of the nodes have
+ * been serialized.
+ */
+int
+serialize_workers_run(struct serialize_workers * W, struct btree * T,
+    struct node ** nodes, size_t nnodes, size_t buflen)
+{
+	int rc;
+
+	/* Lock the pool. */
+	if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Post the work and wake up the threads. */
+	W->T = T;
+	W->nodes = nodes;
+	W->nnodes = nnodes;
+	W->buflen = buflen;
+	W->next = 0;
+	W->nbusy = W->nthreads;
+	W->generation += 1;
+	if ((rc = pthread_cond_broadcast(&W->cv_work)) != 0) {
+		warn0("pthread_cond_broadcast: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Help out. */
+	if (dowork(W))
+		goto err0;
+
+	/* Wait until every thread has finished. */
+	while (W->nbusy > 0) {
+		if ((rc = pthread_cond_wait(&W->cv_done, &W->mtx)) != 0) {
+			warn0("pthread_cond_wait: %s", strerror(rc));
+			goto err1;
+		}
+	}
+
+	/* Unlock the pool. */
+	if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&W->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * serialize_workers_free(W):
+ * Stop and free the threads in the worker pool ${W}.
+ */
+void
+serialize_workers_free(struct serialize_workers * W)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (W == NULL)
+		return;
+
+	/* Kill the threads. */
+	if (killthreads(W, W->nthreads)) {
+		warn0("Error stopping serialization threads");
+		exit(1);
+	}
+
+	/* Free the synchronization primitives and memory. */
+	pthread_cond_destroy(&W->cv_done);
+	pthread_cond_destroy(&W->cv_work);
+	pthread_mutex_destroy(&W->mtx);
+	free(W->thr);
+	free(W);
+}
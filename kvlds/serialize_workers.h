@@ -0,0 +1,33 @@
+#ifndef SERIALIZE_WORKERS_H_
+#define SERIALIZE_WORKERS_H_
+
+#include <stddef.h>
+
+/* Opaque types. */
+struct btree;
+struct node;
+struct serialize_workers;
+
+/**
+ * serialize_workers_init(nthreads):
+ * Create a pool of ${nthreads} threads which serialize B+Tree nodes.
+ */
+struct serialize_workers * serialize_workers_init(size_t);
+
+/**
+ * serialize_workers_run(W, T, nodes, nnodes, buflen):
+ * Use the worker pool ${W} (and the calling thread) to serialize the
+ * ${nnodes} dirty nodes ${nodes}[0 .. ${nnodes} - 1] of the B+Tree ${T} via
+ * serialize_write(${T}, node, ${buflen}).  Return once all of the nodes have
+ * been serialized.
+ */
+int serialize_workers_run(struct serialize_workers *, struct btree *,
+    struct node **, size_t, size_t);
+
+/**
+ * serialize_workers_free(W):
+ * Stop and free the threads in the worker pool ${W}.
+ */
+void serialize_workers_free(struct serialize_workers *);
+
+#endif /* !SERIALIZE_WORKERS_H_ */
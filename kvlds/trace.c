@@ -0,0 +1,155 @@
+#include <sys/time.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "trace.h"
+
+/* Stage names, as reported via STATS. */
+static const char * stagenames[TRACE_NSTAGES] = {
+	[TRACE_LEAVES] = "leaves",
+	[TRACE_MUTATE] = "mutate",
+	[TRACE_BALANCE] = "balance",
+	[TRACE_MLEN] = "mlen",
+	[TRACE_SERIALIZE] = "serialize",
+	[TRACE_APPEND] = "append",
+	[TRACE_UNSHADOW] = "unshadow"
+};
+
+/**
+ * trace_init(void):
+ * Create a commit pipeline trace with all counters zero.
+ */
+struct trace *
+trace_init(void)
+{
+	struct trace * R;
+	size_t i, j;
+
+	/* Allocate the structure. */
+	if ((R = malloc(sizeof(struct trace))) == NULL)
+		goto err0;
+
+	/* Nothing has happened yet. */
+	for (i = 0; i < TRACE_NSTAGES; i++) {
+		for (j = 0; j < TRACE_NBUCKETS; j++)
+			R->hist[i][j] = 0;
+		R->total[i] = 0;
+	}
+	for (i = 0; i <= TRACE_MAXMERGES; i++)
+		R->merges[i] = 0;
+
+	/* Success! */
+	return (R);
+
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * trace_stagename(stage):
+ * Return the name of the commit pipeline stage ${stage}.
+ */
+const char *
+trace_stagename(int stage)
+{
+
+	/* Sanity check. */
+	assert((stage >= 0) && (stage < TRACE_NSTAGES));
+
+	return (stagenames[stage]);
+}
+
+/**
+ * trace_stage(R, stage, t):
+ * If ${R} is not NULL, record in ${R} that the commit pipeline stage
+ * ${stage} ran from ${t} until now, and set ${t} to the current time.  If
+ * ${stage} is TRACE_NONE, only set ${t}.
+ */
+int
+trace_stage(struct trace * R, int stage, struct timeval * t)
+{
+	struct timeval tnow;
+	double d;
+	uint64_t us;
+	size_t i;
+
+	/* If we're not tracing, do nothing. */
+	if (R == NULL)
+		goto done;
+
+	/* What time is it? */
+	if (monoclock_get(&tnow)) {
+		warnp("monoclock_get");
+		goto err0;
+	}
+
+	/* Record the stage duration, if we were timing a stage. */
+	if (stage != TRACE_NONE) {
+		assert((stage >= 0) && (stage < TRACE_NSTAGES));
+
+		/* Convert to microseconds; the clock should never go back. */
+		d = timeval_diff(*t, tnow);
+		us = (d > 0.0) ? (uint64_t)(d * 1000000.0) : 0;
+
+		/* Find the histogram bucket. */
+		for (i = 0; (i < TRACE_NBUCKETS - 1) && (us >> i); i++)
+			continue;
+
+		/* Record the duration. */
+		R->hist[stage][i] += 1;
+		R->total[stage] += us;
+	}
+
+	/* The next stage starts now. */
+	*t = tnow;
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * trace_merges(R, npasses):
+ * If ${R} is not NULL, record in ${R} that balancing a batch took
+ * ${npasses} Merge passes.
+ */
+void
+trace_merges(struct trace * R, size_t npasses)
+{
+
+	/* If we're not tracing, do nothing. */
+	if (R == NULL)
+		return;
+
+	/* Record the number of passes. */
+	if (npasses > TRACE_MAXMERGES)
+		npasses = TRACE_MAXMERGES;
+	R->merges[npasses] += 1;
+}
+
+/**
+ * trace_free(R):
+ * Free the commit pipeline trace ${R}.
+ */
+void
+trace_free(struct trace * R)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (R == NULL)
+		return;
+
+	/* Free the structure. */
+	free(R);
+}
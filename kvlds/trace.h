@@ -0,0 +1,70 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <sys/time.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Stages of the commit pipeline. */
+#define TRACE_NONE	(-1)	/* Not a stage; just read the clock. */
+#define TRACE_LEAVES	0	/* Finding leaves. */
+#define TRACE_MUTATE	1	/* Dirtying leaves and performing requests. */
+#define TRACE_BALANCE	2	/* Rebalancing the tree. */
+#define TRACE_MLEN	3	/* Filling in matching-prefix lengths. */
+#define TRACE_SERIALIZE	4	/* Serializing dirty nodes. */
+#define TRACE_APPEND	5	/* Writing pages to LBS. */
+#define TRACE_UNSHADOW	6	/* Freeing the old shadow tree. */
+#define TRACE_NSTAGES	7
+
+/*
+ * Number of histogram buckets: Bucket 0 counts stages taking less than 1 us,
+ * bucket i > 0 counts stages taking [2^(i-1), 2^i) us, and the final bucket
+ * also counts all longer stages.
+ */
+#define TRACE_NBUCKETS	24
+
+/* Merge passes per batch are counted up to this many. */
+#define TRACE_MAXMERGES	8
+
+/* Commit pipeline trace. */
+struct trace {
+	uint64_t hist[TRACE_NSTAGES][TRACE_NBUCKETS];	/* Stage durations. */
+	uint64_t total[TRACE_NSTAGES];	/* Total time in each stage (us). */
+	uint64_t merges[TRACE_MAXMERGES + 1];	/* Merge passes per batch. */
+};
+
+/**
+ * trace_init(void):
+ * Create a commit pipeline trace with all counters zero.
+ */
+struct trace * trace_init(void);
+
+/**
+ * trace_stagename(stage):
+ * Return the name of the commit pipeline stage ${stage}.
+ */
+const char * trace_stagename(int);
+
+/**
+ * trace_stage(R, stage, t):
+ * If ${R} is not NULL, record in ${R} that the commit pipeline stage
+ * ${stage} ran from ${t} until now, and set ${t} to the current time.  If
+ * ${stage} is TRACE_NONE, only set ${t}.
+ */
+int trace_stage(struct trace *, int, struct timeval *);
+
+/**
+ * trace_merges(R, npasses):
+ * If ${R} is not NULL, record in ${R} that balancing a batch took
+ * ${npasses} Merge passes.
+ */
+void trace_merges(struct trace *, size_t);
+
+/**
+ * trace_free(R):
+ * Free the commit pipeline trace ${R}.
+ */
+void trace_free(struct trace *);
+
+#endif /* !TRACE_H_ */
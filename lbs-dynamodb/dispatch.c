@@ -16,6 +16,12 @@
 
 #include "dispatch.h"
 
+/* Queue of APPENDs waiting for the APPEND in progress to complete. */
+struct appendq {
+	struct appendq * next;		/* Next pending APPEND. */
+	struct proto_lbs_request * R;	/* APPEND request. */
+};
+
 /* State of the work dispatcher. */
 struct dispatch_state {
 	/* Internal state. */
@@ -30,6 +36,9 @@ struct dispatch_state {
 	void * read_cookie;		/* Request read cookie. */
 	size_t npending;		/* # responses we owe. */
 	int appendip;			/* An APPEND is in progress. */
+	struct appendq * appendq_head;	/* Queue of pending APPENDs. */
+	struct appendq ** appendq_tail;	/* Location of terminating NULL. */
+	uint64_t appendnext;		/* Block # after pending APPENDs. */
 };
 
 static int callback_accept(void *, int);
@@ -50,8 +59,8 @@ dropconnection(void * cookie)
 	}
 
 	/*
-	 * Note: Since we do not cancel in-progress requests, they will
-	 * continue and will at some point complete and attempt to write
+	 * Note: Since we do not cancel in-progress or queued requests, they
+	 * will continue and will at some point complete and attempt to write
 	 * their responses.  This may result in writes to a failed buffered
 	 * writer, but we don't care; the buffered writer will ignore them.
 	 * (We're guaranteed to not write to a *freed* buffered writer, since
@@ -63,6 +72,43 @@ dropconnection(void * cookie)
 	return (0);
 }
 
+/* Launch an APPEND, or queue it if another APPEND is in progress. */
+static int
+append(struct dispatch_state * D, struct proto_lbs_request * R)
+{
+	struct appendq * aq;
+
+	/* The next APPEND must start where this one ends. */
+	D->appendnext = R->r.append.blkno + R->r.append.nblks;
+
+	/* If an APPEND is in progress, queue this one behind it. */
+	if (D->appendip != 0) {
+		if ((aq = malloc(sizeof(struct appendq))) == NULL)
+			goto err0;
+		aq->next = NULL;
+		aq->R = R;
+		if (D->appendq_head == NULL)
+			D->appendq_head = aq;
+		else
+			*(D->appendq_tail) = aq;
+		D->appendq_tail = &aq->next;
+		goto done;
+	}
+
+	/* Launch the APPEND. */
+	D->appendip = 1;
+	if (state_append(D->S, R, callback_append, D))
+		goto err0;
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /* Read and dispatch incoming request(s). */
 static int
 gotrequest(void * cookie, int status)
@@ -118,8 +164,9 @@ gotrequest(void * cookie, int status)
 			state_params(D->S, &blklen, &lastblk, &nextblk);
 			if (R->r.append.blklen != blklen)
 				goto drop2;
-			if ((R->r.append.blkno != nextblk) ||
-			    (D->appendip != 0)) {
+			if (D->appendip != 0)
+				nextblk = D->appendnext;
+			if (R->r.append.blkno != nextblk) {
 				if (proto_lbs_response_append(D->writeq,
 				    R->ID, 1, 0))
 					goto err2;
@@ -128,8 +175,7 @@ gotrequest(void * cookie, int status)
 				break;
 			}
 			D->npending += 1;
-			D->appendip = 1;
-			if (state_append(D->S, R, callback_append, D))
+			if (append(D, R))
 				goto err1;
 			break;
 		case PROTO_LBS_FREE:
@@ -139,6 +185,13 @@ gotrequest(void * cookie, int status)
 				goto err1;
 			free(R);
 			break;
+		case PROTO_LBS_FREERANGE:
+			/* Advisory; we only delete blocks via FREE. */
+			free(R->r.freerange.ranges);
+			if (proto_lbs_response_freerange(D->writeq, R->ID))
+				goto err1;
+			free(R);
+			break;
 		default:
 			/* proto_lbs_request_read broke. */
 			assert(0);
@@ -215,6 +268,7 @@ static int
 callback_append(void * cookie, struct proto_lbs_request * R, uint64_t nextblk)
 {
 	struct dispatch_state * D = cookie;
+	struct appendq * aq;
 	int rc;
 
 	/* Send a response back. */
@@ -228,6 +282,15 @@ callback_append(void * cookie, struct proto_lbs_request * R, uint64_t nextblk)
 	D->npending -= 1;
 	D->appendip = 0;
 
+	/* Launch the next queued APPEND, if there is one. */
+	if ((aq = D->appendq_head) != NULL) {
+		D->appendq_head = aq->next;
+		D->appendip = 1;
+		if (state_append(D->S, aq->R, callback_append, D))
+			rc = -1;
+		free(aq);
+	}
+
 	/* Return success/failure from response write. */
 	return (rc);
 }
@@ -310,6 +373,7 @@ callback_accept(void * cookie, int s)
 	/* No requests are pending yet. */
 	D->npending = 0;
 	D->appendip = 0;
+	D->appendq_head = NULL;
 
 	/* Success! */
 	return (0);
@@ -127,6 +127,13 @@ gotrequest(void * cookie, int status)
 				goto err1;
 			free(R);
 			break;
+		case PROTO_LBS_FREERANGE:
+			/* Advisory; we only delete blocks via FREE. */
+			free(R->r.freerange.ranges);
+			if (proto_lbs_response_freerange(D->writeq, R->ID))
+				goto err1;
+			free(R);
+			break;
 		default:
 			/* proto_lbs_request_read broke. */
 			assert(0);
@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imalloc.h"
+#include "warnp.h"
+
+#include "blkcache.h"
+
+/*
+ * Maximum distance between block numbers passed to consecutive lookups for
+ * them to be considered ascending.  Some slack is needed because GETs are
+ * handed to several readers and may arrive here slightly out of order.
+ */
+#define ASCENDING_MAX	4
+
+/* Block cache state. */
+struct blkcache {
+	pthread_mutex_t mtx;	/* Controls access to this structure. */
+	size_t nblks;		/* Number of blocks which fit. */
+	size_t blocklen;	/* Block length. */
+	uint64_t * blknos;	/* Block # held in each slot, or -1. */
+	uint8_t * data;		/* Block data. */
+	uint64_t lastget;	/* Block # passed to the last lookup. */
+};
+
+/**
+ * blkcache_init(nblks, blocklen):
+ * Create a cache which holds up to ${nblks} (which must be non-zero) blocks
+ * of ${blocklen} bytes.  The cache is direct-mapped by block number, so the
+ * most recently added ${nblks} consecutive blocks always fit.  The cache may
+ * be accessed from multiple threads at once.
+ */
+struct blkcache *
+blkcache_init(size_t nblks, size_t blocklen)
+{
+	struct blkcache * C;
+	size_t i;
+	int rc;
+
+	/* Allocate the structure. */
+	if ((C = malloc(sizeof(struct blkcache))) == NULL)
+		goto err0;
+	C->nblks = nblks;
+	C->blocklen = blocklen;
+	C->lastget = (uint64_t)(-1);
+
+	/* Allocate the slots, which are all empty. */
+	if (IMALLOC(C->blknos, nblks, uint64_t))
+		goto err1;
+	for (i = 0; i < nblks; i++)
+		C->blknos[i] = (uint64_t)(-1);
+
+	/* Allocate space for the block data. */
+	if (nblks > SIZE_MAX / blocklen) {
+		errno = ENOMEM;
+		goto err2;
+	}
+	if ((C->data = malloc(nblks * blocklen)) == NULL)
+		goto err2;
+
+	/* Create the mutex. */
+	if ((rc = pthread_mutex_init(&C->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err3;
+	}
+
+	/* Success! */
+	return (C);
+
+err3:
+	free(C->data);
+err2:
+	free(C->blknos);
+err1:
+	free(C);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * blkcache_get(C, blkno, buf, ascending):
+ * If block ${blkno} is in the cache ${C}, copy it into ${buf} and return 1;
+ * otherwise, return 0.  Set ${ascending} to non-zero if ${blkno} is a short
+ * distance after the block number passed to the previous call.  Return -1
+ * on error.
+ */
+int
+blkcache_get(struct blkcache * C, uint64_t blkno, uint8_t * buf,
+    int * ascending)
+{
+	size_t i = (size_t)(blkno % C->nblks);
+	int found;
+	int rc;
+
+	/* Lock the cache. */
+	if ((rc = pthread_mutex_lock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Are lookups moving forwards through the blocks? */
+	*ascending = ((blkno > C->lastget) &&
+	    (blkno - C->lastget <= ASCENDING_MAX));
+	C->lastget = blkno;
+
+	/* Copy the block out if we have it. */
+	if ((found = (C->blknos[i] == blkno)) != 0)
+		memcpy(buf, &C->data[i * C->blocklen], C->blocklen);
+
+	/* Unlock the cache. */
+	if ((rc = pthread_mutex_unlock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (found);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * blkcache_put(C, blkno, buf):
+ * Add block ${blkno}, with contents ${buf}, to the cache ${C}.
+ */
+int
+blkcache_put(struct blkcache * C, uint64_t blkno, const uint8_t * buf)
+{
+	size_t i = (size_t)(blkno % C->nblks);
+	int rc;
+
+	/* Lock the cache. */
+	if ((rc = pthread_mutex_lock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Evict whatever was in the slot and store the block. */
+	C->blknos[i] = blkno;
+	memcpy(&C->data[i * C->blocklen], buf, C->blocklen);
+
+	/* Unlock the cache. */
+	if ((rc = pthread_mutex_unlock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * blkcache_free(C):
+ * Free the cache ${C}.
+ */
+void
+blkcache_free(struct blkcache * C)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (C == NULL)
+		return;
+
+	/* Free the mutex and memory. */
+	pthread_mutex_destroy(&C->mtx);
+	free(C->data);
+	free(C->blknos);
+	free(C);
+}
@@ -0,0 +1,40 @@
+#ifndef BLKCACHE_H_
+#define BLKCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opaque type. */
+struct blkcache;
+
+/**
+ * blkcache_init(nblks, blocklen):
+ * Create a cache which holds up to ${nblks} (which must be non-zero) blocks
+ * of ${blocklen} bytes.  The cache is direct-mapped by block number, so the
+ * most recently added ${nblks} consecutive blocks always fit.  The cache may
+ * be accessed from multiple threads at once.
+ */
+struct blkcache * blkcache_init(size_t, size_t);
+
+/**
+ * blkcache_get(C, blkno, buf, ascending):
+ * If block ${blkno} is in the cache ${C}, copy it into ${buf} and return 1;
+ * otherwise, return 0.  Set ${ascending} to non-zero if ${blkno} is a short
+ * distance after the block number passed to the previous call.  Return -1
+ * on error.
+ */
+int blkcache_get(struct blkcache *, uint64_t, uint8_t *, int *);
+
+/**
+ * blkcache_put(C, blkno, buf):
+ * Add block ${blkno}, with contents ${buf}, to the cache ${C}.
+ */
+int blkcache_put(struct blkcache *, uint64_t, const uint8_t *);
+
+/**
+ * blkcache_free(C):
+ * Free the cache ${C}.
+ */
+void blkcache_free(struct blkcache *);
+
+#endif /* !BLKCACHE_H_ */
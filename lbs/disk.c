@@ -1,3 +1,11 @@
+/**
+ * APISUPPORT CFLAGS: NONPOSIX_O_DIRECT NONPOSIX_FALLOCATE
+ */
+
+#ifdef APISUPPORT_CONFIG_FILE
+#include APISUPPORT_CONFIG_FILE
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -5,6 +13,8 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "noeintr.h"
@@ -17,6 +27,25 @@
 #define O_BINARY 0
 #endif
 
+/* Use O_DIRECT for direct I/O, if we have it. */
+#ifdef APISUPPORT_NONPOSIX_O_DIRECT
+#define DISK_O_DIRECT O_DIRECT
+#else
+#define DISK_O_DIRECT 0
+#endif
+
+/**
+ * disk_direct_supported(void):
+ * Return non-zero if direct I/O (bypassing the operating system's buffer
+ * cache) is supported on this platform.
+ */
+int
+disk_direct_supported(void)
+{
+
+	return (DISK_O_DIRECT != 0);
+}
+
 /**
  * disk_syncdir(path):
  * Make sure the directory ${path} is synced to disk.  On some systems, it is
@@ -61,23 +90,27 @@ err0:
 }
 
 /**
- * disk_read(path, offset, nbytes, buf):
- * Read ${nbytes} bytes from position ${offset} in file ${path} into the
- * buffer ${buf}.  Treat EOF as an error.  If the file ${path} does not
- * exist, fail and return with errno set to ENOENT.
+ * disk_open(path, direct):
+ * Open the file ${path} for reading and return a descriptor.  If the file
+ * ${path} does not exist, fail and return with errno set to ENOENT.  If
+ * ${direct} is non-zero, reads via the descriptor will bypass the operating
+ * system's buffer cache and must be aligned to DISK_DIRECT_ALIGN bytes.
  */
 int
-disk_read(const char * path, off_t offset, size_t nbytes, uint8_t * buf)
+disk_open(const char * path, int direct)
 {
+	int flags = O_RDONLY | O_BINARY;
 	int fd;
-	size_t bufpos;
-	ssize_t lenread;
+
+	/* Bypass the buffer cache if requested. */
+	if (direct)
+		flags |= DISK_O_DIRECT;
 
 	/*
 	 * Attempt to open the file.  Pass an errno value of ENOENT back
 	 * without printing a warning, since it might be a non-error.
 	 */
-	while ((fd = open(path, O_RDONLY | O_BINARY)) == -1) {
+	while ((fd = open(path, flags)) == -1) {
 		/* Try again on EINTR. */
 		if (errno == EINTR)
 			continue;
@@ -91,21 +124,36 @@ disk_read(const char * path, off_t offset, size_t nbytes, uint8_t * buf)
 		goto err0;
 	}
 
-	/* Seek to the appropriate position. */
-	if (lseek(fd, offset, SEEK_SET) == -1) {
-		warnp("lseek(%s, %" PRIu64 ")", path, (uint64_t)(offset));
-		goto err1;
-	}
+	/* Success! */
+	return (fd);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * disk_pread(fd, offset, nbytes, buf):
+ * Read ${nbytes} bytes from position ${offset} in the file open as ${fd}
+ * into the buffer ${buf}.  Treat EOF as an error.
+ */
+int
+disk_pread(int fd, off_t offset, size_t nbytes, uint8_t * buf)
+{
+	size_t bufpos;
+	ssize_t lenread;
 
 	/* Read into the buffer. */
 	for (bufpos = 0; bufpos < nbytes; bufpos += (size_t)lenread) {
 		/* Read some bytes. */
-		lenread = read(fd, &buf[bufpos], nbytes - bufpos);
+		lenread = pread(fd, &buf[bufpos], nbytes - bufpos,
+		    offset + (off_t)bufpos);
 
 		/* EOF? */
 		if (lenread == 0) {
-			warn0("Unexpected EOF reading file: %s", path);
-			goto err1;
+			warn0("Unexpected EOF reading block file at %" PRIu64,
+			    (uint64_t)(offset));
+			goto err0;
 		}
 
 		/* EINTR is harmless. */
@@ -114,15 +162,30 @@ disk_read(const char * path, off_t offset, size_t nbytes, uint8_t * buf)
 
 		/* Print a warning and fail on other errors. */
 		if (lenread == -1) {
-			warnp("Error reading file: %s", path);
-			goto err1;
+			warnp("Error reading block file");
+			goto err0;
 		}
 	}
 
-	/* Close the file. */
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * disk_close(fd):
+ * Close the descriptor ${fd}.
+ */
+int
+disk_close(int fd)
+{
+
 	while (close(fd)) {
 		if (errno != EINTR) {
-			warnp("close(%s)", path);
+			warnp("close");
 			goto err0;
 		}
 	}
@@ -130,34 +193,37 @@ disk_read(const char * path, off_t offset, size_t nbytes, uint8_t * buf)
 	/* Success! */
 	return (0);
 
-err1:
-	if (close(fd))
-		warnp("close");
 err0:
 	/* Failure! */
 	return (-1);
 }
 
 /**
- * disk_write(path, creat, nbytes, buf, nosync):
- * Append ${nbytes} from ${buf} to the end of the file ${path} and fsync.  If
- * ${creat} is non-zero, create the file (which should not exist yet) first
- * with 0600 permissions.  If ${nosync} is non-zero, skip the fsync.
+ * disk_open_append(path, creat, direct):
+ * Open the file ${path} for appending and return a descriptor.  If ${creat}
+ * is non-zero, create the file (which should not exist yet) with 0600
+ * permissions.  If ${direct} is non-zero, writes via the descriptor will
+ * bypass the operating system's buffer cache and must be aligned to
+ * DISK_DIRECT_ALIGN bytes.
  */
 int
-disk_write(const char * path, int create, size_t nbytes, const uint8_t * buf,
-    int nosync)
+disk_open_append(const char * path, int create, int direct)
 {
+	int flags = O_WRONLY | O_BINARY | O_APPEND;
 	int fd;
 
+	/* Bypass the buffer cache if requested. */
+	if (direct)
+		flags |= DISK_O_DIRECT;
+
 	/* Open or create the file, depending on ${creat}. */
 	do {
 		/* Attempt to open/create. */
 		if (create) {
-			fd = open(path, O_WRONLY | O_BINARY | O_APPEND |
-			    O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+			fd = open(path, flags | O_CREAT | O_EXCL,
+			    S_IRUSR | S_IWUSR);
 		} else {
-			fd = open(path, O_WRONLY | O_BINARY | O_APPEND);
+			fd = open(path, flags);
 		}
 
 		/* If we hit EINTR, try again. */
@@ -169,34 +235,298 @@ disk_write(const char * path, int create, size_t nbytes, const uint8_t * buf,
 		goto err0;
 	}
 
+	/* Success! */
+	return (fd);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+#ifdef APISUPPORT_NONPOSIX_FALLOCATE
+/**
+ * disk_prealloc(fd, offset, len):
+ * Ask for ${len} bytes of disk space starting at position ${offset} of the
+ * file open as ${fd} to be allocated, without changing the size of the file.
+ * On platforms which cannot do this, do nothing.
+ */
+int
+disk_prealloc(int fd, off_t offset, off_t len)
+{
+
+	/* Allocate space past the end of the file. */
+	while (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len)) {
+		/* EINTR is harmless. */
+		if (errno == EINTR)
+			continue;
+
+		/* Preallocation is only advisory. */
+		if ((errno == EOPNOTSUPP) || (errno == ENOSYS))
+			break;
+
+		/* Anything else is an error. */
+		warnp("fallocate");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+#else /* !APISUPPORT_NONPOSIX_FALLOCATE */
+/**
+ * disk_prealloc(fd, offset, len):
+ * Ask for ${len} bytes of disk space starting at position ${offset} of the
+ * file open as ${fd} to be allocated, without changing the size of the file.
+ * On platforms which cannot do this, do nothing.
+ */
+int
+disk_prealloc(int fd, off_t offset, off_t len)
+{
+
+	(void)fd; /* UNUSED */
+	(void)offset; /* UNUSED */
+	(void)len; /* UNUSED */
+
+	/* We can't preallocate space; that's fine. */
+	return (0);
+}
+#endif /* !APISUPPORT_NONPOSIX_FALLOCATE */
+
+#if defined(APISUPPORT_NONPOSIX_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+/**
+ * disk_punch(fd, offset, len):
+ * Release the disk space used by the ${len} bytes starting at position
+ * ${offset} of the file open as ${fd}, without changing the size of the file;
+ * the bytes will read as zeroes afterwards.  On platforms or filesystems
+ * which cannot do this, do nothing.
+ */
+int
+disk_punch(int fd, off_t offset, off_t len)
+{
+
+	/* Punch a hole in the file. */
+	while (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    offset, len)) {
+		/* EINTR is harmless. */
+		if (errno == EINTR)
+			continue;
+
+		/* Releasing space is only advisory. */
+		if ((errno == EOPNOTSUPP) || (errno == ENOSYS))
+			break;
+
+		/* Anything else is an error. */
+		warnp("fallocate");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+#else /* !(APISUPPORT_NONPOSIX_FALLOCATE && FALLOC_FL_PUNCH_HOLE) */
+/**
+ * disk_punch(fd, offset, len):
+ * Release the disk space used by the ${len} bytes starting at position
+ * ${offset} of the file open as ${fd}, without changing the size of the file;
+ * the bytes will read as zeroes afterwards.  On platforms or filesystems
+ * which cannot do this, do nothing.
+ */
+int
+disk_punch(int fd, off_t offset, off_t len)
+{
+
+	(void)fd; /* UNUSED */
+	(void)offset; /* UNUSED */
+	(void)len; /* UNUSED */
+
+	/* We can't release the space; it will be freed with the file. */
+	return (0);
+}
+#endif /* !(APISUPPORT_NONPOSIX_FALLOCATE && FALLOC_FL_PUNCH_HOLE) */
+
+/**
+ * disk_append(fd, nbytes, buf, nosync):
+ * Append ${nbytes} from ${buf} to the end of the file open as ${fd} and
+ * flush the data to disk.  If ${nosync} is non-zero, skip the flush.
+ */
+int
+disk_append(int fd, size_t nbytes, const uint8_t * buf, int nosync)
+{
+
 	/* Write from the buffer. */
-	if (noeintr_write(fd, buf, nbytes) != (ssize_t)nbytes)
-		goto err1;
+	if (noeintr_write(fd, buf, nbytes) != (ssize_t)nbytes) {
+		warnp("Error writing block file");
+		goto err0;
+	}
 
-	/* Ask to have the write flushed to disk. */
+	/*
+	 * Ask to have the write flushed to disk.  We only need the data and
+	 * the file size to be durable, not the modification time.
+	 */
 	if (nosync == 0) {
-		while (fsync(fd)) {
+		while (fdatasync(fd)) {
 			if (errno != EINTR) {
-				warnp("fsync(%s)", path);
-				goto err1;
+				warnp("fdatasync");
+				goto err0;
+			}
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * disk_truncate(fd, len):
+ * Truncate the file open as ${fd} to ${len} bytes, releasing any disk space
+ * which was preallocated beyond that point.
+ */
+int
+disk_truncate(int fd, off_t len)
+{
+
+	while (ftruncate(fd, len)) {
+		if (errno != EINTR) {
+			warnp("ftruncate");
+			goto err0;
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * disk_readfile(path, buf, len):
+ * Read the contents of the file ${path} into a malloc-allocated buffer, and
+ * set ${buf} and ${len} to the buffer and its length.  If the file ${path}
+ * does not exist, fail and return with errno set to ENOENT.
+ */
+int
+disk_readfile(const char * path, uint8_t ** buf, size_t * len)
+{
+	struct stat sb;
+	ssize_t lenread;
+	size_t pos;
+	int fd;
+
+	/* Open the file, without complaining if it doesn't exist. */
+	while ((fd = open(path, O_RDONLY | O_BINARY)) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno != ENOENT)
+			warnp("open(%s)", path);
+		goto err0;
+	}
+
+	/* How much do we need to read? */
+	if (fstat(fd, &sb)) {
+		warnp("fstat(%s)", path);
+		goto err1;
+	}
+	if ((uintmax_t)sb.st_size > (uintmax_t)(SIZE_MAX - 1)) {
+		errno = ENOMEM;
+		goto err1;
+	}
+	*len = (size_t)sb.st_size;
+
+	/* Allocate a buffer (with at least one byte, to keep malloc happy). */
+	if ((*buf = malloc(*len + 1)) == NULL)
+		goto err1;
+
+	/* Read the file. */
+	for (pos = 0; pos < *len; pos += (size_t)lenread) {
+		if ((lenread = read(fd, &(*buf)[pos], *len - pos)) == -1) {
+			if (errno == EINTR) {
+				lenread = 0;
+				continue;
 			}
+			warnp("read(%s)", path);
+			goto err2;
+		}
+		if (lenread == 0) {
+			warn0("Unexpected EOF reading %s", path);
+			goto err2;
 		}
 	}
 
 	/* Close the file. */
-	while (close(fd)) {
+	if (disk_close(fd)) {
+		free(*buf);
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(*buf);
+err1:
+	disk_close(fd);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * disk_replacefile(path, tmppath, buf, len, nosync):
+ * Atomically replace the file ${path} with one containing the ${len} bytes
+ * in ${buf}, by writing them to ${tmppath} and renaming that over ${path}.
+ * Unless ${nosync} is non-zero, flush the new file to disk before renaming
+ * it; the caller must sync the directory for the rename to be durable.
+ */
+int
+disk_replacefile(const char * path, const char * tmppath,
+    const uint8_t * buf, size_t len, int nosync)
+{
+	int fd;
+
+	/* Create the new file, replacing any left over from before. */
+	while ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+	    S_IRUSR | S_IWUSR)) == -1) {
 		if (errno != EINTR) {
-			warnp("close(%s)", path);
+			warnp("open(%s)", tmppath);
 			goto err0;
 		}
 	}
 
+	/* Write the data and make sure it reaches the disk. */
+	if (disk_append(fd, len, buf, nosync))
+		goto err2;
+
+	/* Close the file. */
+	if (disk_close(fd))
+		goto err1;
+
+	/* Move it into place. */
+	if (rename(tmppath, path)) {
+		warnp("rename(%s, %s)", tmppath, path);
+		goto err1;
+	}
+
 	/* Success! */
 	return (0);
 
+err2:
+	disk_close(fd);
 err1:
-	if (close(fd))
-		warnp("close");
+	unlink(tmppath);
 err0:
 	/* Failure! */
 	return (-1);
@@ -1,9 +1,20 @@
 #ifndef DISK_H_
 #define DISK_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 
+/* Alignment of buffers, lengths, and file positions for direct I/O. */
+#define DISK_DIRECT_ALIGN	4096
+
+/**
+ * disk_direct_supported(void):
+ * Return non-zero if direct I/O (bypassing the operating system's buffer
+ * cache) is supported on this platform.
+ */
+int disk_direct_supported(void);
+
 /**
  * disk_syncdir(path):
  * Make sure the directory ${path} is synced to disk.  On some systems, it is
@@ -15,19 +26,84 @@
 int disk_syncdir(const char *);
 
 /**
- * disk_read(path, offset, nbytes, buf):
- * Read ${nbytes} bytes from position ${offset} in file ${path} into the
- * buffer ${buf}.  Treat EOF as an error.  If the file ${path} does not
- * exist, fail and return with errno set to ENOENT.
+ * disk_open(path, direct):
+ * Open the file ${path} for reading and return a descriptor.  If the file
+ * ${path} does not exist, fail and return with errno set to ENOENT.  If
+ * ${direct} is non-zero, reads via the descriptor will bypass the operating
+ * system's buffer cache and must be aligned to DISK_DIRECT_ALIGN bytes.
+ */
+int disk_open(const char *, int);
+
+/**
+ * disk_pread(fd, offset, nbytes, buf):
+ * Read ${nbytes} bytes from position ${offset} in the file open as ${fd}
+ * into the buffer ${buf}.  Treat EOF as an error.
+ */
+int disk_pread(int, off_t, size_t, uint8_t *);
+
+/**
+ * disk_close(fd):
+ * Close the descriptor ${fd}.
+ */
+int disk_close(int);
+
+/**
+ * disk_open_append(path, creat, direct):
+ * Open the file ${path} for appending and return a descriptor.  If ${creat}
+ * is non-zero, create the file (which should not exist yet) with 0600
+ * permissions.  If ${direct} is non-zero, writes via the descriptor will
+ * bypass the operating system's buffer cache and must be aligned to
+ * DISK_DIRECT_ALIGN bytes.
+ */
+int disk_open_append(const char *, int, int);
+
+/**
+ * disk_prealloc(fd, offset, len):
+ * Ask for ${len} bytes of disk space starting at position ${offset} of the
+ * file open as ${fd} to be allocated, without changing the size of the file.
+ * On platforms which cannot do this, do nothing.
+ */
+int disk_prealloc(int, off_t, off_t);
+
+/**
+ * disk_punch(fd, offset, len):
+ * Release the disk space used by the ${len} bytes starting at position
+ * ${offset} of the file open as ${fd}, without changing the size of the file;
+ * the bytes will read as zeroes afterwards.  On platforms or filesystems
+ * which cannot do this, do nothing.
+ */
+int disk_punch(int, off_t, off_t);
+
+/**
+ * disk_append(fd, nbytes, buf, nosync):
+ * Append ${nbytes} from ${buf} to the end of the file open as ${fd} and
+ * flush the data to disk.  If ${nosync} is non-zero, skip the flush.
+ */
+int disk_append(int, size_t, const uint8_t *, int);
+
+/**
+ * disk_truncate(fd, len):
+ * Truncate the file open as ${fd} to ${len} bytes, releasing any disk space
+ * which was preallocated beyond that point.
+ */
+int disk_truncate(int, off_t);
+
+/**
+ * disk_readfile(path, buf, len):
+ * Read the contents of the file ${path} into a malloc-allocated buffer, and
+ * set ${buf} and ${len} to the buffer and its length.  If the file ${path}
+ * does not exist, fail and return with errno set to ENOENT.
  */
-int disk_read(const char *, off_t, size_t, uint8_t *);
+int disk_readfile(const char *, uint8_t **, size_t *);
 
 /**
- * disk_write(path, creat, nbytes, buf, nosync):
- * Append ${nbytes} from ${buf} to the end of the file ${path} and fsync.  If
- * ${creat} is non-zero, create the file (which should not exist yet) first
- * with 0600 permissions.  If ${nosync} is non-zero, skip the fsync.
+ * disk_replacefile(path, tmppath, buf, len, nosync):
+ * Atomically replace the file ${path} with one containing the ${len} bytes
+ * in ${buf}, by writing them to ${tmppath} and renaming that over ${path}.
+ * Unless ${nosync} is non-zero, flush the new file to disk before renaming
+ * it; the caller must sync the directory for the rename to be durable.
  */
-int disk_write(const char *, int, size_t, const uint8_t *, int);
+int disk_replacefile(const char *, const char *, const uint8_t *, size_t,
+    int);
 
 #endif /* !DISK_H_ */
@@ -1,10 +1,10 @@
 #include <sys/types.h>
-#include <sys/socket.h>
 #include <sys/un.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,62 +13,91 @@
 #include "netbuf.h"
 #include "network.h"
 #include "proto_lbs.h"
+#include "slab.h"
 #include "warnp.h"
 #include "wire.h"
 
+#include "disk.h"
+#include "readsched.h"
+#include "uring.h"
 #include "worker.h"
 
 #include "dispatch.h"
 #include "dispatch_internal.h"
 
+/* Maximum number of reads handed to a pool's readers, per reader. */
+#define READS_PER_READER	2
+
 static int callback_accept(void *, int);
 
-/* The ID of a thread with completed work has been read (or not). */
+/* Kill the reader threads, and free the read pools. */
 static int
-workdone(void * cookie, ssize_t lenread)
+pools_free(struct dispatch_state * D)
 {
-	struct dispatch_state * D = cookie;
+	size_t i;
+	int rc = 0;	/* No errors yet. */
 
-	/* If we failed to read a thread ID, something is seriously wrong. */
-	if (lenread != sizeof(size_t)) {
-		warnp("workdone failed to read thread ID");
-		goto err0;
+	for (i = 0; i < D->npools; i++) {
+		if ((D->pools[i].readers != NULL) &&
+		    worker_kill(D->pools[i].readers)) {
+			warnp("Cannot destroy reader threads");
+			rc = -1;
+		}
+		readsched_free(D->pools[i].Q);
 	}
+	free(D->pools);
 
-	/* Sanity-check the thread ID. */
-	assert(D->wakeupID <= D->nreaders + 2);
-
-	/* Send a response for whatever work was finished. */
-	if (dispatch_response_send(D, D->workers[D->wakeupID]))
-		goto err0;
+	/* Return success, or failure if anything went wrong. */
+	return (rc);
+}
 
-	/* Mark the thread as available for more work. */
-	if (D->wakeupID == D->nreaders + 1) {
-		D->deleter_busy = 0;
-	} else if (D->wakeupID == D->nreaders) {
-		D->writer_busy = 0;
-	} else {
-		D->readers_idle[D->nreaders_idle++] = D->wakeupID;
+/* Work has been completed by worker threads. */
+static int
+workdone(void * cookie, struct workitem * W)
+{
+	struct dispatch_state * D = cookie;
+	struct workitem * W_next;
+
+	/* Handle each completed work item. */
+	for (; W != NULL; W = W_next) {
+		W_next = W->next;
+
+		/* Sanity-check the queue ID. */
+		assert(W->qid <= D->npools + 1);
+
+		/* Mark the thread (or a reader slot) as available. */
+		if (W->qid == D->npools + 1)
+			D->deleter_busy = 0;
+		else if (W->qid == D->npools)
+			D->writer_busy = 0;
+		else
+			D->pools[W->qid].inflight -= 1;
+
+		/* Send a response for whatever work was finished. */
+		if (dispatch_response_send(D, W))
+			goto err1;
 	}
 
 	/*
-	 * If this was a read thread, check if there is pending work which
-	 * should now be scheduled for this thread.
+	 * Launch any queued work which can now be performed.  We do this
+	 * once for the whole batch, so that the reads which replace those
+	 * which completed are handed to the readers together.
 	 */
-	if ((D-> wakeupID < D->nreaders) && dispatch_request_pokereadq(D))
+	if (dispatch_request_pokereadq(D))
 		goto err0;
-
-	/* Read the ID of another thread with completed work. */
-	if ((D->wakeup_cookie = network_read(D->spair[0],
-	    (uint8_t *)&D->wakeupID, sizeof(size_t), sizeof(size_t),
-	    workdone, D)) == NULL) {
-		warnp("Error reading thread ID from socket");
+	if (dispatch_request_pokeappendq(D))
+		goto err0;
+	if (dispatch_request_pokefreeq(D))
 		goto err0;
-	}
 
 	/* Success! */
 	return (0);
 
+err1:
+	for (W = W_next; W != NULL; W = W_next) {
+		W_next = W->next;
+		free(W);
+	}
 err0:
 	/* Failure! */
 	return (-1);
@@ -79,7 +108,9 @@ static int
 dropconnection(void * cookie)
 {
 	struct dispatch_state * D = cookie;
-	void * tmp;
+	struct appendq * aq;
+	struct readpool * P;
+	size_t i;
 
 	/* If we're waiting for a request to arrive, stop waiting. */
 	if (D->read_cookie != NULL) {
@@ -88,11 +119,19 @@ dropconnection(void * cookie)
 	}
 
 	/* Kill any queued read requests. */
-	while (D->readq_head) {
-		tmp = D->readq_head;
-		D->readq_head = D->readq_head->next;
+	for (i = 0; i < D->npools; i++) {
+		P = &D->pools[i];
+		D->npending -= readsched_len(P->Q);
+		readsched_clear(P->Q);
+	}
+
+	/* Kill any queued write requests. */
+	while (D->appendq_head) {
+		aq = D->appendq_head;
+		D->appendq_head = D->appendq_head->next;
 		D->npending -= 1;
-		free(tmp);
+		free(aq->buf);
+		free(aq);
 	}
 
 	/* Success!  (We can't fail -- but netbuf_write doesn't know that.) */
@@ -163,6 +202,10 @@ gotrequest(void * cookie, int status)
 			if (dispatch_request_free(D, R))
 				goto err0;
 			break;
+		case PROTO_LBS_FREERANGE:
+			if (dispatch_request_freerange(D, R))
+				goto err0;
+			break;
 		default:
 			/* proto_lbs_request_read broke. */
 			assert(0);
@@ -197,94 +240,167 @@ err0:
 }
 
 /**
- * dispatch_init(S, blocklen, nreaders):
+ * dispatch_init(S, blocklen, direct, ndirs, nreaders, depth, deadline,
+ *     appendmax):
  * Initialize a dispatcher to manage requests to storage state ${S} with
- * block size ${blocklen}, using ${nreaders} read threads.
+ * block size ${blocklen}, using ${nreaders} read threads for each of the
+ * ${ndirs} storage directories.  If ${direct} is non-zero, the storage state
+ * uses direct I/O and blocks must be read into suitably aligned buffers.  If
+ * ${depth} is non-zero, attempt to perform reads via an io_uring with up to
+ * ${depth} reads in flight instead of using read threads.  Perform queued
+ * reads in ascending order of block number, except that a read which has
+ * waited ${deadline} seconds goes first.  While reads are queued or in
+ * progress, write at most ${appendmax} blocks of queued APPENDs at once.
  */
 struct dispatch_state *
-dispatch_init(struct storage_state * S, size_t blocklen, size_t nreaders)
+dispatch_init(struct storage_state * S, size_t blocklen, int direct,
+    size_t ndirs, size_t nreaders, size_t depth, double deadline,
+    size_t appendmax)
 {
 	struct dispatch_state * D;
-	size_t nworkers;
-	size_t i;
+	struct readpool * P;
+	size_t reclen;
+	size_t j;
 
 	/* Bake a cookie. */
 	if ((D = malloc(sizeof(struct dispatch_state))) == NULL)
 		goto err0;
-	D->nreaders = nreaders;
 	D->writer_busy = D->deleter_busy = 0;
+	D->freeto = 0;
+	D->freeranges = NULL;
+	D->nfreeranges = 0;
 	D->blocklen = blocklen;
 	D->sstate = S;
+	D->appendmax_reading = appendmax;
+
+	/* If requested, hand reads to the kernel instead of to threads. */
+	D->uring = NULL;
+	D->uring_depth = depth;
+	D->uring_inflight = 0;
+	D->npools = ndirs;
+	if (depth > 0) {
+		if ((D->uring = uring_init(depth, dispatch_response_uring,
+		    D)) == NULL) {
+			warnp("Cannot use io_uring; using read threads");
+		} else {
+			D->npools = 1;
+			nreaders = 0;
+		}
+	}
 
-	/* All the readers will be idle when we create them. */
-	if (IMALLOC(D->readers_idle, D->nreaders, size_t))
+	/* Collect completed work from all the worker threads. */
+	if ((D->done = worker_done_init(workdone, D)) == NULL)
 		goto err1;
-	D->nreaders_idle = D->nreaders;
-	for (i = 0; i < D->nreaders; i++)
-		D->readers_idle[i] = i;
 
-	/* Create a socket pair for sending work completion messages. */
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, D->spair)) {
-		warnp("socketpair");
+	/*
+	 * Give each storage directory its own queue of reads and its own
+	 * readers, so that a slow device can't tie up every reader.  We hand
+	 * each pool up to READS_PER_READER reads per reader, so that a reader
+	 * which finishes a read can take the next one without waiting for us
+	 * to notice.
+	 */
+	D->readmax = nreaders * READS_PER_READER;
+	if (IMALLOC(D->pools, D->npools, struct readpool))
 		goto err2;
+	for (j = 0; j < D->npools; j++) {
+		D->pools[j].Q = NULL;
+		D->pools[j].readers = NULL;
+		D->pools[j].inflight = 0;
 	}
-
-	/* Mark the read end of the socket pair as non-blocking. */
-	if (fcntl(D->spair[0], F_SETFL, O_NONBLOCK) == -1) {
-		warnp("Cannot make wakeup socket non-blocking");
-		goto err3;
+	for (j = 0; j < D->npools; j++) {
+		P = &D->pools[j];
+		if ((P->Q = readsched_init(deadline)) == NULL)
+			goto err3;
+		if ((nreaders > 0) && ((P->readers = worker_create(j,
+		    nreaders, S, blocklen, D->done)) == NULL)) {
+			warnp("Cannot create reader threads");
+			goto err3;
+		}
 	}
 
-	/* Read work completion messages from the socket. */
-	if ((D->wakeup_cookie = network_read(D->spair[0],
-	    (uint8_t *)&D->wakeupID, sizeof(size_t), sizeof(size_t),
-	    workdone, D)) == NULL) {
-		warnp("Error reading thread ID from socket");
+	/* Create the writer and deleter threads. */
+	if ((D->writer = worker_create(D->npools, 1, S, blocklen,
+	    D->done)) == NULL) {
+		warnp("Cannot create writer thread");
 		goto err3;
 	}
-
-	/* Create worker threads. */
-	nworkers = D->nreaders + 2;
-	if (IMALLOC(D->workers, nworkers, struct workctl *)) {
-		warnp("malloc");
+	if ((D->deleter = worker_create(D->npools + 1, 1, S, blocklen,
+	    D->done)) == NULL) {
+		warnp("Cannot create deleter thread");
 		goto err4;
 	}
-	for (i = 0; i < nworkers; i++)
-		D->workers[i] = NULL;
-	for (i = 0; i < nworkers; i++) {
-		if ((D->workers[i] =
-		    worker_create(i, S, D->spair[1])) == NULL) {
-			warnp("Cannot create worker thread");
-			goto err5;
-		}
-	}
+
+	/*
+	 * Create an allocator for block read buffers.  Each buffer holds a
+	 * complete GET response, with the block data at offset ${readoff}, so
+	 * that the response can be sent without copying the data; if we're
+	 * using direct I/O, the data must be aligned.  Buffers are held until
+	 * the response has been written to the connection, so there may be a
+	 * few more of them than reads in progress (in threads or in flight via
+	 * io_uring), but we should rarely need more than one slab.  The slab
+	 * size is a multiple of the record size so that slabs are aligned for
+	 * huge pages (and thus for direct I/O).
+	 */
+	D->readoff = direct ? DISK_DIRECT_ALIGN :
+	    PROTO_LBS_RESPONSE_GET_DATAOFF;
+	reclen = D->readoff + PROTO_LBS_RESPONSE_GET_LEN(blocklen) -
+	    PROTO_LBS_RESPONSE_GET_DATAOFF;
+	if (direct)
+		reclen = (reclen + DISK_DIRECT_ALIGN - 1) / DISK_DIRECT_ALIGN *
+		    DISK_DIRECT_ALIGN;
+	if ((D->readbufs = slab_init(reclen,
+	    (SLAB_HUGEPAGE + reclen - 1) / reclen * reclen)) == NULL)
+		goto err5;
 
 	/* Success! */
 	return (D);
 
 err5:
-	for (i = 0; i < nworkers; i++) {
-		if (D->workers[i] == NULL)
-			continue;
-		worker_kill(D->workers[i]);
-	}
-	free(D->workers);
+	worker_kill(D->deleter);
 err4:
-	network_read_cancel(D->wakeup_cookie);
+	worker_kill(D->writer);
 err3:
-	if (close(D->spair[1]))
-		warnp("close");
-	if (close(D->spair[0]))
-		warnp("close");
+	pools_free(D);
 err2:
-	free(D->readers_idle);
+	worker_done_free(D->done);
 err1:
+	uring_free(D->uring);
 	free(D);
 err0:
 	/* Failure! */
 	return (NULL);
 }
 
+/**
+ * dispatch_readbuf_alloc(dstate):
+ * Return a buffer into which a block can be read, with space around it for
+ * constructing a GET response via proto_lbs_response_get_frame() at
+ * &${buf}[-PROTO_LBS_RESPONSE_GET_DATAOFF].
+ */
+uint8_t *
+dispatch_readbuf_alloc(struct dispatch_state * dstate)
+{
+	uint8_t * rec;
+
+	/* Allocate a record. */
+	if ((rec = slab_rec_alloc(dstate->readbufs)) == NULL)
+		return (NULL);
+
+	/* The block data goes at the offset we picked. */
+	return (&rec[dstate->readoff]);
+}
+
+/**
+ * dispatch_readbuf_free(dstate, buf):
+ * Free the buffer ${buf} returned by dispatch_readbuf_alloc().
+ */
+void
+dispatch_readbuf_free(struct dispatch_state * dstate, uint8_t * buf)
+{
+
+	slab_rec_free(dstate->readbufs, &buf[-(ptrdiff_t)dstate->readoff]);
+}
+
 /**
  * dispatch_accept(D, s):
  * Accept a connection from the listening socket ${s} and perform all
@@ -319,9 +435,10 @@ callback_accept(void * cookie, int s)
 		goto err0;
 	}
 
-	/* We have no pending requests and no queued reads. */
+	/* We have no pending requests and no queued reads or writes. */
 	D->npending = 0;
-	D->readq_head = NULL;
+	D->appendq_head = NULL;
+	D->appending = NULL;
 
 	/* Make the accepted connection non-blocking. */
 	if (fcntl(D->sconn, F_SETFL, O_NONBLOCK) == -1) {
@@ -425,37 +542,29 @@ err0:
 int
 dispatch_done(struct dispatch_state * D)
 {
-	size_t i;
 	int rc = 0;	/* No errors yet. */
 
 	/* Shut down the worker threads. */
-	for (i = 0; i < D->nreaders + 2; i++) {
-		if (worker_kill(D->workers[i])) {
-			warnp("Cannot destroy worker thread");
-			rc = -1;
-		}
-	}
-	free(D->workers);
-
-	/* Stop reading work completion messages. */
-	network_read_cancel(D->wakeup_cookie);
-
-	/* Close the work completion message conduit. */
-	while (close(D->spair[1])) {
-		if (errno == EINTR)
-			continue;
-		warnp("close");
+	if (worker_kill(D->deleter)) {
+		warnp("Cannot destroy deleter thread");
 		rc = -1;
 	}
-	while (close(D->spair[0])) {
-		if (errno == EINTR)
-			continue;
-		warnp("close");
+	if (worker_kill(D->writer)) {
+		warnp("Cannot destroy writer thread");
 		rc = -1;
 	}
+	if (pools_free(D))
+		rc = -1;
+
+	/* Stop collecting completed work. */
+	worker_done_free(D->done);
+
+	/* Shut down the io_uring, if we have one. */
+	uring_free(D->uring);
 
 	/* Free allocated memory. */
-	free(D->readers_idle);
+	free(D->freeranges);
+	slab_free(D->readbufs);
 	free(D);
 
 	/* Return success, or failure if anything went wrong. */
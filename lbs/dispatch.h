@@ -9,11 +9,20 @@ struct dispatch_state;
 struct storage_state;
 
 /**
- * dispatch_init(S, blocklen, nreaders):
+ * dispatch_init(S, blocklen, direct, ndirs, nreaders, depth, deadline,
+ *     appendmax):
  * Initialize a dispatcher to manage requests to storage state ${S} with
- * block size ${blocklen}, using ${nreaders} read threads.
+ * block size ${blocklen}, using ${nreaders} read threads for each of the
+ * ${ndirs} storage directories.  If ${direct} is non-zero, the storage state
+ * uses direct I/O and blocks must be read into suitably aligned buffers.  If
+ * ${depth} is non-zero, attempt to perform reads via an io_uring with up to
+ * ${depth} reads in flight instead of using read threads.  Perform queued
+ * reads in ascending order of block number, except that a read which has
+ * waited ${deadline} seconds goes first.  While reads are queued or in
+ * progress, write at most ${appendmax} blocks of queued APPENDs at once.
  */
-struct dispatch_state * dispatch_init(struct storage_state *, size_t, size_t);
+struct dispatch_state * dispatch_init(struct storage_state *, size_t, int,
+    size_t, size_t, size_t, double, size_t);
 
 /**
  * dispatch_accept(D, s):
@@ -7,36 +7,65 @@
 /* Opaque types. */
 struct netbuf_read;
 struct netbuf_write;
+struct proto_lbs_range;
 struct proto_lbs_request;
+struct readsched;
+struct slab;
 struct storage_state;
+struct uring;
+struct workdone;
+struct workitem;
+struct workq;
+
+/* Pending block reads for one storage directory, and its reader threads. */
+struct readpool {
+	struct readsched * Q;		/* Queue of pending reads. */
+	struct workq * readers;		/* Reads handed to reader threads... */
+	size_t inflight;		/* ... and how many of them. */
+};
+
+/* Linked list structure for queue of pending block writes. */
+struct appendq {
+	struct appendq * next;		/* Next pending write. */
+	uint64_t reqID;			/* Packet ID of APPEND request. */
+	uint64_t blkno;			/* First block # to write. */
+	size_t nblks;			/* Number of blocks to write. */
+	uint8_t * buf;			/* Data to write. */
+};
 
-/* Linked list structure for queue of pending block reads. */
-struct readq {
-	struct readq * next;		/* Next pending read. */
+/* A block read in flight via io_uring. */
+struct uringread {
 	uint64_t reqID;			/* Packet ID of GET request. */
-	uint64_t blkno;			/* Requested block #. */
+	uint64_t blkno;			/* Block being read. */
+	uint8_t * buf;			/* Buffer being read into. */
+	int fd;				/* Descriptor being read from. */
+	void * ref;			/* Reference from storage_read_open. */
 };
 
 /* State of the work dispatcher. */
 struct dispatch_state {
 	/* Thread management. */
-	struct workctl ** workers;	/* #0--(nreaders-1) are readers. */
-					/* #(nreaders) is the writer. */
-					/* #(nreaders+1) is the deleter. */
-	size_t nreaders;		/* Number of reader threads. */
+	struct workdone * done;		/* Work completed by any thread. */
+	struct workq * writer;		/* Work for the writer thread. */
+	struct workq * deleter;		/* Work for the deleter thread. */
+	size_t readmax;			/* Max reads handed to each pool. */
 	int writer_busy;		/* Is the writer thread busy? */
 	int deleter_busy;		/* Is the deleter thread busy? */
-	size_t nreaders_idle;		/* How many readers are idle... */
-	size_t * readers_idle;		/* ... and what are their #s? */
+
+	/* Reads; each pool has its own reader threads. */
+	size_t npools;			/* # storage dirs, or 1 for io_uring. */
+	struct readpool * pools;	/* Pending reads and their readers. */
+
+	/* io_uring reads, if in use. */
+	struct uring * uring;		/* io_uring, or NULL to use readers. */
+	size_t uring_depth;		/* Maximum reads in flight. */
+	size_t uring_inflight;		/* Reads in flight. */
 
 	/* Storage management. */
 	size_t blocklen;		/* Block length. */
 	struct storage_state * sstate;	/* Back-end storage state. */
-
-	/* Work done dispatch-poking. */
-	int spair[2];			/* Read from [0], write to [1]. */
-	size_t wakeupID;		/* Thread ID being read. */
-	void * wakeup_cookie;		/* Thread ID read cookie. */
+	struct slab * readbufs;		/* Buffers for block reads. */
+	size_t readoff;			/* Offset of block in read buffers. */
 
 	/* Connection management. */
 	int accepting;			/* We are waiting for a connection. */
@@ -47,16 +76,51 @@ struct dispatch_state {
 	size_t npending;		/* # responses we owe. */
 
 	/* Pending work. */
-	struct readq * readq_head;	/* Queue of pending reads. */
-	struct readq ** readq_tail;	/* Location of terminating NULL. */
+	struct appendq * appendq_head;	/* Queue of pending writes. */
+	struct appendq ** appendq_tail;	/* Location of terminating NULL. */
+	uint64_t appendnext;		/* Block # after pending writes. */
+	size_t appendmax_reading;	/* Max blocks per write during GETs. */
+	struct appendq * appending;	/* Writes being performed. */
+	uint64_t freeto;		/* FREE waiting for deleter, or 0. */
+	struct proto_lbs_range * freeranges;	/* Ranges waiting to be... */
+	size_t nfreeranges;		/* ... freed by the deleter. */
 };
 
 /**
- * dispatch_response_send(dstate, thread):
- * Using the dispatch state ${dstate}, send a response for the work which was
- * just completed by thread ${thread}.
+ * dispatch_readbuf_alloc(dstate):
+ * Return a buffer into which a block can be read, with space around it for
+ * constructing a GET response via proto_lbs_response_get_frame() at
+ * &${buf}[-PROTO_LBS_RESPONSE_GET_DATAOFF].
+ */
+uint8_t * dispatch_readbuf_alloc(struct dispatch_state *);
+
+/**
+ * dispatch_readbuf_free(dstate, buf):
+ * Free the buffer ${buf} returned by dispatch_readbuf_alloc().
+ */
+void dispatch_readbuf_free(struct dispatch_state *, uint8_t *);
+
+/**
+ * dispatch_response_get(dstate, buf, len):
+ * Using the dispatch state ${dstate}, send the GET response of length ${len}
+ * which has been constructed around the read buffer ${buf}, and free the
+ * buffer (once the response has been written).
+ */
+int dispatch_response_get(struct dispatch_state *, uint8_t *, size_t);
+
+/**
+ * dispatch_response_send(dstate, W):
+ * Using the dispatch state ${dstate}, send a response for the work item ${W}
+ * which was just completed by a worker thread, and free the work item.
+ */
+int dispatch_response_send(struct dispatch_state *, struct workitem *);
+
+/**
+ * dispatch_response_uring(dstate, udata, res):
+ * Using the dispatch state ${dstate}, send a response for the io_uring read
+ * ${udata}, which completed with result ${res}.
  */
-int dispatch_response_send(struct dispatch_state *, struct workctl *);
+int dispatch_response_uring(void *, uint64_t, int32_t);
 
 /**
  * dispatch_request_params(dstate, R):
@@ -92,6 +156,12 @@ int dispatch_request_pokereadq(struct dispatch_state *);
 int dispatch_request_append(struct dispatch_state *,
     struct proto_lbs_request *);
 
+/**
+ * dispatch_request_pokeappendq(dstate):
+ * Launch a queued APPEND if possible.
+ */
+int dispatch_request_pokeappendq(struct dispatch_state *);
+
 /**
  * dispatch_request_free(dstate, R):
  * Handle and free a FREE request.
@@ -99,4 +169,17 @@ int dispatch_request_append(struct dispatch_state *,
 int dispatch_request_free(struct dispatch_state *,
     struct proto_lbs_request *);
 
+/**
+ * dispatch_request_freerange(dstate, R):
+ * Handle and free a FREERANGE request.
+ */
+int dispatch_request_freerange(struct dispatch_state *,
+    struct proto_lbs_request *);
+
+/**
+ * dispatch_request_pokefreeq(dstate):
+ * Launch a queued FREE or queued FREERANGEs if possible.
+ */
+int dispatch_request_pokefreeq(struct dispatch_state *);
+
 #endif /* !DISPATCH_INTERNAL_H_ */
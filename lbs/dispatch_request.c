@@ -1,16 +1,27 @@
+#include <sys/types.h>
+
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "proto_lbs.h"
 #include "warnp.h"
 
 #include "dispatch.h"
+#include "readsched.h"
 #include "storage.h"
+#include "uring.h"
 #include "worker.h"
 
 #include "dispatch_internal.h"
 
+/* Maximum number of bytes of queued APPENDs to perform at once. */
+#define APPEND_BATCH_MAX	(8 * 1024 * 1024)
+
+/* Maximum number of FREERANGE ranges to queue while the deleter is busy. */
+#define FREERANGE_QUEUE_MAX	(1024 * 1024)
+
 /**
  * dispatch_request_params(dstate, R):
  * Handle and free a PARAMS request.
@@ -102,19 +113,20 @@ int
 dispatch_request_get(struct dispatch_state * dstate,
     struct proto_lbs_request * R)
 {
-	struct readq * rq;
+	size_t dir;
+
+	/* Figure out which storage directory the block is in. */
+	if (dstate->npools > 1) {
+		if ((dir = storage_blkdir(dstate->sstate,
+		    R->r.get.blkno)) == (size_t)(-1))
+			goto err1;
+	} else {
+		dir = 0;
+	}
 
-	/* Add the read request to the pending read queue. */
-	if ((rq = malloc(sizeof(struct readq))) == NULL)
+	/* Add the read request to that directory's pending read queue. */
+	if (readsched_add(dstate->pools[dir].Q, R->ID, R->r.get.blkno))
 		goto err1;
-	rq->next = NULL;
-	rq->reqID = R->ID;
-	rq->blkno = R->r.get.blkno;
-	if (dstate->readq_head == NULL)
-		dstate->readq_head = rq;
-	else
-		*(dstate->readq_tail) = rq;
-	dstate->readq_tail = &rq->next;
 
 	/* Free the request structure. */
 	free(R);
@@ -133,74 +145,196 @@ err0:
 	return (-1);
 }
 
-/**
- * dispatch_request_pokereadq(dstate):
- * Launch queued GET(s) if possible.
- */
-int
-dispatch_request_pokereadq(struct dispatch_state * dstate)
+/* Launch queued GET(s) via io_uring if possible. */
+static int
+pokereadq_uring(struct dispatch_state * dstate)
 {
-	struct readq * R;
-	struct workctl * reader;
-	uint8_t * buf;
+	struct readsched * Q = dstate->pools[0].Q;
+	struct uringread * UR;
+	uint64_t reqID;
+	uint64_t blkno;
+	off_t offset;
+	size_t len;
+	int cached;
+	int rc;
+
+	/* Sanity check. */
+	assert(dstate->blocklen <= UINT32_MAX);
 
 	/* Loop as long as we can launch a read. */
-	while ((dstate->nreaders_idle > 0) && (dstate->readq_head != NULL)) {
-		/* Grab the first read from the queue. */
-		R = dstate->readq_head;
+	while ((dstate->uring_inflight < dstate->uring_depth) &&
+	    (readsched_len(Q) > 0)) {
+		/* Grab the next read from the queue. */
+		if (readsched_get(Q, &reqID, &blkno))
+			goto err0;
 
-		/* Allocate a buffer to read the block into. */
-		if ((buf = malloc(dstate->blocklen)) == NULL)
+		/* Allocate read state and a buffer to read the block into. */
+		if ((UR = malloc(sizeof(struct uringread))) == NULL)
 			goto err0;
+		UR->reqID = reqID;
+		UR->blkno = blkno;
+		if ((UR->buf = dispatch_readbuf_alloc(dstate)) == NULL)
+			goto err1;
 
-		/* Grab an idle reader. */
-		reader = dstate->workers[
-		    dstate->readers_idle[dstate->nreaders_idle - 1]];
-		dstate->nreaders_idle -= 1;
+		/* Look for the block in the cache first, then on disk. */
+		if ((rc = storage_read_cached(dstate->sstate, blkno,
+		    UR->buf)) == -1)
+			goto err2;
+		cached = rc;
+		if ((cached == 0) && ((rc = storage_read_open(dstate->sstate,
+		    blkno, &UR->fd, &offset, &UR->ref)) == -1))
+			goto err2;
+
+		/* Read the block, or respond if it's cached or nonexistent. */
+		if ((cached == 0) && (rc == 1)) {
+			if (uring_read(dstate->uring, UR->fd, offset, UR->buf,
+			    dstate->blocklen, (uint64_t)(uintptr_t)UR))
+				goto err3;
+			dstate->uring_inflight += 1;
+		} else {
+			dstate->npending--;
+			len = proto_lbs_response_get_frame(
+			    &UR->buf[-PROTO_LBS_RESPONSE_GET_DATAOFF],
+			    UR->reqID, rc ? 0 : 1, (uint32_t)dstate->blocklen);
+			if (dispatch_response_get(dstate, UR->buf, len))
+				goto err1;
+			free(UR);
+		}
+	}
 
-		/* Give the reader the work. */
-		if (worker_assign(reader, 0, R->blkno, 0, buf, R->reqID))
-			goto err1;
+	/* Start the reads. */
+	if (uring_submit(dstate->uring))
+		goto err0;
 
-		/* Remove the work from the queue. */
-		dstate->readq_head = R->next;
+	/* Success! */
+	return (0);
+
+err3:
+	storage_read_close(dstate->sstate, UR->fd, UR->ref);
+err2:
+	dispatch_readbuf_free(dstate, UR->buf);
+err1:
+	free(UR);
+err0:
+	/* Failure! */
+	return (-1);
+}
 
-		/* Free the dequeued read queue entry. */
-		free(R);
+/**
+ * dispatch_request_pokereadq(dstate):
+ * Launch queued GET(s) if possible.
+ */
+int
+dispatch_request_pokereadq(struct dispatch_state * dstate)
+{
+	struct readpool * P;
+	struct workitem * W;
+	struct workitem * W_head;
+	struct workitem ** W_tail;
+	size_t i;
+
+	/* If we're using io_uring, hand the reads to the kernel. */
+	if (dstate->uring != NULL)
+		return (pokereadq_uring(dstate));
+
+	/* Launch as many reads as we can from each directory's queue. */
+	for (i = 0; i < dstate->npools; i++) {
+		P = &dstate->pools[i];
+
+		/* Gather the reads into a list. */
+		W_head = NULL;
+		W_tail = &W_head;
+		while ((P->inflight < dstate->readmax) &&
+		    (readsched_len(P->Q) > 0)) {
+			/* Allocate a work item and a buffer for the block. */
+			if ((W = malloc(sizeof(struct workitem))) == NULL)
+				goto err1;
+			if ((W->buf = dispatch_readbuf_alloc(dstate)) == NULL)
+				goto err2;
+
+			/* Grab the next read from the queue. */
+			if (readsched_get(P->Q, &W->reqID, &W->blkno))
+				goto err3;
+			W->op = 0;
+			W->nblks = 0;
+
+			/* Add it to the list. */
+			W->next = NULL;
+			*W_tail = W;
+			W_tail = &W->next;
+			P->inflight += 1;
+		}
+
+		/* Hand the reads to the pool's readers all at once. */
+		if ((W_head != NULL) && worker_submit(P->readers, W_head))
+			goto err1;
 	}
 
 	/* Success! */
 	return (0);
 
+err3:
+	dispatch_readbuf_free(dstate, W->buf);
+err2:
+	free(W);
 err1:
-	dstate->nreaders_idle += 1;
-	free(buf);
-err0:
+	while ((W = W_head) != NULL) {
+		W_head = W->next;
+		dispatch_readbuf_free(dstate, W->buf);
+		free(W);
+	}
+
 	/* Failure! */
 	return (-1);
 }
 
+/* Return non-zero if any GETs are queued or being performed. */
+static int
+readsbusy(struct dispatch_state * dstate)
+{
+	struct readpool * P;
+	size_t i;
+
+	/* Are any reads in flight via io_uring? */
+	if (dstate->uring_inflight > 0)
+		return (1);
+
+	/* Are any reads queued, or are any readers busy? */
+	for (i = 0; i < dstate->npools; i++) {
+		P = &dstate->pools[i];
+		if ((readsched_len(P->Q) > 0) || (P->inflight > 0))
+			return (1);
+	}
+
+	/* Nothing is being read. */
+	return (0);
+}
+
 /**
  * dispatch_request_append(dstate, R):
- * Handle and free a APPEND request.
+ * Handle and free a APPEND request (queue it if necessary).
  */
 int
 dispatch_request_append(struct dispatch_state * dstate,
     struct proto_lbs_request * R)
 {
-	struct workctl * writer = dstate->workers[dstate->nreaders];
+	struct appendq * aq;
 	uint64_t blkno;
 
-	/* Figure out what the first available block number is. */
-	if ((blkno = storage_nextblock(dstate->sstate)) == (uint64_t)(-1))
-		goto err1;
-
 	/*
-	 * If the block number provided is wrong, or there's a write in
-	 * progress (in which case the requestor can't possibly know what
-	 * the correct next block number is), send a failure response.
+	 * Figure out what the first available block number is.  If there's
+	 * a write in progress, the next write must start where the most
+	 * recently accepted write ends; this allows the requestor to split
+	 * a large write into a sequence of pipelined APPENDs.
 	 */
-	if ((R->r.append.blkno != blkno) || (dstate->writer_busy != 0)) {
+	if (dstate->writer_busy != 0)
+		blkno = dstate->appendnext;
+	else if ((blkno = storage_nextblock(dstate->sstate)) ==
+	    (uint64_t)(-1))
+		goto err1;
+
+	/* If the block number provided is wrong, send a failure response. */
+	if (R->r.append.blkno != blkno) {
 		dstate->npending--;
 		if (proto_lbs_response_append(dstate->writeq, R->ID, 1,
 		    (uint64_t)(-1)))
@@ -208,15 +342,30 @@ dispatch_request_append(struct dispatch_state * dstate,
 		goto badblkno;
 	}
 
-	/* Give the writer the work. */
-	dstate->writer_busy = 1;
-	if (worker_assign(writer, 1, R->r.append.blkno, R->r.append.nblks,
-	    R->r.append.buf, R->ID))
+	/* Add the write request to the pending write queue. */
+	if ((aq = malloc(sizeof(struct appendq))) == NULL)
 		goto err1;
+	aq->next = NULL;
+	aq->reqID = R->ID;
+	aq->blkno = R->r.append.blkno;
+	aq->nblks = R->r.append.nblks;
+	aq->buf = R->r.append.buf;
+	if (dstate->appendq_head == NULL)
+		dstate->appendq_head = aq;
+	else
+		*(dstate->appendq_tail) = aq;
+	dstate->appendq_tail = &aq->next;
 
-	/* Free the request but NOT the buffer, since the thread owns that. */
+	/* The next write must start after this one. */
+	dstate->appendnext = blkno + R->r.append.nblks;
+
+	/* Free the request but NOT the buffer, since the queue owns that. */
 	free(R);
 
+	/* Poke the queue. */
+	if (dispatch_request_pokeappendq(dstate))
+		goto err0;
+
 	/* Success! */
 	return (0);
 
@@ -232,7 +381,99 @@ err1:
 	/* Free request AND included buffer. */
 	free(R->r.append.buf);
 	free(R);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * dispatch_request_pokeappendq(dstate):
+ * Launch queued APPEND(s) if possible.
+ */
+int
+dispatch_request_pokeappendq(struct dispatch_state * dstate)
+{
+	struct workitem * W;
+	struct appendq * aq;
+	struct appendq * aq_last;
+	size_t nblks;
+	size_t maxblks;
+	uint8_t * buf;
+	uint8_t * p;
 
+	/* If the writer is busy or there's nothing to write, do nothing. */
+	if ((dstate->writer_busy != 0) || (dstate->appendq_head == NULL))
+		goto done;
+
+	/* Grab the first write from the queue. */
+	aq = dstate->appendq_head;
+
+	/* Sanity check: Writes are queued in block order. */
+	assert(aq->blkno == storage_nextblock(dstate->sstate));
+
+	/*
+	 * Queued writes are contiguous, so we can perform as many of them as
+	 * we like at once, with a single flush to disk.  Don't take more than
+	 * APPEND_BATCH_MAX bytes (unless the first write is larger) so that
+	 * the first write isn't delayed too much; and if GETs are waiting,
+	 * don't take more than we were told to, so that they don't queue up
+	 * behind a long flush.
+	 */
+	maxblks = APPEND_BATCH_MAX / dstate->blocklen;
+	if (readsbusy(dstate) && (dstate->appendmax_reading < maxblks))
+		maxblks = dstate->appendmax_reading;
+	nblks = aq->nblks;
+	for (aq_last = aq; aq_last->next != NULL; aq_last = aq_last->next) {
+		if (nblks + aq_last->next->nblks > maxblks)
+			break;
+		nblks += aq_last->next->nblks;
+	}
+
+	/* Use the first write's buffer, or gather the writes together. */
+	if (aq_last == aq) {
+		buf = aq->buf;
+	} else {
+		if ((buf = malloc(nblks * dstate->blocklen)) == NULL)
+			goto err0;
+		for (p = buf; ; aq = aq->next) {
+			memcpy(p, aq->buf, aq->nblks * dstate->blocklen);
+			p += aq->nblks * dstate->blocklen;
+			free(aq->buf);
+			aq->buf = NULL;
+			if (aq == aq_last)
+				break;
+		}
+		aq = dstate->appendq_head;
+	}
+
+	/* Give the writer the work; the thread now owns the buffer. */
+	if ((W = malloc(sizeof(struct workitem))) == NULL)
+		goto err1;
+	W->next = NULL;
+	W->op = 1;
+	W->blkno = aq->blkno;
+	W->nblks = nblks;
+	W->buf = buf;
+	W->reqID = aq->reqID;
+	if (worker_submit(dstate->writer, W))
+		goto err2;
+	dstate->writer_busy = 1;
+
+	/* Move the writes from the queue to the list of writes in progress. */
+	dstate->appending = aq;
+	dstate->appendq_head = aq_last->next;
+	aq_last->next = NULL;
+
+done:
+	/* Success! */
+	return (0);
+
+err2:
+	free(W);
+err1:
+	if (buf != aq->buf)
+		free(buf);
+err0:
 	/* Failure! */
 	return (-1);
 }
@@ -245,16 +486,12 @@ int
 dispatch_request_free(struct dispatch_state * dstate,
     struct proto_lbs_request * R)
 {
-	struct workctl * deleter = dstate->workers[dstate->nreaders + 1];
-
-	/* If the deleter is not busy, tell it to do something. */
-	if (dstate->deleter_busy == 0) {
-		/* Give the deleter the work. */
-		dstate->deleter_busy = 1;
-		if (worker_assign(deleter,
-		    2, R->r.free.blkno, 0, NULL, R->ID))
-			goto err1;
-	}
+
+	/*
+	 * Remember how far we can delete.  If the deleter is busy, this
+	 * replaces any FREE which is already waiting for it.
+	 */
+	dstate->freeto = R->r.free.blkno;
 
 	/*
 	 * Send an ACK to the request.  FREEs are advisory, so we don't need
@@ -267,12 +504,133 @@ dispatch_request_free(struct dispatch_state * dstate,
 	/* Free the request. */
 	free(R);
 
+	/* Hand the work to the deleter if it is idle. */
+	if (dispatch_request_pokefreeq(dstate))
+		goto err0;
+
 	/* Success! */
 	return (0);
 
 err1:
 	free(R);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * dispatch_request_freerange(dstate, R):
+ * Handle and free a FREERANGE request.
+ */
+int
+dispatch_request_freerange(struct dispatch_state * dstate,
+    struct proto_lbs_request * R)
+{
+	struct proto_lbs_range * ranges = R->r.freerange.ranges;
+	size_t nranges = R->r.freerange.nranges;
+	struct proto_lbs_range * p;
 
+	/*
+	 * Add the ranges to those waiting for the deleter.  FREERANGEs are
+	 * advisory, so if too many ranges are waiting already, drop these.
+	 */
+	if (dstate->nfreeranges == 0) {
+		dstate->freeranges = ranges;
+		dstate->nfreeranges = nranges;
+	} else if (dstate->nfreeranges + nranges <= FREERANGE_QUEUE_MAX) {
+		if ((p = realloc(dstate->freeranges,
+		    (dstate->nfreeranges + nranges) *
+		    sizeof(struct proto_lbs_range))) == NULL)
+			goto err2;
+		memcpy(&p[dstate->nfreeranges], ranges,
+		    nranges * sizeof(struct proto_lbs_range));
+		dstate->freeranges = p;
+		dstate->nfreeranges += nranges;
+		free(ranges);
+	} else {
+		free(ranges);
+	}
+
+	/* Send an ACK to the request without waiting for the deleter. */
+	dstate->npending--;
+	if (proto_lbs_response_freerange(dstate->writeq, R->ID))
+		goto err1;
+
+	/* Free the request. */
+	free(R);
+
+	/* Hand the ranges to the deleter if it is idle. */
+	if (dispatch_request_pokefreeq(dstate))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(ranges);
+err1:
+	free(R);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * dispatch_request_pokefreeq(dstate):
+ * Launch a queued FREE or queued FREERANGEs if possible.
+ */
+int
+dispatch_request_pokefreeq(struct dispatch_state * dstate)
+{
+	struct workitem * W;
+	int op;
+
+	/* If the deleter is busy or there's nothing to free, do nothing. */
+	if ((dstate->deleter_busy != 0) ||
+	    ((dstate->freeto == 0) && (dstate->nfreeranges == 0)))
+		goto done;
+
+	/* Allocate a work item. */
+	if ((W = malloc(sizeof(struct workitem))) == NULL)
+		goto err0;
+	W->next = NULL;
+	W->reqID = 0;
+
+	/*
+	 * Deleting whole files is cheaper than punching holes in them, and
+	 * makes any ranges in those files moot; so do it first.  Otherwise,
+	 * give the deleter any ranges; the thread then owns them.
+	 */
+	op = (dstate->freeto != 0) ? 2 : 3;
+	W->op = op;
+	if (op == 2) {
+		W->blkno = dstate->freeto;
+		W->nblks = 0;
+		W->buf = NULL;
+	} else {
+		W->blkno = 0;
+		W->nblks = dstate->nfreeranges;
+		W->buf = (uint8_t *)dstate->freeranges;
+	}
+	if (worker_submit(dstate->deleter, W))
+		goto err1;
+	dstate->deleter_busy = 1;
+
+	/* The work is no longer waiting. */
+	if (op == 2) {
+		dstate->freeto = 0;
+	} else {
+		dstate->freeranges = NULL;
+		dstate->nfreeranges = 0;
+	}
+
+done:
+	/* Success! */
+	return (0);
+
+err1:
+	free(W);
+err0:
 	/* Failure! */
 	return (-1);
 }
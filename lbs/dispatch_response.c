@@ -1,7 +1,9 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "netbuf.h"
 #include "proto_lbs.h"
 #include "warnp.h"
 
@@ -11,63 +13,103 @@
 
 #include "dispatch_internal.h"
 
+/*
+ * GET responses at least this long are handed to the buffered writer without
+ * being copied; shorter responses are copied so that several of them can be
+ * sent in a single write.
+ */
+#define GIVE_MIN	4096
+
+/* The buffered writer is done with the GET response ${pkt}. */
+static void
+givenfree(void * cookie, void * pkt)
+{
+	struct dispatch_state * dstate = cookie;
+	uint8_t * buf = pkt;
+
+	dispatch_readbuf_free(dstate, &buf[PROTO_LBS_RESPONSE_GET_DATAOFF]);
+}
+
 /**
- * dispatch_response_send(dstate, thread):
- * Using the dispatch state ${dstate}, send a response for the work which was
- * just completed by thread ${thread}.
+ * dispatch_response_get(dstate, buf, len):
+ * Using the dispatch state ${dstate}, send the GET response of length ${len}
+ * which has been constructed around the read buffer ${buf}, and free the
+ * buffer (once the response has been written).
  */
 int
-dispatch_response_send(struct dispatch_state * dstate, struct workctl * thread)
+dispatch_response_get(struct dispatch_state * dstate, uint8_t * buf,
+    size_t len)
 {
-	int op;
-	uint64_t blkno;
-	size_t nblks;
-	uint8_t * buf;
-	uint64_t reqID;
-	int status;
-
-	/* Figure out what work was completed. */
-	if (worker_getdone(thread, &op, &blkno, &nblks, &buf, &reqID))
-		goto err0;
+	uint8_t * pkt = &buf[-PROTO_LBS_RESPONSE_GET_DATAOFF];
+
+	/* Hand over the buffer, or copy the response out of it. */
+	if (len >= GIVE_MIN) {
+		if (netbuf_write_give(dstate->writeq, pkt, len, givenfree,
+		    dstate))
+			goto err1;
+	} else {
+		if (netbuf_write_write(dstate->writeq, pkt, len))
+			goto err1;
+		dispatch_readbuf_free(dstate, buf);
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	dispatch_readbuf_free(dstate, buf);
+
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * dispatch_response_send(dstate, W):
+ * Using the dispatch state ${dstate}, send a response for the work item ${W}
+ * which was just completed by a worker thread, and free the work item.
+ */
+int
+dispatch_response_send(struct dispatch_state * dstate, struct workitem * W)
+{
+	size_t len;
+	struct appendq * aq;
 
 	/* Different types of work get handled differently. */
-	switch (op) {
+	switch (W->op) {
 	case 0:	/* read operation. */
-		/* Sanity check. */
-		assert(dstate->blocklen <= UINT32_MAX);
-
-		/* If we read a block, our status is 0; otherwise, 1. */
-		if (nblks == 1)
-			status = 0;
+		/*
+		 * The reader constructed the response around the block; if
+		 * it read a block, the response includes it (status 0).
+		 */
+		if (W->nblks == 1)
+			len = PROTO_LBS_RESPONSE_GET_LEN(dstate->blocklen);
 		else
-			status = 1;
+			len = PROTO_LBS_RESPONSE_GET_LEN(0);
 
-		/* Send a response. */
+		/* Send the response. */
 		dstate->npending--;
-		if (proto_lbs_response_get(dstate->writeq, reqID, status,
-		    (uint32_t)dstate->blocklen, buf))
+		if (dispatch_response_get(dstate, W->buf, len))
 			goto err1;
 
-		/* Free the buffer holding read data. */
-		free(buf);
-
 		break;
 	case 1:	/* write operation. */
-		/* Figure out what the next available block number is. */
-		if ((blkno = storage_nextblock(dstate->sstate)) ==
-		    (uint64_t)(-1))
-			goto err1;
+		/* Free the buffer holding written data. */
+		free(W->buf);
 
 		/*
-		 * Send a response back, with status = 0 since we will only
-		 * end up here if the requested write position was correct.
+		 * Send a response back for each APPEND which was performed,
+		 * with status = 0 since we will only end up here if the
+		 * requested write position was correct, and the block
+		 * number following the blocks it wrote.
 		 */
-		dstate->npending--;
-		if (proto_lbs_response_append(dstate->writeq, reqID, 0, blkno))
-			goto err1;
-
-		/* Free the buffer holding written data. */
-		free(buf);
+		while ((aq = dstate->appending) != NULL) {
+			dstate->appending = aq->next;
+			dstate->npending--;
+			if (proto_lbs_response_append(dstate->writeq,
+			    aq->reqID, 0, aq->blkno + aq->nblks))
+				goto err2;
+			free(aq);
+		}
 
 		break;
 	case 2:	/* delete operation. */
@@ -77,16 +119,94 @@ dispatch_response_send(struct dispatch_state * dstate, struct workctl * thread)
 		 * before the work was assigned to a thread.
 		 */
 		break;
+	case 3:	/* free ranges operation. */
+		/*
+		 * As with FREE, a response was sent before the work was
+		 * assigned to a thread; we just need to free the ranges.
+		 */
+		free(W->buf);
+		break;
 	default:
-		warn0("invalid work type: %d", op);
-		goto err0;
+		warn0("invalid work type: %d", W->op);
+		goto err1;
+	}
+
+	/* Free the work item. */
+	free(W);
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(aq);
+err1:
+	free(W);
+
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * dispatch_response_uring(dstate, udata, res):
+ * Using the dispatch state ${dstate}, send a response for the io_uring read
+ * ${udata}, which completed with result ${res}.
+ */
+int
+dispatch_response_uring(void * cookie, uint64_t udata, int32_t res)
+{
+	struct dispatch_state * dstate = cookie;
+	struct uringread * UR = (struct uringread *)(uintptr_t)udata;
+	size_t len;
+
+	/* Sanity check. */
+	assert(dstate->blocklen <= UINT32_MAX);
+
+	/* This read is no longer in flight. */
+	dstate->uring_inflight--;
+
+	/* We're done with the descriptor. */
+	if (storage_read_close(dstate->sstate, UR->fd, UR->ref))
+		goto err1;
+
+	/* Read errors are fatal, just as they are in reader threads. */
+	if (res < 0) {
+		errno = -res;
+		warnp("Failure reading block");
+		goto err1;
 	}
+	if ((size_t)res != dstate->blocklen) {
+		warn0("Unexpected EOF reading block file");
+		goto err1;
+	}
+
+	/* Cache the block in case it is read again. */
+	if (storage_read_cache(dstate->sstate, UR->blkno, UR->buf))
+		goto err1;
+
+	/* Construct and send a response. */
+	dstate->npending--;
+	len = proto_lbs_response_get_frame(
+	    &UR->buf[-PROTO_LBS_RESPONSE_GET_DATAOFF], UR->reqID, 0,
+	    (uint32_t)dstate->blocklen);
+	if (dispatch_response_get(dstate, UR->buf, len))
+		goto err2;
+
+	/* Free the read state. */
+	free(UR);
+
+	/* Launch more reads if we have any queued. */
+	if (dispatch_request_pokereadq(dstate))
+		goto err0;
 
 	/* Success! */
 	return (0);
 
+err2:
+	free(UR);
+	goto err0;
 err1:
-	free(buf);
+	dispatch_readbuf_free(dstate, UR->buf);
+	free(UR);
 err0:
 	/* Failure! */
 	return (-1);
@@ -1,4 +1,5 @@
 #include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,7 @@
 
 #include "asprintf.h"
 #include "daemonize.h"
+#include "elasticarray.h"
 #include "events.h"
 #include "getopt.h"
 #include "parsenum.h"
@@ -13,16 +15,23 @@
 #include "sock.h"
 #include "warnp.h"
 
+#include "disk.h"
 #include "dispatch.h"
 #include "storage.h"
 
+ELASTICARRAY_DECL(DIRLIST, dirlist, char *);
+
 static void
 usage(void)
 {
 
 	fprintf(stderr, "usage: kivaloo-lbs -s <lbs socket> -d <storage dir> "
-	    "-b <block size> [-n <# of readers>] [-p <pidfile>] "
-	    "[-1] [-L] [-l <read latency in ns>]\n");
+	    "[-d <storage dir> ...] -b <block size> "
+	    "[-n <# of readers per dir>] [-q <io_uring depth>] "
+	    "[-D] [-c <# of cached blocks>] [-r <GET deadline in ms>] "
+	    "[-a <max APPEND blocks per write while reading>] "
+	    "[-F <ms between file deletions>] [-p <pidfile>] [-1] [-L] "
+	    "[-l <read latency in ns>]\n");
 	fprintf(stderr, "       kivaloo-lbs --version\n");
 	exit(1);
 }
@@ -42,24 +51,48 @@ main(int argc, char * argv[])
 	int s;
 
 	/* Command-line parameters. */
+	size_t opt_a = 0;
 	char * opt_s = NULL;
-	char * opt_d = NULL;
+	DIRLIST opt_d;
 	size_t opt_b = (size_t)(-1);
+	size_t opt_c = 0;
+	int opt_D = 0;
+	long opt_F = 0;
 	size_t opt_n = 16;
 	char * opt_p = NULL;
+	size_t opt_q = 0;
+	long opt_r = -1;
 	int opt_1 = 0;
 	long opt_l = 0;
 	int opt_L = 0;
 
 	/* Working variables. */
 	struct sock_addr ** sas;
+	char * s_d;
+	size_t ndirs;
+	size_t i;
 	const char * ch;
 
 	WARNP_INIT;
 
+	/* We have no storage directories yet. */
+	if ((opt_d = dirlist_init(0)) == NULL) {
+		warnp("dirlist_init");
+		exit(1);
+	}
+
 	/* Parse the command line. */
 	while ((ch = GETOPT(argc, argv)) != NULL) {
 		GETOPT_SWITCH(ch) {
+		GETOPT_OPTARG("-a"):
+			if (opt_a != 0)
+				usage();
+			if (PARSENUM(&opt_a, optarg, 1, SIZE_MAX)) {
+				warn0("APPEND blocks per write must be"
+				    " positive");
+				goto err1;
+			}
+			break;
 		GETOPT_OPTARG("-b"):
 			if (opt_b != (size_t)(-1))
 				usage();
@@ -72,11 +105,35 @@ main(int argc, char * argv[])
 				goto err1;
 			}
 			break;
-		GETOPT_OPTARG("-d"):
-			if (opt_d != NULL)
+		GETOPT_OPTARG("-c"):
+			if (opt_c != 0)
+				usage();
+			if (PARSENUM(&opt_c, optarg, 1, 1048576)) {
+				warn0("Cache size must be in [1, 2^20] blocks");
+				goto err1;
+			}
+			break;
+		GETOPT_OPT("-D"):
+			if (opt_D != 0)
 				usage();
-			if ((opt_d = strdup(optarg)) == NULL)
+			opt_D = 1;
+			break;
+		GETOPT_OPTARG("-d"):
+			if ((s_d = strdup(optarg)) == NULL)
 				OPT_EPARSE(ch, optarg);
+			if (dirlist_append(opt_d, &s_d, 1)) {
+				free(s_d);
+				OPT_EPARSE(ch, optarg);
+			}
+			break;
+		GETOPT_OPTARG("-F"):
+			if (opt_F != 0)
+				usage();
+			if (PARSENUM(&opt_F, optarg, 1, 60000)) {
+				warn0("Deletion pause must be in"
+				    " [1, 60000] ms");
+				goto err1;
+			}
 			break;
 		GETOPT_OPTARG("-l"):
 			if (opt_l != 0)
@@ -105,6 +162,22 @@ main(int argc, char * argv[])
 			if ((opt_p = strdup(optarg)) == NULL)
 				OPT_EPARSE(ch, optarg);
 			break;
+		GETOPT_OPTARG("-q"):
+			if (opt_q != 0)
+				usage();
+			if (PARSENUM(&opt_q, optarg, 1, 4096)) {
+				warn0("io_uring depth must be in [1, 4096]");
+				goto err1;
+			}
+			break;
+		GETOPT_OPTARG("-r"):
+			if (opt_r != -1)
+				usage();
+			if (PARSENUM(&opt_r, optarg, 0, 60000)) {
+				warn0("GET deadline must be in [0, 60000] ms");
+				goto err1;
+			}
+			break;
 		GETOPT_OPTARG("-s"):
 			if (opt_s != NULL)
 				usage();
@@ -138,11 +211,30 @@ main(int argc, char * argv[])
 	/* Sanity-check options. */
 	if (opt_s == NULL)
 		usage();
-	if (opt_d == NULL)
+	if ((ndirs = dirlist_getsize(opt_d)) == 0)
 		usage();
 	if (opt_b == (size_t)(-1))
 		usage();
 
+	/* Set defaults. */
+	if (opt_r == -1)
+		opt_r = 50;
+	if (opt_a == 0)
+		opt_a = SIZE_MAX;
+	if (opt_D && !disk_direct_supported()) {
+		warn0("Direct I/O is not supported on this platform");
+		goto err1;
+	}
+	if (opt_D && (opt_b % DISK_DIRECT_ALIGN != 0)) {
+		warn0("Direct I/O requires a block size which is a multiple"
+		    " of %d", DISK_DIRECT_ALIGN);
+		goto err1;
+	}
+	if ((opt_q != 0) && (opt_l != 0)) {
+		warn0("Read latency cannot be simulated with io_uring");
+		goto err1;
+	}
+
 	/* Resolve the listening address. */
 	if ((sas = sock_resolve(opt_s)) == NULL) {
 		warnp("Error resolving socket address: %s", opt_s);
@@ -161,8 +253,9 @@ main(int argc, char * argv[])
 		goto err2;
 
 	/* Initialize the storage back-end. */
-	if ((S = storage_init(opt_d, opt_b, opt_l, opt_L)) == NULL) {
-		warnp("Error initializing storage directory: %s", opt_d);
+	if ((S = storage_init((const char * const *)dirlist_get(opt_d, 0),
+	    ndirs, opt_b, opt_l, opt_L, opt_D, opt_c, opt_F)) == NULL) {
+		warnp("Error initializing storage");
 		goto err3;
 	}
 
@@ -179,7 +272,8 @@ main(int argc, char * argv[])
 	}
 
 	/* Initialize the dispatcher. */
-	if ((D = dispatch_init(S, opt_b, opt_n)) == NULL) {
+	if ((D = dispatch_init(S, opt_b, opt_D, ndirs, opt_n, opt_q,
+	    (double)opt_r / 1000.0, opt_a)) == NULL) {
 		warnp("Error initializing work dispatcher");
 		goto err4;
 	}
@@ -223,7 +317,9 @@ main(int argc, char * argv[])
 	/* Free option strings. */
 	free(opt_s);
 	free(opt_p);
-	free(opt_d);
+	for (i = 0; i < dirlist_getsize(opt_d); i++)
+		free(*dirlist_get(opt_d, i));
+	dirlist_free(opt_d);
 
 	/* Success! */
 	exit(0);
@@ -240,7 +336,9 @@ err2:
 err1:
 	free(opt_s);
 	free(opt_p);
-	free(opt_d);
+	for (i = 0; i < dirlist_getsize(opt_d); i++)
+		free(*dirlist_get(opt_d, i));
+	dirlist_free(opt_d);
 
 	/* Failure! */
 	exit(1);
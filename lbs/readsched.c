@@ -0,0 +1,260 @@
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "monoclock.h"
+#include "ptrheap.h"
+#include "warnp.h"
+
+#include "readsched.h"
+
+/* A pending block read. */
+struct readq {
+	struct readq * older;		/* Previous read added, or NULL. */
+	struct readq * newer;		/* Next read added, or NULL. */
+	struct ptrheap * H;		/* Heap holding this read... */
+	size_t rc;			/* ... and its record cookie there. */
+	struct timeval t_add;		/* When the read was added. */
+	uint64_t reqID;			/* Packet ID of GET request. */
+	uint64_t blkno;			/* Requested block #. */
+};
+
+/* Queue of pending block reads. */
+struct readsched {
+	double deadline;		/* Maximum time to wait, in seconds. */
+	struct readq * oldest;		/* Oldest pending read, or NULL. */
+	struct readq * newest;		/* Newest pending read, or NULL. */
+	struct ptrheap * ahead;		/* Reads of blocks >= pos. */
+	struct ptrheap * behind;	/* Reads of blocks < pos. */
+	uint64_t pos;			/* Block # of the last read taken. */
+	size_t len;			/* Number of pending reads. */
+};
+
+/* Compare the block numbers of two reads. */
+static int
+compar(void * cookie, const void * _x, const void * _y)
+{
+	const struct readq * x = _x;
+	const struct readq * y = _y;
+
+	(void)cookie; /* UNUSED */
+
+	if (x->blkno < y->blkno)
+		return (-1);
+	else if (x->blkno > y->blkno)
+		return (1);
+	else
+		return (0);
+}
+
+/* Record the position of a read in its heap. */
+static void
+setreccookie(void * cookie, void * ptr, size_t rc)
+{
+	struct readq * R = ptr;
+
+	(void)cookie; /* UNUSED */
+
+	R->rc = rc;
+}
+
+/* Remove the read ${R} from the queue ${Q} and free it. */
+static void
+readq_delete(struct readsched * Q, struct readq * R)
+{
+
+	/* Remove it from the list of reads in the order they were added. */
+	if (R->older == NULL)
+		Q->oldest = R->newer;
+	else
+		R->older->newer = R->newer;
+	if (R->newer == NULL)
+		Q->newest = R->older;
+	else
+		R->newer->older = R->older;
+
+	/* Remove it from its heap. */
+	ptrheap_delete(R->H, R->rc);
+
+	/* Free it. */
+	free(R);
+	Q->len -= 1;
+}
+
+/**
+ * readsched_init(deadline):
+ * Create a queue of pending block reads.  Reads are taken from the queue in
+ * ascending order of block number, starting over from the lowest block when
+ * no reads of blocks after the last one taken remain; but a read which has
+ * been queued for at least ${deadline} seconds is taken first.  If
+ * ${deadline} is zero, reads are taken in the order they were added.
+ */
+struct readsched *
+readsched_init(double deadline)
+{
+	struct readsched * Q;
+
+	/* Allocate the structure. */
+	if ((Q = malloc(sizeof(struct readsched))) == NULL)
+		goto err0;
+	Q->deadline = deadline;
+	Q->oldest = Q->newest = NULL;
+	Q->pos = 0;
+	Q->len = 0;
+
+	/* Create heaps for reads before and after the current position. */
+	if ((Q->ahead = ptrheap_init(compar, setreccookie, NULL)) == NULL)
+		goto err1;
+	if ((Q->behind = ptrheap_init(compar, setreccookie, NULL)) == NULL)
+		goto err2;
+
+	/* Success! */
+	return (Q);
+
+err2:
+	ptrheap_free(Q->ahead);
+err1:
+	free(Q);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * readsched_add(Q, reqID, blkno):
+ * Add a read of block ${blkno} for the request ${reqID} to the queue ${Q}.
+ */
+int
+readsched_add(struct readsched * Q, uint64_t reqID, uint64_t blkno)
+{
+	struct readq * R;
+
+	/* Allocate and fill in a structure. */
+	if ((R = malloc(sizeof(struct readq))) == NULL)
+		goto err0;
+	R->reqID = reqID;
+	R->blkno = blkno;
+	if (monoclock_get(&R->t_add)) {
+		warnp("monoclock_get");
+		goto err1;
+	}
+
+	/* Put it in the heap for this sweep or the next one. */
+	R->H = (blkno >= Q->pos) ? Q->ahead : Q->behind;
+	if (ptrheap_add(R->H, R))
+		goto err1;
+
+	/* Add it to the end of the list of reads. */
+	R->older = Q->newest;
+	R->newer = NULL;
+	if (Q->newest == NULL)
+		Q->oldest = R;
+	else
+		Q->newest->newer = R;
+	Q->newest = R;
+	Q->len += 1;
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(R);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * readsched_get(Q, reqID, blkno):
+ * Remove the next read from the queue ${Q}, and set ${reqID} and ${blkno} to
+ * its request ID and block number.  Return 0 on success; 1 if the queue is
+ * empty; or -1 on error.
+ */
+int
+readsched_get(struct readsched * Q, uint64_t * reqID, uint64_t * blkno)
+{
+	struct readq * R;
+	struct ptrheap * H;
+	struct timeval tnow;
+
+	/* If we have nothing, we can't return anything. */
+	if (Q->oldest == NULL)
+		return (1);
+
+	/*
+	 * Take the oldest read if it has run out of time; otherwise take the
+	 * next block in this sweep, starting the next sweep if this one is
+	 * over.  Reads taken because of their deadline don't move us.
+	 */
+	R = Q->oldest;
+	if (Q->deadline > 0) {
+		if (monoclock_get(&tnow)) {
+			warnp("monoclock_get");
+			goto err0;
+		}
+		if (timeval_diff(R->t_add, tnow) < Q->deadline) {
+			if (ptrheap_getmin(Q->ahead) == NULL) {
+				H = Q->ahead;
+				Q->ahead = Q->behind;
+				Q->behind = H;
+			}
+			R = ptrheap_getmin(Q->ahead);
+			Q->pos = R->blkno;
+		}
+	}
+
+	/* Hand the read back and remove it from the queue. */
+	*reqID = R->reqID;
+	*blkno = R->blkno;
+	readq_delete(Q, R);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * readsched_len(Q):
+ * Return the number of reads in the queue ${Q}.
+ */
+size_t
+readsched_len(struct readsched * Q)
+{
+
+	return (Q->len);
+}
+
+/**
+ * readsched_clear(Q):
+ * Remove all the reads from the queue ${Q}.
+ */
+void
+readsched_clear(struct readsched * Q)
+{
+
+	while (Q->oldest != NULL)
+		readq_delete(Q, Q->oldest);
+}
+
+/**
+ * readsched_free(Q):
+ * Free the queue ${Q} and any reads in it.
+ */
+void
+readsched_free(struct readsched * Q)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (Q == NULL)
+		return;
+
+	/* Free any reads we have, then the heaps and the structure. */
+	readsched_clear(Q);
+	ptrheap_free(Q->behind);
+	ptrheap_free(Q->ahead);
+	free(Q);
+}
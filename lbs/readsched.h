@@ -0,0 +1,52 @@
+#ifndef READSCHED_H_
+#define READSCHED_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opaque type. */
+struct readsched;
+
+/**
+ * readsched_init(deadline):
+ * Create a queue of pending block reads.  Reads are taken from the queue in
+ * ascending order of block number, starting over from the lowest block when
+ * no reads of blocks after the last one taken remain; but a read which has
+ * been queued for at least ${deadline} seconds is taken first.  If
+ * ${deadline} is zero, reads are taken in the order they were added.
+ */
+struct readsched * readsched_init(double);
+
+/**
+ * readsched_add(Q, reqID, blkno):
+ * Add a read of block ${blkno} for the request ${reqID} to the queue ${Q}.
+ */
+int readsched_add(struct readsched *, uint64_t, uint64_t);
+
+/**
+ * readsched_get(Q, reqID, blkno):
+ * Remove the next read from the queue ${Q}, and set ${reqID} and ${blkno} to
+ * its request ID and block number.  Return 0 on success; 1 if the queue is
+ * empty; or -1 on error.
+ */
+int readsched_get(struct readsched *, uint64_t *, uint64_t *);
+
+/**
+ * readsched_len(Q):
+ * Return the number of reads in the queue ${Q}.
+ */
+size_t readsched_len(struct readsched *);
+
+/**
+ * readsched_clear(Q):
+ * Remove all the reads from the queue ${Q}.
+ */
+void readsched_clear(struct readsched *);
+
+/**
+ * readsched_free(Q):
+ * Free the queue ${Q} and any reads in it.
+ */
+void readsched_free(struct readsched *);
+
+#endif /* !READSCHED_H_ */
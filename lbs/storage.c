@@ -8,37 +8,441 @@
 #include <unistd.h>
 
 #include "elasticqueue.h"
+#include "imalloc.h"
 #include "proto_lbs.h"
 #include "warnp.h"
 
+#include "blkcache.h"
 #include "disk.h"
 #include "storage_findfiles.h"
 #include "storage_internal.h"
+#include "storage_manifest.h"
 #include "storage_util.h"
 
 #include "storage.h"
 
+/* Maximum number of block file descriptors to keep open. */
+#define FDCACHE_MAX	256
+
+/* Maximum number of blocks to read at once when GETs are ascending. */
+#define READAHEAD_MAX	16
+
+/* Minimum amount of disk space to preallocate when appending. */
+#define PREALLOC_MIN	(8 * 1024 * 1024)
+
+/* Release the space used by dead blocks in chunks of at least this size. */
+#define PUNCH_MIN	(1024 * 1024)
+
+/* Descriptor for reading a block file, shared between reader threads. */
+struct file_fd {
+	int fd;				/* Descriptor, or -1 if not cached. */
+	size_t refcnt;			/* References, including from files. */
+	size_t nusers;			/* Readers using the cached fd. */
+
+	/* If fd != -1, neighbours in the LRU list of cached descriptors. */
+	struct file_fd * lru_prev;
+	struct file_fd * lru_next;
+};
+
 /* State of an individual file. */
 struct file_state {
 	uint64_t start;			/* First block # in file. */
 	uint64_t len;			/* Length of file in blocks. */
+	size_t dir;			/* Index of directory holding file. */
+	struct file_fd * ffd;		/* Descriptor for reading. */
+
+	/* Blocks released by FREERANGE; only used by the deleter thread. */
+	uint8_t * dead;			/* Bitmap of dead blocks, or NULL. */
+	size_t deadlen;			/* Length of bitmap in bytes. */
+	uint64_t ndead;			/* Number of dead blocks. */
 };
 
+/* Create a descriptor record, with one reference and no descriptor. */
+static struct file_fd *
+ffd_init(void)
+{
+	struct file_fd * ffd;
+
+	/* Allocate the structure. */
+	if ((ffd = malloc(sizeof(struct file_fd))) == NULL)
+		goto err0;
+
+	/* We haven't opened the file yet. */
+	ffd->fd = -1;
+	ffd->refcnt = 1;
+	ffd->nusers = 0;
+
+	/* Success! */
+	return (ffd);
+
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Lock the descriptor cache. */
+static int
+fdlock(struct storage_state * S)
+{
+	int rc;
+
+	if ((rc = pthread_mutex_lock(&S->fdlck)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Unlock the descriptor cache. */
+static int
+fdunlock(struct storage_state * S)
+{
+	int rc;
+
+	if ((rc = pthread_mutex_unlock(&S->fdlck)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Remove the descriptor record ${ffd}, which has a cached descriptor, from
+ * the LRU list.  Must be called with ${S}->fdlck held.
+ */
+static void
+lru_remove(struct storage_state * S, struct file_fd * ffd)
+{
+
+	if (ffd->lru_prev != NULL)
+		ffd->lru_prev->lru_next = ffd->lru_next;
+	else
+		S->lru_head = ffd->lru_next;
+	if (ffd->lru_next != NULL)
+		ffd->lru_next->lru_prev = ffd->lru_prev;
+	else
+		S->lru_tail = ffd->lru_prev;
+}
+
+/*
+ * Add the descriptor record ${ffd}, which has a cached descriptor, to the
+ * most recently used end of the LRU list.  Must be called with ${S}->fdlck
+ * held.
+ */
+static void
+lru_append(struct storage_state * S, struct file_fd * ffd)
+{
+
+	ffd->lru_prev = S->lru_tail;
+	ffd->lru_next = NULL;
+	if (S->lru_tail != NULL)
+		S->lru_tail->lru_next = ffd;
+	else
+		S->lru_head = ffd;
+	S->lru_tail = ffd;
+}
+
+/*
+ * Evict the least recently used cached descriptor which no reader is using,
+ * and return it so that the caller can close it once ${S}->fdlck has been
+ * released; or return -1 if every cached descriptor is in use.  Must be
+ * called with ${S}->fdlck held.
+ */
+static int
+lru_evict(struct storage_state * S)
+{
+	struct file_fd * ffd;
+	int fd;
+
+	/* Find the oldest idle descriptor. */
+	for (ffd = S->lru_head; ffd != NULL; ffd = ffd->lru_next) {
+		if (ffd->nusers == 0)
+			break;
+	}
+	if (ffd == NULL)
+		return (-1);
+
+	/* Drop the cache's hold on it. */
+	lru_remove(S, ffd);
+	fd = ffd->fd;
+	ffd->fd = -1;
+	S->nfds--;
+
+	/* Return the descriptor. */
+	return (fd);
+}
+
+/*
+ * Drop a reference to the descriptor record ${ffd}; if it was the last one,
+ * close the descriptor (if any) and free the record.
+ */
+static int
+ffd_release(struct storage_state * S, struct file_fd * ffd)
+{
+	int fd = -1;
+
+	/* Drop the reference. */
+	if (fdlock(S))
+		goto err0;
+	if (--ffd->refcnt == 0) {
+		if ((fd = ffd->fd) != -1) {
+			lru_remove(S, ffd);
+			S->nfds--;
+		}
+		free(ffd);
+	}
+	if (fdunlock(S))
+		goto err0;
+
+	/* Close the descriptor if nobody is using it any more. */
+	if ((fd != -1) && disk_close(fd))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Close any cached descriptors and free a queue of file states. */
+static void
+files_free(struct elasticqueue * files)
+{
+	struct file_state * fs;
+
+	/* Nobody else can be holding references now. */
+	while ((fs = elasticqueue_get(files, 0)) != NULL) {
+		if (fs->ffd->fd != -1)
+			disk_close(fs->ffd->fd);
+		free(fs->ffd);
+		free(fs->dead);
+		elasticqueue_delete(files);
+	}
+	elasticqueue_free(files);
+}
+
+/*
+ * Rewrite the manifest of the storage directory #${dir} to list the block
+ * files which it holds.
+ */
+static int
+manifest_update(struct storage_state * S, size_t dir)
+{
+	struct file_state * fs;
+	uint64_t * filenos;
+	size_t nfiles;
+	size_t i;
+	int rc;
+
+	/* Only one manifest update at once. */
+	if ((rc = pthread_mutex_lock(&S->mflck)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* List the files in this directory. */
+	if (storage_util_readlock(S))
+		goto err1;
+	if (IMALLOC(filenos, elasticqueue_getlen(S->files) + 1, uint64_t))
+		goto err2;
+	for (nfiles = i = 0; i < elasticqueue_getlen(S->files); i++) {
+		fs = elasticqueue_get(S->files, i);
+		if (fs->dir == dir)
+			filenos[nfiles++] = fs->start;
+	}
+	if (storage_util_unlock(S))
+		goto err3;
+
+	/* Write the manifest. */
+	if (storage_manifest_write(S->storagedirs[dir], filenos, nfiles,
+	    S->nosync))
+		goto err3;
+	free(filenos);
+
+	/* Release the manifest lock. */
+	if ((rc = pthread_mutex_unlock(&S->mflck)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err3:
+	free(filenos);
+	goto err1;
+err2:
+	storage_util_unlock(S);
+err1:
+	pthread_mutex_unlock(&S->mflck);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Return the index in ${S}->files of the file holding block ${blkno}, which
+ * must be in the range [${S}->minblk, ${S}->nextblk).  Must be called with
+ * ${S}->lck held.
+ */
+static size_t
+findfile(struct storage_state * S, uint64_t blkno)
+{
+	struct file_state * fs;
+	size_t lo, hi, mid;
+
+	/* File lo starts at or before blkno; file hi (if any) after it. */
+	lo = 0;
+	hi = elasticqueue_getlen(S->files);
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		fs = elasticqueue_get(S->files, mid);
+		if (fs->start <= blkno)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	/* Sanity-check. */
+	fs = elasticqueue_get(S->files, lo);
+	assert((fs->start <= blkno) && (blkno < fs->start + fs->len));
+
+	return (lo);
+}
+
+/*
+ * Mark blocks ${off} ... ${off} + ${n} - 1 of the file ${fs} as dead.  Must
+ * be called by the deleter thread with the storage state lock held.
+ */
+static int
+markdead(struct file_state * fs, uint64_t off, uint64_t n)
+{
+	uint8_t * p;
+	size_t newlen;
+	uint64_t i;
+
+	/* Grow the bitmap if necessary, doubling it to amortize copying. */
+	if ((off + n + 7) / 8 > fs->deadlen) {
+		if ((off + n + 7) / 8 > SIZE_MAX / 2) {
+			errno = ENOMEM;
+			goto err0;
+		}
+		newlen = (size_t)((off + n + 7) / 8);
+		if (newlen < fs->deadlen * 2)
+			newlen = fs->deadlen * 2;
+		if ((p = realloc(fs->dead, newlen)) == NULL)
+			goto err0;
+		memset(&p[fs->deadlen], 0, newlen - fs->deadlen);
+		fs->dead = p;
+		fs->deadlen = newlen;
+	}
+
+	/* Mark the blocks, counting those which weren't already dead. */
+	for (i = off; i < off + n; i++) {
+		if (fs->dead[i / 8] & (1 << (i % 8)))
+			continue;
+		fs->dead[i / 8] |= (uint8_t)(1 << (i % 8));
+		fs->ndead++;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Return non-zero if blocks ${off} ... ${off} + ${n} - 1 of the file ${fs}
+ * are all dead.  Must be called by the deleter thread with the storage
+ * state lock held.
+ */
+static int
+alldead(struct file_state * fs, uint64_t off, uint64_t n)
+{
+	uint64_t i;
+
+	for (i = off; i < off + n; i++) {
+		if ((i / 8 >= fs->deadlen) ||
+		    ((fs->dead[i / 8] & (1 << (i % 8))) == 0))
+			return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * Close the descriptor we're appending to (if any), releasing any disk space
+ * we preallocated beyond the end of the file.
+ */
+static int
+closewfd(struct storage_state * S)
+{
+
+	/* If we don't have a file open, there's nothing to do. */
+	if (S->wfd == -1)
+		goto done;
+
+	/* Give back space we won't use. */
+	if ((S->walloc > S->wlen) && disk_truncate(S->wfd, S->wlen))
+		goto err1;
+
+	/* Close the file. */
+	if (disk_close(S->wfd))
+		goto err0;
+	S->wfd = -1;
+
+done:
+	/* Success! */
+	return (0);
+
+err1:
+	disk_close(S->wfd);
+	S->wfd = -1;
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /**
- * storage_init(storagedir, blklen, latency, nosync):
+ * storage_init(storagedirs, ndirs, blklen, latency, nosync, direct, ncache,
+ *     delpause):
  * Initialize and return the storage state for ${blklen}-byte blocks of data
- * stored in ${storagedir}.  Sleep ${latency} ns in storage_read() calls.  If
- * ${nosync} is non-zero, don't use fsync.
+ * stored in the ${ndirs} directories ${storagedirs}[0 .. ${ndirs} - 1]; new
+ * block files are placed in the directories in turn.  The array
+ * ${storagedirs} must remain valid until storage_done() is called.  Sleep
+ * ${latency} ns in storage_read() calls.  If ${nosync} is non-zero, don't
+ * use fsync.  If ${direct} is non-zero, bypass the operating system's buffer
+ * cache; ${blklen} must then be a multiple of DISK_DIRECT_ALIGN.  If
+ * ${ncache} is non-zero, keep the ${ncache} most recently appended or read
+ * blocks in memory, and read ahead when blocks are read in ascending order.
+ * Pause ${delpause} ms between deleting block files in storage_delete().
  */
 struct storage_state *
-storage_init(const char * storagedir, size_t blocklen, long latency,
-    int nosync)
+storage_init(const char * const * storagedirs, size_t ndirs, size_t blocklen,
+    long latency, int nosync, int direct, size_t ncache, long delpause)
 {
 	struct storage_state * S;
 	struct elasticqueue * files;
 	struct storage_file * sf;
 	struct file_state fs;
 	char * s;
+	size_t i;
 	int rc;
 	off_t num_blocks;
 
@@ -46,13 +450,23 @@ storage_init(const char * storagedir, size_t blocklen, long latency,
 	assert(blocklen >= PROTO_LBS_BLKLEN_MIN);
 	assert(blocklen <= PROTO_LBS_BLKLEN_MAX);
 
+	/* We need somewhere to put the blocks. */
+	assert(ndirs > 0);
+
 	/* Allocate structure and fill in static data. */
 	if ((S = malloc(sizeof(struct storage_state))) == NULL)
 		goto err0;
-	S->storagedir = storagedir;
+	S->storagedirs = storagedirs;
+	S->ndirs = ndirs;
 	S->blocklen = blocklen;
 	S->latency = latency;
 	S->nosync = nosync;
+	S->direct = direct;
+	S->delpause = delpause;
+	S->wfd = -1;
+
+	/* Direct I/O must be aligned. */
+	assert((direct == 0) || (blocklen % DISK_DIRECT_ALIGN == 0));
 
 	/*
 	 * Figure out the maximum number of blocks a file can contain without
@@ -69,13 +483,35 @@ storage_init(const char * storagedir, size_t blocklen, long latency,
 #endif
 	S->maxnblks = S->maxnblks / S->blocklen;
 
+	/*
+	 * Create a cache for recently used blocks, if requested.  Don't read
+	 * ahead so far that blocks we read evict each other.
+	 */
+	S->cache = NULL;
+	S->ranblks = 0;
+	if (ncache > 0) {
+		if ((S->cache = blkcache_init(ncache, blocklen)) == NULL)
+			goto err1;
+		S->ranblks = (ncache / 2 < READAHEAD_MAX) ?
+		    ncache / 2 : READAHEAD_MAX;
+	}
+
+	/* Create a lock on the descriptor cache, which is empty. */
+	if ((rc = pthread_mutex_init(&S->fdlck, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+	S->nfds = 0;
+	S->lru_head = S->lru_tail = NULL;
+
 	/* Create an elastic queue to hold block file state. */
 	if ((S->files = elasticqueue_init(sizeof(struct file_state))) == NULL)
-		goto err1;
+		goto err3;
 
 	/* Get a sorted list of block files. */
-	if ((files = storage_findfiles(S->storagedir)) == NULL)
-		goto err2;
+	if ((files = storage_findfiles(S->storagedirs, S->ndirs,
+	    S->blocklen)) == NULL)
+		goto err4;
 
 	/* If we have at least one file, its # is where the blocks start. */
 	if (elasticqueue_getlen(files) > 0) {
@@ -95,107 +531,484 @@ storage_init(const char * storagedir, size_t blocklen, long latency,
 		/* The first block is the file number. */
 		fs.start = sf->fileno;
 
-		/* Is the first block the one we expected? */
-		if (fs.start != S->nextblk) {
-			warn0("Start of block storage file does not match"
-			    " end of previous file: %016" PRIx64, sf->fileno);
-			goto err3;
-		}
+		/* Is the first block the one we expected? */
+		if (fs.start != S->nextblk) {
+			warn0("Start of block storage file does not match"
+			    " end of previous file: %016" PRIx64, sf->fileno);
+			goto err5;
+		}
+
+		/* Does it have a non-integer number of blocks? */
+		if ((sf->len % (off_t)S->blocklen) != 0) {
+			/* Not permitted for files in the middle. */
+			if (elasticqueue_getlen(files) > 1) {
+				warn0("Block storage file has non-integer"
+				    " number of blocks: %016" PRIx64,
+				    sf->fileno);
+				goto err5;
+			}
+
+			/*
+			 * The final file may have a non-integer number of
+			 * blocks due to an interrupted write; just remove
+			 * any partial block.
+			 */
+			if ((s = storage_util_mkpath(S, sf->dir,
+			    sf->fileno)) == NULL)
+				goto err5;
+			if (truncate(s, sf->len - (sf->len %
+			    (off_t)S->blocklen)))
+				goto err6;
+			free(s);
+		}
+
+		/* Compute number of blocks. */
+		num_blocks = sf->len / (off_t)S->blocklen;
+#if UINTMAX_MAX > UINT64_MAX
+		if ((uintmax_t)num_blocks > (uintmax_t)UINT64_MAX)
+			goto err5;
+#endif
+		fs.len = (uint64_t)num_blocks;
+		fs.dir = sf->dir;
+		fs.dead = NULL;
+		fs.deadlen = 0;
+		fs.ndead = 0;
+
+		/* We'll open the file when we first need to read from it. */
+		if ((fs.ffd = ffd_init()) == NULL)
+			goto err5;
+
+		/* Add to the queue of block file state structures. */
+		if (elasticqueue_add(S->files, &fs)) {
+			free(fs.ffd);
+			goto err5;
+		}
+
+		/* Adjust nextblk to account for this latest block file. */
+		S->nextblk = fs.start + fs.len;
+
+		/* Remove the file from the queue. */
+		elasticqueue_delete(files);
+	}
+
+	/* Free the (now empty) queue of files. */
+	elasticqueue_free(files);
+
+	/* Create a lock on the dynamic data. */
+	if ((rc = pthread_rwlock_init(&S->lck, NULL)) != 0) {
+		warn0("pthread_rwlock_init: %s", strerror(rc));
+		goto err4;
+	}
+
+	/*
+	 * Bring the manifests up to date with the files we found, so that
+	 * next time we won't need to look for them.
+	 */
+	if ((rc = pthread_mutex_init(&S->mflck, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err7;
+	}
+	for (i = 0; i < S->ndirs; i++) {
+		if (manifest_update(S, i))
+			goto err8;
+	}
+
+	/* Success! */
+	return (S);
+
+err8:
+	pthread_mutex_destroy(&S->mflck);
+err7:
+	pthread_rwlock_destroy(&S->lck);
+	goto err4;
+err6:
+	free(s);
+err5:
+	elasticqueue_free(files);
+err4:
+	files_free(S->files);
+err3:
+	pthread_mutex_destroy(&S->fdlck);
+err2:
+	blkcache_free(S->cache);
+err1:
+	free(S);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * storage_nextblock(S):
+ * Return the next writable block number for storage state ${S}, or
+ * (uint64_t)(-1) on error.
+ */
+uint64_t
+storage_nextblock(struct storage_state * S)
+{
+	uint64_t nextblk;
+
+	/* Grab a read lock. */
+	if (storage_util_readlock(S))
+		goto err0;
+
+	/* Grab the next block # value. */
+	nextblk = S->nextblk;
+
+	/* Release the lock. */
+	if (storage_util_unlock(S))
+		goto err0;
+
+	/* Success! */
+	return (nextblk);
+
+err0:
+	/* Failure! */
+	return ((uint64_t)(-1));
+}
+
+/**
+ * storage_blkdir(S, blkno):
+ * Return the index of the storage directory which holds block number
+ * ${blkno} in storage state ${S}, or 0 if the block does not exist.  Return
+ * (size_t)(-1) on error.
+ */
+size_t
+storage_blkdir(struct storage_state * S, uint64_t blkno)
+{
+	struct file_state * fs;
+	size_t dir;
+
+	/* With only one directory, we don't need to look. */
+	if (S->ndirs == 1)
+		return (0);
+
+	/* Grab a read lock. */
+	if (storage_util_readlock(S))
+		goto err0;
+
+	/* Find the file holding the block, if we have it. */
+	if ((blkno < S->minblk) || (blkno >= S->nextblk)) {
+		dir = 0;
+	} else {
+		fs = elasticqueue_get(S->files, findfile(S, blkno));
+		dir = fs->dir;
+	}
+
+	/* Release the lock. */
+	if (storage_util_unlock(S))
+		goto err0;
+
+	/* Success! */
+	return (dir);
+
+err0:
+	/* Failure! */
+	return ((size_t)(-1));
+}
+
+/*
+ * Look for block ${blkno} in the block cache, as for storage_read_cached(),
+ * and set ${ascending} to non-zero if GETs are moving forwards through the
+ * blocks.
+ */
+static int
+cacheget(struct storage_state * S, uint64_t blkno, uint8_t * buf,
+    int * ascending)
+{
+	int rc;
+
+	/* If we have no cache, we don't have the block. */
+	*ascending = 0;
+	if (S->cache == NULL)
+		return (0);
+
+	/* Grab a read lock. */
+	if (storage_util_readlock(S))
+		goto err0;
+
+	/* Blocks which have been deleted must not be returned. */
+	if ((blkno < S->minblk) || (blkno >= S->nextblk))
+		rc = 0;
+	else if ((rc = blkcache_get(S->cache, blkno, buf, ascending)) == -1)
+		goto err1;
+
+	/* Release the lock. */
+	if (storage_util_unlock(S))
+		goto err0;
+
+	/* Success! */
+	return (rc);
+
+err1:
+	storage_util_unlock(S);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Find block ${blkno} as for storage_read_open(), and set ${navail} to the
+ * number of blocks, starting with ${blkno}, which can be read from ${fd}.
+ */
+static int
+readopen(struct storage_state * S, uint64_t blkno, int * fd, off_t * offset,
+    void ** ref, uint64_t * navail)
+{
+	struct file_state * fs;
+	struct file_fd * ffd;
+	uint64_t fstart;
+	size_t fdir;
+	char * s;
+	int evictfd = -1;
+
+	/* Grab a read lock. */
+	if (storage_util_readlock(S))
+		goto err0;
+
+	/* Figure out if we have this block. */
+	if ((blkno < S->minblk) || (blkno >= S->nextblk))
+		goto enoent2;
+
+	/* Figure out which file to read from, and at what position. */
+	fs = elasticqueue_get(S->files, findfile(S, blkno));
+	fstart = fs->start;
+	fdir = fs->dir;
+	ffd = fs->ffd;
+	*offset = (off_t)((blkno - fstart) * S->blocklen);
+	*navail = fstart + fs->len - blkno;
+
+	/*
+	 * Take a reference to the file's descriptor record, so that the
+	 * descriptor stays open even if the file is deleted.  If it has a
+	 * cached descriptor, use it and mark it as recently used.
+	 */
+	if (fdlock(S))
+		goto err1;
+	ffd->refcnt++;
+	if ((*fd = ffd->fd) != -1) {
+		ffd->nusers++;
+		lru_remove(S, ffd);
+		lru_append(S, ffd);
+	}
+	if (fdunlock(S))
+		goto err1;
+
+	/* Release the read lock. */
+	if (storage_util_unlock(S))
+		goto err2;
+
+	/* If we have a descriptor cached, we're done. */
+	if (*fd != -1)
+		goto done;
+
+	/* Open the file. */
+	if ((s = storage_util_mkpath(S, fdir, fstart)) == NULL)
+		goto err2;
+	if ((*fd = disk_open(s, S->direct)) == -1) {
+		free(s);
+
+		/*
+		 * If errno is ENOENT, we lost a race against the deleter
+		 * thread.  The block does not exist.
+		 */
+		if (errno == ENOENT)
+			goto enoent1;
+
+		/* Anything else is an error. */
+		goto err2;
+	}
+	free(s);
+
+	/*
+	 * Cache the descriptor if nobody beat us, evicting the least recently
+	 * used idle descriptor if the cache is full.
+	 */
+	if (fdlock(S))
+		goto err3;
+	if ((ffd->fd == -1) && (S->nfds == FDCACHE_MAX))
+		evictfd = lru_evict(S);
+	if ((ffd->fd == -1) && (S->nfds < FDCACHE_MAX)) {
+		ffd->fd = *fd;
+		ffd->nusers++;
+		lru_append(S, ffd);
+		S->nfds++;
+	}
+	if (fdunlock(S))
+		goto err4;
+
+	/* Close the evicted descriptor. */
+	if ((evictfd != -1) && disk_close(evictfd))
+		goto err2;
+
+done:
+	*ref = ffd;
+
+	/* Success! */
+	return (1);
+
+enoent2:
+	/* Release the lock. */
+	if (storage_util_unlock(S))
+		goto err0;
+
+	/* This block is not available. */
+	return (0);
+
+enoent1:
+	/* Release our reference to the descriptor record. */
+	if (ffd_release(S, ffd))
+		goto err0;
+
+	/* This block is not available. */
+	return (0);
+
+err4:
+	if (evictfd != -1)
+		disk_close(evictfd);
+err3:
+	disk_close(*fd);
+err2:
+	ffd_release(S, ffd);
+	goto err0;
+err1:
+	storage_util_unlock(S);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * storage_read_open(S, blkno, fd, offset, ref):
+ * Using storage state ${S}, find block number ${blkno}: Set ${fd} to a
+ * descriptor from which it can be read at position ${offset}, and ${ref} to
+ * a reference which must be passed to storage_read_close() along with ${fd}
+ * once the read is done.  Return 1 on success; 0 if the block does not
+ * exist; or -1 on error.
+ */
+int
+storage_read_open(struct storage_state * S, uint64_t blkno, int * fd,
+    off_t * offset, void ** ref)
+{
+	uint64_t navail;
+
+	return (readopen(S, blkno, fd, offset, ref, &navail));
+}
 
-		/* Does it have a non-integer number of blocks? */
-		if ((sf->len % (off_t)S->blocklen) != 0) {
-			/* Not permitted for files in the middle. */
-			if (elasticqueue_getlen(files) > 1) {
-				warn0("Block storage file has non-integer"
-				    " number of blocks: %016" PRIx64,
-				    sf->fileno);
-				goto err3;
-			}
+/**
+ * storage_read_cached(S, blkno, buf):
+ * Using storage state ${S}, if block number ${blkno} is in the block cache,
+ * copy it into the buffer ${buf} and return 1; otherwise return 0.  Return
+ * -1 on error.
+ */
+int
+storage_read_cached(struct storage_state * S, uint64_t blkno, uint8_t * buf)
+{
+	int ascending;
 
-			/*
-			 * The final file may have a non-integer number of
-			 * blocks due to an interrupted write; just remove
-			 * any partial block.
-			 */
-			if ((s = storage_util_mkpath(S, sf->fileno)) == NULL)
-				goto err3;
-			if (truncate(s, sf->len - (sf->len %
-			    (off_t)S->blocklen)))
-				goto err4;
-			free(s);
-		}
+	return (cacheget(S, blkno, buf, &ascending));
+}
 
-		/* Compute number of blocks. */
-		num_blocks = sf->len / (off_t)S->blocklen;
-#if UINTMAX_MAX > UINT64_MAX
-		if ((uintmax_t)num_blocks > (uintmax_t)UINT64_MAX)
-			goto err3;
-#endif
-		fs.len = (uint64_t)num_blocks;
+/**
+ * storage_read_cache(S, blkno, buf):
+ * Using storage state ${S}, add block number ${blkno}, which has been read
+ * into the buffer ${buf}, to the block cache (if there is one).
+ */
+int
+storage_read_cache(struct storage_state * S, uint64_t blkno,
+    const uint8_t * buf)
+{
 
-		/* Add to the queue of block file state structures. */
-		if (elasticqueue_add(S->files, &fs))
-			goto err3;
+	/* If we have no cache, there's nothing to do. */
+	if (S->cache == NULL)
+		return (0);
 
-		/* Adjust nextblk to account for this latest block file. */
-		S->nextblk = fs.start + fs.len;
+	/* Add the block. */
+	return (blkcache_put(S->cache, blkno, buf));
+}
 
-		/* Remove the file from the queue. */
-		elasticqueue_delete(files);
+/*
+ * Read ${nblks} blocks starting at block ${blkno} from position ${offset} of
+ * ${fd} into the block cache, and copy the first of them into ${buf}.
+ */
+static int
+readahead(struct storage_state * S, int fd, off_t offset, uint64_t blkno,
+    size_t nblks, uint8_t * buf)
+{
+	void * rabuf;
+	uint8_t * blks;
+	size_t i;
+	int rc;
+
+	/* Allocate a buffer suitable for direct I/O. */
+	if ((rc = posix_memalign(&rabuf, DISK_DIRECT_ALIGN,
+	    nblks * S->blocklen)) != 0) {
+		errno = rc;
+		goto err0;
 	}
+	blks = rabuf;
 
-	/* Free the (now empty) queue of files. */
-	elasticqueue_free(files);
+	/* Read the blocks. */
+	if (disk_pread(fd, offset, nblks * S->blocklen, blks))
+		goto err1;
 
-	/* Create a lock on the dynamic data. */
-	if ((rc = pthread_rwlock_init(&S->lck, NULL)) != 0) {
-		warn0("pthread_rwlock_init: %s", strerror(rc));
-		goto err2;
+	/* Cache them. */
+	for (i = 0; i < nblks; i++) {
+		if (blkcache_put(S->cache, blkno + i, &blks[i * S->blocklen]))
+			goto err1;
 	}
 
+	/* Hand the first block back. */
+	memcpy(buf, blks, S->blocklen);
+
+	/* Free the buffer. */
+	free(rabuf);
+
 	/* Success! */
-	return (S);
+	return (0);
 
-err4:
-	free(s);
-err3:
-	elasticqueue_free(files);
-err2:
-	elasticqueue_free(S->files);
 err1:
-	free(S);
+	free(rabuf);
 err0:
 	/* Failure! */
-	return (NULL);
+	return (-1);
 }
 
 /**
- * storage_nextblock(S):
- * Return the next writable block number for storage state ${S}, or
- * (uint64_t)(-1) on error.
+ * storage_read_close(S, fd, ref):
+ * Finish reading from the descriptor ${fd} with the reference ${ref}, as
+ * returned by storage_read_open().
  */
-uint64_t
-storage_nextblock(struct storage_state * S)
+int
+storage_read_close(struct storage_state * S, int fd, void * ref)
 {
-	uint64_t nextblk;
+	struct file_fd * ffd = ref;
+	int cached;
 
-	/* Grab a read lock. */
-	if (storage_util_readlock(S))
+	/* Is this the cached descriptor, or one opened just for us? */
+	if (fdlock(S))
+		goto err0;
+	if ((cached = (ffd->fd == fd)) != 0)
+		ffd->nusers--;
+	if (fdunlock(S))
 		goto err0;
 
-	/* Grab the next block # value. */
-	nextblk = S->nextblk;
+	/* Close the descriptor if we're not caching it. */
+	if ((cached == 0) && disk_close(fd))
+		goto err1;
 
-	/* Release the lock. */
-	if (storage_util_unlock(S))
+	/* Release our reference to the descriptor record. */
+	if (ffd_release(S, ffd))
 		goto err0;
 
 	/* Success! */
-	return (nextblk);
+	return (0);
 
+err1:
+	ffd_release(S, ffd);
 err0:
 	/* Failure! */
-	return ((uint64_t)(-1));
+	return (-1);
 }
 
 /**
@@ -207,48 +1020,48 @@ err0:
 int
 storage_read(struct storage_state * S, uint64_t blkno, uint8_t * buf)
 {
-	struct file_state * fs;
-	size_t i;
-	char * s = NULL;	/* free(NULL) simplifies error path. */
+	void * ref;
+	off_t offset;
+	uint64_t navail;
+	size_t nblks;
+	int fd;
+	int rc;
+	int ascending;
 	struct timespec nstime;
 
-	/* Grab a read lock. */
-	if (storage_util_readlock(S))
+	/* If the block is cached, we don't need to touch the disk. */
+	if ((rc = cacheget(S, blkno, buf, &ascending)) == -1)
 		goto err0;
+	if (rc == 1)
+		return (1);
 
-	/* Figure out if we have this block. */
-	if ((blkno < S->minblk) || (blkno >= S->nextblk))
-		goto enoent2;
-
-	/* Figure out which file to read from, and at what position. */
-	for (i = 0; ; i++) {
-		fs = elasticqueue_get(S->files, i);
-		assert(fs != NULL);
-		if (blkno < fs->start + fs->len)
-			break;
-	}
-	assert(fs->start <= blkno);
-
-	/* Release the read lock. */
-	if (storage_util_unlock(S))
+	/* Find the block. */
+	if ((rc = readopen(S, blkno, &fd, &offset, &ref, &navail)) == -1)
 		goto err0;
 
-	/* Read the block. */
-	if ((s = storage_util_mkpath(S, fs->start)) == NULL)
-		goto err0;
-	if (disk_read(s, (off_t)((blkno - fs->start) * S->blocklen),
-	    S->blocklen, buf)) {
-		/*
-		 * If errno is ENOENT, we lost a race against the deleter
-		 * thread.  The block does not exist.
-		 */
-		if (errno == ENOENT)
-			goto enoent1;
+	/* If the block doesn't exist, there's nothing to read. */
+	if (rc == 0)
+		return (0);
 
-		/* Anything else is an error. */
-		goto err1;
+	/* If GETs are ascending, read ahead as far as this file goes. */
+	nblks = 1;
+	if (ascending)
+		nblks = (navail < S->ranblks) ? (size_t)navail : S->ranblks;
+
+	/* Read the block(s). */
+	if (nblks > 1) {
+		if (readahead(S, fd, offset, blkno, nblks, buf))
+			goto err1;
+	} else {
+		if (disk_pread(fd, offset, S->blocklen, buf))
+			goto err1;
+		if (storage_read_cache(S, blkno, buf))
+			goto err1;
 	}
-	free(s);
+
+	/* We're done with the descriptor. */
+	if (storage_read_close(S, fd, ref))
+		goto err0;
 
 	/* Sleep the indicated duration. */
 	if (S->latency) {
@@ -260,18 +1073,8 @@ storage_read(struct storage_state * S, uint64_t blkno, uint8_t * buf)
 	/* Success! */
 	return (1);
 
-enoent2:
-	/* Release the lock. */
-	if (storage_util_unlock(S))
-		goto err1;
-enoent1:
-	free(s);
-
-	/* This block is not available. */
-	return (0);
-
 err1:
-	free(s);
+	storage_read_close(S, fd, ref);
 err0:
 	/* Failure! */
 	return (-1);
@@ -291,11 +1094,19 @@ storage_write(struct storage_state * S,
 	struct file_state * fs;
 	int newfile;
 	uint64_t fnum;
-	char * s = NULL;	/* free(NULL) simplifies error path. */
+	uint64_t flen;
+	size_t fdir;
+	uint64_t i;
+	size_t len;
+	off_t prealloc;
+	char * s;
+	void * dbuf = NULL;	/* Aligned copy of buf for direct I/O. */
+	int rc;
 
 	/* Sanity checks.  We must have nblks * S->blocklen <= SIZE_MAX. */
 	assert((nblks != 0) && (S->blocklen != 0));
 	assert(nblks <= SIZE_MAX / S->blocklen);
+	len = (size_t)(S->blocklen * nblks);
 
 	/* Pick up a write lock. */
 	if (storage_util_writelock(S))
@@ -330,34 +1141,95 @@ storage_write(struct storage_state * S,
 	else
 		newfile = 0;
 
-	/* If we're creating a new file, add a new file_state to the queue. */
+	/*
+	 * If we're creating a new file, add a new file_state to the queue.
+	 * New files go into the storage directories in turn.
+	 */
 	if (newfile) {
 		fs_new.start = blkno;
 		fs_new.len = 0;
+		fs_new.dir = (fs == NULL) ? 0 : (fs->dir + 1) % S->ndirs;
+		fs_new.dead = NULL;
+		fs_new.deadlen = 0;
+		fs_new.ndead = 0;
+		if ((fs_new.ffd = ffd_init()) == NULL)
+			goto err2;
 		fs = &fs_new;
-		if (elasticqueue_add(S->files, fs))
+		if (elasticqueue_add(S->files, fs)) {
+			free(fs_new.ffd);
 			goto err2;
+		}
 	}
 
-	/* Record which file we're appending to. */
+	/* Record which file we're appending to, and its length. */
 	fnum = fs->start;
+	flen = fs->len;
+	fdir = fs->dir;
 
 	/* Release the lock. */
 	if (storage_util_unlock(S))
 		goto err0;
 
+	/* Direct I/O needs an aligned buffer; buf comes from the network. */
+	if (S->direct) {
+		if ((rc = posix_memalign(&dbuf, DISK_DIRECT_ALIGN, len)) != 0) {
+			errno = rc;
+			goto err0;
+		}
+		memcpy(dbuf, buf, len);
+	}
+
+	/*
+	 * If we don't have this file open for appending yet, close the file
+	 * we were appending to (if any) and open this one.  We keep it open
+	 * so that later appends don't need to open it again.
+	 */
+	if ((S->wfd == -1) || (S->wfileno != fnum)) {
+		if (closewfd(S))
+			goto err1;
+		if ((s = storage_util_mkpath(S, fdir, fnum)) == NULL)
+			goto err1;
+		if ((S->wfd = disk_open_append(s, newfile, S->direct)) == -1) {
+			free(s);
+			goto err1;
+		}
+		free(s);
+		S->wfileno = fnum;
+		S->wlen = S->walloc = (off_t)(flen * S->blocklen);
+	}
+
+	/*
+	 * Preallocate space for this write and (probably) some later ones,
+	 * so that flushing the data to disk doesn't need to allocate blocks.
+	 */
+	if (S->wlen + (off_t)len > S->walloc) {
+		prealloc = ((off_t)len > PREALLOC_MIN) ?
+		    (off_t)len : PREALLOC_MIN;
+		if (disk_prealloc(S->wfd, S->wlen, prealloc))
+			goto err1;
+		S->walloc = S->wlen + prealloc;
+	}
+
 	/* Write the block(s) to the end of the file. */
-	if ((s = storage_util_mkpath(S, fnum)) == NULL)
-		goto err0;
-	if (disk_write(s, newfile, (size_t)(S->blocklen * nblks), buf,
-	    S->nosync)) {
+	if (disk_append(S->wfd, len, S->direct ? dbuf : buf, S->nosync))
 		goto err1;
-	}
-	free(s);
+	S->wlen += (off_t)len;
+	free(dbuf);
 
 	/* Make sure any file creation is flushed to disk. */
 	if ((newfile) && (S->nosync == 0)) {
-		if (disk_syncdir(S->storagedir))
+		if (disk_syncdir(S->storagedirs[fdir]))
+			goto err0;
+	}
+
+	/* Add a new file to its directory's manifest. */
+	if ((newfile) && manifest_update(S, fdir))
+		goto err0;
+
+	/* Recently appended blocks are likely to be read soon. */
+	for (i = 0; i < nblks; i++) {
+		if (storage_read_cache(S, blkno + i,
+		    &buf[(size_t)i * S->blocklen]))
 			goto err0;
 	}
 
@@ -386,8 +1258,9 @@ storage_write(struct storage_state * S,
 
 err2:
 	storage_util_unlock(S);
+	goto err0;
 err1:
-	free(s);
+	free(dbuf);
 err0:
 	/* Failure! */
 	return (-1);
@@ -402,11 +1275,32 @@ int
 storage_delete(struct storage_state * S, uint64_t blkno)
 {
 	struct file_state * fs;
+	struct file_fd * ffd;
 	uint64_t fileno;
+	size_t fdir;
 	char * s;
+	struct timespec nstime;
+	uint8_t * touched;
+	size_t i;
+	int deleted = 0;
+
+	/* We haven't deleted files from any directories yet. */
+	if ((touched = calloc(S->ndirs, 1)) == NULL)
+		goto err0;
 
 	/* Loop until we don't need to delete anything. */
 	do {
+		/*
+		 * If we've already deleted a file, pause before deleting
+		 * another one; unlinking a large file can keep a disk busy
+		 * for a while, and we don't want to starve readers.
+		 */
+		if (deleted && (S->delpause > 0)) {
+			nstime.tv_sec = S->delpause / 1000;
+			nstime.tv_nsec = (S->delpause % 1000) * 1000000;
+			nanosleep(&nstime, NULL);
+		}
+
 		/*
 		 * First, figure out if we need to delete a file; if we do,
 		 * remove it from the file queue.
@@ -414,7 +1308,7 @@ storage_delete(struct storage_state * S, uint64_t blkno)
 
 		/* Grab a write lock. */
 		if (storage_util_writelock(S))
-			goto err0;
+			goto err1;
 
 		/* If we have less than 2 files, don't delete anything. */
 		if (elasticqueue_getlen(S->files) < 2)
@@ -427,6 +1321,9 @@ storage_delete(struct storage_state * S, uint64_t blkno)
 
 		/* We want to delete the first file. */
 		fileno = fs->start;
+		fdir = fs->dir;
+		ffd = fs->ffd;
+		free(fs->dead);
 
 		/* Remove the file from the file queue. */
 		elasticqueue_delete(S->files);
@@ -437,7 +1334,15 @@ storage_delete(struct storage_state * S, uint64_t blkno)
 
 		/* Release the lock. */
 		if (storage_util_unlock(S))
-			goto err0;
+			goto err1;
+
+		/*
+		 * Drop the file queue's reference to the file's descriptor;
+		 * readers which are using the descriptor hold their own
+		 * references, and the last of them will close it.
+		 */
+		if (ffd_release(S, ffd))
+			goto err1;
 
 		/*
 		 * Delete the file.  We don't need to worry about racing
@@ -445,30 +1350,200 @@ storage_delete(struct storage_state * S, uint64_t blkno)
 		 * file; and racing against readers is handled by readers
 		 * treating ENOENT properly.
 		 */
-		if ((s = storage_util_mkpath(S, fileno)) == NULL)
-			goto err0;
+		if ((s = storage_util_mkpath(S, fdir, fileno)) == NULL)
+			goto err1;
 		if (unlink(s)) {
 			warnp("unlink(%s)", s);
-			goto err1;
+			goto err2;
 		}
 		free(s);
 
 		/* Make sure the file deletion is flushed to disk. */
-		if (disk_syncdir(S->storagedir))
-			goto err0;
+		if (disk_syncdir(S->storagedirs[fdir]))
+			goto err1;
+		deleted = 1;
+
+		/* This directory's manifest needs to be rewritten. */
+		touched[fdir] = 1;
 	} while (1);
 
 	/* Release the write lock. */
 	if (storage_util_unlock(S))
-		goto err0;
+		goto err1;
+
+	/*
+	 * Remove the deleted files from their directories' manifests.  Files
+	 * listed in a manifest which no longer exist are ignored when the
+	 * manifest is read, so we only need to do this once per directory.
+	 */
+	for (i = 0; i < S->ndirs; i++) {
+		if (touched[i] && manifest_update(S, i))
+			goto err1;
+	}
+	free(touched);
 
 	/* Success! */
 	return (0);
 
-err1:
+err2:
 	free(s);
+err1:
+	free(touched);
 err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * storage_freerange(S, ranges, nranges):
+ * Using storage state ${S}, release the disk space used by the blocks in the
+ * ${nranges} ranges ${ranges}[0 .. ${nranges} - 1], which will never be read
+ * again; and delete any block files at the start of the log which hold only
+ * such blocks.  There MUST NOT at any time be more than one thread calling
+ * this function or storage_delete().
+ */
+int
+storage_freerange(struct storage_state * S,
+    const struct proto_lbs_range * ranges, size_t nranges)
+{
+	struct file_state * fs;
+	uint64_t blkno, end;
+	uint64_t fstart, n;
+	uint64_t pstart, pend, plast;
+	uint64_t fnum = (uint64_t)(-1);
+	uint64_t horizon;
+	uint64_t cblks;
+	size_t fdir;
+	size_t i;
+	int fd = -1;
+	char * s;
+
+	/*
+	 * Punching a hole for each block would take a system call per block
+	 * and fragment the file, so we release space in chunks of at least
+	 * PUNCH_MIN bytes, once all the blocks in a chunk are dead.
+	 */
+	cblks = (PUNCH_MIN + S->blocklen - 1) / S->blocklen;
+
+	/* Handle each range in turn. */
+	for (i = 0; i < nranges; i++) {
+		blkno = ranges[i].blkno;
+		if (ranges[i].nblks > UINT64_MAX - blkno)
+			end = UINT64_MAX;
+		else
+			end = blkno + ranges[i].nblks;
+
+		/* Handle the part of the range in each file in turn. */
+		while (blkno < end) {
+			/* Grab a read lock. */
+			if (storage_util_readlock(S))
+				goto err1;
+
+			/* Ignore blocks which we don't have. */
+			if (blkno < S->minblk)
+				blkno = S->minblk;
+			if (end > S->nextblk)
+				end = S->nextblk;
+			if (blkno >= end) {
+				if (storage_util_unlock(S))
+					goto err1;
+				break;
+			}
+
+			/* Find the blocks in the file holding this block. */
+			fs = elasticqueue_get(S->files, findfile(S, blkno));
+			fstart = fs->start;
+			fdir = fs->dir;
+			n = fs->start + fs->len - blkno;
+			if (n > end - blkno)
+				n = end - blkno;
+
+			/* Record that they are dead. */
+			if (markdead(fs, blkno - fstart, n))
+				goto err2;
+
+			/*
+			 * Find the chunks overlapping these blocks which are
+			 * now entirely dead; chunks in the middle must be.
+			 */
+			pstart = (blkno - fstart) / cblks * cblks;
+			plast = (blkno - fstart + n - 1) / cblks * cblks;
+			pend = plast + cblks;
+			if (pend > fs->len)
+				pend = fs->len;
+			if (!alldead(fs, pstart, (pstart < plast) ?
+			    cblks : pend - pstart))
+				pstart += cblks;
+			if ((pstart < pend) &&
+			    !alldead(fs, plast, pend - plast))
+				pend = plast;
+
+			/* Release the lock. */
+			if (storage_util_unlock(S))
+				goto err1;
+
+			/* Move on if there's nothing to release yet. */
+			blkno += n;
+			if (pstart >= pend)
+				continue;
+
+			/* Open the file if we don't already have it open. */
+			if (fnum != fstart) {
+				if ((fd != -1) && disk_close(fd))
+					goto err0;
+				fd = -1;
+				if ((s = storage_util_mkpath(S, fdir,
+				    fstart)) == NULL)
+					goto err0;
+				if ((fd = disk_open_append(s, 0, 0)) == -1) {
+					free(s);
+					goto err0;
+				}
+				free(s);
+				fnum = fstart;
+			}
+
+			/* Release the space used by those chunks. */
+			if (disk_punch(fd, (off_t)(pstart * S->blocklen),
+			    (off_t)((pend - pstart) * S->blocklen)))
+				goto err1;
+		}
+	}
+
+	/* Close the file we were punching holes in. */
+	if ((fd != -1) && disk_close(fd))
+		goto err0;
+
+	/*
+	 * Find the end of any run of files at the start of the log which
+	 * hold only dead blocks.  We never delete the last file, since we
+	 * might be appending to it.
+	 */
+	if (storage_util_readlock(S))
+		goto err0;
+	horizon = 0;
+	for (i = 0; i + 1 < elasticqueue_getlen(S->files); i++) {
+		fs = elasticqueue_get(S->files, i);
+		if (fs->ndead < fs->len)
+			break;
+		horizon = fs->start + fs->len;
+	}
+	if (storage_util_unlock(S))
+		goto err0;
+
+	/* Delete those files. */
+	if ((horizon > 0) && storage_delete(S, horizon))
+		goto err0;
 
+	/* Success! */
+	return (0);
+
+err2:
+	storage_util_unlock(S);
+err1:
+	if (fd != -1)
+		disk_close(fd);
+err0:
 	/* Failure! */
 	return (-1);
 }
@@ -488,8 +1563,27 @@ storage_done(struct storage_state * S)
 		goto err0;
 	}
 
-	/* Free the queue of file state structures. */
-	elasticqueue_free(S->files);
+	/* Stop appending to the last file. */
+	if (closewfd(S))
+		goto err0;
+
+	/* Close cached descriptors and free the queue of file states. */
+	files_free(S->files);
+
+	/* Free the block cache. */
+	blkcache_free(S->cache);
+
+	/* Destroy the lock on the manifests. */
+	if ((rc = pthread_mutex_destroy(&S->mflck)) != 0) {
+		warn0("pthread_mutex_destroy: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Destroy the lock on the descriptor cache. */
+	if ((rc = pthread_mutex_destroy(&S->fdlck)) != 0) {
+		warn0("pthread_mutex_destroy: %s", strerror(rc));
+		goto err0;
+	}
 
 	/* Free the storage state. */
 	free(S);
@@ -1,19 +1,33 @@
 #ifndef STORAGE_H_
 #define STORAGE_H_
 
+#include <sys/types.h>
+
 #include <stddef.h>
 #include <stdint.h>
 
 /* Opaque structure holding back-end storage state. */
 struct storage_state;
 
+/* Opaque type. */
+struct proto_lbs_range;
+
 /**
- * storage_init(storagedir, blklen, latency, nosync):
+ * storage_init(storagedirs, ndirs, blklen, latency, nosync, direct, ncache,
+ *     delpause):
  * Initialize and return the storage state for ${blklen}-byte blocks of data
- * stored in ${storagedir}.  Sleep ${latency} ns in storage_read() calls.  If
- * ${nosync} is non-zero, don't use fsync.
+ * stored in the ${ndirs} directories ${storagedirs}[0 .. ${ndirs} - 1]; new
+ * block files are placed in the directories in turn.  The array
+ * ${storagedirs} must remain valid until storage_done() is called.  Sleep
+ * ${latency} ns in storage_read() calls.  If ${nosync} is non-zero, don't
+ * use fsync.  If ${direct} is non-zero, bypass the operating system's buffer
+ * cache; ${blklen} must then be a multiple of DISK_DIRECT_ALIGN.  If
+ * ${ncache} is non-zero, keep the ${ncache} most recently appended or read
+ * blocks in memory, and read ahead when blocks are read in ascending order.
+ * Pause ${delpause} ms between deleting block files in storage_delete().
  */
-struct storage_state * storage_init(const char *, size_t, long, int);
+struct storage_state * storage_init(const char * const *, size_t, size_t,
+    long, int, int, size_t, long);
 
 /**
  * storage_nextblock(S):
@@ -22,6 +36,47 @@ struct storage_state * storage_init(const char *, size_t, long, int);
  */
 uint64_t storage_nextblock(struct storage_state *);
 
+/**
+ * storage_blkdir(S, blkno):
+ * Return the index of the storage directory which holds block number
+ * ${blkno} in storage state ${S}, or 0 if the block does not exist.  Return
+ * (size_t)(-1) on error.
+ */
+size_t storage_blkdir(struct storage_state *, uint64_t);
+
+/**
+ * storage_read_open(S, blkno, fd, offset, ref):
+ * Using storage state ${S}, find block number ${blkno}: Set ${fd} to a
+ * descriptor from which it can be read at position ${offset}, and ${ref} to
+ * a reference which must be passed to storage_read_close() along with ${fd}
+ * once the read is done.  Return 1 on success; 0 if the block does not
+ * exist; or -1 on error.
+ */
+int storage_read_open(struct storage_state *, uint64_t, int *, off_t *,
+    void **);
+
+/**
+ * storage_read_cached(S, blkno, buf):
+ * Using storage state ${S}, if block number ${blkno} is in the block cache,
+ * copy it into the buffer ${buf} and return 1; otherwise return 0.  Return
+ * -1 on error.
+ */
+int storage_read_cached(struct storage_state *, uint64_t, uint8_t *);
+
+/**
+ * storage_read_cache(S, blkno, buf):
+ * Using storage state ${S}, add block number ${blkno}, which has been read
+ * into the buffer ${buf}, to the block cache (if there is one).
+ */
+int storage_read_cache(struct storage_state *, uint64_t, const uint8_t *);
+
+/**
+ * storage_read_close(S, fd, ref):
+ * Finish reading from the descriptor ${fd} with the reference ${ref}, as
+ * returned by storage_read_open().
+ */
+int storage_read_close(struct storage_state *, int, void *);
+
 /**
  * storage_read(S, blkno, buf):
  * Using storage state ${S}, read block number ${blkno} into the buffer
@@ -45,6 +100,17 @@ int storage_write(struct storage_state *, uint64_t, uint64_t, uint8_t *);
  */
 int storage_delete(struct storage_state *, uint64_t);
 
+/**
+ * storage_freerange(S, ranges, nranges):
+ * Using storage state ${S}, release the disk space used by the blocks in the
+ * ${nranges} ranges ${ranges}[0 .. ${nranges} - 1], which will never be read
+ * again; and delete any block files at the start of the log which hold only
+ * such blocks.  There MUST NOT at any time be more than one thread calling
+ * this function or storage_delete().
+ */
+int storage_freerange(struct storage_state *,
+    const struct proto_lbs_range *, size_t);
+
 /**
  * storage_done(S):
  * Free the storage state data ${S}.
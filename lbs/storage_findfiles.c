@@ -3,6 +3,7 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +15,8 @@
 #include "sysendian.h"
 #include "warnp.h"
 
+#include "storage_manifest.h"
+
 #include "storage_findfiles.h"
 
 /* Compare the fileno values in two storage_file structures. */
@@ -32,36 +35,25 @@ fs_compar(void * cookie, const void * _x, const void * _y)
 		return (0);
 }
 
-/**
- * storage_findfiles(path):
- * Look for files named "blks_<16 hex digits>" in the directory ${path}.
- * Return an elastic queue of struct storage_file, in order of increasing
- * fileno.
+/*
+ * Look for files named "blks_<16 hex digits>" in the directory ${path}, and
+ * add storage_file structures for them, with directory index ${dirno}, to
+ * the heap ${H}.
  */
-struct elasticqueue *
-storage_findfiles(const char * path)
+static int
+findfiles_dir(struct ptrheap * H, const char * path, size_t dirno)
 {
 	struct stat sb;
 	DIR * dir;
 	struct dirent * dp;
-	struct ptrheap * H;
 	struct storage_file * sf;
 	char * s;
 	uint8_t fileno_exp[8];
-	struct elasticqueue * Q;
-
-	/* Create a heap for holding storage_file structures. */
-	if ((H = ptrheap_init(fs_compar, NULL, NULL)) == NULL)
-		goto err0;
-
-	/* Create a queue for holding the structures in sorted order. */
-	if ((Q = elasticqueue_init(sizeof(struct storage_file))) == NULL)
-		goto err1;
 
 	/* Open the storage directory. */
 	if ((dir = opendir(path)) == NULL) {
 		warnp("Cannot open storage directory: %s", path);
-		goto err2;
+		goto err0;
 	}
 
 	/*
@@ -89,11 +81,11 @@ storage_findfiles(const char * path)
 		/* Construct a full path to the file and stat. */
 		if (asprintf(&s, "%s/%s", path, dp->d_name) == -1) {
 			warnp("asprintf");
-			goto err3;
+			goto err1;
 		}
 		if (lstat(s, &sb)) {
 			warnp("stat(%s)", s);
-			goto err4;
+			goto err2;
 		}
 
 		/* Skip anything other than regular files. */
@@ -102,15 +94,16 @@ storage_findfiles(const char * path)
 
 		/* Allocate a file_state structure. */
 		if ((sf = malloc(sizeof(struct storage_file))) == NULL)
-			goto err4;
+			goto err2;
 
-		/* Fill in file number and size. */
+		/* Fill in file number, size, and location. */
 		sf->fileno = be64dec(fileno_exp);
 		sf->len = sb.st_size;
+		sf->dir = dirno;
 
 		/* Insert the file into the heap. */
 		if (ptrheap_add(H, sf))
-			goto err5;
+			goto err3;
 
 next:
 		/* Free the full path to the file. */
@@ -118,7 +111,7 @@ next:
 	}
 	if (errno != 0) {
 		warnp("Error reading storage directory: %s", path);
-		goto err3;
+		goto err1;
 	}
 
 	/* Close the storage directory. */
@@ -129,15 +122,173 @@ next:
 
 		/* Oops, something bad happened. */
 		warnp("Error closing storage directory: %s", path);
-		goto err2;
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err3:
+	free(sf);
+err2:
+	free(s);
+err1:
+	closedir(dir);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Add storage_file structures for the files listed in the manifest of the
+ * directory ${path}, with directory index ${dirno} and lengths of -1 (not
+ * known yet), to the heap ${H}.  Return 1 if there is no usable manifest.
+ */
+static int
+listfiles_dir(struct ptrheap * H, const char * path, size_t dirno)
+{
+	struct storage_file * sf;
+	uint64_t * filenos;
+	size_t nfiles;
+	size_t i;
+	int rc;
+
+	/* Read the manifest. */
+	if ((rc = storage_manifest_read(path, &filenos, &nfiles)) != 0)
+		return (rc);
+
+	/* Add the files it lists. */
+	for (i = 0; i < nfiles; i++) {
+		if ((sf = malloc(sizeof(struct storage_file))) == NULL)
+			goto err1;
+		sf->fileno = filenos[i];
+		sf->len = -1;
+		sf->dir = dirno;
+		if (ptrheap_add(H, sf))
+			goto err2;
+	}
+
+	/* Free the list of file numbers. */
+	free(filenos);
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(sf);
+err1:
+	free(filenos);
+
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * If a regular file "blks_${fileno}" exists in the directory ${path}, set
+ * ${len} to its length and return 1; otherwise return 0.  Return -1 on
+ * error.
+ */
+static int
+statfile(const char * path, uint64_t fileno, off_t * len)
+{
+	struct stat sb;
+	char * s;
+
+	/* Construct a full path to the file and stat. */
+	if (asprintf(&s, "%s/blks_%016" PRIx64, path, fileno) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (lstat(s, &sb)) {
+		if (errno == ENOENT)
+			goto nofile;
+		warnp("stat(%s)", s);
+		goto err1;
+	}
+	free(s);
+
+	/* Anything other than a regular file doesn't count. */
+	if (!S_ISREG(sb.st_mode))
+		return (0);
+
+	/* The file exists. */
+	*len = sb.st_size;
+	return (1);
+
+nofile:
+	free(s);
+
+	/* There is no such file. */
+	return (0);
+
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Find the block files in the ${npaths} directories ${paths}, from each
+ * directory's manifest (if ${usemanifests} is non-zero and it has one) or by
+ * looking at the directory.  Return an elastic queue of struct storage_file
+ * in order of increasing fileno, and set ${nlisted} to the number of
+ * directories whose manifests were used.
+ */
+static struct elasticqueue *
+collect(const char * const * paths, size_t npaths, int usemanifests,
+    size_t * nlisted)
+{
+	struct ptrheap * H;
+	struct storage_file * sf;
+	struct storage_file * sf_prev;
+	struct elasticqueue * Q;
+	size_t i;
+	int rc;
+
+	/* Create a heap for holding storage_file structures. */
+	if ((H = ptrheap_init(fs_compar, NULL, NULL)) == NULL)
+		goto err0;
+
+	/* Create a queue for holding the structures in sorted order. */
+	if ((Q = elasticqueue_init(sizeof(struct storage_file))) == NULL)
+		goto err1;
+
+	/* Look for files in each of the storage directories. */
+	*nlisted = 0;
+	for (i = 0; i < npaths; i++) {
+		/* Use the directory's manifest if we can. */
+		if (usemanifests) {
+			if ((rc = listfiles_dir(H, paths[i], i)) == -1)
+				goto err2;
+			if (rc == 0) {
+				*nlisted += 1;
+				continue;
+			}
+		}
+
+		/* Otherwise, look at what's in the directory. */
+		if (findfiles_dir(H, paths[i], i))
+			goto err2;
 	}
 
 	/* Suck structures from the heap into the queue. */
+	sf_prev = NULL;
 	while ((sf = ptrheap_getmin(H)) != NULL) {
+		/* Each file must only be in one place. */
+		if ((sf_prev != NULL) && (sf_prev->fileno == sf->fileno)) {
+			warn0("Block storage file %016" PRIx64
+			    " is in both %s and %s", sf->fileno,
+			    paths[sf_prev->dir], paths[sf->dir]);
+			goto err2;
+		}
+
+		/* Move the structure into the queue. */
 		if (elasticqueue_add(Q, sf))
 			goto err2;
 		free(sf);
 		ptrheap_deletemin(H);
+		sf_prev = elasticqueue_get(Q, elasticqueue_getlen(Q) - 1);
 	}
 
 	/* Free the (now empty) heap. */
@@ -146,12 +297,6 @@ next:
 	/* Success! */
 	return (Q);
 
-err5:
-	free(sf);
-err4:
-	free(s);
-err3:
-	closedir(dir);
 err2:
 	elasticqueue_free(Q);
 err1:
@@ -164,3 +309,149 @@ err0:
 	/* Failure! */
 	return (NULL);
 }
+
+/*
+ * Given the queue ${L} of files in the ${npaths} directories ${paths}, some
+ * of which came from manifests and have unknown lengths, return a queue of
+ * the files which exist, with their lengths filled in.  Only the files at
+ * the ends of the queue are examined: files which were deleted or not yet
+ * created when the manifests were written are dropped, and files which have
+ * been created since then are found by looking for a file which starts
+ * where the last file ends.
+ */
+static struct elasticqueue *
+checkfiles(struct elasticqueue * L, const char * const * paths,
+    size_t npaths, size_t blocklen)
+{
+	struct elasticqueue * Q;
+	struct storage_file * sf;
+	struct storage_file * sf_next;
+	struct storage_file sf_new;
+	uint64_t nblks;
+	size_t first, last;
+	size_t i;
+	int rc;
+
+	/* Create a queue for holding the files. */
+	if ((Q = elasticqueue_init(sizeof(struct storage_file))) == NULL)
+		goto err0;
+
+	/* Skip files at the start which have been deleted. */
+	for (first = 0; first < elasticqueue_getlen(L); first++) {
+		sf = elasticqueue_get(L, first);
+		if (sf->len != -1)
+			break;
+		if ((rc = statfile(paths[sf->dir], sf->fileno, &sf->len)) == -1)
+			goto err1;
+		if (rc == 1)
+			break;
+	}
+
+	/* Skip files at the end which were never created. */
+	for (last = elasticqueue_getlen(L); last > first; last--) {
+		sf = elasticqueue_get(L, last - 1);
+		if (sf->len != -1)
+			break;
+		if ((rc = statfile(paths[sf->dir], sf->fileno, &sf->len)) == -1)
+			goto err1;
+		if (rc == 1)
+			break;
+	}
+
+	/* Each file in between runs up to the start of the next file. */
+	for (i = first; i < last; i++) {
+		sf = elasticqueue_get(L, i);
+		if (sf->len == -1) {
+			sf_next = elasticqueue_get(L, i + 1);
+			nblks = sf_next->fileno - sf->fileno;
+			sf->len = (off_t)(nblks * blocklen);
+		}
+		if (elasticqueue_add(Q, sf))
+			goto err1;
+	}
+
+	/* Look for files which were created after the manifests. */
+	while (elasticqueue_getlen(Q) > 0) {
+		/* Where does the last file end? */
+		sf = elasticqueue_get(Q, elasticqueue_getlen(Q) - 1);
+		if ((nblks = (uint64_t)sf->len / blocklen) == 0)
+			break;
+		sf_new.fileno = sf->fileno + nblks;
+
+		/* Look for a file starting there in each directory. */
+		for (i = 0; i < npaths; i++) {
+			if ((rc = statfile(paths[i], sf_new.fileno,
+			    &sf_new.len)) == -1)
+				goto err1;
+			if (rc == 1)
+				break;
+		}
+		if (i == npaths)
+			break;
+		sf_new.dir = i;
+
+		/* Add it to the end of the queue. */
+		if (elasticqueue_add(Q, &sf_new))
+			goto err1;
+	}
+
+	/* Success! */
+	return (Q);
+
+err1:
+	elasticqueue_free(Q);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * storage_findfiles(paths, npaths, blocklen):
+ * Find the files named "blks_<16 hex digits>" in the ${npaths} directories
+ * ${paths}[0 .. ${npaths} - 1], which hold blocks of ${blocklen} bytes.
+ * Return an elastic queue of struct storage_file, in order of increasing
+ * fileno.  It is an error for a file to be present in more than one of the
+ * directories.  Directories which have a manifest (written by
+ * storage_manifest_write) are not listed; only the first and last files
+ * they hold are examined.
+ */
+struct elasticqueue *
+storage_findfiles(const char * const * paths, size_t npaths, size_t blocklen)
+{
+	struct elasticqueue * L;
+	struct elasticqueue * Q;
+	size_t nlisted;
+
+	/* Get the files from the manifests or the directories. */
+	if ((L = collect(paths, npaths, 1, &nlisted)) == NULL)
+		goto err0;
+
+	/* If we had no manifests, we know what files we have. */
+	if (nlisted == 0)
+		return (L);
+
+	/* Check the files at the ends of the list. */
+	if ((Q = checkfiles(L, paths, npaths, blocklen)) == NULL)
+		goto err1;
+	elasticqueue_free(L);
+
+	/*
+	 * If the manifests didn't lead us to any files, they may be out of
+	 * date (e.g., if an older version of lbs has been using these
+	 * directories); look at what the directories hold instead.
+	 */
+	if (elasticqueue_getlen(Q) == 0) {
+		elasticqueue_free(Q);
+		if ((Q = collect(paths, npaths, 0, &nlisted)) == NULL)
+			goto err0;
+	}
+
+	/* Success! */
+	return (Q);
+
+err1:
+	elasticqueue_free(L);
+err0:
+	/* Failure! */
+	return (NULL);
+}
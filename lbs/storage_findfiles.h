@@ -3,20 +3,26 @@
 
 #include <sys/types.h>
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Info about block storage files. */
 struct storage_file {
 	uint64_t fileno;	/* Hex digits in "blks_<16 hex digits>". */
 	off_t len;		/* Length of the file, in bytes. */
+	size_t dir;		/* Index of the directory holding it. */
 };
 
 /**
- * storage_findfiles(path):
- * Look for files named "blks_<16 hex digits>" in the directory ${path}.
+ * storage_findfiles(paths, npaths, blocklen):
+ * Find the files named "blks_<16 hex digits>" in the ${npaths} directories
+ * ${paths}[0 .. ${npaths} - 1], which hold blocks of ${blocklen} bytes.
  * Return an elastic queue of struct storage_file, in order of increasing
- * fileno.
+ * fileno.  It is an error for a file to be present in more than one of the
+ * directories.  Directories which have a manifest (written by
+ * storage_manifest_write) are not listed; only the first and last files
+ * they hold are examined.
  */
-struct elasticqueue * storage_findfiles(const char *);
+struct elasticqueue * storage_findfiles(const char * const *, size_t, size_t);
 
 #endif /* !STORAGE_FINDFILES_H_ */
@@ -1,19 +1,40 @@
 #ifndef STORAGE_INTERNAL_H_
 #define STORAGE_INTERNAL_H_
 
+#include <sys/types.h>
+
 #include <pthread.h>
 #include <stdint.h>
 
 /* Opaque types. */
+struct blkcache;
 struct elasticqueue;
+struct file_fd;
 
 /* Back-end storage state. */
 struct storage_state {
 	/* Static data. */
-	const char * storagedir;	/* Directory containing bits. */
+	const char * const * storagedirs;	/* Directories holding bits. */
+	size_t ndirs;			/* Number of storage directories. */
 	size_t blocklen;		/* Block size in bytes. */
 	uint64_t maxnblks;		/* Maximum # of blocks in a file. */
 
+	/* Direct I/O and block caching. */
+	int direct;			/* Bypass the OS buffer cache. */
+	struct blkcache * cache;	/* Recently used blocks, or NULL. */
+
+	/* Number of blocks to read ahead when reads are ascending. */
+	size_t ranblks;
+
+	/* Deleting; only used by the deleter thread. */
+	long delpause;			/* Pause between deletions, in ms. */
+
+	/* Appending; only used by the writer thread. */
+	int wfd;			/* Descriptor for appending, or -1. */
+	uint64_t wfileno;		/* File which wfd refers to. */
+	off_t wlen;			/* Length of that file. */
+	off_t walloc;			/* Space preallocated in that file. */
+
 	/* Debugging options. */
 	long latency;			/* Read latency in ns. */
 	int nosync;			/* Don't sync to disk. */
@@ -23,6 +44,15 @@ struct storage_state {
 	struct elasticqueue * files;	/* File states. */
 	uint64_t minblk;		/* Minimum valid block #. */
 	uint64_t nextblk;		/* Next block # to write. */
+
+	/* Manifests of block files. */
+	pthread_mutex_t mflck;		/* Serializes manifest updates. */
+
+	/* Descriptor cache. */
+	pthread_mutex_t fdlck;		/* Lock on descriptor references. */
+	size_t nfds;			/* Number of cached descriptors. */
+	struct file_fd * lru_head;	/* Least recently used descriptor. */
+	struct file_fd * lru_tail;	/* Most recently used descriptor. */
 };
 
 /**
@@ -31,6 +61,8 @@ struct storage_state {
  * 2. If files is non-empty, minblk = head(files)->start.
  * 3. If files is non-empty, nextblk = tail(files)->start + tail(files)->len.
  * 4. For consecutive entries x, y in files, x->start + x->len = y->start.
+ * The reference counts of cached descriptors are protected by fdlck rather
+ * than lck, since readers modify them while holding lck for reading.
  */
 
 #endif /* !STORAGE_INTERNAL_H_ */
@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asprintf.h"
+#include "crc32c.h"
+#include "sysendian.h"
+#include "warnp.h"
+
+#include "disk.h"
+
+#include "storage_manifest.h"
+
+/*
+ * A manifest is a list of big-endian 64-bit file numbers, followed by the
+ * CRC32C of the list.
+ */
+#define MANIFEST_NAME	"manifest"
+#define MANIFEST_TMP	"manifest.tmp"
+
+/**
+ * storage_manifest_read(path, filenos, nfiles):
+ * Read the manifest of block files in the storage directory ${path}, and set
+ * ${filenos} to a malloc-allocated array of the ${nfiles} file numbers which
+ * it lists, in increasing order.  Return 0 on success; 1 if the directory
+ * has no manifest or the manifest is corrupt; or -1 on error.
+ */
+int
+storage_manifest_read(const char * path, uint64_t ** filenos, size_t * nfiles)
+{
+	CRC32C_CTX ctx;
+	uint8_t cbuf[4];
+	char * s;
+	uint8_t * buf;
+	size_t len;
+	size_t i;
+
+	/* Read the manifest, if there is one. */
+	if (asprintf(&s, "%s/%s", path, MANIFEST_NAME) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (disk_readfile(s, &buf, &len)) {
+		if (errno == ENOENT)
+			goto nomanifest;
+		goto err1;
+	}
+
+	/* Check the length and CRC. */
+	if ((len < 4) || ((len - 4) % 8 != 0))
+		goto corrupt;
+	CRC32C_Init(&ctx);
+	CRC32C_Update(&ctx, buf, len - 4);
+	CRC32C_Final(cbuf, &ctx);
+	if (memcmp(cbuf, &buf[len - 4], 4))
+		goto corrupt;
+
+	/* Parse the file numbers. */
+	*nfiles = (len - 4) / 8;
+	if ((*filenos = malloc((*nfiles + 1) * sizeof(uint64_t))) == NULL)
+		goto err2;
+	for (i = 0; i < *nfiles; i++) {
+		(*filenos)[i] = be64dec(&buf[i * 8]);
+		if ((i > 0) && ((*filenos)[i] <= (*filenos)[i - 1])) {
+			free(*filenos);
+			goto corrupt;
+		}
+	}
+
+	/* Clean up. */
+	free(buf);
+	free(s);
+
+	/* Success! */
+	return (0);
+
+corrupt:
+	warn0("Ignoring corrupt manifest: %s", s);
+	free(buf);
+nomanifest:
+	free(s);
+
+	/* We don't have a usable manifest. */
+	return (1);
+
+err2:
+	free(buf);
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * storage_manifest_write(path, filenos, nfiles, nosync):
+ * Replace the manifest of block files in the storage directory ${path} with
+ * one listing the ${nfiles} file numbers ${filenos}, which must be in
+ * increasing order.  The manifest is replaced atomically; unless ${nosync}
+ * is non-zero, it is also flushed to disk.
+ */
+int
+storage_manifest_write(const char * path, const uint64_t * filenos,
+    size_t nfiles, int nosync)
+{
+	CRC32C_CTX ctx;
+	char * s;
+	char * s_tmp;
+	uint8_t * buf;
+	size_t len;
+	size_t i;
+
+	/* Serialize the file numbers and append their CRC. */
+	if (nfiles > (SIZE_MAX - 4) / 8) {
+		errno = ENOMEM;
+		goto err0;
+	}
+	len = nfiles * 8 + 4;
+	if ((buf = malloc(len)) == NULL)
+		goto err0;
+	for (i = 0; i < nfiles; i++)
+		be64enc(&buf[i * 8], filenos[i]);
+	CRC32C_Init(&ctx);
+	CRC32C_Update(&ctx, buf, len - 4);
+	CRC32C_Final(&buf[len - 4], &ctx);
+
+	/* Construct paths for the manifest and its replacement. */
+	if (asprintf(&s, "%s/%s", path, MANIFEST_NAME) == -1) {
+		warnp("asprintf");
+		goto err1;
+	}
+	if (asprintf(&s_tmp, "%s/%s", path, MANIFEST_TMP) == -1) {
+		warnp("asprintf");
+		goto err2;
+	}
+
+	/* Replace the manifest. */
+	if (disk_replacefile(s, s_tmp, buf, len, nosync))
+		goto err3;
+
+	/* Make sure the rename is flushed to disk. */
+	if ((nosync == 0) && disk_syncdir(path))
+		goto err3;
+
+	/* Clean up. */
+	free(s_tmp);
+	free(s);
+	free(buf);
+
+	/* Success! */
+	return (0);
+
+err3:
+	free(s_tmp);
+err2:
+	free(s);
+err1:
+	free(buf);
+err0:
+	/* Failure! */
+	return (-1);
+}
@@ -0,0 +1,25 @@
+#ifndef STORAGE_MANIFEST_H_
+#define STORAGE_MANIFEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * storage_manifest_read(path, filenos, nfiles):
+ * Read the manifest of block files in the storage directory ${path}, and set
+ * ${filenos} to a malloc-allocated array of the ${nfiles} file numbers which
+ * it lists, in increasing order.  Return 0 on success; 1 if the directory
+ * has no manifest or the manifest is corrupt; or -1 on error.
+ */
+int storage_manifest_read(const char *, uint64_t **, size_t *);
+
+/**
+ * storage_manifest_write(path, filenos, nfiles, nosync):
+ * Replace the manifest of block files in the storage directory ${path} with
+ * one listing the ${nfiles} file numbers ${filenos}, which must be in
+ * increasing order.  The manifest is replaced atomically; unless ${nosync}
+ * is non-zero, it is also flushed to disk.
+ */
+int storage_manifest_write(const char *, const uint64_t *, size_t, int);
+
+#endif /* !STORAGE_MANIFEST_H_ */
@@ -79,18 +79,19 @@ err0:
 }
 
 /**
- * storage_util_mkpath(S, fileno):
- * Return the malloc-allocated NUL-terminated string "${dir}/blks_${fileno}"
- * where ${dir} is ${S}->storagedir and ${fileno} is a 0-padding hex value.
+ * storage_util_mkpath(S, dir, fileno):
+ * Return the malloc-allocated NUL-terminated string "${path}/blks_${fileno}"
+ * where ${path} is ${S}->storagedirs[${dir}] and ${fileno} is a 0-padding
+ * hex value.
  */
 char *
-storage_util_mkpath(struct storage_state * S, uint64_t fileno)
+storage_util_mkpath(struct storage_state * S, size_t dir, uint64_t fileno)
 {
 	char * s;
 
 	/* Construct path. */
 	if (asprintf(&s, "%s/blks_%016" PRIx64,
-	    S->storagedir, fileno) == -1) {
+	    S->storagedirs[dir], fileno) == -1) {
 		warnp("asprintf");
 		goto err0;
 	}
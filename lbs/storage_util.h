@@ -1,6 +1,7 @@
 #ifndef STORAGE_UTIL_H_
 #define STORAGE_UTIL_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Opaque types. */
@@ -25,10 +26,11 @@ int storage_util_writelock(struct storage_state *);
 int storage_util_unlock(struct storage_state *);
 
 /**
- * storage_util_mkpath(S, fileno):
- * Return the malloc-allocated NUL-terminated string "${dir}/blks_${fileno}"
- * where ${dir} is ${S}->storagedir and ${fileno} is a 0-padding hex value.
+ * storage_util_mkpath(S, dir, fileno):
+ * Return the malloc-allocated NUL-terminated string "${path}/blks_${fileno}"
+ * where ${path} is ${S}->storagedirs[${dir}] and ${fileno} is a 0-padding
+ * hex value.
  */
-char * storage_util_mkpath(struct storage_state *, uint64_t);
+char * storage_util_mkpath(struct storage_state *, size_t, uint64_t);
 
 #endif /* !STORAGE_UTIL_H_ */
@@ -0,0 +1,369 @@
+/**
+ * APISUPPORT CFLAGS: NONPOSIX_IO_URING
+ */
+
+#ifdef APISUPPORT_CONFIG_FILE
+#include APISUPPORT_CONFIG_FILE
+#endif
+
+#ifdef APISUPPORT_NONPOSIX_IO_URING
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#endif
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "events.h"
+#include "warnp.h"
+
+#include "uring.h"
+
+#ifdef APISUPPORT_NONPOSIX_IO_URING
+
+/* io_uring state. */
+struct uring {
+	int fd;			/* io_uring descriptor. */
+	int efd;		/* Signalled when reads complete. */
+	int (* callback)(void *, uint64_t, int32_t);
+	void * cookie;
+
+	/* Submission queue. */
+	uint8_t * sqmem;	/* Mapped submission ring. */
+	size_t sqlen;		/* Length of sqmem. */
+	uint32_t * sq_tail;	/* Written by us. */
+	uint32_t * sq_array;	/* Indexes into sqes. */
+	uint32_t sq_mask;	/* Mask for ring indexes. */
+	struct io_uring_sqe * sqes;	/* Submission queue entries. */
+	size_t sqeslen;		/* Length of sqes. */
+	uint32_t nqueued;	/* Entries queued but not submitted. */
+
+	/* Completion queue. */
+	uint8_t * cqmem;	/* Mapped completion ring. */
+	size_t cqlen;		/* Length of cqmem. */
+	uint32_t * cq_head;	/* Written by us. */
+	uint32_t * cq_tail;	/* Written by the kernel. */
+	uint32_t cq_mask;	/* Mask for ring indexes. */
+	struct io_uring_cqe * cqes;	/* Completion queue entries. */
+};
+
+/* Reap completed reads. */
+static int
+callback_completions(void * cookie)
+{
+	struct uring * U = cookie;
+	struct io_uring_cqe * cqe;
+	uint64_t n;
+	uint64_t udata;
+	int32_t res;
+	uint32_t head;
+
+	/* Reset the eventfd counter; we're about to reap everything. */
+	if ((read(U->efd, &n, sizeof(uint64_t)) == -1) &&
+	    (errno != EAGAIN) && (errno != EINTR)) {
+		warnp("Error reading io_uring eventfd");
+		goto err0;
+	}
+
+	/* Handle completions until there are no more. */
+	head = *U->cq_head;
+	while (head != __atomic_load_n(U->cq_tail, __ATOMIC_ACQUIRE)) {
+		/* Grab the completion and give the slot back to the kernel. */
+		cqe = &U->cqes[head & U->cq_mask];
+		udata = cqe->user_data;
+		res = cqe->res;
+		__atomic_store_n(U->cq_head, ++head, __ATOMIC_RELEASE);
+
+		/* Tell our caller. */
+		if ((U->callback)(U->cookie, udata, res))
+			goto err0;
+	}
+
+	/* Wait for more reads to complete. */
+	if (events_network_register(callback_completions, U, U->efd,
+	    EVENTS_NETWORK_OP_READ)) {
+		warnp("Error registering io_uring eventfd");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * uring_init(depth, callback, cookie):
+ * Create an io_uring which can hold ${depth} reads in flight, and arrange
+ * for ${callback}(${cookie}, ${udata}, ${res}) to be invoked from the event
+ * loop when each read completes, where ${udata} is the value passed to
+ * uring_read() and ${res} is the number of bytes read or minus an errno
+ * value.  If io_uring is not available, return NULL with errno set to
+ * ENOSYS (if it was not compiled in) or the error from io_uring_setup.
+ */
+struct uring *
+uring_init(size_t depth, int (* callback)(void *, uint64_t, int32_t),
+    void * cookie)
+{
+	struct uring * U;
+	struct io_uring_params p;
+	long fd;
+
+	/* Sanity-check the depth; the kernel won't allow more. */
+	if ((depth == 0) || (depth > 4096)) {
+		errno = EINVAL;
+		goto err0;
+	}
+
+	/* Allocate a structure. */
+	if ((U = malloc(sizeof(struct uring))) == NULL)
+		goto err0;
+	U->callback = callback;
+	U->cookie = cookie;
+	U->nqueued = 0;
+
+	/* Create the io_uring. */
+	memset(&p, 0, sizeof(struct io_uring_params));
+	if ((fd = syscall(__NR_io_uring_setup, (unsigned int)depth, &p)) ==
+	    -1)
+		goto err1;
+	U->fd = (int)fd;
+
+	/* Map the submission ring and entries. */
+	U->sqlen = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	if ((U->sqmem = mmap(NULL, U->sqlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, U->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		warnp("mmap");
+		goto err2;
+	}
+	U->sq_tail = (uint32_t *)(void *)&U->sqmem[p.sq_off.tail];
+	U->sq_array = (uint32_t *)(void *)&U->sqmem[p.sq_off.array];
+	U->sq_mask = *(uint32_t *)(void *)&U->sqmem[p.sq_off.ring_mask];
+	U->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((U->sqes = mmap(NULL, U->sqeslen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, U->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		warnp("mmap");
+		goto err3;
+	}
+
+	/* Map the completion ring. */
+	U->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((U->cqmem = mmap(NULL, U->cqlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, U->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		warnp("mmap");
+		goto err4;
+	}
+	U->cq_head = (uint32_t *)(void *)&U->cqmem[p.cq_off.head];
+	U->cq_tail = (uint32_t *)(void *)&U->cqmem[p.cq_off.tail];
+	U->cq_mask = *(uint32_t *)(void *)&U->cqmem[p.cq_off.ring_mask];
+	U->cqes = (struct io_uring_cqe *)(void *)&U->cqmem[p.cq_off.cqes];
+
+	/* Have the kernel signal an eventfd when reads complete. */
+	if ((U->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		warnp("eventfd");
+		goto err5;
+	}
+	if (syscall(__NR_io_uring_register, U->fd, IORING_REGISTER_EVENTFD,
+	    &U->efd, 1)) {
+		warnp("io_uring_register");
+		goto err6;
+	}
+
+	/* Wait for reads to complete. */
+	if (events_network_register(callback_completions, U, U->efd,
+	    EVENTS_NETWORK_OP_READ)) {
+		warnp("Error registering io_uring eventfd");
+		goto err6;
+	}
+
+	/* Success! */
+	return (U);
+
+err6:
+	close(U->efd);
+err5:
+	munmap(U->cqmem, U->cqlen);
+err4:
+	munmap(U->sqes, U->sqeslen);
+err3:
+	munmap(U->sqmem, U->sqlen);
+err2:
+	close(U->fd);
+err1:
+	free(U);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * uring_read(U, fd, offset, buf, len, udata):
+ * Queue a read of ${len} bytes at position ${offset} of the descriptor ${fd}
+ * into ${buf}, identified by ${udata}.  Queued reads are not started until
+ * uring_submit() is called.  At most ${depth} reads may be in flight.
+ */
+int
+uring_read(struct uring * U, int fd, off_t offset, uint8_t * buf,
+    size_t len, uint64_t udata)
+{
+	struct io_uring_sqe * sqe;
+	uint32_t tail = *U->sq_tail;
+	uint32_t i = tail & U->sq_mask;
+
+	/* Fill in the submission queue entry. */
+	sqe = &U->sqes[i];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)offset;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	sqe->user_data = udata;
+
+	/* Add it to the ring. */
+	U->sq_array[i] = i;
+	__atomic_store_n(U->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	U->nqueued += 1;
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * uring_submit(U):
+ * Start all of the reads queued by uring_read().
+ */
+int
+uring_submit(struct uring * U)
+{
+	long n;
+
+	/* Keep going until the kernel has taken everything. */
+	while (U->nqueued > 0) {
+		if ((n = syscall(__NR_io_uring_enter, U->fd, U->nqueued, 0, 0,
+		    NULL, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warnp("io_uring_enter");
+			goto err0;
+		}
+		U->nqueued -= (uint32_t)n;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * uring_free(U):
+ * Free the io_uring ${U}, which must not have any reads in flight.
+ */
+void
+uring_free(struct uring * U)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (U == NULL)
+		return;
+
+	/* Stop waiting for completions. */
+	events_network_cancel(U->efd, EVENTS_NETWORK_OP_READ);
+
+	/* Release the kernel resources and free the structure. */
+	close(U->efd);
+	munmap(U->cqmem, U->cqlen);
+	munmap(U->sqes, U->sqeslen);
+	munmap(U->sqmem, U->sqlen);
+	close(U->fd);
+	free(U);
+}
+
+#else /* !APISUPPORT_NONPOSIX_IO_URING */
+
+/**
+ * uring_init(depth, callback, cookie):
+ * Create an io_uring which can hold ${depth} reads in flight, and arrange
+ * for ${callback}(${cookie}, ${udata}, ${res}) to be invoked from the event
+ * loop when each read completes, where ${udata} is the value passed to
+ * uring_read() and ${res} is the number of bytes read or minus an errno
+ * value.  If io_uring is not available, return NULL with errno set to
+ * ENOSYS (if it was not compiled in) or the error from io_uring_setup.
+ */
+struct uring *
+uring_init(size_t depth, int (* callback)(void *, uint64_t, int32_t),
+    void * cookie)
+{
+
+	(void)depth; /* UNUSED */
+	(void)callback; /* UNUSED */
+	(void)cookie; /* UNUSED */
+
+	/* We don't have io_uring. */
+	errno = ENOSYS;
+	return (NULL);
+}
+
+/**
+ * uring_read(U, fd, offset, buf, len, udata):
+ * Queue a read of ${len} bytes at position ${offset} of the descriptor ${fd}
+ * into ${buf}, identified by ${udata}.  Queued reads are not started until
+ * uring_submit() is called.  At most ${depth} reads may be in flight.
+ */
+int
+uring_read(struct uring * U, int fd, off_t offset, uint8_t * buf,
+    size_t len, uint64_t udata)
+{
+
+	(void)U; /* UNUSED */
+	(void)fd; /* UNUSED */
+	(void)offset; /* UNUSED */
+	(void)buf; /* UNUSED */
+	(void)len; /* UNUSED */
+	(void)udata; /* UNUSED */
+
+	/* uring_init never succeeds, so we can't be called. */
+	abort();
+}
+
+/**
+ * uring_submit(U):
+ * Start all of the reads queued by uring_read().
+ */
+int
+uring_submit(struct uring * U)
+{
+
+	(void)U; /* UNUSED */
+
+	/* uring_init never succeeds, so we can't be called. */
+	abort();
+}
+
+/**
+ * uring_free(U):
+ * Free the io_uring ${U}, which must not have any reads in flight.
+ */
+void
+uring_free(struct uring * U)
+{
+
+	/* Only NULL can be passed to us. */
+	if (U != NULL)
+		abort();
+}
+
+#endif /* !APISUPPORT_NONPOSIX_IO_URING */
@@ -0,0 +1,43 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opaque type. */
+struct uring;
+
+/**
+ * uring_init(depth, callback, cookie):
+ * Create an io_uring which can hold ${depth} reads in flight, and arrange
+ * for ${callback}(${cookie}, ${udata}, ${res}) to be invoked from the event
+ * loop when each read completes, where ${udata} is the value passed to
+ * uring_read() and ${res} is the number of bytes read or minus an errno
+ * value.  If io_uring is not available, return NULL with errno set to
+ * ENOSYS (if it was not compiled in) or the error from io_uring_setup.
+ */
+struct uring * uring_init(size_t, int (*)(void *, uint64_t, int32_t), void *);
+
+/**
+ * uring_read(U, fd, offset, buf, len, udata):
+ * Queue a read of ${len} bytes at position ${offset} of the descriptor ${fd}
+ * into ${buf}, identified by ${udata}.  Queued reads are not started until
+ * uring_submit() is called.  At most ${depth} reads may be in flight.
+ */
+int uring_read(struct uring *, int, off_t, uint8_t *, size_t, uint64_t);
+
+/**
+ * uring_submit(U):
+ * Start all of the reads queued by uring_read().
+ */
+int uring_submit(struct uring *);
+
+/**
+ * uring_free(U):
+ * Free the io_uring ${U}, which must not have any reads in flight.
+ */
+void uring_free(struct uring *);
+
+#endif /* !URING_H_ */
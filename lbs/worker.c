@@ -1,278 +1,546 @@
+/**
+ * APISUPPORT CFLAGS: NONPOSIX_EVENTFD
+ */
+
+#ifdef APISUPPORT_CONFIG_FILE
+#include APISUPPORT_CONFIG_FILE
+#endif
+
+#ifdef APISUPPORT_NONPOSIX_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
-#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "events.h"
+#include "imalloc.h"
 #include "noeintr.h"
+#include "proto_lbs.h"
 #include "warnp.h"
 
 #include "storage.h"
 
 #include "worker.h"
 
-/* Thread control structure. */
-struct workctl {
+/* Queue of completed work, shared by all the worker threads. */
+struct workdone {
+	pthread_mutex_t mtx;	/* Controls access to the list. */
+	struct workitem * head;	/* Completed work items, or NULL. */
+	struct workitem ** tail;	/* Location of terminating NULL. */
+	int rfd;		/* Readable when the list is non-empty... */
+	int wfd;		/* ... after being written to here. */
+	int (* callback)(void *, struct workitem *);
+	void * cookie;
+};
+
+/* Queue of work waiting for a group of threads. */
+struct workq {
 	/* Thread management. */
 	pthread_mutex_t mtx;	/* Controls access to this structure. */
-	pthread_t thr;		/* Thread ID. */
 	pthread_cond_t cv;	/* Work-management condition variable. */
-	int haswork;		/* Has-work condition. */
-	int workdone;		/* Has-finished-work condition. */
-	int suicide;		/* Need-to-kill-ourself condition. */
+	pthread_t * thr;	/* Thread IDs. */
+	size_t nthreads;	/* Number of threads. */
+	int suicide;		/* Need-to-kill-ourselves condition. */
 
 	/* Static state data. */
-	size_t ID;		/* ID of this thread. */
-	int wakeupsock;		/* Write ID here when done. */
+	size_t ID;		/* ID of this queue. */
+	struct workdone * D;	/* Put completed work here. */
 	struct storage_state * sstate;	/* Storage state. */
+	size_t blocklen;	/* Block length. */
 
 	/* Work to be done. */
-	int op;			/* 0 = read, 1 = write, 2 = free. */
-	uint64_t blkno;		/* Block to read, first block to write, */
-				/* or first block to NOT delete. */
-	size_t nblks;		/* Number of blocks to write. */
-				/* Number of blocks successfully read. */
-	uint8_t * buf;		/* Buffer to read/write into/from. */
-	uint64_t reqID;		/* ID of request (not used by worker). */
+	struct workitem * head;	/* Oldest queued work item, or NULL. */
+	struct workitem ** tail;	/* Location of terminating NULL. */
 };
 
+/* Perform the work ${W}. */
+static void
+dowork(struct workq * Q, struct workitem * W)
+{
+
+	switch (W->op) {
+	case 0:	/* Read */
+		if ((W->nblks = (size_t)storage_read(Q->sstate,
+		    W->blkno, W->buf)) == (size_t)(-1)) {
+			warnp("Failure reading block");
+			exit(1);
+		}
+
+		/*
+		 * Construct the response around the block here, so that the
+		 * master thread doesn't need to compute the CRC of every
+		 * block we read.
+		 */
+		proto_lbs_response_get_frame(
+		    &W->buf[-PROTO_LBS_RESPONSE_GET_DATAOFF],
+		    W->reqID, (W->nblks == 1) ? 0 : 1,
+		    (uint32_t)Q->blocklen);
+		break;
+	case 1:	/* Write */
+		if (storage_write(Q->sstate, W->blkno, W->nblks, W->buf)) {
+			warnp("Failure writing blocks");
+			exit(1);
+		}
+		break;
+	case 2:	/* Delete */
+		if (storage_delete(Q->sstate, W->blkno)) {
+			warnp("Failure deleting blocks");
+			exit(1);
+		}
+		break;
+	case 3:	/* Free ranges */
+		if (storage_freerange(Q->sstate,
+		    (struct proto_lbs_range *)(void *)W->buf, W->nblks)) {
+			warnp("Failure freeing blocks");
+			exit(1);
+		}
+		break;
+	default:
+		warn0("Invalid op: %d", W->op);
+	}
+}
+
+/* Add the completed work item ${W} to the queue ${D}. */
+static void
+done_put(struct workdone * D, struct workitem * W)
+{
+	uint64_t one = 1;
+	int wasempty;
+	int rc;
+
+	/* Add the item to the end of the list. */
+	if ((rc = pthread_mutex_lock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		exit(1);
+	}
+	wasempty = (D->head == NULL);
+	W->next = NULL;
+	*D->tail = W;
+	D->tail = &W->next;
+	if ((rc = pthread_mutex_unlock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/*
+	 * If the list was empty, the master thread may be asleep; wake it
+	 * up.  Otherwise it has already been woken and hasn't taken the list
+	 * yet, so it will see this item too.  If the descriptor is full, it
+	 * is already readable.
+	 */
+	if (wasempty && (noeintr_write(D->wfd, &one, sizeof(uint64_t)) == -1) &&
+	    (errno != EAGAIN)) {
+		warnp("Error writing to wakeup descriptor");
+		exit(1);
+	}
+}
+
 /* Worker thread. */
 static void *
 workthread(void * cookie)
 {
-	struct workctl * ctl = cookie;
+	struct workq * Q = cookie;
+	struct workitem * W;
 	int rc;
 
 	/* Grab the mutex. */
-	if ((rc = pthread_mutex_lock(&ctl->mtx)) != 0) {
+	if ((rc = pthread_mutex_lock(&Q->mtx)) != 0) {
 		warn0("pthread_mutex_lock: %s", strerror(rc));
 		exit(1);
 	}
 
 	/* Infinite loop doing work until told to suicide. */
 	do {
-		/*
-		 * Sleep until we have work which we haven't done yet or
-		 * we need to kill ourself.
-		 */
-		while (((ctl->haswork == 0) || (ctl->workdone != 0)) &&
-		    (ctl->suicide == 0)) {
-			/* Sleep until we're woken up. */
-			if ((rc = pthread_cond_wait(&ctl->cv,
-			    &ctl->mtx)) != 0) {
+		/* Sleep until we have work or we need to kill ourself. */
+		while ((Q->head == NULL) && (Q->suicide == 0)) {
+			if ((rc = pthread_cond_wait(&Q->cv, &Q->mtx)) != 0) {
 				warn0("pthread_cond_wait: %s", strerror(rc));
 				exit(1);
 			}
 		}
 
 		/* If we need to kill ourself, stop looping. */
-		if (ctl->suicide)
+		if (Q->suicide)
 			break;
 
-		/* Do the work. */
-		switch (ctl->op) {
-		case 0:	/* Read */
-			if ((ctl->nblks = (size_t)storage_read(ctl->sstate,
-			    ctl->blkno, ctl->buf)) == (size_t)(-1)) {
-				warnp("Failure reading block");
-				exit(1);
-			}
-			break;
-		case 1:	/* Write */
-			if (storage_write(ctl->sstate,
-			    ctl->blkno, ctl->nblks, ctl->buf)) {
-				warnp("Failure writing blocks");
-				exit(1);
-			}
-			break;
-		case 2:	/* Delete */
-			if (storage_delete(ctl->sstate, ctl->blkno)) {
-				warnp("Failure deleting blocks");
-				exit(1);
-			}
-			break;
-		default:
-			warn0("Invalid op: %d", ctl->op);
+		/* Take the oldest work item. */
+		W = Q->head;
+		if ((Q->head = W->next) == NULL)
+			Q->tail = &Q->head;
+
+		/* Do the work without holding the mutex. */
+		if ((rc = pthread_mutex_unlock(&Q->mtx)) != 0) {
+			warn0("pthread_mutex_unlock: %s", strerror(rc));
+			exit(1);
 		}
+		dowork(Q, W);
 
-		/* We've done the work; notify the master thread. */
-		ctl->workdone = 1;
-		if (noeintr_write(ctl->wakeupsock, &ctl->ID, sizeof(size_t)) <
-		    (ssize_t)sizeof(size_t)) {
-			warnp("Error writing to wakeup socket");
+		/* We've done the work; hand it back to the master thread. */
+		done_put(Q->D, W);
+
+		/* Grab the mutex again. */
+		if ((rc = pthread_mutex_lock(&Q->mtx)) != 0) {
+			warn0("pthread_mutex_lock: %s", strerror(rc));
 			exit(1);
 		}
 	} while (1);
 
 	/* Release the mutex and die. */
-	if ((rc = pthread_mutex_unlock(&ctl->mtx)) != 0) {
+	if ((rc = pthread_mutex_unlock(&Q->mtx)) != 0) {
 		warn0("pthread_mutex_unlock: %s", strerror(rc));
 		exit(1);
 	}
 	return (NULL);
 }
 
+/* Work has been completed. */
+static int
+callback_done(void * cookie)
+{
+	struct workdone * D = cookie;
+	struct workitem * W;
+	uint64_t n;
+	int rc;
+
+	/*
+	 * Reset the wakeup descriptor before taking the list, so that any
+	 * item added after we take it will wake us up again.
+	 */
+	if ((read(D->rfd, &n, sizeof(uint64_t)) == -1) &&
+	    (errno != EAGAIN) && (errno != EINTR)) {
+		warnp("Error reading from wakeup descriptor");
+		goto err0;
+	}
+
+	/* Take all the completed work. */
+	if ((rc = pthread_mutex_lock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+	W = D->head;
+	D->head = NULL;
+	D->tail = &D->head;
+	if ((rc = pthread_mutex_unlock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Tell our caller. */
+	if ((W != NULL) && (D->callback)(D->cookie, W))
+		goto err0;
+
+	/* Wait for more work to be completed. */
+	if (events_network_register(callback_done, D, D->rfd,
+	    EVENTS_NETWORK_OP_READ)) {
+		warnp("Error registering wakeup descriptor");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /**
- * worker_create(ID, sstate, wakeupsock):
- * Create a worker thread which performs operations on the storage state
- * ${sstate} and writes the ID ${ID} to the socket ${wakeupsock} when each
- * operation is done.
+ * worker_done_init(callback, cookie):
+ * Create a queue of completed work, and arrange for
+ * ${callback}(${cookie}, ${W}) to be invoked from the event loop with a list
+ * ${W} of work items (linked via their next pointers, in the order in which
+ * they were completed) whenever work has been completed.  The callback owns
+ * the items.  Worker threads only wake the event loop when the queue goes
+ * from empty to non-empty, so work completed while earlier completions are
+ * waiting to be handled costs no system calls.
  */
-struct workctl *
-worker_create(size_t ID, struct storage_state * sstate, int wakeupsock)
+struct workdone *
+worker_done_init(int (* callback)(void *, struct workitem *), void * cookie)
 {
-	struct workctl * ctl;
+	struct workdone * D;
+#ifndef APISUPPORT_NONPOSIX_EVENTFD
+	int fds[2];
+#endif
 	int rc;
 
-	/* Allocate a worker structure. */
-	if ((ctl = malloc(sizeof(struct workctl))) == NULL)
+	/* Allocate the structure. */
+	if ((D = malloc(sizeof(struct workdone))) == NULL)
 		goto err0;
+	D->head = NULL;
+	D->tail = &D->head;
+	D->callback = callback;
+	D->cookie = cookie;
 
-	/*
-	 * Create and lock mutex.  Locking the mutex here is arguably rather
-	 * silly, since we're the only thread with access to the workctl
-	 * structure right now; but theoretically pthread_create could launch
-	 * a new thread on a different CPU without any memory barriers, which
-	 * would -- given sufficient re-ordering of memory accesses -- result
-	 * in it reading pre-initialization values from the structure.
-	 */
-	if ((rc = pthread_mutex_init(&ctl->mtx, NULL)) != 0) {
+	/* Create the mutex. */
+	if ((rc = pthread_mutex_init(&D->mtx, NULL)) != 0) {
 		warn0("pthread_mutex_init: %s", strerror(rc));
 		goto err1;
 	}
-	if ((rc = pthread_mutex_lock(&ctl->mtx)) != 0) {
-		warn0("pthread_mutex_lock: %s", strerror(rc));
+
+	/*
+	 * Create a non-blocking wakeup descriptor: an eventfd if we have one
+	 * (it is a single descriptor, and never fills up), or a pipe.
+	 */
+#ifdef APISUPPORT_NONPOSIX_EVENTFD
+	if ((D->rfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		warnp("eventfd");
+		goto err2;
+	}
+	D->wfd = D->rfd;
+#else /* !APISUPPORT_NONPOSIX_EVENTFD */
+	if (pipe(fds)) {
+		warnp("pipe");
 		goto err2;
 	}
+	D->rfd = fds[0];
+	D->wfd = fds[1];
+	if ((fcntl(D->rfd, F_SETFL, O_NONBLOCK) == -1) ||
+	    (fcntl(D->wfd, F_SETFL, O_NONBLOCK) == -1)) {
+		warnp("Cannot make wakeup pipe non-blocking");
+		goto err3;
+	}
+#endif /* !APISUPPORT_NONPOSIX_EVENTFD */
 
-	/* Create has-work condition variable. */
-	if ((rc = pthread_cond_init(&ctl->cv, NULL)) != 0) {
-		warn0("pthread_cond_init: %s", strerror(rc));
+	/* Wait for work to be completed. */
+	if (events_network_register(callback_done, D, D->rfd,
+	    EVENTS_NETWORK_OP_READ)) {
+		warnp("Error registering wakeup descriptor");
 		goto err3;
 	}
 
-	/* No work to do, no work finished yet, no need to suicide. */
-	ctl->haswork = ctl->workdone = ctl->suicide = 0;
+	/* Success! */
+	return (D);
 
-	/* Static state data. */
-	ctl->ID = ID;
-	ctl->sstate = sstate;
-	ctl->wakeupsock = wakeupsock;
+err3:
+	if (D->wfd != D->rfd)
+		close(D->wfd);
+	close(D->rfd);
+err2:
+	pthread_mutex_destroy(&D->mtx);
+err1:
+	free(D);
+err0:
+	/* Failure! */
+	return (NULL);
+}
 
-	/* Create the thread. */
-	if ((rc = pthread_create(&ctl->thr, NULL, workthread, ctl)) != 0) {
-		warn0("pthread_create: %s", strerror(rc));
-		goto err4;
+/**
+ * worker_done_free(D):
+ * Free the queue of completed work ${D}, and any work items in it.  All the
+ * threads putting work into it must have been killed.
+ */
+void
+worker_done_free(struct workdone * D)
+{
+	struct workitem * W;
+
+	/* Behave consistently with free(NULL). */
+	if (D == NULL)
+		return;
+
+	/* Stop waiting for completions. */
+	events_network_cancel(D->rfd, EVENTS_NETWORK_OP_READ);
+
+	/* Free any work items. */
+	while ((W = D->head) != NULL) {
+		D->head = W->next;
+		free(W);
 	}
 
-	/* Unlock the mutex. */
-	if ((rc = pthread_mutex_unlock(&ctl->mtx)) != 0) {
+	/* Release the descriptors and mutex, and free the structure. */
+	if (D->wfd != D->rfd)
+		close(D->wfd);
+	close(D->rfd);
+	pthread_mutex_destroy(&D->mtx);
+	free(D);
+}
+
+/* Kill the first ${n} threads serving ${Q}; the mutex must be held. */
+static int
+killthreads(struct workq * Q, size_t n)
+{
+	size_t i;
+	int rc;
+
+	/* Tell the threads to die, and wake them up. */
+	Q->suicide = 1;
+	if ((rc = pthread_cond_broadcast(&Q->cv)) != 0) {
+		warn0("pthread_cond_broadcast: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Unlock the queue. */
+	if ((rc = pthread_mutex_unlock(&Q->mtx)) != 0) {
 		warn0("pthread_mutex_unlock: %s", strerror(rc));
 		goto err0;
 	}
 
+	/* Wait for the threads to die. */
+	for (i = 0; i < n; i++) {
+		if ((rc = pthread_join(Q->thr[i], NULL)) != 0) {
+			warn0("pthread_join: %s", strerror(rc));
+			goto err0;
+		}
+	}
+
 	/* Success! */
-	return (ctl);
+	return (0);
 
-err4:
-	pthread_cond_destroy(&ctl->cv);
-err3:
-	pthread_mutex_unlock(&ctl->mtx);
-err2:
-	pthread_mutex_destroy(&ctl->mtx);
 err1:
-	free(ctl);
+	pthread_mutex_unlock(&Q->mtx);
 err0:
 	/* Failure! */
-	return (NULL);
+	return (-1);
 }
 
 /**
- * worker_assign(ctl, op, blkno, nblks, buf, reqID):
- * Assign the work tuple (${op}, ${blkno}, ${nblks}, ${buf}, ${reqID}) to the
- * thread with work control structure ${ctl} and wake it up.
+ * worker_create(ID, nthreads, sstate, blocklen, D):
+ * Create a work queue with ID ${ID}, served by ${nthreads} worker threads
+ * which perform operations on the storage state ${sstate}, which has blocks
+ * of ${blocklen} bytes.  Each thread takes the oldest queued work item when
+ * it is idle, and puts the item into the queue of completed work ${D} (with
+ * its qid set to ${ID}) when it is done.  Blocks are read into buffers
+ * returned by dispatch_readbuf_alloc(), around which the GET response is
+ * then constructed.
  */
-int
-worker_assign(struct workctl * ctl, int op, uint64_t blkno, size_t nblks,
-    uint8_t * buf, uint64_t reqID)
+struct workq *
+worker_create(size_t ID, size_t nthreads, struct storage_state * sstate,
+    size_t blocklen, struct workdone * D)
 {
+	struct workq * Q;
+	size_t i;
 	int rc;
 
-	/* Lock the control structure. */
-	if ((rc = pthread_mutex_lock(&ctl->mtx)) != 0) {
-		warn0("pthread_mutex_lock: %s", strerror(rc));
+	/* Allocate a work queue structure. */
+	if ((Q = malloc(sizeof(struct workq))) == NULL)
 		goto err0;
-	}
+	if (IMALLOC(Q->thr, nthreads, pthread_t))
+		goto err1;
 
-	/* Sanity check: The thread shouldn't be busy. */
-	assert(ctl->haswork == 0);
+	/* Static state data. */
+	Q->ID = ID;
+	Q->D = D;
+	Q->sstate = sstate;
+	Q->blocklen = blocklen;
+	Q->nthreads = nthreads;
 
-	/* Record the work to be done. */
-	ctl->op = op;
-	ctl->blkno = blkno;
-	ctl->nblks = nblks;
-	ctl->buf = buf;
-	ctl->reqID = reqID;
+	/* No work to do, no need to suicide. */
+	Q->head = NULL;
+	Q->tail = &Q->head;
+	Q->suicide = 0;
 
-	/* The work isn't finished yet. */
-	ctl->workdone = 0;
+	/*
+	 * Create and lock mutex.  Locking the mutex here is arguably rather
+	 * silly, since we're the only thread with access to the workq
+	 * structure right now; but theoretically pthread_create could launch
+	 * a new thread on a different CPU without any memory barriers, which
+	 * would -- given sufficient re-ordering of memory accesses -- result
+	 * in it reading pre-initialization values from the structure.
+	 */
+	if ((rc = pthread_mutex_init(&Q->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+	if ((rc = pthread_mutex_lock(&Q->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err3;
+	}
 
-	/* Wake up the thread and unlock the control structure. */
-	ctl->haswork = 1;
-	if ((rc = pthread_cond_signal(&ctl->cv)) != 0) {
-		warn0("pthread_cond_signal: %s", strerror(rc));
-		goto err1;
+	/* Create has-work condition variable. */
+	if ((rc = pthread_cond_init(&Q->cv, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err4;
 	}
-	if ((rc = pthread_mutex_unlock(&ctl->mtx)) != 0) {
+
+	/* Create the threads. */
+	for (i = 0; i < nthreads; i++) {
+		if ((rc = pthread_create(&Q->thr[i], NULL, workthread,
+		    Q)) != 0) {
+			warn0("pthread_create: %s", strerror(rc));
+			goto err5;
+		}
+	}
+
+	/* Unlock the mutex. */
+	if ((rc = pthread_mutex_unlock(&Q->mtx)) != 0) {
 		warn0("pthread_mutex_unlock: %s", strerror(rc));
 		goto err0;
 	}
 
 	/* Success! */
-	return (0);
+	return (Q);
 
+err5:
+	if (killthreads(Q, i))
+		goto err0;
+	pthread_cond_destroy(&Q->cv);
+	goto err3;
+err4:
+	pthread_mutex_unlock(&Q->mtx);
+err3:
+	pthread_mutex_destroy(&Q->mtx);
+err2:
+	free(Q->thr);
 err1:
-	pthread_mutex_unlock(&ctl->mtx);
+	free(Q);
 err0:
 	/* Failure! */
-	return (-1);
+	return (NULL);
 }
 
 /**
- * worker_getdone(ctl, op, blkno, nblks, buf, reqID):
- * Set (${op}, ${blkno}, ${nblks}, ${buf}, ${reqID}) to the work tuple which
- * has been completed by the thread with work control structure ${ctl}, and
- * mark the thread as having no work.
+ * worker_submit(Q, W):
+ * Add the list of work items ${W} (linked via their next pointers) to the
+ * work queue ${Q}, and wake up as many threads as are needed to perform
+ * them.  The queue owns the items until they are completed.
  */
 int
-worker_getdone(struct workctl * ctl, int * op, uint64_t * blkno,
-    size_t * nblks, uint8_t ** buf, uint64_t * reqID)
+worker_submit(struct workq * Q, struct workitem * W)
 {
+	struct workitem * W_last;
+	size_t n;
 	int rc;
 
-	/* Lock the control structure. */
-	if ((rc = pthread_mutex_lock(&ctl->mtx)) != 0) {
+	/* Find the end of the list and count the items. */
+	for (W_last = W, n = 1; W_last->next != NULL; W_last = W_last->next)
+		n++;
+
+	/* Lock the queue. */
+	if ((rc = pthread_mutex_lock(&Q->mtx)) != 0) {
 		warn0("pthread_mutex_lock: %s", strerror(rc));
 		goto err0;
 	}
 
-	/* Sanity check: This thread should have finished some work. */
-	assert(ctl->haswork != 0);
-	assert(ctl->workdone != 0);
-
-	/* Copy out the work tuple. */
-	*op = ctl->op;
-	*blkno = ctl->blkno;
-	*nblks = ctl->nblks;
-	*buf = ctl->buf;
-	*reqID = ctl->reqID;
+	/* Add the items to the end of the queue. */
+	*Q->tail = W;
+	Q->tail = &W_last->next;
+	for (; W != NULL; W = W->next)
+		W->qid = Q->ID;
 
-	/* This thread no longer has work assigned to it. */
-	ctl->haswork = 0;
+	/*
+	 * Wake up a thread for each item.  Threads which are busy will look
+	 * for more work before going back to sleep, so we may wake up fewer
+	 * threads than this; but signalling a condition variable which no
+	 * thread is waiting on is cheap.
+	 */
+	if (n > Q->nthreads)
+		n = Q->nthreads;
+	for (; n > 0; n--) {
+		if ((rc = pthread_cond_signal(&Q->cv)) != 0) {
+			warn0("pthread_cond_signal: %s", strerror(rc));
+			goto err1;
+		}
+	}
 
-	/* Unlock the thread control structure. */
-	if ((rc = pthread_mutex_unlock(&ctl->mtx)) != 0) {
+	/* Unlock the queue. */
+	if ((rc = pthread_mutex_unlock(&Q->mtx)) != 0) {
 		warn0("pthread_mutex_unlock: %s", strerror(rc));
 		goto err0;
 	}
@@ -280,65 +548,55 @@ worker_getdone(struct workctl * ctl, int * op, uint64_t * blkno,
 	/* Success! */
 	return (0);
 
+err1:
+	pthread_mutex_unlock(&Q->mtx);
 err0:
 	/* Failure! */
 	return (-1);
 }
 
 /**
- * worker_kill(ctl):
- * Tell the thread with control structure ${ctl} to die and clean it up.
+ * worker_kill(Q):
+ * Tell the threads serving the work queue ${Q}, which must not have any work
+ * queued or in progress, to die and clean them up.
  */
 int
-worker_kill(struct workctl * ctl)
+worker_kill(struct workq * Q)
 {
 	int rc;
 
-	/* Lock the control structure. */
-	if ((rc = pthread_mutex_lock(&ctl->mtx)) != 0) {
+	/* Lock the queue. */
+	if ((rc = pthread_mutex_lock(&Q->mtx)) != 0) {
 		warn0("pthread_mutex_lock: %s", strerror(rc));
 		goto err0;
 	}
 
-	/* Tell the thread to die, and wake it up. */
-	ctl->suicide = 1;
-	if ((rc = pthread_cond_signal(&ctl->cv)) != 0) {
-		warn0("pthread_cond_signal: %s", strerror(rc));
-		goto err1;
-	}
+	/* Sanity check: There shouldn't be any work queued. */
+	assert(Q->head == NULL);
 
-	/* Unlock the control structure. */
-	if ((rc = pthread_mutex_unlock(&ctl->mtx)) != 0) {
-		warn0("pthread_mutex_unlock: %s", strerror(rc));
+	/* Kill the threads; this unlocks the queue. */
+	if (killthreads(Q, Q->nthreads))
 		goto err0;
-	}
-
-	/* Wait for the thread to die. */
-	if ((rc = pthread_join(ctl->thr, NULL)) != 0) {
-		warn0("pthread_join: %s", strerror(rc));
-		goto err0;
-	}
 
 	/* Destroy condition variable. */
-	if ((rc = pthread_cond_destroy(&ctl->cv)) != 0) {
+	if ((rc = pthread_cond_destroy(&Q->cv)) != 0) {
 		warn0("pthread_cond_destroy: %s", strerror(rc));
 		goto err0;
 	}
 
 	/* Destroy mutex. */
-	if ((rc = pthread_mutex_destroy(&ctl->mtx)) != 0) {
+	if ((rc = pthread_mutex_destroy(&Q->mtx)) != 0) {
 		warn0("pthread_mutex_destroy: %s", strerror(rc));
 		goto err0;
 	}
 
-	/* Free the control structure. */
-	free(ctl);
+	/* Free the queue structure. */
+	free(Q->thr);
+	free(Q);
 
 	/* Success! */
 	return (0);
 
-err1:
-	pthread_mutex_unlock(&ctl->mtx);
 err0:
 	/* Failure! */
 	return (-1);
@@ -6,37 +6,71 @@
 
 /* Opaque types. */
 struct storage_state;
-struct workctl;
+struct workdone;
+struct workq;
+
+/* A unit of work for a worker thread. */
+struct workitem {
+	struct workitem * next;	/* Next item in the same list. */
+	size_t qid;		/* ID of the queue which performed it. */
+	int op;			/* 0 = read, 1 = write, 2 = free, */
+				/* 3 = free ranges. */
+	uint64_t blkno;		/* Block to read, first block to write, */
+				/* or first block to NOT delete. */
+	size_t nblks;		/* Number of blocks to write. */
+				/* Number of blocks successfully read. */
+				/* Number of ranges to free. */
+	uint8_t * buf;		/* Buffer to read/write into/from, */
+				/* or ranges to free. */
+	uint64_t reqID;		/* ID of request (for GET responses). */
+};
+
+/**
+ * worker_done_init(callback, cookie):
+ * Create a queue of completed work, and arrange for
+ * ${callback}(${cookie}, ${W}) to be invoked from the event loop with a list
+ * ${W} of work items (linked via their next pointers, in the order in which
+ * they were completed) whenever work has been completed.  The callback owns
+ * the items.  Worker threads only wake the event loop when the queue goes
+ * from empty to non-empty, so work completed while earlier completions are
+ * waiting to be handled costs no system calls.
+ */
+struct workdone * worker_done_init(int (*)(void *, struct workitem *),
+    void *);
 
 /**
- * worker_create(ID, sstate, wakeupsock):
- * Create a worker thread which performs operations on the storage state
- * ${sstate} and writes the ID ${ID} to the socket ${wakeupsock} when each
- * operation is done.
+ * worker_done_free(D):
+ * Free the queue of completed work ${D}, and any work items in it.  All the
+ * threads putting work into it must have been killed.
  */
-struct workctl * worker_create(size_t, struct storage_state *, int);
+void worker_done_free(struct workdone *);
 
 /**
- * worker_assign(ctl, op, blkno, nblks, buf, reqID):
- * Assign the work tuple (${op}, ${blkno}, ${nblks}, ${buf}, ${reqID}) to the
- * thread with work control structure ${ctl} and wake it up.
+ * worker_create(ID, nthreads, sstate, blocklen, D):
+ * Create a work queue with ID ${ID}, served by ${nthreads} worker threads
+ * which perform operations on the storage state ${sstate}, which has blocks
+ * of ${blocklen} bytes.  Each thread takes the oldest queued work item when
+ * it is idle, and puts the item into the queue of completed work ${D} (with
+ * its qid set to ${ID}) when it is done.  Blocks are read into buffers
+ * returned by dispatch_readbuf_alloc(), around which the GET response is
+ * then constructed.
  */
-int worker_assign(struct workctl *,
-    int, uint64_t, size_t, uint8_t *, uint64_t);
+struct workq * worker_create(size_t, size_t, struct storage_state *, size_t,
+    struct workdone *);
 
 /**
- * worker_getdone(ctl, op, blkno, nblks, buf, reqID):
- * Set (${op}, ${blkno}, ${nblks}, ${buf}, ${reqID}) to the work tuple which
- * has been completed by the thread with work control structure ${ctl}, and
- * mark the thread as having no work.
+ * worker_submit(Q, W):
+ * Add the list of work items ${W} (linked via their next pointers) to the
+ * work queue ${Q}, and wake up as many threads as are needed to perform
+ * them.  The queue owns the items until they are completed.
  */
-int worker_getdone(struct workctl *,
-    int *, uint64_t *, size_t *, uint8_t **, uint64_t *);
+int worker_submit(struct workq *, struct workitem *);
 
 /**
- * worker_kill(ctl):
- * Tell the thread with control structure ${ctl} to die and clean it up.
+ * worker_kill(Q):
+ * Tell the threads serving the work queue ${Q}, which must not have any work
+ * queued or in progress, to die and clean them up.
  */
-int worker_kill(struct workctl *);
+int worker_kill(struct workq *);
 
 #endif /* !WORKER_H_ */
@@ -0,0 +1,174 @@
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/* Alignment sufficient for any object we might store. */
+union arena_align {
+	long double ld;
+	uint64_t u64;
+	void * p;
+	void (* fp)(void);
+};
+#define ALIGN	sizeof(union arena_align)
+
+/* A chunk of memory from which allocations are carved. */
+struct arena_chunk {
+	struct arena_chunk * next;
+	size_t len;
+	size_t used;
+	union arena_align buf[];
+};
+
+/* Arena state. */
+struct arena {
+	size_t chunklen;
+	struct arena_chunk * head;
+};
+
+/* Allocate a new chunk of at least ${len} bytes and make it the head. */
+static struct arena_chunk *
+newchunk(struct arena * A, size_t len)
+{
+	struct arena_chunk * C;
+
+	/* Never allocate less than the standard chunk size. */
+	if (len < A->chunklen)
+		len = A->chunklen;
+
+	/* Check for overflow. */
+	if (len > SIZE_MAX - sizeof(struct arena_chunk)) {
+		errno = ENOMEM;
+		goto err0;
+	}
+
+	/* Allocate the chunk. */
+	if ((C = malloc(sizeof(struct arena_chunk) + len)) == NULL)
+		goto err0;
+	C->len = len;
+	C->used = 0;
+
+	/* Link it in. */
+	C->next = A->head;
+	A->head = C;
+
+	/* Success! */
+	return (C);
+
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * arena_init(chunklen):
+ * Create an arena which allocates memory in chunks of (at least) ${chunklen}
+ * bytes.
+ */
+struct arena *
+arena_init(size_t chunklen)
+{
+	struct arena * A;
+
+	/* Allocate the arena structure. */
+	if ((A = malloc(sizeof(struct arena))) == NULL)
+		goto err0;
+	A->chunklen = chunklen;
+	A->head = NULL;
+
+	/* Success! */
+	return (A);
+
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * arena_malloc(A, len):
+ * Allocate ${len} bytes from the arena ${A}.  The returned pointer is
+ * suitably aligned for any object type and remains valid until the arena is
+ * freed.  If ${len} is zero, return NULL.
+ */
+void *
+arena_malloc(struct arena * A, size_t len)
+{
+	struct arena_chunk * C = A->head;
+	void * p;
+
+	/* Handle cases where we don't allocate memory. */
+	if (len == 0)
+		return (NULL);
+
+	/* Round up to a multiple of the alignment. */
+	if (len > SIZE_MAX - (ALIGN - 1)) {
+		errno = ENOMEM;
+		goto err0;
+	}
+	len = ((len + (ALIGN - 1)) / ALIGN) * ALIGN;
+
+	/* If the current chunk is too full, get a new one. */
+	if ((C == NULL) || (C->len - C->used < len)) {
+		if ((C = newchunk(A, len)) == NULL)
+			goto err0;
+	}
+
+	/* Carve off the requested space. */
+	p = (uint8_t *)C->buf + C->used;
+	C->used += len;
+
+	/* Success! */
+	return (p);
+
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * arena_imalloc(A, nrec, reclen):
+ * Allocate ${nrec} records of length ${reclen} from the arena ${A}.  Check
+ * for size_t overflow.  If ${nrec} is zero, return NULL.
+ */
+void *
+arena_imalloc(struct arena * A, size_t nrec, size_t reclen)
+{
+
+	/* Sanity check. */
+	assert(reclen != 0);
+
+	/* Check for overflow. */
+	if (nrec > SIZE_MAX / reclen) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	/* Allocate memory. */
+	return (arena_malloc(A, nrec * reclen));
+}
+
+/**
+ * arena_free(A):
+ * Free the arena ${A} and all memory allocated from it.
+ */
+void
+arena_free(struct arena * A)
+{
+	struct arena_chunk * C;
+
+	/* Behave consistently with free(NULL). */
+	if (A == NULL)
+		return;
+
+	/* Free all the chunks. */
+	while ((C = A->head) != NULL) {
+		A->head = C->next;
+		free(C);
+	}
+
+	/* Free the arena structure. */
+	free(A);
+}
@@ -0,0 +1,53 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/**
+ * An arena is a bump allocator for objects which share a common lifetime:
+ * memory is carved sequentially out of large chunks, individual allocations
+ * are never freed, and the entire arena is released at once.  This turns
+ * thousands of small malloc/free pairs into a handful of large allocations.
+ */
+
+/* Opaque type. */
+struct arena;
+
+/**
+ * arena_init(chunklen):
+ * Create an arena which allocates memory in chunks of (at least) ${chunklen}
+ * bytes.
+ */
+struct arena * arena_init(size_t);
+
+/**
+ * arena_malloc(A, len):
+ * Allocate ${len} bytes from the arena ${A}.  The returned pointer is
+ * suitably aligned for any object type and remains valid until the arena is
+ * freed.  If ${len} is zero, return NULL.
+ */
+void * arena_malloc(struct arena *, size_t);
+
+/**
+ * ARENA_MALLOC(A, p, nrec, type):
+ * Allocate ${nrec} records of type ${type} from the arena ${A} and store the
+ * pointer in ${p}.  Check for size_t overflow.  Return non-zero on failure.
+ */
+#define ARENA_MALLOC(A, p, nrec, type)					\
+	((((p) = (type *)arena_imalloc((A), (nrec), sizeof(type))) == NULL) && \
+	    ((nrec) > 0))
+
+/**
+ * arena_imalloc(A, nrec, reclen):
+ * Allocate ${nrec} records of length ${reclen} from the arena ${A}.  Check
+ * for size_t overflow.  If ${nrec} is zero, return NULL.
+ */
+void * arena_imalloc(struct arena *, size_t, size_t);
+
+/**
+ * arena_free(A):
+ * Free the arena ${A} and all memory allocated from it.
+ */
+void arena_free(struct arena *);
+
+#endif /* !ARENA_H_ */
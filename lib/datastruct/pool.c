@@ -3,15 +3,21 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "mpool.h"
+
 #include "pool.h"
 
+MPOOL(poolelem, struct pool_elem, 4096);
+
 /**
- * pool_init(nrec, offset):
- * Create a pool with target size ${nrec} records, where each record has a
- * (struct pool_elem *) reserved at offset ${offset}.
+ * pool_init(nrec, nbytes, offset):
+ * Create a pool with target size ${nrec} records and ${nbytes} bytes, where
+ * each record has a (struct pool_elem *) reserved at offset ${offset}.  The
+ * size of a record in bytes is set via pool_rec_setsize(); the pool's own
+ * per-record overhead is included automatically.
  */
 struct pool *
-pool_init(size_t nrec, size_t offset)
+pool_init(size_t nrec, size_t nbytes, size_t offset)
 {
 	struct pool * P;
 
@@ -22,6 +28,9 @@ pool_init(size_t nrec, size_t offset)
 	/* Initialize. */
 	P->size = nrec;
 	P->used = 0;
+	P->maxbytes = nbytes;
+	P->bytes = 0;
+	P->peakbytes = 0;
 	P->evict_head = P->evict_tail = NULL;
 	P->offset = offset;
 
@@ -46,28 +55,17 @@ pool_rec_add(struct pool * P, void * rec, void ** evict)
 {
 
 	/* Create a pool_elem structure for this record. */
-	if ((get_pool_elem(P, rec) =
-	    malloc(sizeof(struct pool_elem))) == NULL)
+	if ((get_pool_elem(P, rec) = mpool_poolelem_malloc()) == NULL)
 		goto err0;
 	get_pool_elem(P, rec)->wire_count = 1;
+	get_pool_elem(P, rec)->size = sizeof(struct pool_elem);
 
 	/* Add the record to the pool. */
 	P->used += 1;
+	P->bytes += sizeof(struct pool_elem);
 
 	/* Evict a record if necessary and possible. */
-	if ((P->used > P->size) && (P->evict_head != NULL)) {
-		/* Grab the record at the head of the evict queue. */
-		*evict = P->evict_head;
-
-		/* Remove said record from the queue. */
-		pool_delqueue(P, *evict);
-
-		/* Remove the record from the pool. */
-		free(get_pool_elem(P, *evict));
-		P->used -= 1;
-	} else {
-		*evict = NULL;
-	}
+	*evict = pool_evict(P);
 
 	/* Success! */
 	return (0);
@@ -77,6 +75,88 @@ err0:
 	return (-1);
 }
 
+/**
+ * pool_rec_setsize(P, rec, size):
+ * Record that the record ${rec} in the pool ${P} occupies ${size} bytes.
+ * This does not evict any records; see pool_evict().
+ */
+void
+pool_rec_setsize(struct pool * P, void * rec, size_t size)
+{
+	struct pool_elem * E = get_pool_elem(P, rec);
+
+	/* Replace the old size with the new size. */
+	P->bytes -= E->size;
+	E->size = size + sizeof(struct pool_elem);
+	P->bytes += E->size;
+}
+
+/**
+ * pool_evict(P):
+ * If the pool ${P} is above its target size (in either records or bytes)
+ * and there is a record with lock count 0, remove that record from the pool
+ * and return it; otherwise, return NULL.
+ */
+void *
+pool_evict(struct pool * P)
+{
+	void * rec;
+
+	/* Are we within our target size? */
+	if ((P->used <= P->size) && (P->bytes <= P->maxbytes))
+		goto done;
+
+	/* Is there anything we can evict? */
+	if ((rec = P->evict_head) == NULL)
+		goto done;
+
+	/* Remove said record from the queue. */
+	pool_delqueue(P, rec);
+
+	/* Remove the record from the pool. */
+	P->bytes -= get_pool_elem(P, rec)->size;
+	mpool_poolelem_free(get_pool_elem(P, rec));
+	P->used -= 1;
+
+	/* Return the evicted record. */
+	return (rec);
+
+done:
+	/* We can't shrink any further; record how large we are. */
+	if (P->bytes > P->peakbytes)
+		P->peakbytes = P->bytes;
+
+	/* Nothing to evict. */
+	return (NULL);
+}
+
+/**
+ * pool_usage(P, nrec, nbytes):
+ * Return via ${nrec} and ${nbytes} the number of records in the pool ${P}
+ * and the number of bytes they occupy.
+ */
+void
+pool_usage(struct pool * P, size_t * nrec, size_t * nbytes)
+{
+
+	/* Report the current size. */
+	*nrec = P->used;
+	*nbytes = P->bytes;
+}
+
+/**
+ * pool_peakbytes(P):
+ * Return the largest number of bytes which records in the pool ${P} have
+ * occupied after pool_evict() was unable to evict any more records.
+ */
+size_t
+pool_peakbytes(struct pool * P)
+{
+
+	/* Report the high-water mark. */
+	return (P->peakbytes);
+}
+
 /**
  * pool_rec_free(P, rec):
  * Remove the record ${rec} from the pool ${P}.  The record ${rec} must have
@@ -90,7 +170,8 @@ pool_rec_free(struct pool * P, void * rec)
 	assert(get_pool_elem(P, rec)->wire_count == 1);
 
 	/* Remove the record from the pool. */
-	free(get_pool_elem(P, rec));
+	P->bytes -= get_pool_elem(P, rec)->size;
+	mpool_poolelem_free(get_pool_elem(P, rec));
 	P->used -= 1;
 }
 
@@ -120,6 +201,7 @@ pool_free(struct pool * P)
 
 	/* Make sure the pool is empty. */
 	assert(P->used == 0);
+	assert(P->bytes == 0);
 
 	/* Free the pool. */
 	free(P);
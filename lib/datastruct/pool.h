@@ -10,11 +10,13 @@ struct pool;
 struct pool_elem;
 
 /**
- * pool_init(nrec, offset):
- * Create a pool with target size ${nrec} records, where each record has a
- * (struct pool_elem *) reserved at offset ${offset}.
+ * pool_init(nrec, nbytes, offset):
+ * Create a pool with target size ${nrec} records and ${nbytes} bytes, where
+ * each record has a (struct pool_elem *) reserved at offset ${offset}.  The
+ * size of a record in bytes is set via pool_rec_setsize(); the pool's own
+ * per-record overhead is included automatically.
  */
-struct pool * pool_init(size_t, size_t);
+struct pool * pool_init(size_t, size_t, size_t);
 
 /**
  * pool_rec_add(P, rec, evict):
@@ -26,6 +28,35 @@ struct pool * pool_init(size_t, size_t);
  */
 int pool_rec_add(struct pool *, void *, void **);
 
+/**
+ * pool_rec_setsize(P, rec, size):
+ * Record that the record ${rec} in the pool ${P} occupies ${size} bytes.
+ * This does not evict any records; see pool_evict().
+ */
+void pool_rec_setsize(struct pool *, void *, size_t);
+
+/**
+ * pool_evict(P):
+ * If the pool ${P} is above its target size (in either records or bytes)
+ * and there is a record with lock count 0, remove that record from the pool
+ * and return it; otherwise, return NULL.
+ */
+void * pool_evict(struct pool *);
+
+/**
+ * pool_usage(P, nrec, nbytes):
+ * Return via ${nrec} and ${nbytes} the number of records in the pool ${P}
+ * and the number of bytes they occupy.
+ */
+void pool_usage(struct pool *, size_t *, size_t *);
+
+/**
+ * pool_peakbytes(P):
+ * Return the largest number of bytes which records in the pool ${P} have
+ * occupied after pool_evict() was unable to evict any more records.
+ */
+size_t pool_peakbytes(struct pool *);
+
 /**
  * pool_rec_free(P, rec):
  * Remove the record ${rec} from the pool ${P}.  The record ${rec} must have
@@ -71,6 +102,9 @@ void pool_free(struct pool *);
 struct pool {
 	size_t size;		/* Target size of pool. */
 	size_t used;		/* Current size of pool. */
+	size_t maxbytes;	/* Target size of pool in bytes. */
+	size_t bytes;		/* Current size of pool in bytes. */
+	size_t peakbytes;	/* Peak size of pool in bytes. */
 	void * evict_head;	/* First record to evict. */
 	void * evict_tail;	/* Last record to evict. */
 	size_t offset;		/* Offset of rec.(struct pool_elem). */
@@ -84,6 +118,9 @@ struct pool_elem {
 	 */
 	size_t wire_count;
 
+	/* Number of bytes occupied by the record and this structure. */
+	size_t size;
+
 	/* If wire_count == 0, next element to be evicted. */
 	void * next;
 
@@ -0,0 +1,190 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+/* Free records hold a pointer to the next free record. */
+struct slab_free {
+	struct slab_free * next;
+};
+
+/* A slab of memory. */
+struct slab_slab {
+	struct slab_slab * next;
+	void * mem;
+};
+
+/* Slab allocator state. */
+struct slab {
+	size_t reclen;
+	size_t nrec;
+	size_t align;
+	struct slab_slab * slabs;
+	struct slab_free * freelist;
+};
+
+/* Allocate a new slab and thread its records onto the free list. */
+static int
+grow(struct slab * S)
+{
+	struct slab_slab * SS;
+	struct slab_free * F;
+	uint8_t * p;
+	size_t i;
+	int rc;
+
+	/* Allocate a slab structure. */
+	if ((SS = malloc(sizeof(struct slab_slab))) == NULL)
+		goto err0;
+
+	/* Allocate the memory for the slab. */
+	if ((rc = posix_memalign(&SS->mem, S->align,
+	    S->nrec * S->reclen)) != 0) {
+		errno = rc;
+		goto err1;
+	}
+
+	/* Add the records to the free list, lowest address first. */
+	p = SS->mem;
+	for (i = S->nrec; i > 0; i--) {
+		F = (struct slab_free *)(void *)&p[(i - 1) * S->reclen];
+		F->next = S->freelist;
+		S->freelist = F;
+	}
+
+	/* Link the slab in. */
+	SS->next = S->slabs;
+	S->slabs = SS;
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(SS);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * slab_init(reclen, slablen):
+ * Create a slab allocator for records of ${reclen} bytes, allocating memory
+ * from the system in slabs of ${slablen} bytes (or one record, if larger).
+ */
+struct slab *
+slab_init(size_t reclen, size_t slablen)
+{
+	struct slab * S;
+
+	/* Allocate the allocator state. */
+	if ((S = malloc(sizeof(struct slab))) == NULL)
+		goto err0;
+
+	/* Records must be able to hold a free-list pointer... */
+	if (reclen < sizeof(struct slab_free))
+		reclen = sizeof(struct slab_free);
+
+	/* ... and must keep that pointer aligned. */
+	if (reclen > SIZE_MAX - (sizeof(void *) - 1)) {
+		errno = ENOMEM;
+		goto err1;
+	}
+	reclen = ((reclen + sizeof(void *) - 1) / sizeof(void *)) *
+	    sizeof(void *);
+
+	/* Figure out how many records go into each slab. */
+	S->reclen = reclen;
+	if ((S->nrec = slablen / reclen) == 0)
+		S->nrec = 1;
+
+	/* Large slabs are aligned for huge pages. */
+	if (S->nrec * S->reclen >= SLAB_HUGEPAGE)
+		S->align = SLAB_HUGEPAGE;
+	else
+		S->align = sizeof(void *);
+
+	/* We have no memory yet. */
+	S->slabs = NULL;
+	S->freelist = NULL;
+
+	/* Success! */
+	return (S);
+
+err1:
+	free(S);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * slab_rec_alloc(S):
+ * Return a record from the slab allocator ${S}.  The record is not zeroed.
+ */
+void *
+slab_rec_alloc(struct slab * S)
+{
+	struct slab_free * F;
+
+	/* If we have no free records, allocate another slab. */
+	if (S->freelist == NULL) {
+		if (grow(S))
+			goto err0;
+	}
+
+	/* Grab the first free record. */
+	F = S->freelist;
+	S->freelist = F->next;
+
+	/* Success! */
+	return (F);
+
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * slab_rec_free(S, rec):
+ * Return the record ${rec} to the slab allocator ${S}.
+ */
+void
+slab_rec_free(struct slab * S, void * rec)
+{
+	struct slab_free * F = rec;
+
+	/* Behave consistently with free(NULL). */
+	if (rec == NULL)
+		return;
+
+	/* Put the record at the head of the free list. */
+	F->next = S->freelist;
+	S->freelist = F;
+}
+
+/**
+ * slab_free(S):
+ * Free the slab allocator ${S} and all the memory it holds.  Any records
+ * which have not been returned via slab_rec_free() become invalid.
+ */
+void
+slab_free(struct slab * S)
+{
+	struct slab_slab * SS;
+
+	/* Behave consistently with free(NULL). */
+	if (S == NULL)
+		return;
+
+	/* Free all the slabs. */
+	while ((SS = S->slabs) != NULL) {
+		S->slabs = SS->next;
+		free(SS->mem);
+		free(SS);
+	}
+
+	/* Free the allocator state. */
+	free(S);
+}
@@ -0,0 +1,47 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+
+/**
+ * A slab allocator hands out fixed-size records carved out of large slabs;
+ * freed records are kept on a free list and reused by later allocations
+ * rather than being returned to malloc.  Slabs are only released when the
+ * allocator itself is freed.
+ *
+ * Slabs of SLAB_HUGEPAGE bytes or more are aligned to SLAB_HUGEPAGE-byte
+ * boundaries, which allows operating systems with transparent superpage
+ * support to back them with huge pages.
+ */
+#define SLAB_HUGEPAGE	(2 * 1024 * 1024)
+
+/* Opaque type. */
+struct slab;
+
+/**
+ * slab_init(reclen, slablen):
+ * Create a slab allocator for records of ${reclen} bytes, allocating memory
+ * from the system in slabs of ${slablen} bytes (or one record, if larger).
+ */
+struct slab * slab_init(size_t, size_t);
+
+/**
+ * slab_rec_alloc(S):
+ * Return a record from the slab allocator ${S}.  The record is not zeroed.
+ */
+void * slab_rec_alloc(struct slab *);
+
+/**
+ * slab_rec_free(S, rec):
+ * Return the record ${rec} to the slab allocator ${S}.
+ */
+void slab_rec_free(struct slab *, void *);
+
+/**
+ * slab_free(S):
+ * Free the slab allocator ${S} and all the memory it holds.  Any records
+ * which have not been returned via slab_rec_free() become invalid.
+ */
+void slab_free(struct slab *);
+
+#endif /* !SLAB_H_ */
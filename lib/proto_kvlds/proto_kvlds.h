@@ -135,6 +135,20 @@ int proto_kvlds_request_range2(struct wire_requestqueue *,
     int (*)(void *, const struct kvldskey *, const struct kvldskey *),
     int (*)(void *, int), void *);
 
+/**
+ * proto_kvlds_request_stats(Q, callback, cookie):
+ * Send a STATS request to read the server's internal counters via the
+ * request queue ${Q}.  Invoke
+ *     ${callback}(${cookie}, failed, nstats, names, values)
+ * upon request completion, where failed is 0 on success and 1 on failure,
+ * nstats is the number of counters returned, and names and values are
+ * arrays holding the name and value of each counter.  The arrays and their
+ * members are only valid until the callback returns.
+ */
+int proto_kvlds_request_stats(struct wire_requestqueue *,
+    int (*)(void *, int, size_t, const char * const *, const uint64_t *),
+    void *);
+
 /* Packet types. */
 #define PROTO_KVLDS_PARAMS	0x00000100
 #define PROTO_KVLDS_SET		0x00000110
@@ -145,6 +159,7 @@ int proto_kvlds_request_range2(struct wire_requestqueue *,
 #define PROTO_KVLDS_CAD		0x00000121
 #define PROTO_KVLDS_GET		0x00000130
 #define PROTO_KVLDS_RANGE	0x00000131
+#define PROTO_KVLDS_STATS	0x00000140
 #define PROTO_KVLDS_NONE	(uint32_t)(-1)
 
 /* KVLDS request structure. */
@@ -230,4 +245,13 @@ int proto_kvlds_response_get(struct netbuf_write *, uint64_t, int,
 int proto_kvlds_response_range(struct netbuf_write *, uint64_t, size_t,
     const struct kvldskey *, struct kvldskey **, struct kvldskey **);
 
+/**
+ * proto_kvlds_response_stats(Q, ID, nstats, names, values):
+ * Send a STATS response with ID ${ID} and ${nstats} counters with the
+ * NUL-terminated names in ${names} and values in ${values} to the write
+ * queue ${Q}.  Each name must be at most 255 bytes long.
+ */
+int proto_kvlds_response_stats(struct netbuf_write *, uint64_t, size_t,
+    const char * const *, const uint64_t *);
+
 #endif /* !PROTO_KVLDS_H_ */
@@ -18,6 +18,7 @@ static int callback_done(void *, uint8_t *, size_t);
 static int callback_donep(void *, uint8_t *, size_t);
 static int callback_get(void *, uint8_t *, size_t);
 static int callback_range(void *, uint8_t *, size_t);
+static int callback_stats(void *, uint8_t *, size_t);
 static int callback_range2(void *, int, size_t, struct kvldskey *,
     struct kvldskey **, struct kvldskey **);
 static int poke_range2(void *);
@@ -63,6 +64,12 @@ struct range2_cookie {
 	struct kvldskey * end;
 };
 
+struct stats_cookie {
+	int (* callback)(void *, int, size_t, const char * const *,
+	    const uint64_t *);
+	void * cookie;
+};
+
 MPOOL(done, struct done_cookie, 4096);
 MPOOL(donep, struct donep_cookie, 4096);
 MPOOL(get, struct get_cookie, 4096);
@@ -379,6 +386,95 @@ poke:
 	return (rc);
 }
 
+/* Process a STATS response. */
+static int
+callback_stats(void * cookie, uint8_t * buf, size_t buflen)
+{
+	struct stats_cookie * C = cookie;
+	int failed = 1;
+	size_t bufpos = 0;
+	size_t nstats = 0;
+	char ** names = NULL;
+	uint64_t * values = NULL;
+	char * namebuf = NULL;
+	size_t namepos = 0;
+	size_t namelen;
+	size_t i;
+	int rc;
+
+	/* If we have a packet, parse it. */
+	if (buf != NULL) {
+		/* Is the status code sane? */
+		if (buflen - bufpos < 4)
+			BAD("STATS", "bogus length");
+		if (be32dec(&buf[bufpos]) != 0)
+			BAD("STATS", "bogus status code");
+		bufpos += 4;
+
+		/* Parse and sanity-check the number of counters. */
+		if (buflen - bufpos < 4)
+			BAD("STATS", "bogus length");
+		nstats = be32dec(&buf[bufpos]);
+		if (nstats > (buflen - bufpos - 4) / 9)
+			BAD("STATS", "too many counters");
+		bufpos += 4;
+
+		/* Allocate arrays for names and values. */
+		if (IMALLOC(names, nstats, char *))
+			goto failed;
+		if (IMALLOC(values, nstats, uint64_t))
+			goto failed;
+
+		/* Names (plus NUL terminators) fit into buflen bytes. */
+		if ((namebuf = malloc(buflen)) == NULL)
+			goto failed;
+
+		/* Parse names and values. */
+		for (i = 0; i < nstats; i++) {
+			if (buflen - bufpos < 1)
+				BAD("STATS", "bogus length");
+			namelen = buf[bufpos];
+			bufpos += 1;
+			if (buflen - bufpos < namelen + 8)
+				BAD("STATS", "bogus length");
+			names[i] = &namebuf[namepos];
+			memcpy(names[i], &buf[bufpos], namelen);
+			names[i][namelen] = '\0';
+			namepos += namelen + 1;
+			bufpos += namelen;
+			values[i] = be64dec(&buf[bufpos]);
+			bufpos += 8;
+		}
+
+		/* Make sure we reached the end of the packet. */
+		if (buflen != bufpos)
+			BAD("STATS", "wrong length");
+
+		/* We successfully parsed this response. */
+		failed = 0;
+	}
+
+failed:
+	/* If we failed, we have no counters. */
+	if (failed)
+		nstats = 0;
+
+	/* Invoke the upstream callback. */
+	rc = (C->callback)(C->cookie, failed, nstats,
+	    (const char * const *)names, values);
+
+	/* Free the counters. */
+	free(namebuf);
+	free(values);
+	free(names);
+
+	/* Free the cookie. */
+	free(C);
+
+	/* Return status from callback. */
+	return (rc);
+}
+
 /**
  * proto_kvlds_request_params(Q, callback, cookie):
  * Send a PARAMS request to get the maximum key and value lengths via the
@@ -1006,3 +1102,50 @@ err0:
 	/* Failure! */
 	return (-1);
 }
+
+/**
+ * proto_kvlds_request_stats(Q, callback, cookie):
+ * Send a STATS request to read the server's internal counters via the
+ * request queue ${Q}.  Invoke
+ *     ${callback}(${cookie}, failed, nstats, names, values)
+ * upon request completion, where failed is 0 on success and 1 on failure,
+ * nstats is the number of counters returned, and names and values are
+ * arrays holding the name and value of each counter.  The arrays and their
+ * members are only valid until the callback returns.
+ */
+int
+proto_kvlds_request_stats(struct wire_requestqueue * Q,
+    int (* callback)(void *, int, size_t, const char * const *,
+	const uint64_t *),
+    void * cookie)
+{
+	struct stats_cookie * C;
+	uint8_t * buf;
+
+	/* Bake a cookie. */
+	if ((C = malloc(sizeof(struct stats_cookie))) == NULL)
+		goto err0;
+	C->callback = callback;
+	C->cookie = cookie;
+
+	/* Start writing a request. */
+	if ((buf = wire_requestqueue_add_getbuf(Q, 4,
+	    callback_stats, C)) == NULL)
+		goto err1;
+
+	/* Construct request. */
+	be32enc(&buf[0], PROTO_KVLDS_STATS);
+
+	/* Finish writing request. */
+	if (wire_requestqueue_add_done(Q, buf, 4))
+		goto err1;
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(C);
+err0:
+	/* Failure! */
+	return (-1);
+}
@@ -57,6 +57,7 @@ proto_kvlds_request_parse(const struct wire_packet * P,
 	/* Parse packet. */
 	switch (R->type) {
 	case PROTO_KVLDS_PARAMS:
+	case PROTO_KVLDS_STATS:
 		/* Nothing to parse. */
 		break;
 	case PROTO_KVLDS_DELETE:
@@ -352,3 +353,58 @@ err0:
 	/* Failure! */
 	return (-1);
 }
+
+/**
+ * proto_kvlds_response_stats(Q, ID, nstats, names, values):
+ * Send a STATS response with ID ${ID} and ${nstats} counters with the
+ * NUL-terminated names in ${names} and values in ${values} to the write
+ * queue ${Q}.  Each name must be at most 255 bytes long.
+ */
+int
+proto_kvlds_response_stats(struct netbuf_write * Q, uint64_t ID,
+    size_t nstats, const char * const * names, const uint64_t * values)
+{
+	uint8_t * wbuf;
+	size_t len;
+	size_t namelen;
+	size_t i;
+	size_t bufpos;
+
+	/* Sanity check: We can't return more than 2^32-1 counters. */
+	assert(nstats <= UINT32_MAX);
+
+	/* Figure out how long the packet will be. */
+	len = 8;
+	for (i = 0; i < nstats; i++) {
+		assert(strlen(names[i]) <= 255);
+		len += 1 + strlen(names[i]) + 8;
+	}
+
+	/* Get a packet data buffer. */
+	if ((wbuf = wire_writepacket_getbuf(Q, ID, len)) == NULL)
+		goto err0;
+
+	/* Write the packet data. */
+	be32enc(&wbuf[0], 0);
+	be32enc(&wbuf[4], (uint32_t)nstats);
+	bufpos = 8;
+	for (i = 0; i < nstats; i++) {
+		namelen = strlen(names[i]);
+		wbuf[bufpos] = (uint8_t)namelen;
+		memcpy(&wbuf[bufpos + 1], names[i], namelen);
+		bufpos += 1 + namelen;
+		be64enc(&wbuf[bufpos], values[i]);
+		bufpos += 8;
+	}
+
+	/* Finish the packet. */
+	if (wire_writepacket_done(Q, wbuf, len))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
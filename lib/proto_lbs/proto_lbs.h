@@ -81,6 +81,26 @@ int proto_lbs_request_append(struct wire_requestqueue *,
 int proto_lbs_request_free(struct wire_requestqueue *, uint64_t,
     int (*)(void *, int), void *);
 
+/* A range of blocks. */
+struct proto_lbs_range {
+	uint64_t blkno;		/* First block # in range. */
+	uint64_t nblks;		/* Number of blocks in range. */
+};
+
+/* Maximum number of ranges in a FREERANGE request. */
+#define PROTO_LBS_FREERANGE_MAX	65536
+
+/**
+ * proto_lbs_request_freerange(Q, nranges, ranges, callback, cookie):
+ * Send a FREERANGE request to free the blocks in the ${nranges} ranges
+ * ${ranges}[0 .. ${nranges} - 1] to the request queue ${Q}; ${nranges} must
+ * be non-zero and at most PROTO_LBS_FREERANGE_MAX.  Invoke
+ *     ${callback}(${cookie}, failed)
+ * upon request completion, where failed is 0 on success and 1 on failure.
+ */
+int proto_lbs_request_freerange(struct wire_requestqueue *, size_t,
+    const struct proto_lbs_range *, int (*)(void *, int), void *);
+
 /* Block size limits (from ./DESIGN). */
 #define PROTO_LBS_BLKLEN_MIN	512		/* 2^9 */
 #define PROTO_LBS_BLKLEN_MAX	131072		/* 2^17 */
@@ -91,6 +111,7 @@ int proto_lbs_request_free(struct wire_requestqueue *, uint64_t,
 #define PROTO_LBS_GET		1
 #define PROTO_LBS_APPEND	2
 #define PROTO_LBS_FREE		3
+#define PROTO_LBS_FREERANGE	5
 #define PROTO_LBS_NONE		((uint32_t)(-1))
 
 /* LBS request structure. */
@@ -119,6 +140,10 @@ struct proto_lbs_request {
 		struct proto_lbs_request_free {
 			uint64_t blkno;		/* First block # to keep. */
 		} free;
+		struct proto_lbs_request_freerange {
+			uint32_t nranges;	/* # of ranges to free. */
+			struct proto_lbs_range * ranges; /* Ranges. */
+		} freerange;
 	} r;
 };
 
@@ -156,6 +181,21 @@ int proto_lbs_response_params2(struct netbuf_write *, uint64_t,
 int proto_lbs_response_get(struct netbuf_write *, uint64_t,
     int, uint32_t, const uint8_t *);
 
+/* Layout of a GET response constructed by proto_lbs_response_get_frame(). */
+#define PROTO_LBS_RESPONSE_GET_DATAOFF	20
+#define PROTO_LBS_RESPONSE_GET_LEN(blklen)	((size_t)(blklen) + 24)
+
+/**
+ * proto_lbs_response_get_frame(buf, ID, status, blklen):
+ * Construct in place in ${buf} a GET response with ID ${ID} and status code
+ * ${status}; if ${status} is zero, the ${blklen} bytes of block data must
+ * already be at &${buf}[PROTO_LBS_RESPONSE_GET_DATAOFF].  The buffer must
+ * have space for PROTO_LBS_RESPONSE_GET_LEN(${blklen}) bytes.  Return the
+ * length of the packet, which may be sent with netbuf_write_write() or
+ * netbuf_write_give().
+ */
+size_t proto_lbs_response_get_frame(uint8_t *, uint64_t, int, uint32_t);
+
 /**
  * proto_lbs_response_append(Q, ID, status, blkno):
  * Send an APPEND response with ID ${ID} to the write queue ${Q} with status
@@ -170,4 +210,10 @@ int proto_lbs_response_append(struct netbuf_write *, uint64_t,
  */
 int proto_lbs_response_free(struct netbuf_write *, uint64_t);
 
+/**
+ * proto_lbs_response_freerange(Q, ID):
+ * Send a FREERANGE response with ID ${ID} to the write queue ${Q}.
+ */
+int proto_lbs_response_freerange(struct netbuf_write *, uint64_t);
+
 #endif /* !PROTO_LBS_H_ */
@@ -14,6 +14,7 @@ static int callback_params2(void *, uint8_t *, size_t);
 static int callback_get(void *, uint8_t *, size_t);
 static int callback_append(void *, uint8_t *, size_t);
 static int callback_free(void *, uint8_t *, size_t);
+static int callback_freerange(void *, uint8_t *, size_t);
 
 struct params_cookie {
 	int (* callback)(void *, int, size_t, uint64_t);
@@ -516,3 +517,90 @@ failed:
 	/* Return status from callback. */
 	return (rc);
 }
+
+/**
+ * proto_lbs_request_freerange(Q, nranges, ranges, callback, cookie):
+ * Send a FREERANGE request to free the blocks in the ${nranges} ranges
+ * ${ranges}[0 .. ${nranges} - 1] to the request queue ${Q}; ${nranges} must
+ * be non-zero and at most PROTO_LBS_FREERANGE_MAX.  Invoke
+ *     ${callback}(${cookie}, failed)
+ * upon request completion, where failed is 0 on success and 1 on failure.
+ */
+int
+proto_lbs_request_freerange(struct wire_requestqueue * Q, size_t nranges,
+    const struct proto_lbs_range * ranges,
+    int (* callback)(void *, int), void * cookie)
+{
+	struct free_cookie * C;
+	uint8_t * buf;
+	size_t len;
+	size_t i;
+
+	/* Sanity checks. */
+	assert(callback != NULL);
+	assert((nranges > 0) && (nranges <= PROTO_LBS_FREERANGE_MAX));
+
+	/* Bake a cookie. */
+	if ((C = malloc(sizeof(struct free_cookie))) == NULL)
+		goto err0;
+	C->callback = callback;
+	C->cookie = cookie;
+
+	/* Start writing a request. */
+	len = 8 + nranges * 16;
+	if ((buf = wire_requestqueue_add_getbuf(Q, len,
+	    callback_freerange, C)) == NULL)
+		goto err1;
+
+	/* Construct request. */
+	be32enc(&buf[0], PROTO_LBS_FREERANGE);
+	be32enc(&buf[4], (uint32_t)nranges);
+	for (i = 0; i < nranges; i++) {
+		be64enc(&buf[8 + i * 16], ranges[i].blkno);
+		be64enc(&buf[16 + i * 16], ranges[i].nblks);
+	}
+
+	/* Finish writing request. */
+	if (wire_requestqueue_add_done(Q, buf, len))
+		goto err1;
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(C);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* FREERANGE response-handling callback. */
+static int
+callback_freerange(void * cookie, uint8_t * buf, size_t buflen)
+{
+	struct free_cookie * C = cookie;
+	int failed = 1;
+	int rc;
+
+	/* If we have a packet, parse it. */
+	if (buf != NULL) {
+		/* Is the status code sane? */
+		if (buflen < 4)
+			BAD("FREERANGE", "bogus length");
+		if (be32dec(&buf[0]) > 0)
+			BAD("FREERANGE", "bogus status code");
+
+		/* We successfully parsed this response. */
+		failed = 0;
+	}
+
+failed:
+	/* Invoke the upstream callback. */
+	rc = (C->callback)(C->cookie, failed);
+
+	/* Free the cookie. */
+	free(C);
+
+	/* Return status from callback. */
+	return (rc);
+}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "imalloc.h"
 #include "sysendian.h"
 #include "wire.h"
 
@@ -16,6 +17,7 @@ static int
 proto_lbs_request_parse(const struct wire_packet * P,
     struct proto_lbs_request * R)
 {
+	size_t i;
 
 	/* Sanity check. */
 	assert(P->len <= UINT32_MAX);
@@ -63,6 +65,25 @@ proto_lbs_request_parse(const struct wire_packet * P,
 			goto err0;
 		R->r.free.blkno = be64dec(&P->buf[4]);
 		break;
+	case PROTO_LBS_FREERANGE:
+		if (P->len < 8)
+			goto err0;
+		R->r.freerange.nranges = be32dec(&P->buf[4]);
+		if ((R->r.freerange.nranges == 0) ||
+		    (R->r.freerange.nranges > PROTO_LBS_FREERANGE_MAX))
+			goto err0;
+		if (P->len != 8 + (size_t)R->r.freerange.nranges * 16)
+			goto err0;
+		if (IMALLOC(R->r.freerange.ranges, R->r.freerange.nranges,
+		    struct proto_lbs_range))
+			goto err0;
+		for (i = 0; i < R->r.freerange.nranges; i++) {
+			R->r.freerange.ranges[i].blkno =
+			    be64dec(&P->buf[8 + i * 16]);
+			R->r.freerange.ranges[i].nblks =
+			    be64dec(&P->buf[16 + i * 16]);
+		}
+		break;
 	default:
 		goto err0;
 	}
@@ -220,6 +241,35 @@ err0:
 	return (-1);
 }
 
+/**
+ * proto_lbs_response_get_frame(buf, ID, status, blklen):
+ * Construct in place in ${buf} a GET response with ID ${ID} and status code
+ * ${status}; if ${status} is zero, the ${blklen} bytes of block data must
+ * already be at &${buf}[PROTO_LBS_RESPONSE_GET_DATAOFF].  The buffer must
+ * have space for PROTO_LBS_RESPONSE_GET_LEN(${blklen}) bytes.  Return the
+ * length of the packet, which may be sent with netbuf_write_write() or
+ * netbuf_write_give().
+ */
+size_t
+proto_lbs_response_get_frame(uint8_t * buf, uint64_t ID, int status,
+    uint32_t blklen)
+{
+	size_t len;
+
+	/* Sanity check. */
+	assert((status == 0) || (status == 1));
+
+	/* Compute the response length. */
+	len = 4 + ((status == 0) ? blklen : 0);
+
+	/* Write the status code and construct the packet around the data. */
+	be32enc(&buf[16], (uint32_t)status);
+	wire_writepacket_frame(buf, ID, len);
+
+	/* Return the packet length. */
+	return (len + 20);
+}
+
 /**
  * proto_lbs_response_append(Q, ID, status, blkno):
  * Send an APPEND response with ID ${ID} to the write queue ${Q} with status
@@ -286,3 +336,15 @@ err0:
 	/* Failure! */
 	return (-1);
 }
+
+/**
+ * proto_lbs_response_freerange(Q, ID):
+ * Send a FREERANGE response with ID ${ID} to the write queue ${Q}.
+ */
+int
+proto_lbs_response_freerange(struct netbuf_write * Q, uint64_t ID)
+{
+
+	/* The response is the same as for a FREE. */
+	return (proto_lbs_response_free(Q, ID));
+}
@@ -74,6 +74,15 @@ uint8_t * wire_writepacket_getbuf(struct netbuf_write *, uint64_t, size_t);
  */
 int wire_writepacket_done(struct netbuf_write *, uint8_t *, size_t);
 
+/**
+ * wire_writepacket_frame(buf, ID, len):
+ * Construct in place a packet with ID ${ID} and data length ${len}, the data
+ * of which has already been written at &${buf}[16].  The buffer ${buf} must
+ * have space for ${len} + 20 bytes; the packet occupies all of them and may
+ * be passed directly to netbuf_write_write() or netbuf_write_give().
+ */
+void wire_writepacket_frame(uint8_t *, uint64_t, size_t);
+
 /**
  * wire_writepacket(W, packet):
  * Write the packet ${packet} to the buffered writer ${W}.
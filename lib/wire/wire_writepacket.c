@@ -8,6 +8,44 @@
 
 #include "wire.h"
 
+/* Construct a packet header for the ID ${ID} and data length ${len}. */
+static void
+header(uint8_t * wbuf, uint64_t ID, size_t len)
+{
+	CRC32C_CTX ctx;
+
+	be64enc(&wbuf[0], ID);
+	be32enc(&wbuf[8], (uint32_t)len);
+	CRC32C_Init(&ctx);
+	CRC32C_Update(&ctx, wbuf, 12);
+	CRC32C_Final(&wbuf[12], &ctx);
+}
+
+/* Construct the trailer for the ${len} bytes of packet data at ${wbuf}. */
+static void
+trailer(uint8_t * wbuf, size_t len)
+{
+	CRC32C_CTX ctx;
+	uint8_t cbuf[4];
+	size_t i;
+	uint8_t * header_crc;
+
+	/*
+	 * This is safe because ${wbuf} always points 16 bytes after the start
+	 * of the packet, so position [-4] is the header CRC.
+	 */
+	header_crc = &wbuf[-4];
+
+	/* Compute the CRC32C of the packet data. */
+	CRC32C_Init(&ctx);
+	CRC32C_Update(&ctx, wbuf, len);
+	CRC32C_Final(cbuf, &ctx);
+
+	/* Write the trailer. */
+	for (i = 0; i < 4; i++)
+		wbuf[len + i] = cbuf[i] ^ header_crc[i];
+}
+
 /**
  * wire_writepacket_getbuf(W, ID, len):
  * Start writing a packet with ID ${ID} and data length ${len} to the buffered
@@ -17,7 +55,6 @@
 uint8_t *
 wire_writepacket_getbuf(struct netbuf_write * W, uint64_t ID, size_t len)
 {
-	CRC32C_CTX ctx;
 	uint8_t * wbuf;
 
 	/* Sanity-check packet length. */
@@ -29,11 +66,7 @@ wire_writepacket_getbuf(struct netbuf_write * W, uint64_t ID, size_t len)
 		goto err0;
 
 	/* Construct the header in-place. */
-	be64enc(&wbuf[0], ID);
-	be32enc(&wbuf[8], (uint32_t)len);
-	CRC32C_Init(&ctx);
-	CRC32C_Update(&ctx, wbuf, 12);
-	CRC32C_Final(&wbuf[12], &ctx);
+	header(wbuf, ID, len);
 
 	/* Return a pointer to where the data should be written. */
 	return (&wbuf[16]);
@@ -52,27 +85,13 @@ err0:
 int
 wire_writepacket_done(struct netbuf_write * W, uint8_t * wbuf, size_t len)
 {
-	CRC32C_CTX ctx;
-	uint8_t cbuf[4];
-	size_t i;
-	uint8_t * header_crc;
 
 	/*
-	 * This is safe due to the requirement that ${wbuf} be the pointer
-	 * returned by wire_writepacket_getbuf -- that function returns
-	 * &wbuf[16], so position [-4] in the new buffer is still within
-	 * the allocated memory.
+	 * Write the trailer.  This is safe due to the requirement that ${wbuf}
+	 * be the pointer returned by wire_writepacket_getbuf -- that function
+	 * returns &wbuf[16], so the header CRC is within the allocated memory.
 	 */
-	header_crc = &wbuf[-4];
-
-	/* Compute the CRC32C of the packet data. */
-	CRC32C_Init(&ctx);
-	CRC32C_Update(&ctx, wbuf, len);
-	CRC32C_Final(cbuf, &ctx);
-
-	/* Write the trailer. */
-	for (i = 0; i < 4; i++)
-		wbuf[len + i] = cbuf[i] ^ header_crc[i];
+	trailer(wbuf, len);
 
 	/* We've finished constructing the packet. */
 	if (netbuf_write_consume(W, len + 20))
@@ -86,6 +105,26 @@ err0:
 	return (-1);
 }
 
+/**
+ * wire_writepacket_frame(buf, ID, len):
+ * Construct in place a packet with ID ${ID} and data length ${len}, the data
+ * of which has already been written at &${buf}[16].  The buffer ${buf} must
+ * have space for ${len} + 20 bytes; the packet occupies all of them and may
+ * be passed directly to netbuf_write_write() or netbuf_write_give().
+ */
+void
+wire_writepacket_frame(uint8_t * buf, uint64_t ID, size_t len)
+{
+
+	/* Sanity-check packet length. */
+	assert(len <= UINT32_MAX);
+	assert(len <= SIZE_MAX - 20);
+
+	/* Construct the header and trailer around the data. */
+	header(buf, ID, len);
+	trailer(&buf[16], len);
+}
+
 /**
  * wire_writepacket(W, packet):
  * Write the packet ${packet} to the buffered writer ${W}.
@@ -0,0 +1,12 @@
+#include <sys/eventfd.h>
+
+int
+main(void)
+{
+
+	/* We need a non-blocking eventfd. */
+	(void)eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	/* Success! */
+	return (0);
+}
@@ -0,0 +1,12 @@
+#include <fcntl.h>
+
+int
+main(void)
+{
+
+	/* We need to be able to preallocate without changing the size. */
+	(void)fallocate(-1, FALLOC_FL_KEEP_SIZE, 0, 4096);
+
+	/* Success! */
+	return (0);
+}
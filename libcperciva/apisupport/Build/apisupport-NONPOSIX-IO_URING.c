@@ -0,0 +1,28 @@
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <string.h>
+#include <unistd.h>
+
+int
+main(void)
+{
+	struct io_uring_params p;
+	struct io_uring_sqe sqe;
+
+	/* We need IORING_OP_READ and IORING_REGISTER_EVENTFD. */
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ;
+	(void)eventfd(0, EFD_NONBLOCK);
+
+	/* We make system calls directly. */
+	memset(&p, 0, sizeof(p));
+	(void)syscall(__NR_io_uring_setup, 8, &p);
+	(void)syscall(__NR_io_uring_register, -1, IORING_REGISTER_EVENTFD,
+	    NULL, 1);
+
+	/* Success! */
+	return (0);
+}
@@ -75,6 +75,27 @@ feature NONPOSIX SETGROUPS "" ""			\
 	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE"		\
 	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -Wno-reserved-id-macro"
 
+# Detect how to compile Linux io_uring code.
+feature NONPOSIX IO_URING ""				\
+	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_DEFAULT_SOURCE"	\
+	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_DEFAULT_SOURCE -Wno-reserved-id-macro"
+
+# Detect how to compile code which uses eventfd.
+feature NONPOSIX EVENTFD "" ""				\
+	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_DEFAULT_SOURCE"	\
+	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_DEFAULT_SOURCE -Wno-reserved-id-macro"
+
+# Detect how to compile code which uses O_DIRECT.
+feature NONPOSIX O_DIRECT "" ""				\
+	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE"		\
+	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_GNU_SOURCE"	\
+	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_GNU_SOURCE -Wno-reserved-id-macro"
+
+# Detect how to compile code which uses fallocate.
+feature NONPOSIX FALLOCATE ""				\
+	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_GNU_SOURCE"	\
+	"-U_POSIX_C_SOURCE -U_XOPEN_SOURCE -D_GNU_SOURCE -Wno-reserved-id-macro"
+
 # Detect how to compile libssl and libcrypto code.
 feature LIBSSL HOST_NAME "-lssl" ""			\
 	"-Wno-cast-qual"
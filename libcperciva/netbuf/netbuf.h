@@ -86,6 +86,17 @@ int netbuf_write_consume(struct netbuf_write *, size_t);
  */
 int netbuf_write_write(struct netbuf_write *, const uint8_t *, size_t);
 
+/**
+ * netbuf_write_give(W, buf, buflen, freefunc, cookie):
+ * Write ${buflen} bytes from the buffer ${buf} via the buffered writer ${W}
+ * without copying them.  The buffer must not be modified until the writer
+ * calls ${freefunc}(${cookie}, ${buf}), which it will do once the data has
+ * been written or discarded (at the latest, from netbuf_write_free()).  If
+ * this function fails, ${freefunc} is not called.
+ */
+int netbuf_write_give(struct netbuf_write *, uint8_t *, size_t,
+    void (*)(void *, void *), void *);
+
 /**
  * netbuf_write_free(W):
  * Free the writer ${W}.
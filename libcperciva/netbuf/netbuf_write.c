@@ -31,6 +31,8 @@ struct writebuf {
 	uint8_t * buf;			/* The buffer to be written. */
 	size_t buflen;			/* Size of buffer. */
 	size_t datalen;			/* Amount of data in buffer. */
+	void (* freefunc)(void *, void *);	/* Frees buf, or NULL. */
+	void * freecookie;		/* Cookie for freefunc. */
 	STAILQ_ENTRY(writebuf) entries;
 };
 
@@ -56,6 +58,19 @@ struct netbuf_write {
 static int writbuf(void *, ssize_t);
 static int poke(struct netbuf_write *);
 
+/* Free a write buffer and the memory it holds. */
+static void
+wbfree(struct writebuf * WB)
+{
+
+	/* Buffers we were given are returned to their owner. */
+	if (WB->freefunc != NULL)
+		(WB->freefunc)(WB->freecookie, WB->buf);
+	else
+		free(WB->buf);
+	free(WB);
+}
+
 /* A buffer has been written. */
 static int
 writbuf(void * cookie, ssize_t writelen)
@@ -86,8 +101,7 @@ writbuf(void * cookie, ssize_t writelen)
 		W->failed = 1;
 
 	/* Free this buffer. */
-	free(WB->buf);
-	free(WB);
+	wbfree(WB);
 
 	/* If we failed, invoke the failure callback. */
 	if (W->failed)
@@ -235,9 +249,9 @@ netbuf_write_reserve(struct netbuf_write * W, size_t len)
 	/* We're reserving some space. */
 	W->reserved = 1;
 
-	/* Do we have a buffer with enough space?  Return it. */
+	/* Do we have a buffer (of our own) with enough space?  Return it. */
 	if ((WB = STAILQ_LAST(&W->buffers, writebuf, entries)) != NULL) {
-		if (WB->buflen - WB->datalen >= len)
+		if ((WB->freefunc == NULL) && (WB->buflen - WB->datalen >= len))
 			goto oldbuf;
 	}
 
@@ -257,6 +271,7 @@ netbuf_write_reserve(struct netbuf_write * W, size_t len)
 
 	/* No data in this buffer yet. */
 	WB->datalen = 0;
+	WB->freefunc = NULL;
 
 	/* Add this buffer to the queue. */
 	STAILQ_INSERT_TAIL(&W->buffers, WB, entries);
@@ -344,6 +359,59 @@ err0:
 	return (-1);
 }
 
+/**
+ * netbuf_write_give(W, buf, buflen, freefunc, cookie):
+ * Write ${buflen} bytes from the buffer ${buf} via the buffered writer ${W}
+ * without copying them.  The buffer must not be modified until the writer
+ * calls ${freefunc}(${cookie}, ${buf}), which it will do once the data has
+ * been written or discarded (at the latest, from netbuf_write_free()).  If
+ * this function fails, ${freefunc} is not called.
+ */
+int
+netbuf_write_give(struct netbuf_write * W, uint8_t * buf, size_t buflen,
+    void (* freefunc)(void *, void *), void * cookie)
+{
+	struct writebuf * WB;
+
+	/* Sanity-check: No calls while buffer space reserved. */
+	assert(W->reserved == 0);
+
+	/* If we've failed, just silently discard writes. */
+	if (W->failed)
+		goto discard;
+
+	/* Add a buffer to the queue, pointing at the data we were given. */
+	if ((WB = malloc(sizeof(struct writebuf))) == NULL)
+		goto err0;
+	WB->buf = buf;
+	WB->buflen = WB->datalen = buflen;
+	WB->freefunc = freefunc;
+	WB->freecookie = cookie;
+	STAILQ_INSERT_TAIL(&W->buffers, WB, entries);
+
+	/* Poke the queue to see if we can launch more writing now. */
+	if (poke(W))
+		goto err1;
+
+	/* Success! */
+	return (0);
+
+discard:
+	/* Give the buffer back. */
+	(freefunc)(cookie, buf);
+
+	/* Success! */
+	return (0);
+
+err1:
+	/* The buffer still belongs to the caller; don't write or free it. */
+	STAILQ_REMOVE(&W->buffers, WB, writebuf, entries);
+	free(WB);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /**
  * netbuf_write_free(W):
  * Free the writer ${W}.
@@ -363,16 +431,14 @@ netbuf_write_free(struct netbuf_write * W)
 			(netbuf_write_ssl_cancel_func)(W->write_cookie);
 		else
 			network_write_cancel(W->write_cookie);
-		free(W->curr->buf);
-		free(W->curr);
+		wbfree(W->curr);
 	}
 
 	/* Free write buffers. */
 	while (!STAILQ_EMPTY(&W->buffers)) {
 		WB = STAILQ_FIRST(&W->buffers);
 		STAILQ_REMOVE_HEAD(&W->buffers, entries);
-		free(WB->buf);
-		free(WB);
+		wbfree(WB);
 	}
 
 	/* Free the buffered writer. */
@@ -11,6 +11,8 @@
 #include "warnp.h"
 #include "wire.h"
 
+#include "router.h"
+
 #include "dispatch.h"
 
 /* Dispatcher state. */
@@ -24,9 +26,10 @@ struct dispatch_state {
 	size_t nsock_active;			/* # active sockets. */
 	size_t nsock_active_max;		/* Max # active sockets. */
 
-	/* Request queue. */
+	/* Request queue or router. */
 	struct wire_requestqueue * Q;		/* Connected to target. */
-	int failed;				/* Q has failed. */
+	struct router * RT;			/* Routes to shards. */
+	int failed;				/* Q or RT has failed. */
 };
 
 /* Listening socket. */
@@ -65,6 +68,8 @@ static int callback_gotconn(void *, int);
 static int readreq(struct sock_active *);
 static int callback_gotrequests(void *, int);
 static int callback_gotresponse(void *, uint8_t *, size_t);
+static int callback_routed(void *, int);
+static int upstream_failed(struct dispatch_state *);
 static int reqdone(struct sock_active *);
 static int dropconn(struct sock_active *);
 
@@ -278,10 +283,16 @@ callback_gotrequests(void * cookie, int status)
 		F->ID = P.ID;
 		F->conn = S;
 
-		/* Send the request to the target. */
-		if (wire_requestqueue_add(dstate->Q, P.buf, P.len,
-		    callback_gotresponse, F))
-			goto err1;
+		/* Send the request to the target, or route it to a shard. */
+		if (dstate->RT != NULL) {
+			if (router_request(dstate->RT, P.buf, P.len, P.ID,
+			    S->writeq, callback_routed, F))
+				goto err1;
+		} else {
+			if (wire_requestqueue_add(dstate->Q, P.buf, P.len,
+			    callback_gotresponse, F))
+				goto err1;
+		}
 
 		/* We have an additional outstanding request. */
 		S->nrequests++;
@@ -319,7 +330,6 @@ callback_gotresponse(void * cookie, uint8_t * buf, size_t buflen)
 {
 	struct forwardee * F = cookie;
 	struct sock_active * S = F->conn;
-	struct sock_active * S_next;
 	struct dispatch_state * dstate = S->dstate;
 	struct wire_packet P;
 
@@ -352,6 +362,52 @@ failed:
 	if (reqdone(S))
 		goto err0;
 
+	/* The connection to the upstream server has failed. */
+	if (upstream_failed(dstate))
+		goto err0;
+
+	/* The failed request has been successfully handled. */
+	return (0);
+
+err1:
+	mpool_forwardee_free(F);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+callback_routed(void * cookie, int failed)
+{
+	struct forwardee * F = cookie;
+	struct sock_active * S = F->conn;
+	struct dispatch_state * dstate = S->dstate;
+
+	/* Free the cookie. */
+	mpool_forwardee_free(F);
+
+	/* We've finished with a request. */
+	if (reqdone(S))
+		goto err0;
+
+	/* If the request failed, a connection to a shard has failed. */
+	if (failed && upstream_failed(dstate))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+upstream_failed(struct dispatch_state * dstate)
+{
+	struct sock_active * S;
+	struct sock_active * S_next;
+
 	/* Stop trying to accept connections. */
 	accept_stop(dstate);
 
@@ -365,11 +421,9 @@ failed:
 			goto err0;
 	}
 
-	/* The failed request has been successfully handled. */
+	/* Success! */
 	return (0);
 
-err1:
-	mpool_forwardee_free(F);
 err0:
 	/* Failure! */
 	return (-1);
@@ -450,14 +504,15 @@ err1:
 }
 
 /**
- * dispatch_init(socks, nsocks, Q, maxconn):
+ * dispatch_init(socks, nsocks, Q, RT, maxconn):
  * Initialize a dispatcher to accept connections from the listening sockets
  * ${socks[0]} ... ${socks[nsocks - 1]} (but no more than ${maxconn} at
- * once) and shuttle requests/responses to/from the request queue ${Q}.
+ * once) and shuttle requests/responses to/from the request queue ${Q}, or
+ * if ${Q} is NULL, via the router ${RT}.
  */
 struct dispatch_state *
 dispatch_init(const int * socks, size_t nsocks,
-    struct wire_requestqueue * Q, size_t maxconn)
+    struct wire_requestqueue * Q, struct router * RT, size_t maxconn)
 {
 	struct dispatch_state * dstate;
 	size_t i;
@@ -470,6 +525,7 @@ dispatch_init(const int * socks, size_t nsocks,
 	dstate->nsock_active = 0;
 	dstate->nsock_active_max = maxconn;
 	dstate->Q = Q;
+	dstate->RT = RT;
 	dstate->failed = 0;
 
 	/* Allocate an array of listeners. */
@@ -5,16 +5,19 @@
 
 /* Opaque types. */
 struct dispatch_state;
+struct router;
 struct wire_requestqueue;
 
 /**
- * dispatch_init(socks, nsocks, Q, maxconn):
+ * dispatch_init(socks, nsocks, Q, RT, maxconn):
  * Initialize a dispatcher to accept connections from the listening sockets
  * ${socks[0]} ... ${socks[nsocks - 1]} (but no more than ${maxconn} at
- * once) and shuttle requests/responses to/from the request queue ${Q}.
+ * once) and shuttle requests/responses to/from the request queue ${Q}, or
+ * if ${Q} is NULL, via the router ${RT}.
  */
 struct dispatch_state *
-dispatch_init(const int *, size_t, struct wire_requestqueue *, size_t);
+dispatch_init(const int *, size_t, struct wire_requestqueue *,
+    struct router *, size_t);
 
 /**
  * dispatch_alive(dstate):
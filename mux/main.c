@@ -11,20 +11,26 @@
 #include "elasticarray.h"
 #include "events.h"
 #include "getopt.h"
+#include "hexify.h"
+#include "kvldskey.h"
 #include "parsenum.h"
 #include "sock.h"
 #include "warnp.h"
 #include "wire.h"
 
 #include "dispatch.h"
+#include "router.h"
 
 ELASTICARRAY_DECL(ADDRLIST, addrlist, struct sock_addr *);
+ELASTICARRAY_DECL(STRLIST, strlist, char *);
+ELASTICARRAY_DECL(KEYLIST, keylist, struct kvldskey *);
 
 static void
 usage(void)
 {
 
 	fprintf(stderr, "usage: kivaloo-mux -t <target socket> "
+	    "[-k <split key> -t <target socket> ...] "
 	    "-s <source socket> [-s <source socket> ...] "
 	    "[-n <max # connections] [-p <pidfile>]\n");
 	fprintf(stderr, "       kivaloo-mux --version\n");
@@ -42,34 +48,63 @@ main(int argc, char * argv[])
 {
 	/* State variables. */
 	int * socks_s;
-	int sock_t;
-	struct wire_requestqueue * Q_t;
+	int * socks_t;
+	struct wire_requestqueue ** Qs_t;
+	struct router * RT = NULL;
 	struct dispatch_state * dstate;
 
 	/* Command-line parameters. */
 	size_t opt_n = 0;
 	char * opt_p = NULL;
-	char * opt_t = NULL;
+	STRLIST opt_t;
+	KEYLIST opt_k;
 	ADDRLIST opt_s;
 	char * opt_s_1 = NULL;
 
 	/* Working variables. */
 	size_t opt_s_size;
+	size_t opt_t_size;
 	struct sock_addr ** sas;
+	struct kvldskey * K;
+	uint8_t kbuf[255];
+	char * t;
 	size_t i;
 	const char * ch;
 
 	WARNP_INIT;
 
-	/* We have no addresses to listen on yet. */
+	/* We have no addresses to listen on or connect to yet. */
 	if ((opt_s = addrlist_init(0)) == NULL) {
 		warnp("addrlist_init");
 		exit(1);
 	}
+	if ((opt_t = strlist_init(0)) == NULL) {
+		warnp("strlist_init");
+		exit(1);
+	}
+	if ((opt_k = keylist_init(0)) == NULL) {
+		warnp("keylist_init");
+		exit(1);
+	}
 
 	/* Parse the command line. */
 	while ((ch = GETOPT(argc, argv)) != NULL) {
 		GETOPT_SWITCH(ch) {
+		GETOPT_OPTARG("-k"):
+			/* Split keys are given in hex. */
+			if ((strlen(optarg) % 2 != 0) ||
+			    (strlen(optarg) == 0) ||
+			    (strlen(optarg) > 2 * sizeof(kbuf)) ||
+			    unhexify(optarg, kbuf, strlen(optarg) / 2)) {
+				warn0("Invalid option: -k %s", optarg);
+				usage();
+			}
+			if ((K = kvldskey_create(kbuf,
+			    strlen(optarg) / 2)) == NULL)
+				OPT_EPARSE(ch, optarg);
+			if (keylist_append(opt_k, &K, 1))
+				OPT_EPARSE(ch, optarg);
+			break;
 		GETOPT_OPTARG("-n"):
 			if (opt_n != 0)
 				usage();
@@ -110,9 +145,9 @@ main(int argc, char * argv[])
 			free(sas);
 			break;
 		GETOPT_OPTARG("-t"):
-			if (opt_t != NULL)
-				usage();
-			if ((opt_t = strdup(optarg)) == NULL)
+			if ((t = strdup(optarg)) == NULL)
+				OPT_EPARSE(ch, optarg);
+			if (strlist_append(opt_t, &t, 1))
 				OPT_EPARSE(ch, optarg);
 			break;
 		GETOPT_OPT("--version"):
@@ -137,30 +172,68 @@ main(int argc, char * argv[])
 	/* Sanity-check options. */
 	if ((opt_s_size = addrlist_getsize(opt_s)) == 0)
 		usage();
-	if (opt_t == NULL)
+	if ((opt_t_size = strlist_getsize(opt_t)) == 0)
+		usage();
+
+	/* Each target after the first needs a split key. */
+	if (keylist_getsize(opt_k) != opt_t_size - 1) {
+		warn0("Need one -k option between each pair of -t options");
 		usage();
+	}
+	for (i = 1; i < keylist_getsize(opt_k); i++) {
+		if (kvldskey_cmp(*keylist_get(opt_k, i - 1),
+		    *keylist_get(opt_k, i)) >= 0) {
+			warn0("Split keys must be in increasing order");
+			usage();
+		}
+	}
 
-	/* Resolve target address. */
-	if ((sas = sock_resolve(opt_t)) == NULL) {
-		warnp("Error resolving socket address: %s", opt_t);
+	/* Allocate arrays of target sockets and request queues. */
+	if ((socks_t = malloc(opt_t_size * sizeof(int))) == NULL) {
+		warnp("malloc");
 		exit(1);
 	}
-	if (sas[0] == NULL) {
-		warn0("No addresses found for %s", opt_t);
+	if ((Qs_t = malloc(opt_t_size *
+	    sizeof(struct wire_requestqueue *))) == NULL) {
+		warnp("malloc");
 		exit(1);
 	}
 
-	/* Connect to the target. */
-	if ((sock_t = sock_connect(sas)) == -1)
-		exit(1);
+	/* Connect to each of the targets. */
+	for (i = 0; i < opt_t_size; i++) {
+		t = *strlist_get(opt_t, i);
 
-	/* Free the target address(es). */
-	sock_addr_freelist(sas);
+		/* Resolve target address. */
+		if ((sas = sock_resolve(t)) == NULL) {
+			warnp("Error resolving socket address: %s", t);
+			exit(1);
+		}
+		if (sas[0] == NULL) {
+			warn0("No addresses found for %s", t);
+			exit(1);
+		}
 
-	/* Create a queue of requests to the target. */
-	if ((Q_t = wire_requestqueue_init(sock_t)) == NULL) {
-		warnp("Cannot create request queue");
-		exit(1);
+		/* Connect to the target. */
+		if ((socks_t[i] = sock_connect(sas)) == -1)
+			exit(1);
+
+		/* Free the target address(es). */
+		sock_addr_freelist(sas);
+
+		/* Create a queue of requests to the target. */
+		if ((Qs_t[i] = wire_requestqueue_init(socks_t[i])) == NULL) {
+			warnp("Cannot create request queue");
+			exit(1);
+		}
+	}
+
+	/* With more than one target, route requests by key. */
+	if (opt_t_size > 1) {
+		if ((RT = router_init(Qs_t, opt_t_size,
+		    keylist_get(opt_k, 0))) == NULL) {
+			warnp("Failed to initialize router");
+			exit(1);
+		}
 	}
 
 	/* Allocate array of source sockets. */
@@ -178,7 +251,8 @@ main(int argc, char * argv[])
 
 	/* Initialize the dispatcher. */
 	if ((dstate = dispatch_init(socks_s, opt_s_size,
-	    Q_t, opt_n ? opt_n : SIZE_MAX)) == NULL) {
+	    (RT == NULL) ? Qs_t[0] : NULL, RT,
+	    opt_n ? opt_n : SIZE_MAX)) == NULL) {
 		warnp("Failed to initialize dispatcher");
 		exit(1);
 	}
@@ -206,9 +280,15 @@ main(int argc, char * argv[])
 	/* Clean up the dispatcher. */
 	dispatch_done(dstate);
 
-	/* Shut down the request queue. */
-	wire_requestqueue_destroy(Q_t);
-	wire_requestqueue_free(Q_t);
+	/* Clean up the router. */
+	router_free(RT);
+
+	/* Shut down the request queues. */
+	for (i = 0; i < opt_t_size; i++) {
+		wire_requestqueue_destroy(Qs_t[i]);
+		wire_requestqueue_free(Qs_t[i]);
+	}
+	free(Qs_t);
 
 	/* Close sockets. */
 	for (i = 0; i < opt_s_size; i++) {
@@ -216,18 +296,28 @@ main(int argc, char * argv[])
 			warnp("close");
 	}
 	free(socks_s);
-	if (close(sock_t))
-		warnp("close");
+	for (i = 0; i < opt_t_size; i++) {
+		if (close(socks_t[i]))
+			warnp("close");
+	}
+	free(socks_t);
 
 	/* Free source socket addresses. */
 	for (i = 0; i < addrlist_getsize(opt_s); i++)
 		sock_addr_free(*addrlist_get(opt_s, i));
 	addrlist_free(opt_s);
 
+	/* Free split keys. */
+	for (i = 0; i < keylist_getsize(opt_k); i++)
+		kvldskey_free(*keylist_get(opt_k, i));
+	keylist_free(opt_k);
+
 	/* Free option strings. */
 	free(opt_p);
 	free(opt_s_1);
-	free(opt_t);
+	for (i = 0; i < opt_t_size; i++)
+		free(*strlist_get(opt_t, i));
+	strlist_free(opt_t);
 
 	/* Success! */
 	return (0);
@@ -0,0 +1,665 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvldskey.h"
+#include "proto_kvlds.h"
+#include "sysendian.h"
+#include "wire.h"
+
+#include "router.h"
+
+/*
+ * Maximum serialized size of a key-value pair.  A RANGE request only moves
+ * on to the next shard if this much of its size budget remains, since a
+ * shard returns at least one pair even if it exceeds the budget.
+ */
+#define PAIR_MAX	(2 * 256)
+
+/* Router state. */
+struct router {
+	struct wire_requestqueue ** Qs;		/* Connected to shards. */
+	size_t nshards;				/* # shards. */
+	struct kvldskey ** splits;		/* First key of shards 1... */
+};
+
+/* A request forwarded unchanged to a single shard. */
+struct fwd_cookie {
+	struct netbuf_write * WQ;		/* Write responses here... */
+	uint64_t ID;				/* ... with this ID. */
+	int (* callback)(void *, int);
+	void * cookie;
+};
+
+/* A RANGE request which may span several shards. */
+struct range_cookie {
+	struct router * RT;
+	struct netbuf_write * WQ;		/* Write responses here... */
+	uint64_t ID;				/* ... with this ID. */
+	int (* callback)(void *, int);
+	void * cookie;
+	struct kvldskey * end;			/* End of requested range. */
+	size_t shard;				/* Shard being read. */
+	size_t max;				/* Maximum total pair size. */
+	size_t len;				/* Total pair size so far. */
+	size_t nkeys;				/* # pairs so far. */
+	struct kvldskey ** keys;		/* Keys so far. */
+	struct kvldskey ** values;		/* Values so far. */
+};
+
+/* A PARAMS or STATS request sent to every shard. */
+struct fanout_cookie {
+	struct netbuf_write * WQ;		/* Write responses here... */
+	uint64_t ID;				/* ... with this ID. */
+	uint32_t type;				/* PARAMS or STATS. */
+	int (* callback)(void *, int);
+	void * cookie;
+	size_t nleft;				/* # shards yet to respond. */
+	int failed;				/* A shard request failed. */
+	size_t kmax;				/* Smallest kmax seen. */
+	size_t vmax;				/* Smallest vmax seen. */
+	size_t nstats;				/* # distinct counters. */
+	char ** names;				/* Counter names. */
+	uint64_t * values;			/* Combined counter values. */
+};
+
+/* Return the shard holding the key ${key}. */
+static size_t
+findshard(struct router * RT, const struct kvldskey * key)
+{
+	size_t lo = 0;
+	size_t hi = RT->nshards - 1;
+	size_t mid;
+
+	/* Find the first split key which is greater than ${key}. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (kvldskey_cmp(key, RT->splits[mid]) < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	/* The shard with that index holds the key. */
+	return (lo);
+}
+
+/* Return the serialized key at ${buf}[${pos}], or NULL if it doesn't fit. */
+static const struct kvldskey *
+getkey(const uint8_t * buf, size_t buflen, size_t pos)
+{
+
+	if ((pos >= buflen) || (buf[pos] > buflen - pos - 1))
+		return (NULL);
+	return ((const struct kvldskey *)(const void *)&buf[pos]);
+}
+
+static int
+callback_forward(void * cookie, uint8_t * resbuf, size_t resbuflen)
+{
+	struct fwd_cookie * C = cookie;
+	struct wire_packet P;
+	int failed = 1;
+	int rc;
+
+	/* Send the response back to the client. */
+	if (resbuf != NULL) {
+		P.ID = C->ID;
+		P.buf = resbuf;
+		P.len = resbuflen;
+		if (wire_writepacket(C->WQ, &P))
+			goto err1;
+		failed = 0;
+	}
+
+	/* We're done with this request. */
+	rc = (C->callback)(C->cookie, failed);
+
+	/* Free the cookie. */
+	free(C);
+
+	/* Return status from callback. */
+	return (rc);
+
+err1:
+	free(C);
+
+	/* Failure! */
+	return (-1);
+}
+
+/* Forward the request ${buf} unchanged to shard ${shard}. */
+static int
+forward(struct router * RT, size_t shard, uint8_t * buf, size_t buflen,
+    uint64_t ID, struct netbuf_write * WQ, int (* callback)(void *, int),
+    void * cookie)
+{
+	struct fwd_cookie * C;
+
+	/* Bake a cookie. */
+	if ((C = malloc(sizeof(struct fwd_cookie))) == NULL)
+		goto err0;
+	C->WQ = WQ;
+	C->ID = ID;
+	C->callback = callback;
+	C->cookie = cookie;
+
+	/* Send the request to the shard. */
+	if (wire_requestqueue_add(RT->Qs[shard], buf, buflen,
+	    callback_forward, C))
+		goto err1;
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(C);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int callback_range(void *, int, size_t, struct kvldskey *,
+    struct kvldskey **, struct kvldskey **);
+
+/* Send the part of the RANGE ${C} which starts at ${start}. */
+static int
+range_send(struct range_cookie * C, const struct kvldskey * start)
+{
+	struct router * RT = C->RT;
+	const struct kvldskey * end = C->end;
+
+	/* Don't read past the end of this shard. */
+	if ((C->shard < RT->nshards - 1) && ((end->len == 0) ||
+	    (kvldskey_cmp(RT->splits[C->shard], end) < 0)))
+		end = RT->splits[C->shard];
+
+	/* Ask the shard for as much as we still have room for. */
+	return (proto_kvlds_request_range(RT->Qs[C->shard], start, end,
+	    C->max - C->len, callback_range, C));
+}
+
+/* Free the RANGE cookie ${C} and any pairs in it. */
+static void
+range_free(struct range_cookie * C)
+{
+	size_t i;
+
+	for (i = 0; i < C->nkeys; i++) {
+		kvldskey_free(C->keys[i]);
+		kvldskey_free(C->values[i]);
+	}
+	free(C->keys);
+	free(C->values);
+	kvldskey_free(C->end);
+	free(C);
+}
+
+/* Append ${nkeys} pairs to the RANGE ${C}, taking ownership of them. */
+static int
+range_append(struct range_cookie * C, size_t nkeys, struct kvldskey ** keys,
+    struct kvldskey ** values)
+{
+	struct kvldskey ** p;
+	size_t i;
+
+	/* Record the size of the new pairs. */
+	for (i = 0; i < nkeys; i++) {
+		C->len += kvldskey_serial_size(keys[i]);
+		C->len += kvldskey_serial_size(values[i]);
+	}
+
+	/* If we have no pairs yet, take the arrays as they are. */
+	if (C->nkeys == 0) {
+		free(C->keys);
+		free(C->values);
+		C->keys = keys;
+		C->values = values;
+		C->nkeys = nkeys;
+		return (0);
+	}
+
+	/* Otherwise, add the pairs to the ends of our arrays. */
+	if (nkeys > SIZE_MAX / sizeof(struct kvldskey *) - C->nkeys) {
+		errno = ENOMEM;
+		goto err1;
+	}
+	if ((p = realloc(C->keys,
+	    (C->nkeys + nkeys) * sizeof(struct kvldskey *))) == NULL)
+		goto err1;
+	C->keys = p;
+	if ((p = realloc(C->values,
+	    (C->nkeys + nkeys) * sizeof(struct kvldskey *))) == NULL)
+		goto err1;
+	C->values = p;
+	memcpy(&C->keys[C->nkeys], keys, nkeys * sizeof(struct kvldskey *));
+	memcpy(&C->values[C->nkeys], values,
+	    nkeys * sizeof(struct kvldskey *));
+	C->nkeys += nkeys;
+	free(keys);
+	free(values);
+
+	/* Success! */
+	return (0);
+
+err1:
+	for (i = 0; i < nkeys; i++) {
+		kvldskey_free(keys[i]);
+		kvldskey_free(values[i]);
+	}
+	free(keys);
+	free(values);
+
+	/* Failure! */
+	return (-1);
+}
+
+static int
+callback_range(void * cookie, int failed, size_t nkeys,
+    struct kvldskey * next, struct kvldskey ** keys,
+    struct kvldskey ** values)
+{
+	struct range_cookie * C = cookie;
+	struct router * RT = C->RT;
+	int rc;
+
+	/* If the request failed, we have nothing to send back. */
+	if (failed)
+		goto done;
+
+	/* Add the pairs to those we already have. */
+	if (range_append(C, nkeys, keys, values))
+		goto err1;
+
+	/*
+	 * If this shard is exhausted, the range continues into the next one,
+	 * and we still have room for at least one pair, move on.
+	 */
+	if ((C->shard < RT->nshards - 1) &&
+	    (kvldskey_cmp(next, RT->splits[C->shard]) == 0) &&
+	    ((C->end->len == 0) || (kvldskey_cmp(next, C->end) < 0)) &&
+	    (C->len <= C->max) && (C->max - C->len >= PAIR_MAX)) {
+		C->shard++;
+		rc = range_send(C, next);
+		kvldskey_free(next);
+		if (rc)
+			goto err0;
+		return (0);
+	}
+
+	/* Send the pairs back to the client. */
+	if (proto_kvlds_response_range(C->WQ, C->ID, C->nkeys, next,
+	    C->keys, C->values))
+		goto err1;
+	kvldskey_free(next);
+
+done:
+	/* We're done with this request. */
+	rc = (C->callback)(C->cookie, failed);
+
+	/* Free the cookie. */
+	range_free(C);
+
+	/* Return status from callback. */
+	return (rc);
+
+err1:
+	kvldskey_free(next);
+err0:
+	range_free(C);
+
+	/* Failure! */
+	return (-1);
+}
+
+/* Handle a RANGE request for [${start}, ${end}) returning up to ${max}. */
+static int
+range(struct router * RT, size_t max, const struct kvldskey * start,
+    const struct kvldskey * end, uint64_t ID, struct netbuf_write * WQ,
+    int (* callback)(void *, int), void * cookie)
+{
+	struct range_cookie * C;
+
+	/* Bake a cookie. */
+	if ((C = malloc(sizeof(struct range_cookie))) == NULL)
+		goto err0;
+	C->RT = RT;
+	C->WQ = WQ;
+	C->ID = ID;
+	C->callback = callback;
+	C->cookie = cookie;
+	C->shard = findshard(RT, start);
+	C->max = max;
+	C->len = 0;
+	C->nkeys = 0;
+	C->keys = NULL;
+	C->values = NULL;
+
+	/* The request buffer will go away, so keep a copy of the end key. */
+	if ((C->end = kvldskey_dup(end)) == NULL)
+		goto err1;
+
+	/* Read from the shard holding the start of the range. */
+	if (range_send(C, start))
+		goto err2;
+
+	/* Success! */
+	return (0);
+
+err2:
+	kvldskey_free(C->end);
+err1:
+	free(C);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * STATS counters which measure a current level (a size or a queue length)
+ * rather than counting events.  We report the largest value seen on any
+ * shard for these; adding them up would give meaningless numbers (e.g., a
+ * height of 6 for two trees of height 3).  All other counters are summed.
+ */
+static const char * const stats_levels[] = {
+	"pool.size",
+	"pool.used",
+	"pool.bytes",
+	"tree.height",
+	"cleaner.debt",
+	"nmr.queued",
+	NULL
+};
+
+/* Return non-zero if the STATS counter ${name} measures a level. */
+static int
+stats_islevel(const char * name)
+{
+	size_t i;
+
+	for (i = 0; stats_levels[i] != NULL; i++) {
+		if (strcmp(name, stats_levels[i]) == 0)
+			return (1);
+	}
+	return (0);
+}
+
+/* Send the combined response to the PARAMS or STATS request ${C}. */
+static int
+fanout_respond(struct fanout_cookie * C)
+{
+
+	if (C->type == PROTO_KVLDS_PARAMS)
+		return (proto_kvlds_response_params(C->WQ, C->ID,
+		    (uint32_t)C->kmax, (uint32_t)C->vmax));
+	else
+		return (proto_kvlds_response_stats(C->WQ, C->ID, C->nstats,
+		    (const char * const *)C->names, C->values));
+}
+
+/*
+ * A shard has responded to the PARAMS or STATS request ${C}, or failed to if
+ * ${failed} is non-zero.  Once every shard has responded, send the combined
+ * response (unless anything failed) and finish the request.
+ */
+static int
+fanout_done(struct fanout_cookie * C, int failed)
+{
+	size_t i;
+	int rc;
+
+	/* Record a failure. */
+	if (failed)
+		C->failed = 1;
+
+	/* Wait until every shard has responded. */
+	if (--C->nleft > 0)
+		return (0);
+
+	/* Send the combined response. */
+	if (!C->failed && fanout_respond(C))
+		C->failed = 1;
+
+	/* We're done with this request. */
+	rc = (C->callback)(C->cookie, C->failed);
+
+	/* Free the cookie. */
+	for (i = 0; i < C->nstats; i++)
+		free(C->names[i]);
+	free(C->names);
+	free(C->values);
+	free(C);
+
+	/* Return status from callback. */
+	return (rc);
+}
+
+static int
+callback_params(void * cookie, int failed, size_t kmax, size_t vmax)
+{
+	struct fanout_cookie * C = cookie;
+
+	/* Keys and values must fit into every shard. */
+	if (!failed) {
+		if (kmax < C->kmax)
+			C->kmax = kmax;
+		if (vmax < C->vmax)
+			C->vmax = vmax;
+	}
+
+	/* This shard is done. */
+	return (fanout_done(C, failed));
+}
+
+static int
+callback_stats(void * cookie, int failed, size_t nstats,
+    const char * const * names, const uint64_t * values)
+{
+	struct fanout_cookie * C = cookie;
+	char ** p;
+	uint64_t * v;
+	size_t i, j;
+
+	/* If the request failed, we have nothing to add. */
+	if (failed)
+		goto done;
+
+	/* Combine each counter with the one with the same name. */
+	for (i = 0; i < nstats; i++) {
+		for (j = 0; j < C->nstats; j++) {
+			if (strcmp(C->names[j], names[i]) == 0)
+				break;
+		}
+
+		/* Add a new counter if we haven't seen this one before. */
+		if (j == C->nstats) {
+			if ((p = realloc(C->names,
+			    (C->nstats + 1) * sizeof(char *))) == NULL)
+				goto fail;
+			C->names = p;
+			if ((v = realloc(C->values,
+			    (C->nstats + 1) * sizeof(uint64_t))) == NULL)
+				goto fail;
+			C->values = v;
+			if ((C->names[j] = strdup(names[i])) == NULL)
+				goto fail;
+			C->values[j] = 0;
+			C->nstats++;
+		}
+
+		/* Take the largest level, or add up events. */
+		if (stats_islevel(names[i])) {
+			if (values[i] > C->values[j])
+				C->values[j] = values[i];
+		} else {
+			C->values[j] += values[i];
+		}
+	}
+
+done:
+	/* This shard is done. */
+	return (fanout_done(C, failed));
+
+fail:
+	/* We can't combine the responses; fail the request. */
+	return (fanout_done(C, 1));
+}
+
+/* Send a PARAMS or STATS request to every shard. */
+static int
+fanout(struct router * RT, uint32_t type, uint64_t ID,
+    struct netbuf_write * WQ, int (* callback)(void *, int), void * cookie)
+{
+	struct fanout_cookie * C;
+	size_t i;
+
+	/* Bake a cookie. */
+	if ((C = malloc(sizeof(struct fanout_cookie))) == NULL)
+		goto err0;
+	C->WQ = WQ;
+	C->ID = ID;
+	C->type = type;
+	C->callback = callback;
+	C->cookie = cookie;
+	C->nleft = RT->nshards;
+	C->failed = 0;
+	C->kmax = SIZE_MAX;
+	C->vmax = SIZE_MAX;
+	C->nstats = 0;
+	C->names = NULL;
+	C->values = NULL;
+
+	/* Send the request to every shard. */
+	for (i = 0; i < RT->nshards; i++) {
+		if (type == PROTO_KVLDS_PARAMS) {
+			if (proto_kvlds_request_params(RT->Qs[i],
+			    callback_params, C))
+				goto err1;
+		} else {
+			if (proto_kvlds_request_stats(RT->Qs[i],
+			    callback_stats, C))
+				goto err1;
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	/*
+	 * If some requests are in flight, their callbacks still need the
+	 * cookie; wait for only those, and then report the request as failed.
+	 */
+	if (i > 0) {
+		C->nleft = i;
+		C->failed = 1;
+		return (0);
+	}
+	free(C);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * router_init(Qs, nshards, splits):
+ * Create a router which shards the KVLDS keyspace across the ${nshards}
+ * request queues ${Qs[0]} ... ${Qs[nshards - 1]}, with shard i holding the
+ * keys k where ${splits[i - 1]} <= k < ${splits[i]}.  The ${nshards} - 1
+ * split keys must be in strictly increasing order.  The router does not
+ * take ownership of the queues or the split keys.
+ */
+struct router *
+router_init(struct wire_requestqueue ** Qs, size_t nshards,
+    struct kvldskey ** splits)
+{
+	struct router * RT;
+
+	/* Bake a cookie. */
+	if ((RT = malloc(sizeof(struct router))) == NULL)
+		goto err0;
+	RT->Qs = Qs;
+	RT->nshards = nshards;
+	RT->splits = splits;
+
+	/* Success! */
+	return (RT);
+
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * router_request(RT, buf, buflen, ID, WQ, callback, cookie):
+ * Route the KVLDS request packet ${buf} of length ${buflen} with ID ${ID}
+ * via the router ${RT}, and write the response to the write queue ${WQ}.
+ * GET and modifying requests are forwarded to the shard holding their key;
+ * RANGE requests are stitched together from as many shards as they span;
+ * and PARAMS and STATS requests are sent to every shard and the responses
+ * combined.  Requests which cannot be parsed are forwarded to the first
+ * shard.  Invoke ${callback}(${cookie}, failed) when the request is done,
+ * where failed is non-zero if a request to a shard failed.  The buffer
+ * ${buf} is not needed after this function returns.
+ */
+int
+router_request(struct router * RT, uint8_t * buf, size_t buflen, uint64_t ID,
+    struct netbuf_write * WQ, int (* callback)(void *, int), void * cookie)
+{
+	const struct kvldskey * key;
+	const struct kvldskey * end;
+	size_t shard = 0;
+
+	/* Anything too short to have a type goes to the first shard. */
+	if (buflen < 4)
+		goto forward;
+
+	/* Figure out where the request needs to go. */
+	switch (be32dec(&buf[0])) {
+	case PROTO_KVLDS_PARAMS:
+	case PROTO_KVLDS_STATS:
+		if (buflen != 4)
+			break;
+		return (fanout(RT, be32dec(&buf[0]), ID, WQ, callback,
+		    cookie));
+	case PROTO_KVLDS_RANGE:
+		if (((key = getkey(buf, buflen, 8)) == NULL) ||
+		    ((end = getkey(buf, buflen, 9 + key->len)) == NULL) ||
+		    (buflen != 10 + (size_t)key->len + end->len))
+			break;
+		return (range(RT, be32dec(&buf[4]), key, end, ID, WQ,
+		    callback, cookie));
+	case PROTO_KVLDS_SET:
+	case PROTO_KVLDS_CAS:
+	case PROTO_KVLDS_ADD:
+	case PROTO_KVLDS_MODIFY:
+	case PROTO_KVLDS_DELETE:
+	case PROTO_KVLDS_CAD:
+	case PROTO_KVLDS_GET:
+		/* The key always comes first. */
+		if ((key = getkey(buf, buflen, 4)) != NULL)
+			shard = findshard(RT, key);
+		break;
+	}
+
+forward:
+	/* Send the request, unchanged, to a single shard. */
+	return (forward(RT, shard, buf, buflen, ID, WQ, callback, cookie));
+}
+
+/**
+ * router_free(RT):
+ * Free the router ${RT}.
+ */
+void
+router_free(struct router * RT)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (RT == NULL)
+		return;
+
+	/* Free the router state. */
+	free(RT);
+}
@@ -0,0 +1,45 @@
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opaque types. */
+struct kvldskey;
+struct netbuf_write;
+struct router;
+struct wire_requestqueue;
+
+/**
+ * router_init(Qs, nshards, splits):
+ * Create a router which shards the KVLDS keyspace across the ${nshards}
+ * request queues ${Qs[0]} ... ${Qs[nshards - 1]}, with shard i holding the
+ * keys k where ${splits[i - 1]} <= k < ${splits[i]}.  The ${nshards} - 1
+ * split keys must be in strictly increasing order.  The router does not
+ * take ownership of the queues or the split keys.
+ */
+struct router * router_init(struct wire_requestqueue **, size_t,
+    struct kvldskey **);
+
+/**
+ * router_request(RT, buf, buflen, ID, WQ, callback, cookie):
+ * Route the KVLDS request packet ${buf} of length ${buflen} with ID ${ID}
+ * via the router ${RT}, and write the response to the write queue ${WQ}.
+ * GET and modifying requests are forwarded to the shard holding their key;
+ * RANGE requests are stitched together from as many shards as they span;
+ * and PARAMS and STATS requests are sent to every shard and the responses
+ * combined.  Requests which cannot be parsed are forwarded to the first
+ * shard.  Invoke ${callback}(${cookie}, failed) when the request is done,
+ * where failed is non-zero if a request to a shard failed.  The buffer
+ * ${buf} is not needed after this function returns.
+ */
+int router_request(struct router *, uint8_t *, size_t, uint64_t,
+    struct netbuf_write *, int (*)(void *, int), void *);
+
+/**
+ * router_free(RT):
+ * Free the router ${RT}.
+ */
+void router_free(struct router *);
+
+#endif /* !ROUTER_H_ */
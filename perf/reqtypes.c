@@ -39,6 +39,7 @@ reqtypes_lookup(uint32_t id)
 	PROTO(LBS_GET);
 	PROTO(LBS_APPEND);
 	PROTO(LBS_FREE);
+	PROTO(LBS_FREERANGE);
 	PROTO(S3_PUT);
 	PROTO(S3_GET);
 	PROTO(S3_RANGE);
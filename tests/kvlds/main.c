@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "events.h"
 #include "kivaloo.h"
@@ -16,6 +17,11 @@ static int op_failed = 0;
 static int op_p = 0;
 static int op_badval = 0;
 static size_t op_count = 0;
+static uint64_t op_nnodes = 0;
+static uint64_t op_stat = 0;
+static int op_statfound = 0;
+static uint64_t order_nset = 0;
+static uint64_t order_nseen = 0;
 
 static int
 callback_params(void * cookie, int failed, size_t kmax, size_t vmax)
@@ -36,6 +42,191 @@ callback_params(void * cookie, int failed, size_t kmax, size_t vmax)
 	return (0);
 }
 
+static int
+callback_stats(void * cookie, int failed, size_t nstats,
+    const char * const * names, const uint64_t * values)
+{
+	uint64_t budget = 0;
+	uint64_t peak = 0;
+	size_t i;
+
+	(void)cookie; /* UNUSED */
+
+	/* Did we fail? */
+	if (failed)
+		op_failed = 1;
+
+	/* We must have written pages and committed some batches. */
+	for (i = 0; i < nstats; i++) {
+		if (strcmp(names[i], "pool.budget") == 0)
+			budget = values[i];
+		if (strcmp(names[i], "pool.peak") == 0)
+			peak = values[i];
+		if ((strcmp(names[i], "tree.nnodes") == 0) &&
+		    (values[i] == 0))
+			op_badval = 1;
+		if ((strcmp(names[i], "lbs.bytesappended") == 0) &&
+		    (values[i] == 0))
+			op_badval = 1;
+		if (strncmp(names[i], "mr.batches.", 11) == 0)
+			op_count += values[i];
+	}
+
+	/* The page pool must have stayed within its size in bytes. */
+	if ((budget > 0) && (peak > budget))
+		op_badval = 1;
+
+	/* We're done! */
+	op_done = 1;
+
+	/* Success! */
+	return (0);
+}
+
+static int
+callback_nnodes(void * cookie, int failed, size_t nstats,
+    const char * const * names, const uint64_t * values)
+{
+	size_t i;
+
+	(void)cookie; /* UNUSED */
+
+	/* Did we fail? */
+	if (failed)
+		op_failed = 1;
+
+	/* Record the number of nodes in the tree. */
+	for (i = 0; i < nstats; i++) {
+		if (strcmp(names[i], "tree.nnodes") == 0)
+			op_nnodes = values[i];
+	}
+
+	/* We're done! */
+	op_done = 1;
+
+	/* Success! */
+	return (0);
+}
+
+static int
+callback_getstat(void * cookie, int failed, size_t nstats,
+    const char * const * names, const uint64_t * values)
+{
+	const char * name = cookie;
+	size_t i;
+
+	/* Did we fail? */
+	if (failed)
+		op_failed = 1;
+
+	/* Find the counter we want. */
+	for (i = 0; i < nstats; i++) {
+		if (strcmp(names[i], name) == 0) {
+			op_stat = values[i];
+			op_statfound = 1;
+		}
+	}
+
+	/* We're done! */
+	op_done = 1;
+
+	/* Success! */
+	return (0);
+}
+
+static int
+callback_printstats(void * cookie, int failed, size_t nstats,
+    const char * const * names, const uint64_t * values)
+{
+	size_t i;
+
+	(void)cookie; /* UNUSED */
+
+	/* Did we fail? */
+	if (failed)
+		op_failed = 1;
+
+	/* Print the counters. */
+	for (i = 0; i < nstats; i++)
+		printf("%s %ju\n", names[i], (uintmax_t)values[i]);
+
+	/* We're done! */
+	op_done = 1;
+
+	/* Success! */
+	return (0);
+}
+
+static int
+callback_order_set(void * cookie, int failed)
+{
+	uint64_t i = (uint64_t)(uintptr_t)cookie;
+
+	/* Did we fail? */
+	if (failed) {
+		op_failed = 1;
+		op_done = 1;
+	}
+
+	/* SETs must complete in the order they were sent. */
+	if (i != order_nset)
+		op_badval = 1;
+	order_nset += 1;
+
+	/* Decrement the counter. */
+	op_count -= 1;
+
+	/* Are we done? */
+	if (op_count == 0)
+		op_done = 1;
+
+	/* Success! */
+	return (0);
+}
+
+static int
+callback_order_get(void * cookie, int failed, struct kvldskey * value)
+{
+	uint64_t i;
+
+	(void)cookie; /* UNUSED */
+
+	/* Did we fail? */
+	if (failed) {
+		op_failed = 1;
+		op_done = 1;
+	}
+
+	/*
+	 * We must only see values whose SETs have completed, and must never
+	 * see an older value than one we have already seen.
+	 */
+	if (failed == 0) {
+		if (value == NULL) {
+			if (order_nset > 0)
+				op_badval = 1;
+		} else if (value->len != 8) {
+			op_badval = 1;
+		} else {
+			i = be64dec(value->buf);
+			if ((i >= order_nset) || (i + 1 < order_nseen))
+				op_badval = 1;
+			order_nseen = i + 1;
+		}
+		kvldskey_free(value);
+	}
+
+	/* Decrement the counter. */
+	op_count -= 1;
+
+	/* Are we done? */
+	if (op_count == 0)
+		op_done = 1;
+
+	/* Success! */
+	return (0);
+}
+
 static int
 callback_done(void * cookie, int failed)
 {
@@ -394,6 +585,130 @@ err0:
 	return (-1);
 }
 
+static int
+dostats(struct wire_requestqueue * Q)
+{
+
+	/* Send the request. */
+	op_done = 0;
+	op_badval = 0;
+	op_count = 0;
+	if (proto_kvlds_request_stats(Q, callback_stats, NULL)) {
+		warnp("Error sending STATS request");
+		goto err0;
+	}
+
+	/* Wait for it to finish. */
+	if (events_spin(&op_done) || op_failed) {
+		warnp("STATS request failed");
+		goto err0;
+	}
+
+	/* Check that the counters are plausible. */
+	if (op_badval || (op_count == 0)) {
+		warn0("STATS counters are implausible");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+getnnodes(struct wire_requestqueue * Q, uint64_t * nnodes)
+{
+
+	/* Send the request. */
+	op_done = 0;
+	op_nnodes = 0;
+	if (proto_kvlds_request_stats(Q, callback_nnodes, NULL)) {
+		warnp("Error sending STATS request");
+		goto err0;
+	}
+
+	/* Wait for it to finish. */
+	if (events_spin(&op_done) || op_failed) {
+		warnp("STATS request failed");
+		goto err0;
+	}
+
+	/* Every tree has at least one node. */
+	if (op_nnodes == 0) {
+		warn0("STATS did not report tree.nnodes");
+		goto err0;
+	}
+	*nnodes = op_nnodes;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+getstat(struct wire_requestqueue * Q, const char * name, uint64_t * value)
+{
+
+	/* Send the request. */
+	op_done = 0;
+	op_statfound = 0;
+	if (proto_kvlds_request_stats(Q, callback_getstat, (void *)name)) {
+		warnp("Error sending STATS request");
+		goto err0;
+	}
+
+	/* Wait for it to finish. */
+	if (events_spin(&op_done) || op_failed) {
+		warnp("STATS request failed");
+		goto err0;
+	}
+
+	/* Did we get the counter? */
+	if (op_statfound == 0) {
+		warn0("STATS did not report %s", name);
+		goto err0;
+	}
+	*value = op_stat;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+printstats(struct wire_requestqueue * Q)
+{
+
+	/* Send the request. */
+	op_done = 0;
+	if (proto_kvlds_request_stats(Q, callback_printstats, NULL)) {
+		warnp("Error sending STATS request");
+		goto err0;
+	}
+
+	/* Wait for it to finish. */
+	if (events_spin(&op_done) || op_failed) {
+		warnp("STATS request failed");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 static int
 mutate(struct wire_requestqueue * Q)
 {
@@ -593,28 +908,449 @@ err0:
 	return (-1);
 }
 
+/* Create an 8-byte key or value holding the big-endian value ${x}. */
+static struct kvldskey *
+mkkey(uint64_t x)
+{
+	uint8_t buf[8];
+
+	be64enc(buf, x);
+	return (kvldskey_create(buf, 8));
+}
+
+static int
+appendmany(struct wire_requestqueue * Q, size_t N, size_t pagelen)
+{
+	struct kvldskey * key;
+	struct kvldskey * key2;
+	struct kvldskey ** values;
+	uint64_t nnodes0, nnodes;
+	size_t i, k;
+
+	/* Record how big the tree is before we start. */
+	if (getnnodes(Q, &nnodes0))
+		goto err0;
+
+	/* Allocate a value slot for each of 2N keys. */
+	if ((values = calloc(2 * N, sizeof(struct kvldskey *))) == NULL) {
+		warnp("calloc");
+		goto err0;
+	}
+
+	/* Append N key-value pairs in increasing key order. */
+	op_done = 0;
+	op_count = N;
+	for (i = 0; i < N; i++) {
+		if ((values[i] = mkkey(i * i)) == NULL)
+			goto err1;
+		if ((key = mkkey(i)) == NULL)
+			goto err1;
+		if (proto_kvlds_request_set(Q, key, values[i],
+		    callback_done, NULL)) {
+			warnp("Error sending SET request");
+			kvldskey_free(key);
+			goto err1;
+		}
+		kvldskey_free(key);
+	}
+	if (events_spin(&op_done) || op_failed) {
+		warnp("SET request failed");
+		goto err1;
+	}
+
+	/*
+	 * Each pair takes 18 bytes (a length byte plus 8 bytes for each of
+	 * the key and value).  Splitting at 2/3 of a page would leave less
+	 * than 3/4 of a page of pairs per node, since each part is finished
+	 * as soon as it exceeds 2/3 of a page; the right edge of the tree
+	 * should be packed more tightly than that, even if we count the
+	 * parent nodes as if they held pairs too.
+	 */
+	if (getnnodes(Q, &nnodes))
+		goto err1;
+	if ((nnodes <= nnodes0) ||
+	    (N * 18 * 4 <= (nnodes - nnodes0) * pagelen * 3)) {
+		warn0("%zu appended pairs took %ju nodes with %zu-byte pages",
+		    N, (uintmax_t)(nnodes - nnodes0), pagelen);
+		goto err1;
+	}
+
+	/*
+	 * Now SET and DELETE random keys, reaching beyond the appended keys
+	 * so that the packed nodes get split and emptied nodes get merged.
+	 */
+	srandom(0);
+	for (i = 0; i < 2 * N; i++) {
+		k = (size_t)random() % (2 * N);
+		if ((key = mkkey(k)) == NULL)
+			goto err1;
+		kvldskey_free(values[k]);
+		values[k] = NULL;
+		if (random() & 1) {
+			if ((values[k] = mkkey((uint64_t)random())) == NULL)
+				goto err2;
+			if (set(Q, key, values[k]))
+				goto err2;
+		} else {
+			if (delete(Q, key))
+				goto err2;
+		}
+		kvldskey_free(key);
+	}
+
+	/* Read all the values back and check that they are correct. */
+	op_done = 0;
+	op_count = 2 * N;
+	for (i = 0; i < 2 * N; i++) {
+		if ((key = mkkey(i)) == NULL)
+			goto err1;
+		if (proto_kvlds_request_get(Q, key, callback_get, values[i])) {
+			warnp("Error sending GET request");
+			kvldskey_free(key);
+			goto err1;
+		}
+		kvldskey_free(key);
+	}
+	if (events_spin(&op_done) || op_failed) {
+		warnp("GET request failed");
+		goto err1;
+	}
+	if (op_badval) {
+		warn0("Bad value returned by GET!");
+		goto err1;
+	}
+
+	/* Free values. */
+	for (i = 0; i < 2 * N; i++)
+		kvldskey_free(values[i]);
+	free(values);
+
+	/* Delete all the values. */
+	if ((key = mkkey(0)) == NULL)
+		goto err0;
+	if ((key2 = mkkey(2 * N)) == NULL) {
+		kvldskey_free(key);
+		goto err0;
+	}
+	op_done = 0;
+	op_count = 1;
+	if (proto_kvlds_request_range2(Q, key, key2, callback_range,
+	    callback_done, Q)) {
+		kvldskey_free(key2);
+		kvldskey_free(key);
+		goto err0;
+	}
+	kvldskey_free(key2);
+	kvldskey_free(key);
+	if (events_spin(&op_done) || op_failed) {
+		warnp("RANGE or DELETE request failed");
+		goto err0;
+	}
+
+	/* With everything deleted, the tree should have merged back. */
+	if (getnnodes(Q, &nnodes))
+		goto err0;
+	if (nnodes > nnodes0) {
+		warn0("Tree has %ju nodes after deleting all pairs",
+		    (uintmax_t)nnodes);
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err2:
+	kvldskey_free(key);
+err1:
+	for (i = 0; i < 2 * N; i++)
+		kvldskey_free(values[i]);
+	free(values);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Create a 100-byte value for key ${i} as of round ${round}. */
+static struct kvldskey *
+mkvalue(uint64_t i, uint8_t round)
+{
+	uint8_t buf[100];
+
+	memset(buf, round, sizeof(buf));
+	be64enc(buf, i);
+	return (kvldskey_create(buf, sizeof(buf)));
+}
+
+/* SET keys 0 to ${N} - 1 to their values as of round ${round}. */
+static int
+setmany(struct wire_requestqueue * Q, size_t N, uint8_t round)
+{
+	struct kvldskey * key;
+	struct kvldskey * value;
+	size_t i;
+
+	/* Send all the SETs without waiting for them to complete. */
+	op_done = 0;
+	op_count = N;
+	for (i = 0; i < N; i++) {
+		if ((key = mkkey(i)) == NULL)
+			goto err0;
+		if ((value = mkvalue(i, round)) == NULL)
+			goto err1;
+		if (proto_kvlds_request_set(Q, key, value,
+		    callback_done, NULL)) {
+			warnp("Error sending SET request");
+			goto err2;
+		}
+		kvldskey_free(value);
+		kvldskey_free(key);
+	}
+
+	/* Wait for them to complete. */
+	if (events_spin(&op_done) || op_failed) {
+		warnp("SET request failed");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err2:
+	kvldskey_free(value);
+err1:
+	kvldskey_free(key);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+cleaning(struct wire_requestqueue * Q, size_t N)
+{
+	struct kvldskey * key;
+	struct kvldskey * key2;
+	struct kvldskey * value;
+	uint64_t cleaned0, cleaned, npages0, npages, deferring;
+	size_t i;
+	uint8_t round;
+	int t;
+
+	/* Store N pairs, and note how much cleaning has been done. */
+	if (setmany(Q, N, 0))
+		goto err0;
+	if (getstat(Q, "cleaner.cleaned", &cleaned0))
+		goto err0;
+
+	/*
+	 * Repeatedly overwrite the first half of the pairs, so that the
+	 * leaves holding the second half are left behind in old blocks which
+	 * the cleaner must rewrite before the block store can free them;
+	 * between rounds, check that the cleaner is still answering.
+	 */
+	for (round = 1; round <= 5; round++) {
+		if (setmany(Q, N / 2, round))
+			goto err0;
+		if (getstat(Q, "cleaner.cleaned", &cleaned))
+			goto err0;
+	}
+	if (getstat(Q, "tree.npages", &npages0))
+		goto err0;
+
+	/*
+	 * Now that we're idle, the cleaner should stop deferring cleaning,
+	 * clean the old leaves, and allow the old blocks to be freed.
+	 */
+	for (t = 0; t < 60; t++) {
+		sleep(1);
+		if (getstat(Q, "cleaner.deferring", &deferring))
+			goto err0;
+		if (getstat(Q, "cleaner.cleaned", &cleaned))
+			goto err0;
+		if (getstat(Q, "tree.npages", &npages))
+			goto err0;
+		if ((deferring == 0) && (cleaned > cleaned0) &&
+		    (npages < npages0))
+			break;
+	}
+	if (t == 60) {
+		warn0("Cleaner did not free old blocks: deferring = %ju, "
+		    "%ju pages cleaned, %ju -> %ju pages", (uintmax_t)deferring,
+		    (uintmax_t)(cleaned - cleaned0), (uintmax_t)npages0,
+		    (uintmax_t)npages);
+		goto err0;
+	}
+
+	/* Read the values back and check that they are correct. */
+	for (i = 0; i < N; i++) {
+		if ((key = mkkey(i)) == NULL)
+			goto err0;
+		if ((value = mkvalue(i, (i < N / 2) ? 5 : 0)) == NULL)
+			goto err1;
+		if (verify(Q, key, value))
+			goto err2;
+		kvldskey_free(value);
+		kvldskey_free(key);
+	}
+
+	/* Delete all the values. */
+	if ((key = mkkey(0)) == NULL)
+		goto err0;
+	if ((key2 = mkkey(N)) == NULL)
+		goto err1;
+	op_done = 0;
+	op_count = 1;
+	if (proto_kvlds_request_range2(Q, key, key2, callback_range,
+	    callback_done, Q)) {
+		kvldskey_free(key2);
+		goto err1;
+	}
+	kvldskey_free(key2);
+	kvldskey_free(key);
+	if (events_spin(&op_done) || op_failed) {
+		warnp("RANGE or DELETE request failed");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err2:
+	kvldskey_free(value);
+err1:
+	kvldskey_free(key);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+ordered(struct wire_requestqueue * Q, size_t N)
+{
+	struct kvldskey * key;
+	struct kvldskey * value;
+	size_t i;
+
+	/* All of the requests use the same key. */
+	if ((key = kvldskey_create((const uint8_t *)"order", 5)) == NULL)
+		goto err0;
+
+	/*
+	 * Send SETs of increasing values, each followed by a GET, without
+	 * waiting for any of them to complete.
+	 */
+	op_done = 0;
+	op_count = 2 * N;
+	for (i = 0; i < N; i++) {
+		if ((value = mkkey(i)) == NULL)
+			goto err1;
+		if (proto_kvlds_request_set(Q, key, value,
+		    callback_order_set, (void *)(uintptr_t)i)) {
+			warnp("Error sending SET request");
+			kvldskey_free(value);
+			goto err1;
+		}
+		kvldskey_free(value);
+		if (proto_kvlds_request_get(Q, key, callback_order_get,
+		    NULL)) {
+			warnp("Error sending GET request");
+			goto err1;
+		}
+	}
+	if (events_spin(&op_done) || op_failed) {
+		warnp("SET or GET request failed");
+		goto err1;
+	}
+	if (op_badval) {
+		warn0("Responses were not sent in commit order!");
+		goto err1;
+	}
+
+	/* The last value should have stuck. */
+	if ((value = mkkey(N - 1)) == NULL)
+		goto err1;
+	if (verify(Q, key, value)) {
+		kvldskey_free(value);
+		goto err1;
+	}
+	kvldskey_free(value);
+
+	/* Clean up. */
+	if (delete(Q, key))
+		goto err1;
+	kvldskey_free(key);
+
+	/* Success! */
+	return (0);
+
+err1:
+	kvldskey_free(key);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: test_kvlds %s %s\n", "<socketname>",
+	    "[num_pairs]");
+	fprintf(stderr, "       test_kvlds %s %s\n", "<socketname>",
+	    "append <pagelen>");
+	fprintf(stderr, "       test_kvlds %s %s\n", "<socketname>",
+	    "order <num_sets>");
+	fprintf(stderr, "       test_kvlds %s %s\n", "<socketname>",
+	    "clean <num_pairs>");
+	fprintf(stderr, "       test_kvlds %s %s\n", "<socketname>",
+	    "stats");
+	exit(1);
+}
+
 int
 main(int argc, char * argv[])
 {
 	struct wire_requestqueue * Q;
 	struct kivaloo_cookie * K;
 	size_t num_pairs = 40000;
+	size_t pagelen = 0;
+	size_t num_sets = 0;
+	size_t num_clean = 0;
+	int stats = 0;
 
 	WARNP_INIT;
 
-	/* Check number of arguments. */
-	if ((argc != 2) && (argc != 3)) {
-		fprintf(stderr, "usage: test_kvlds %s %s\n", "<socketname>",
-		    "[num_pairs]");
-		exit(1);
-	}
-
-	/* Override the default number of pairs to test. */
-	if (argc == 3) {
+	/* Check number of arguments and figure out what we're testing. */
+	if ((argc < 2) || (argc > 4))
+		usage();
+	if ((argc == 4) && (strcmp(argv[2], "append") == 0)) {
+		/* Test appending pairs to pages of the specified size. */
+		if (PARSENUM(&pagelen, argv[3], 1, SIZE_MAX)) {
+			warnp("PARSENUM");
+			exit(1);
+		}
+	} else if ((argc == 4) && (strcmp(argv[2], "order") == 0)) {
+		/* Test the order in which responses are sent. */
+		if (PARSENUM(&num_sets, argv[3], 1, SIZE_MAX)) {
+			warnp("PARSENUM");
+			exit(1);
+		}
+	} else if ((argc == 4) && (strcmp(argv[2], "clean") == 0)) {
+		/* Test background cleaning under load. */
+		if (PARSENUM(&num_clean, argv[3], 2, SIZE_MAX)) {
+			warnp("PARSENUM");
+			exit(1);
+		}
+	} else if ((argc == 3) && (strcmp(argv[2], "stats") == 0)) {
+		/* Print the server's counters. */
+		stats = 1;
+	} else if (argc == 3) {
+		/* Override the default number of pairs to test. */
 		if (PARSENUM(&num_pairs, argv[2])) {
 			warnp("PARSENUM");
 			exit(1);
 		}
+	} else if (argc == 4) {
+		usage();
 	}
 
 	/* Open a connection to KVLDS. */
@@ -627,13 +1363,39 @@ main(int argc, char * argv[])
 	if (doparams(Q))
 		goto err1;
 
-	/* Test B+Tree mutation code paths. */
-	if (mutate(Q))
-		goto err1;
+	if (stats) {
+		/* Print the server's counters. */
+		if (printstats(Q))
+			goto err1;
+	} else if (num_sets > 0) {
+		/* Test that responses follow commit order. */
+		if (ordered(Q, num_sets))
+			goto err1;
 
-	/* Test creating key-value pairs and reading them back. */
-	if (createmany(Q, num_pairs))
-		goto err1;
+		/* Print the counters for the batches we launched. */
+		if (printstats(Q))
+			goto err1;
+	} else if (num_clean > 0) {
+		/* Test that the cleaner frees old blocks once we're idle. */
+		if (cleaning(Q, num_clean))
+			goto err1;
+	} else if (pagelen > 0) {
+		/* Test packing appended pairs, then random SETs and DELETEs. */
+		if (appendmany(Q, 5000, pagelen))
+			goto err1;
+	} else {
+		/* Test B+Tree mutation code paths. */
+		if (mutate(Q))
+			goto err1;
+
+		/* Test creating key-value pairs and reading them back. */
+		if (createmany(Q, num_pairs))
+			goto err1;
+
+		/* Check that the server's counters reflect the work done. */
+		if (dostats(Q))
+			goto err1;
+	}
 
 	/* Free the request queue and network connection. */
 	kivaloo_close(K);
@@ -3,12 +3,114 @@
 # Paths
 LBS=../../lbs/lbs
 KVLDS=../../kvlds/kvlds
+DUMP=../../kvlds-dump/kvlds-dump
+UNDUMP=../../kvlds-undump/kvlds-undump
 MSLEEP=../msleep/msleep
 TESTKVLDS=./test_kvlds
 STOR=${KIVALOO_TESTDIR:-`pwd`/stor}
 SOCKL=$STOR/sock_lbs
 SOCKK=$STOR/sock_kvlds
 
+## restart_kvlds (options...):
+# Stop the running KVLDS and start a new one with the options ${options}.
+restart_kvlds() {
+	kill `cat $SOCKK.pid`
+	rm $SOCKK.pid $SOCKK
+	$KVLDS -s $SOCKK -l $SOCKL "$@"
+}
+
+## check (description, cmd...):
+# Run ${cmd}, and report whether "Testing ${description}" passed; exit if
+# it failed.
+check() {
+	printf "Testing %s..." "$1"
+	shift
+	if "$@"; then
+		echo " PASSED!"
+	else
+		echo " FAILED!"
+		exit 1
+	fi
+}
+
+## pipelined (nsets):
+# Send ${nsets} SETs of one key, each followed by a GET, and check that the
+# responses followed commit order and that some batches were launched while
+# earlier batches were being written.
+pipelined() {
+	$TESTKVLDS $SOCKK order $1 > $STOR/stats.out &&
+	    grep -q '^mr.overlapped [1-9]' $STOR/stats.out
+}
+
+## flooded (nsets):
+# Send ${nsets} SETs of one key, each followed by a GET, without waiting for
+# responses, and check that they all completed without KVLDS ever having more
+# than 4096 requests pending.
+flooded() {
+	$TESTKVLDS $SOCKK order $1 > $STOR/stats.out &&
+	    awk '/^requests.maxpending / { n = $2 }
+		END { exit !((n > 0) && (n <= 4096)) }' $STOR/stats.out
+}
+
+## clustered:
+# Run the operations test, and check that the cleaner dirtied sibling leaves
+# and that every run of leaves which was rewritten was written into
+# consecutive pages, in key order.
+clustered() {
+	$TESTKVLDS $SOCKK > /dev/null &&
+	    $TESTKVLDS $SOCKK stats > $STOR/stats.out &&
+	    awk '/^cleaner.clustered / { c = $2 }
+		/^tree.leafruns / { r = $2 }
+		/^tree.leafruns.contiguous / { k = $2 }
+		END { exit !((c > 0) && (r > 0) && (k == r)) }' $STOR/stats.out
+}
+
+## tuned (nsets, maxwait):
+# Send ${nsets} SETs of one key, each followed by a GET, and check that the
+# group commit delay was tuned to at most ${maxwait} us and the forced commit
+# size to between 1 and 1024 requests.
+tuned() {
+	$TESTKVLDS $SOCKK order $1 > $STOR/stats.out &&
+	    awk -v maxwait=$2 '/^mr.timeout / { w = $2 }
+		/^mr.min_batch / { g = $2 }
+		END { exit !((w <= maxwait) && (g >= 1) && (g <= 1024)) }' \
+		$STOR/stats.out
+}
+
+## traced:
+# Run the operations test, and check that every stage of the group commit
+# pipeline was timed and that Merge passes were counted.
+traced() {
+	$TESTKVLDS $SOCKK > /dev/null &&
+	    $TESTKVLDS $SOCKK stats > $STOR/stats.out &&
+	    awk '/^trace\.[a-z]*\.total / { n++; if ($2 > 0) t++ }
+		/^trace\.merges\./ { m += $2 }
+		END { exit !((n == 7) && (t == 7) && (m > 0)) }' $STOR/stats.out
+}
+
+## samedump (nthreads):
+# Load the same pairs into two new trees, with pages serialized by one thread
+# and by ${nthreads} threads, and check that kvlds-dump reads the same pairs
+# back from each after KVLDS is restarted.
+samedump() {
+	awk 'BEGIN { for (i = 0; i < 20000; i++)
+		printf "%c%08d%c%-56d", 8, i, 56, i }' > $STOR/pairs
+	for J in 1 $1; do
+		mkdir $STOR/j$J
+		$LBS -s $STOR/j$J/sock_lbs -d $STOR/j$J -b 512 -l 1000000
+		$KVLDS -s $STOR/j$J/sock_kvlds -l $STOR/j$J/sock_lbs \
+		    -v 104 -C 1024 -j $J
+		$UNDUMP -t $STOR/j$J/sock_kvlds < $STOR/pairs
+		kill `cat $STOR/j$J/sock_kvlds.pid`
+		rm $STOR/j$J/sock_kvlds.pid $STOR/j$J/sock_kvlds
+		$KVLDS -s $STOR/j$J/sock_kvlds -l $STOR/j$J/sock_lbs \
+		    -v 104 -C 1024
+		$DUMP -t $STOR/j$J/sock_kvlds > $STOR/dump.$J
+		kill `cat $STOR/j$J/sock_kvlds.pid` `cat $STOR/j$J/sock_lbs.pid`
+	done
+	cmp -s $STOR/pairs $STOR/dump.1 && cmp -s $STOR/dump.1 $STOR/dump.$1
+}
+
 # Clean up any old tests
 rm -rf $STOR
 
@@ -137,6 +239,52 @@ else
 	exit 1
 fi
 
+# Check that flooding KVLDS with requests doesn't make it queue them all
+check "KVLDS request backlog limits" flooded 20000
+
+# Test operations with a page cache size in bytes; the test checks that the
+# page pool never grows past it
+restart_kvlds -v 104 -c 1M
+check "KVLDS with a page cache size in bytes" $TESTKVLDS $SOCKK 100000
+
+# Test background cleaning with a very aggressive cleaner: the test overwrites
+# half of its pairs repeatedly, then checks that once it is idle the cleaner
+# stops deferring, cleans the old leaves, and lets their blocks be freed
+restart_kvlds -v 104 -C 1024 -S 1000000
+check "KVLDS background cleaning" $TESTKVLDS $SOCKK clean 4000
+
+# Test operations with pipelined group commits
+restart_kvlds -v 104 -C 1024 -P
+check "KVLDS with pipelined commits" $TESTKVLDS $SOCKK
+check "KVLDS pipelined commit order" pipelined 20000
+
+# Test operations with adaptive group commits
+restart_kvlds -v 104 -C 1024 -W 0.01
+check "KVLDS with adaptive commits" $TESTKVLDS $SOCKK
+check "KVLDS adaptive commit tuning" tuned 20000 10000
+
+# Test operations with commit pipeline tracing
+restart_kvlds -v 104 -C 1024 -P -T
+check "KVLDS with commit tracing" traced
+
+# Test operations with parallel serialization
+restart_kvlds -v 104 -C 1024 -j 4
+check "KVLDS with parallel serialization" $TESTKVLDS $SOCKK
+check "KVLDS parallel serialization output" samedump 4
+
+# Test operations with chunked APPENDs
+restart_kvlds -v 104 -C 1024 -P -A 16k
+check "KVLDS with chunked APPENDs" $TESTKVLDS $SOCKK
+
+# Test operations with leaf clustering and aggressive cleaning
+restart_kvlds -v 104 -C 1024 -L -S 1000
+check "KVLDS with leaf clustering" clustered
+
+# Test that pairs appended in key order are packed into nodes, and that the
+# packed nodes still split and merge correctly
+restart_kvlds -C 1024
+check "KVLDS packing of appended pairs" $TESTKVLDS $SOCKK append 512
+
 # Shut down KVLDS and LBS and clean up
 kill `cat $SOCKK.pid`
 rm $SOCKK.pid $SOCKK
@@ -5,6 +5,7 @@
 
 #include "events.h"
 #include "kivaloo.h"
+#include "parsenum.h"
 #include "proto_lbs.h"
 #include "warnp.h"
 
@@ -32,6 +33,12 @@ static int gets_failed;
 static int gets_ndone;
 static int free_done;
 static int free_failed;
+static int freerange_done;
+static int freerange_failed;
+static int reads_done;
+static int reads_failed;
+static size_t reads_nleft;
+static char * reads_expected;
 
 /* Callback for PARAMS request. */
 static int
@@ -178,19 +185,116 @@ callback_free(void * cookie, int failed)
 	return (0);
 }
 
+/* Callback for FREERANGE request. */
+static int
+callback_freerange(void * cookie, int failed)
+{
+
+	(void)cookie; /* UNUSED */
+
+	/* Record returned value. */
+	freerange_failed = failed;
+
+	/* We're done. */
+	freerange_done = 1;
+
+	/* Success! */
+	return (0);
+}
+
+/* Callback for GET requests of blocks written by test_lbs.sh. */
+static int
+callback_reads(void * cookie, int failed, int status, const uint8_t * buf)
+{
+	size_t blkno = (size_t)(uintptr_t)cookie;
+
+	/* Each block holds its block number, right-aligned. */
+	if (failed || status) {
+		reads_failed = 1;
+	} else {
+		snprintf(reads_expected, params_blklen + 1, "%*zu",
+		    (int)params_blklen, blkno);
+		if (memcmp(buf, reads_expected, params_blklen))
+			reads_failed = 1;
+	}
+
+	/* Are we done? */
+	if (--reads_nleft == 0)
+		reads_done = 1;
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * Read blocks 0 .. ${nblks} - 1, which test_lbs.sh has stored one per block
+ * file, all at once; then do so again, so that descriptors which were
+ * evicted from the LBS descriptor cache need to be reopened.
+ */
+static int
+readmany(struct wire_requestqueue * Q, size_t nblks)
+{
+	size_t pass;
+	size_t i;
+
+	/* Allocate space for the expected contents of a block. */
+	if ((reads_expected = malloc(params_blklen + 1)) == NULL) {
+		warnp("malloc");
+		goto err0;
+	}
+
+	/* Read the blocks twice. */
+	for (pass = 0; pass < 2; pass++) {
+		reads_done = reads_failed = 0;
+		reads_nleft = nblks;
+		for (i = 0; i < nblks; i++) {
+			if (proto_lbs_request_get(Q, i, params_blklen,
+			    callback_reads, (void *)(uintptr_t)i)) {
+				warnp("Failed to send GET request");
+				goto err1;
+			}
+		}
+		if (events_spin(&reads_done) || reads_failed) {
+			warnp("GET request(s) failed");
+			goto err1;
+		}
+	}
+
+	/* Free the buffer. */
+	free(reads_expected);
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(reads_expected);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 int
 main(int argc, char * argv[])
 {
 	struct wire_requestqueue * Q;
 	struct kivaloo_cookie * K;
+	struct proto_lbs_range ranges[2];
 	uint8_t * buf;
+	size_t nblks = 0;
 	size_t i, j, k;
 
 	WARNP_INIT;
 
 	/* Check number of arguments. */
-	if (argc != 2) {
-		fprintf(stderr, "usage: test_lbs %s\n", "<socketname>");
+	if ((argc == 4) && (strcmp(argv[2], "read") == 0)) {
+		/* Read blocks stored one per file. */
+		if (PARSENUM(&nblks, argv[3], 1, SIZE_MAX)) {
+			warnp("PARSENUM");
+			goto err0;
+		}
+	} else if (argc != 2) {
+		fprintf(stderr, "usage: test_lbs %s %s\n", "<socketname>",
+		    "[read <nblks>]");
 		goto err0;
 	}
 
@@ -211,6 +315,14 @@ main(int argc, char * argv[])
 		goto err1;
 	}
 
+	/* If we're just reading blocks, do that. */
+	if (nblks > 0) {
+		if (readmany(Q, nblks))
+			goto err1;
+		kivaloo_close(K);
+		exit(0);
+	}
+
 	/* Allocate 16 blocks. */
 	if ((buf = malloc(16 * params_blklen)) == NULL) {
 		warnp("malloc");
@@ -317,6 +429,44 @@ main(int argc, char * argv[])
 		goto err2;
 	}
 
+	/* Free the blocks in the first and third batches of 256 pages. */
+	ranges[0].blkno = params_nextblk - 512;
+	ranges[0].nblks = npages[0];
+	ranges[1].blkno = params_nextblk - 512 + npages[0] + npages[1];
+	ranges[1].nblks = npages[2];
+	freerange_done = freerange_failed = 0;
+	if (proto_lbs_request_freerange(Q, 2, ranges, callback_freerange,
+	    NULL)) {
+		warnp("Failed to send FREERANGE request");
+		goto err2;
+	}
+	if (events_spin(&freerange_done) || freerange_failed) {
+		warnp("FREERANGE request failed");
+		goto err2;
+	}
+
+	/* The other pages should be intact. */
+	for (i = npages[0]; i < 512; i++) {
+		if ((i >= npages[0] + npages[1]) &&
+		    (i < npages[0] + npages[1] + npages[2]))
+			continue;
+		get_done = get_failed = 0;
+		if (proto_lbs_request_get(Q, params_nextblk - 512 + i,
+		    params_blklen, callback_get, buf)) {
+			warnp("Failed to send GET request");
+			goto err2;
+		}
+		if (events_spin(&get_done) || get_failed) {
+			warnp("GET request failed");
+			goto err2;
+		}
+		if (((i < 256) && (buf[0] != i)) ||
+		    ((i >= 256) && (buf[0] != 0))) {
+			warn0("GET data is incorrect after FREERANGE");
+			goto err2;
+		}
+	}
+
 	/* Free blocks. */
 	free_done = free_failed = 0;
 	if (proto_lbs_request_free(Q, params_nextblk, callback_free, NULL)) {
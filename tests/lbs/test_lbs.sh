@@ -7,6 +7,41 @@ TESTLBS=./test_lbs
 STOR=${KIVALOO_TESTDIR:-`pwd`/stor}
 SOCK=$STOR/sock
 
+## make_stor:
+# Create the storage directory.
+make_stor() {
+	mkdir $STOR
+	[ `uname` = "FreeBSD" ] && chflags nodump $STOR
+	return 0
+}
+
+## stop_lbs:
+# Stop the running LBS.
+stop_lbs() {
+	kill `cat $SOCK.pid`
+	rm $SOCK.pid $SOCK
+}
+
+## test_twice:
+# Run the LBS test twice against the running LBS.
+test_twice() {
+	$TESTLBS $SOCK && $TESTLBS $SOCK
+}
+
+## check (description, cmd...):
+# Run ${cmd}, and report whether "Testing ${description}" passed; exit if
+# it failed.
+check() {
+	printf "Testing %s..." "$1"
+	shift
+	if "$@"; then
+		echo " PASSED!"
+	else
+		echo " FAILED!"
+		exit 1
+	fi
+}
+
 # Clean up any old tests
 rm -rf $STOR
 
@@ -68,6 +103,90 @@ rm $SOCK.pid
 rm $SOCK
 rm -rf $STOR
 
+# Test reading via io_uring (or read threads, if io_uring is unavailable)
+make_stor
+$LBS -s $SOCK -d $STOR -b 512 -q 8 2>/dev/null
+check "LBS with io_uring" test_twice
+stop_lbs
+rm -rf $STOR
+
+# Test direct I/O (if supported) with a block cache
+make_stor
+if ! $LBS -s $SOCK -d $STOR -b 4096 -D -c 64 2>/dev/null; then
+	$LBS -s $SOCK -d $STOR -b 4096 -c 64
+fi
+check "LBS with direct I/O and a block cache" test_twice
+stop_lbs
+rm -rf $STOR
+
+# Test striping block files across two storage directories
+striped() {
+	$LBS -s $SOCK -d $STOR/0 -d $STOR/1 -b 512 -n 2
+	test_twice || return 1
+	stop_lbs
+	ls $STOR/0 | grep -q blks_ || return 1
+	ls $STOR/1 | grep -q blks_ || return 1
+	$LBS -s $SOCK -d $STOR/0 -d $STOR/1 -b 512 -n 2
+	$TESTLBS $SOCK
+}
+make_stor
+mkdir $STOR/0 $STOR/1
+check "LBS with two storage directories" striped
+stop_lbs
+rm -rf $STOR
+
+# Test finding block files from a manifest which is out of date
+oldmanifest() {
+	$LBS -s $SOCK -d $STOR -b 512
+	test_twice || return 1
+	stop_lbs
+	cp $STOR/manifest $STOR/manifest.old
+	$LBS -s $SOCK -d $STOR -b 512
+	$TESTLBS $SOCK || return 1
+	stop_lbs
+	mv $STOR/manifest.old $STOR/manifest
+	$LBS -s $SOCK -d $STOR -b 512
+	stop_lbs
+	ls $STOR | grep blks_ > $STOR.files
+	od -A n -v -t x1 $STOR/manifest | tr -d ' \n' |
+	    sed -e 's/........$//' |
+	    fold -w 16 | sed -e 's/^/blks_/' > $STOR.manifest
+	echo >> $STOR.manifest
+	cmp -s $STOR.files $STOR.manifest
+}
+make_stor
+check "LBS restart from an old manifest" oldmanifest
+rm -rf $STOR $STOR.files $STOR.manifest
+
+# Test GET scheduling and APPEND and FREE throttling
+make_stor
+$LBS -s $SOCK -d $STOR -b 512 -n 2 -r 5 -a 4 -F 1
+check "LBS with read scheduling" test_twice
+stop_lbs
+rm -rf $STOR
+
+# Test reading from more block files than fit into the descriptor cache
+manyfiles() {
+	i=0
+	while [ $i -lt 300 ]; do
+		printf "%512s" $i > $STOR/blks_`printf %016x $i`
+		i=$((i + 1))
+	done
+	$LBS -s $SOCK -d $STOR -b 512
+	$TESTLBS $SOCK read 300 || return 1
+	$TESTLBS $SOCK read 300 || return 1
+	# At most 256 block file descriptors should be open
+	FDDIR=/proc/`cat $SOCK.pid`/fd
+	if [ -d $FDDIR ]; then
+		[ `ls $FDDIR | wc -l` -le 272 ] || return 1
+	fi
+	return 0
+}
+make_stor
+check "LBS with 300 block files" manyfiles
+stop_lbs
+rm -rf $STOR
+
 # Test connecting via different addresses
 for S in "localhost:1234" "[127.0.0.1]:1235" "[::1]:1236"; do
 	printf "Testing LBS with socket at $S..."
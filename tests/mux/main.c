@@ -15,6 +15,7 @@ static int op_failed = 0;
 static int op_p = 0;
 static int op_badval = 0;
 static size_t op_count = 0;
+static size_t op_nkeys = 0;
 
 static int
 callback_done(void * cookie, int failed)
@@ -102,6 +103,9 @@ callback_range(void * cookie,
 
 	(void)value; /* UNUSED */
 
+	/* Count the key-value pair. */
+	op_nkeys += 1;
+
 	/* Delete the key-value pair. */
 	op_count += 1;
 	if (proto_kvlds_request_delete(Q, key, callback_done, NULL)) {
@@ -322,6 +326,7 @@ createmany(struct wire_requestqueue * Q, size_t N, char * prefix)
 	key2 = kvldskey_create(keybuf, plen + 8);
 	op_done = 0;
 	op_count = 1;
+	op_nkeys = 0;
 	if (proto_kvlds_request_range2(Q, key, key2, callback_range,
 	    callback_done, Q))
 		return (-1);
@@ -333,6 +338,10 @@ createmany(struct wire_requestqueue * Q, size_t N, char * prefix)
 		warnp("RANGE or DELETE request failed");
 		return (-1);
 	}
+	if (op_nkeys != N) {
+		warn0("RANGE returned %zu pairs, expected %zu", op_nkeys, N);
+		return (-1);
+	}
 
 	/* Success! */
 	return (0);
@@ -9,6 +9,9 @@ STOR=${KIVALOO_TESTDIR:-`pwd`/stor}
 SOCKL=$STOR/sock_lbs
 SOCKK=$STOR/sock_kvlds
 SOCKM=$STOR/sock_mux
+STOR2=$STOR/shard2
+SOCKL2=$STOR2/sock_lbs
+SOCKK2=$STOR2/sock_kvlds
 
 ## has_pid (cmd):
 # Look for ${cmd} in ps; return 0 if ${cmd} exists.
@@ -21,6 +24,21 @@ has_pid() {
 	return 1
 }
 
+## has_exited (pidfile):
+# Wait up to 10 seconds for the process whose pid is in ${pidfile} to exit;
+# return 0 if it has exited.  A process which has exited may linger briefly
+# as a zombie until it is reaped, so a single check is not enough.
+has_exited() {
+	pid=$(cat "$1")
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		if ! kill -s 0 "${pid}" 2> /dev/null; then
+			return 0
+		fi
+		sleep 1
+	done
+	return 1
+}
+
 # Clean up any old tests
 rm -rf $STOR
 rm -f .failed
@@ -85,17 +103,70 @@ else
 fi
 rm $TESTMUX.pid
 
+# Stop MUX so that it can be restarted as a router
+kill `cat $SOCKM.pid`
+rm $SOCKM $SOCKM.pid
+
+# Start a second LBS and KVLDS, and shard keys between the two KVLDS at
+# "0." followed by the 64-bit big-endian value 5000.
+mkdir $STOR2
+$LBS -s $SOCKL2 -d $STOR2 -b 512 -L
+$KVLDS -s $SOCKK2 -l $SOCKL2 -C 1024
+$MUX -t $SOCKK -k 302e0000000000001388 -t $SOCKK2 -s $SOCKM
+
+# Verify that requests are routed and RANGEs span both shards.
+printf "Testing KVLDS via MUX with two shards... "
+if $TESTMUX $SOCKM 0.; then
+	echo " PASSED!"
+else
+	echo " FAILED!"
+	exit 1
+fi
+
+# Verify running several clients at once via the router.
+printf "Testing multiple clients with two shards... "
+for X in 0 1 2 3 4 5 6 7 8 9; do
+	( $TESTMUX $SOCKM ${X}. || touch .failed; ) &
+done
+sleep 1
+while has_pid $TESTMUX; do
+	sleep 1
+done
+if [ -f .failed ]; then
+	echo " FAILED!"
+	exit 1
+else
+	echo " PASSED!"
+fi
+
+# Verify that the router dies if a shard dies.
+printf "Testing shard disconnection death... "
+( $TESTMUX $SOCKM loop &) 2>/dev/null
+sleep 1 && kill `cat $SOCKK2.pid`
+rm $SOCKK2 $SOCKK2.pid
+if has_exited $SOCKM.pid; then
+	echo " PASSED!"
+else
+	echo " FAILED!"
+	exit 1
+fi
+rm $SOCKM $SOCKM.pid
+kill `cat $SOCKL2.pid`
+rm $SOCKL2 $SOCKL2.pid
+
+# Restart MUX with a single target
+$MUX -t $SOCKK -s $SOCKM
+
 # Verify that we die if the upstream server dies
 printf "Testing server disconnection death... "
 ( $TESTMUX $SOCKM loop &) 2>/dev/null
 sleep 1 && kill `cat $SOCKK.pid`
 rm $SOCKK $SOCKK.pid
-sleep 1
-if kill -s 0 "$(cat $SOCKM.pid)" 2> /dev/null; then
+if has_exited $SOCKM.pid; then
+	echo " PASSED!"
+else
 	echo " FAILED!"
 	exit 1
-else
-	echo " PASSED!"
 fi
 rm $SOCKM $SOCKM.pid
 